@@ -1,27 +1,187 @@
 /* copy .wav file from specified source to destination */
+/* copies a block at a time so memory use does not depend on file length */
+/* optional start time and duration in seconds copy just that region,
+ * seeking straight to it rather than reading what comes before */
+/* -e encoding converts samples to u8, s16, s24, s32, f32 or f64 on the way */
+/* -b copies every pair in a manifest, or every .wav file in a directory,
+ * on a pool of -j threads */
 
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
 #include "wav_file_access.h"
+#include "wav_batch.h"
 
+static void usage(void)
+{
+	printf("usage: copy_wav_file [ -e encoding ] file1.wav file2.wav [ start-secs [ duration-secs ] ]\n");
+	printf("       copy_wav_file [ -e encoding ] [ -j threads ] -b manifest | -b input-dir output-dir\n");
+	exit(NOTOK);
+}
+
+/* copy one file of a batch into the worker's buffers, which outlive the file.
+ * return OK if done, NOTOK otherwise */
+
+static int copy_file(struct wav_batch_worker *worker, struct wav_batch_item *item, void *arg)
+{
+	const struct wav_info * encoding = (const struct wav_info * )arg;
+	struct wav_reader * rdr;
+	struct wav_writer * wtr;
+	struct wav_info info, out_info;
+	void * in_buf, * out_buf;
+	float * float_buf = NULL;
+	int frames;
+	int rc;
+
+	if (wav_reader_open(item->input, &rdr, &info) != OK)
+		return NOTOK;
+	out_info = info;
+	if (encoding->format) {
+		out_info.format = encoding->format;
+		out_info.bits_per_sample = encoding->bits_per_sample;
+	}
+	in_buf = wav_batch_buf(worker, 0, (size_t )WAV_BLOCK_FRAMES * info.channels * info.bits_per_sample / 8);
+	out_buf = in_buf;
+	if (out_info.format != info.format || out_info.bits_per_sample != info.bits_per_sample) {
+		float_buf = (float * )wav_batch_buf(worker, 1, sizeof(float) * WAV_BLOCK_FRAMES * info.channels);
+		out_buf = wav_batch_buf(worker, 2, (size_t )WAV_BLOCK_FRAMES * info.channels * out_info.bits_per_sample / 8);
+	}
+	if (!in_buf || !out_buf || (out_buf != in_buf && !float_buf)) {
+		wav_reader_close(rdr);
+		return NOTOK;
+	}
+	rc = wav_writer_open_format(item->output, &out_info, &wtr);
+	if (rc) {
+		wav_reader_close(rdr);
+		return rc;
+	}
+	for (;;) {
+		rc = wav_reader_read_raw(rdr, in_buf, WAV_BLOCK_FRAMES, &frames);
+		if (rc || frames == 0)
+			break;
+		if (float_buf) {
+			size_t samples = (size_t )frames * info.channels;
+			wav_decode_float(in_buf, info.format, info.bits_per_sample, float_buf, samples);
+			wav_encode_float(float_buf, out_info.format, out_info.bits_per_sample, out_buf, samples);
+		}
+		rc = wav_writer_write_raw(wtr, out_buf, frames);
+		if (rc)
+			break;
+	}
+	wav_reader_close(rdr);
+	if (rc) {
+		wav_writer_abort(wtr);
+		return rc;
+	}
+	return wav_writer_close(wtr);
+}
 
 int main(int argc, char **argv) {
 	int rc;
-	wav_sample_t * sample_buf;
-	int sample_count;
-        int chans;
+	void * block_buf;
+	struct wav_reader * rdr;
+	struct wav_writer * wtr;
+	struct wav_info info, out_info;
+	int frames;
+	int64_t frames_left;
+	int convert;
+	int opt;
+	char * batch_source = NULL;
+	int threads = 1;
 
-	if (argc < 3) {
-		printf("usage: copy_wav_file file1.wav file2.wav\n");
-		exit(NOTOK);
+	opterr = 0;
+	out_info.format = 0;
+	while ((opt = getopt(argc, argv, "e:b:j:")) != -1) {
+		switch (opt) {
+		case 'e':
+			if (wav_parse_encoding(optarg, &out_info.format, &out_info.bits_per_sample)) {
+				printf("ERROR: -e needs one of u8, s16, s24, s32, f32, f64\n");
+				exit(NOTOK);
+			}
+			break;
+		case 'b':
+			batch_source = optarg;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
 	}
-	rc = wav_read(argv[1], &sample_buf, &sample_count, &chans);
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	/* many files, one per thread at a time */
+
+	if (batch_source) {
+		struct wav_batch batch = { 0 };
+
+		if (argc > 2)
+			usage();
+		if (wav_batch_open(&batch, batch_source, argc > 1 ? argv[1] : NULL))
+			exit(NOTOK);
+		rc = wav_batch_run(&batch, threads, copy_file, &out_info);
+		wav_batch_free(&batch);
+		return rc;
+	}
+	if (argc < 3)
+		usage();
+	rc = wav_reader_open(argv[1], &rdr, &info);
 	if (rc) return rc;
-	printf("sample count %d, channels %d\n", sample_count, chans);
-	/* print_samples(sample_buf, sample_count); */
+	printf("sample count %" PRId64 ", channels %d\n", info.frame_count * info.channels, info.channels);
+	frames_left = info.frame_count;
+	if (argc > 3) {
+		rc = wav_reader_seek_time(rdr, atof(argv[3]));
+		if (rc) return rc;
+		frames_left -= (int64_t )(atof(argv[3]) * info.samples_per_sec);
+	}
+	if (argc > 4) {
+		int64_t region_frames = (int64_t )(atof(argv[4]) * info.samples_per_sec);
+		if (region_frames < frames_left)
+			frames_left = region_frames;
+	}
+
+	/* samples are copied untouched unless the encoding changes */
 
-	rc = wav_write(argv[2], sample_buf, sample_count, chans);
+	if (out_info.format == 0) {
+		out_info.format = info.format;
+		out_info.bits_per_sample = info.bits_per_sample;
+	}
+	convert = (out_info.format != info.format || out_info.bits_per_sample != info.bits_per_sample);
+	out_info.channels = info.channels;
+	out_info.samples_per_sec = info.samples_per_sec;
+
+	block_buf = malloc(sizeof(double) * WAV_BLOCK_FRAMES * info.channels);
+	if (!block_buf) {
+		printf("ERROR: could not allocate block buffer\n");
+		exit(NOTOK);
+	}
+	rc = wav_writer_open_format(argv[2], &out_info, &wtr);
+	if (rc) return rc;
+	while (frames_left > 0) {
+		int max_frames = frames_left < WAV_BLOCK_FRAMES ? frames_left : WAV_BLOCK_FRAMES;
+		if (convert)
+			rc = wav_reader_read_float(rdr, (float * )block_buf, max_frames, &frames);
+		else
+			rc = wav_reader_read_raw(rdr, block_buf, max_frames, &frames);
+		if (rc) return rc;
+		if (frames == 0)
+			break;
+		frames_left -= frames;
+		if (convert)
+			rc = wav_writer_write_float(wtr, (float * )block_buf, frames);
+		else
+			rc = wav_writer_write_raw(wtr, block_buf, frames);
+		if (rc) return rc;
+	}
+	wav_reader_close(rdr);
+	free(block_buf);
+	rc = wav_writer_close(wtr);
 	return rc;
 }
@@ -25,13 +25,149 @@
 #include <errno.h>
 #include <fcntl.h>
  
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include <pulse/simple.h>
 #include <pulse/error.h>
 
 #include "wav_file_access.h"
- 
-#define BUFSIZE 1024
- 
+#include "wav_ring.h"
+
+/* Streams the file: a reader thread keeps PREFETCH chunks decoded ahead in
+ * a ring (see wav_ring.h) while the main thread writes one chunk at a time,
+ * so the first sound does not wait for the whole file and memory does not
+ * grow with it.  -w plays the old way, the whole mapped file in one write.
+ *
+ * -o null or -o file.raw replaces the PulseAudio server with a stand-in:
+ * null takes the audio at the rate it would be played and drops it, a file
+ * takes it as fast as it comes and keeps the raw samples.  Either runs
+ * without a server, for tests. */
+
+#define CHUNK_MSEC 50
+#define PREFETCH_CHUNKS 4
+
+enum sink_kind { SINK_PULSE, SINK_NULL, SINK_FILE };
+
+static enum sink_kind sink_kind = SINK_PULSE;
+static pa_simple *s = NULL;
+static FILE *sink_file = NULL;
+static uint64_t sink_start_nsec;	/* first write to the null sink */
+static uint64_t sink_played_nsec;	/* audio handed to the null sink so far */
+static uint64_t sink_buffer_nsec;	/* how far ahead of playing the null sink takes audio */
+
+static struct wav_reader *rdr = NULL;
+static struct wav_ring *ring = NULL;
+static size_t chunk_bytes;
+static int chunk_usec;
+static size_t frame_bytes;
+static atomic_int reader_done;
+static atomic_int reader_failed;
+static atomic_int stop_reader;
+
+static uint64_t get_time_nsec(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void usage(const char *msg) {
+    fprintf(stderr, "ERROR: %s\n", msg);
+    fprintf(stderr, "usage: pacat-simple [ -c chunk-msec ] [ -p prefetch-chunks ] [ -o null | -o file.raw ] [ -w ] file.wav\n");
+    fprintf(stderr, "-c is the duration of each write (default %d), -p how many chunks are read ahead (default %d)\n",
+            CHUNK_MSEC, PREFETCH_CHUNKS);
+    fprintf(stderr, "-o plays into a stand-in for the server: null paces and drops, a file keeps raw samples\n");
+    fprintf(stderr, "-w writes the whole file at once instead of streaming it\n");
+    exit(NOTOK);
+}
+
+static int sink_write(const void *data, size_t bytes, const pa_sample_spec *ss, int *error) {
+    uint64_t now, due;
+
+    switch (sink_kind) {
+    case SINK_PULSE:
+        return pa_simple_write(s, data, bytes, error);
+    case SINK_FILE:
+        return fwrite(data, 1, bytes, sink_file) == bytes ? 0 : -1;
+    case SINK_NULL:
+        /* block like a server with sink_buffer_nsec of buffer would */
+        now = get_time_nsec();
+        if (sink_played_nsec == 0)
+            sink_start_nsec = now;
+        sink_played_nsec += (uint64_t) bytes * 1000000000 / (pa_bytes_per_second(ss));
+        due = sink_start_nsec + sink_played_nsec;
+        if (due > now + sink_buffer_nsec) {
+            struct timespec ts;
+            uint64_t wait = due - now - sink_buffer_nsec;
+            ts.tv_sec = wait / 1000000000;
+            ts.tv_nsec = wait % 1000000000;
+            nanosleep(&ts, NULL);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static int sink_drain(int *error) {
+    uint64_t now;
+
+    switch (sink_kind) {
+    case SINK_PULSE:
+        return pa_simple_drain(s, error);
+    case SINK_FILE:
+        return fflush(sink_file) == 0 ? 0 : -1;
+    case SINK_NULL:
+        now = get_time_nsec();
+        if (sink_played_nsec && sink_start_nsec + sink_played_nsec > now)
+            usleep((sink_start_nsec + sink_played_nsec - now) / 1000);
+        return 0;
+    }
+    return -1;
+}
+
+/* usec from handing audio over until it is heard, as best known */
+static pa_usec_t sink_latency(void) {
+    int error;
+    pa_usec_t latency;
+
+    if (sink_kind != SINK_PULSE)
+        return sink_kind == SINK_NULL ? sink_buffer_nsec / 1000 : 0;
+    latency = pa_simple_get_latency(s, &error);
+    return latency == (pa_usec_t) -1 ? 0 : latency;
+}
+
+/* decodes the file into the ring in whole chunks, sleeping while it is full */
+static void *read_ahead(void *arg) {
+    wav_sample_t *buf = malloc(chunk_bytes);
+    int chunk_frames = chunk_bytes / frame_bytes;
+    int frames;
+
+    if (!buf) {
+        fprintf(stderr, __FILE__": could not allocate read buffer\n");
+        atomic_store(&reader_failed, 1);
+    }
+    while (buf && !atomic_load(&stop_reader)) {
+        if (wav_reader_read(rdr, buf, chunk_frames, &frames) != OK) {
+            atomic_store(&reader_failed, 1);
+            break;
+        }
+        if (frames == 0)
+            break;
+        while (wav_ring_writable(ring) < (size_t) frames * frame_bytes && !atomic_load(&stop_reader))
+            usleep(chunk_usec / 4);
+        wav_ring_write(ring, buf, (size_t) frames * frame_bytes);
+    }
+    free(buf);
+    wav_ring_finish(ring);
+    atomic_store(&reader_done, 1);
+    return NULL;
+}
+
 int main(int argc, char*argv[]) {
  
     /* The Sample format to use */
@@ -41,50 +177,152 @@ int main(int argc, char*argv[]) {
         .channels = 2
     };
  
-    pa_simple *s = NULL;
+    uint64_t start_nsec = get_time_nsec();
+    uint64_t first_audio_nsec = 0;
+    pa_usec_t first_latency = 0;
     int ret = 1;
     int error;
+    int opt;
+    int chunk_msec = CHUNK_MSEC;
+    int prefetch = PREFETCH_CHUNKS;
+    int whole_file = 0;
+    int reader_wait_msec = 0;
+    int reader_started = 0;
+    pthread_t reader;
+    char *sink_name = NULL;
+    void *chunk = NULL;
 
-    wav_sample_t *buf;
-    int samples, channels;
- 
-    if (wav_read(argv[1], &buf, &samples, &channels)) goto finish;
-    ss.channels = channels;
+    struct wav_map *map = NULL;
+    const wav_sample_t *buf;
+    struct wav_info info;
 
-    /* Create a new playback stream */
-    if (!(s = pa_simple_new(NULL, argv[0], PA_STREAM_PLAYBACK, NULL, "playback", &ss, NULL, NULL, &error))) {
-        fprintf(stderr, __FILE__": pa_simple_new() failed: %s\n", pa_strerror(error));
-        goto finish;
+    while ((opt = getopt(argc, argv, "c:p:o:w")) != -1) {
+        switch (opt) {
+        case 'c':
+            chunk_msec = atoi(optarg);
+            if (chunk_msec < 1 || chunk_msec > 10000) usage("chunk-msec must be from 1 to 10000");
+            break;
+        case 'p':
+            prefetch = atoi(optarg);
+            if (prefetch < 1 || prefetch > 1000) usage("prefetch-chunks must be from 1 to 1000");
+            break;
+        case 'o':
+            sink_name = optarg;
+            break;
+        case 'w':
+            whole_file = 1;
+            break;
+        default:
+            usage("unknown option");
+        }
     }
- 
-#if 0
-        pa_usec_t latency;
- 
-        if ((latency = pa_simple_get_latency(s, &error)) == (pa_usec_t) -1) {
-            fprintf(stderr, __FILE__": pa_simple_get_latency() failed: %s\n", pa_strerror(error));
+    if (optind != argc - 1) usage("one .wav file to play");
+
+    if (whole_file) {
+        /* map the file rather than reading it, pages are faulted in as they are played */
+        if (wav_map(argv[optind], &map, &buf, &info)) goto finish;
+    } else {
+        if (wav_reader_open(argv[optind], &rdr, &info)) goto finish;
+    }
+    ss.channels = info.channels;
+    ss.rate = info.samples_per_sec;
+    frame_bytes = sizeof(wav_sample_t) * info.channels;
+    chunk_bytes = (size_t) info.samples_per_sec * chunk_msec / 1000 * frame_bytes;
+    if (chunk_bytes == 0)
+        chunk_bytes = frame_bytes;
+    chunk_usec = chunk_msec * 1000;
+
+    /* Create a new playback stream, or a stand-in for one */
+    if (!sink_name) {
+        if (!(s = pa_simple_new(NULL, argv[0], PA_STREAM_PLAYBACK, NULL, "playback", &ss, NULL, NULL, &error))) {
+            fprintf(stderr, __FILE__": pa_simple_new() failed: %s\n", pa_strerror(error));
             goto finish;
         }
- 
-        fprintf(stderr, "%0.0f usec    \r", (float)latency);
-#endif
- 
-    /* ... and play it */
-    if (pa_simple_write(s, buf, (size_t) samples * sizeof(buf[0]), &error) < 0) {
-        fprintf(stderr, __FILE__": pa_simple_write() failed: %s\n", pa_strerror(error));
-        goto finish;
+    } else if (!strcmp(sink_name, "null")) {
+        sink_kind = SINK_NULL;
+        sink_buffer_nsec = (uint64_t) chunk_msec * 1000000;
+    } else {
+        sink_kind = SINK_FILE;
+        if (!(sink_file = fopen(sink_name, "wb"))) {
+            perror(sink_name);
+            goto finish;
+        }
+    }
+
+    if (whole_file) {
+        /* ... and play it */
+        first_audio_nsec = get_time_nsec();
+        if (sink_write(buf, (size_t) info.frame_count * info.channels * sizeof(buf[0]), &ss, &error) < 0) {
+            fprintf(stderr, __FILE__": pa_simple_write() failed: %s\n", pa_strerror(error));
+            goto finish;
+        }
+        first_latency = sink_latency();
+    } else {
+        /* prefetch a chunk to start with, then play while the reader keeps ahead */
+        chunk = malloc(chunk_bytes);
+        if (!chunk || wav_ring_open(chunk_bytes * prefetch, &ring)) goto finish;
+        if (pthread_create(&reader, NULL, read_ahead, NULL)) {
+            perror("pthread_create");
+            goto finish;
+        }
+        reader_started = 1;
+        for (;;) {
+            size_t bytes;
+            int done = atomic_load(&reader_done);  /* before readable, so it has it all */
+
+            if (wav_ring_readable(ring) < chunk_bytes && !done) {
+                if (first_audio_nsec) reader_wait_msec++;
+                usleep(1000);
+                continue;
+            }
+            bytes = wav_ring_read(ring, chunk, chunk_bytes);
+            if (bytes == 0)
+                break;
+            if (sink_write(chunk, bytes, &ss, &error) < 0) {
+                fprintf(stderr, __FILE__": pa_simple_write() failed: %s\n", pa_strerror(error));
+                goto finish;
+            }
+            if (!first_audio_nsec) {
+                first_audio_nsec = get_time_nsec();
+                first_latency = sink_latency();
+            }
+        }
+        if (atomic_load(&reader_failed)) goto finish;
     }
-    if (pa_simple_drain(s, &error) < 0) {
+    if (sink_drain(&error) < 0) {
         fprintf(stderr, __FILE__": pa_simple_drain() failed: %s\n", pa_strerror(error));
         goto finish;
     }
+
+    /* time to first audio: until the first write was taken, plus what the
+     * server said it would then take to be heard */
+    fprintf(stderr, "first audio handed over after %.1f ms, heard after about %.1f ms",
+            (first_audio_nsec - start_nsec) / 1e6, (first_audio_nsec - start_nsec) / 1e6 + first_latency / 1e3);
+    if (!whole_file)
+        fprintf(stderr, ", %d ms chunks, %d prefetched, %d ms waiting for the reader",
+                chunk_msec, prefetch, reader_wait_msec);
+    fprintf(stderr, "\n");
  
     ret = 0;
  
 finish:
  
+    if (reader_started) {
+        atomic_store(&stop_reader, 1);
+        pthread_join(reader, NULL);
+    }
     if (s)
         pa_simple_free(s);
+    if (sink_file && fclose(sink_file)) {
+        perror("fclose");
+        ret = 1;
+    }
+    if (ring)
+        wav_ring_close(ring);
+    if (rdr)
+        wav_reader_close(rdr);
+    free(chunk);
+    wav_unmap(map);
  
     return ret;
 }
-
@@ -6,6 +6,15 @@
  *   env var NICE_CHANGE lets you adjust priority, requires CAP_SYS_NICE capability
  *   to get this capability: sudo setcap "CAP_SYS_NICE+ep" pulseaudio-example
  *   then to run: NICE_CHANGE=-10 ./pulseaudio-example
+ *   env var SPEED plays faster (2 is twice as fast and an octave up) or slower
+ *   env var EFFECTS is a space-separated list of effect specs to play through,
+ *   e.g. EFFECTS="ripple:freq=4000 convolve:ir=hall.wav" (see wav_effect.h)
+ *   env var STATS names a file (- for stdout) that gets a JSON line of latency
+ *   and callback-time histograms and underflow counts every second, and one
+ *   for the whole run at the end
+ *
+ * a producer thread runs the effects ahead of playback into a lock-free ring
+ * (wav_ring.h), the stream callback only copies out of it
  */
 
 #include <stdio.h>
@@ -15,25 +24,48 @@
 #include <pulse/pulseaudio.h>
 #include <math.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "wav_file_access.h"
+#include "wav_effect.h"
+#include "wav_ring.h"
+#include "wav_hist.h"
 
-#define LATENCY_BUFFER_ELEMENTS 10000
+#define LATENCY_SAMPLE_USEC 10000
+#define STATS_USEC 1000000	/* how often STATS gets a line */
+#define RING_USEC 200000	/* how far ahead of playback the effects run */
 
-static int usecs_per_report = 20000;
 static int latency = 10000; // start latency in micro seconds
-static wav_sample_t * sampledata;
-static int sample_count;
-static int channels;
+static const wav_sample_t * sampledata;
+static struct wav_map * sample_map;
+static struct wav_info info;
+static int channels;	/* coming out of the chain */
+static struct wav_pipeline chain;
+static struct wav_ring * ring;
+static atomic_int stop_producer;
+static atomic_int producer_done;
+static int ring_underruns = 0;
+static int draining = 0;
 static pa_buffer_attr bufattr;
-static int underflows = 0;
+static int underflows = 0;	/* since latency was last increased */
 static pa_sample_spec ss;
 static pa_mainloop *pa_ml;
+static pthread_t producer;
 
-static pa_usec_t latencies[LATENCY_BUFFER_ELEMENTS] = {0};
-static int latency_count = 0;
-static int latency_count_multiple = 10;
-static uint64_t last_time_latencies_reported = 0;
+/* telemetry, all touched from the mainloop thread only.  Histograms
+ * cover the time since the last report and are then added to the totals */
+static struct wav_hist latency_hist;		/* stream latency, usec */
+static struct wav_hist callback_hist;		/* time in stream_request_cb(), nsec */
+static struct wav_hist total_latency_hist;
+static struct wav_hist total_callback_hist;
+static int underflows_total = 0;
+static int latency_increases = 0;
+static FILE * stats_file;
+static uint64_t start_usec;
+static uint64_t last_report_usec;
 
 static const char *debug_env_var = "PA_DEBUG";
 static int pa_debug = -1;
@@ -50,46 +82,95 @@ uint64_t get_time_usec(void) {
 	return time_usec;
 }
 
-void process_latencies(pa_usec_t next_latency) {
-#ifdef DEBUG_LATENCIES
-	float min_l, max_l, sum, sum_squares, avg, variance, stdev;
-#endif
-	uint64_t now_usec;
+uint64_t get_time_nsec(void) {
+	struct timespec now;
 
-	if (latency_count >= LATENCY_BUFFER_ELEMENTS) {
-		printf("ERROR: latency buffer overflow at %d elements\n", latency_count);
-		exit(NOTOK);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t )now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* write one JSON line of telemetry to stats_file, for the last interval
+ * or, when final, the whole run */
+
+void report_stats(int final) {
+	uint64_t now_usec = get_time_usec();
+
+	wav_hist_merge(&total_latency_hist, &latency_hist);
+	wav_hist_merge(&total_callback_hist, &callback_hist);
+	if (stats_file) {
+		fprintf(stats_file, "{\"time_us\":%" PRIu64 ",\"interval_us\":%" PRIu64 ",\"final\":%s,"
+			"\"target_latency_us\":%d,\"tlength\":%u,\"minreq\":%u,\"underflows\":%d,"
+			"\"latency_increases\":%d,\"ring_underruns\":%d,\"ring_bytes\":%zu,\"latency_us\":",
+			now_usec - start_usec, final ? now_usec - start_usec : now_usec - last_report_usec,
+			final ? "true" : "false", latency, bufattr.tlength, bufattr.minreq, underflows_total,
+			latency_increases, ring_underruns, wav_ring_readable(ring));
+		wav_hist_json(final ? &total_latency_hist : &latency_hist, stats_file);
+		fprintf(stats_file, ",\"callback_ns\":");
+		wav_hist_json(final ? &total_callback_hist : &callback_hist, stats_file);
+		fprintf(stats_file, "}\n");
+		fflush(stats_file);
 	}
-	if (next_latency > 1000000) {
-		printf("latency sample %ld count %d > 1 sec, discarding\n", 
-				next_latency, latency_count);
-		return;
+	wav_hist_reset(&latency_hist);
+	wav_hist_reset(&callback_hist);
+	last_report_usec = now_usec;
+}
+
+/* runs the effect chain over the mapped samples ahead of playback and
+ * puts the results into the ring for stream_request_cb() to copy out */
+
+static void * produce(void *arg) {
+	int in_channels = info.channels;
+	int out_frame_bytes = BYTES_PER_SAMPLE * channels;
+	float * in_buf = malloc(sizeof(float) * WAV_EFFECT_BLOCK_FRAMES * in_channels);
+	wav_sample_t * out_buf = malloc(sizeof(wav_sample_t) * chain.out_fmt.max_frames * channels);
+	int64_t frame = 0;
+	struct wav_block blk;
+	int rc = OK;
+
+	if (!in_buf || !out_buf) {
+		printf("ERROR: could not allocate producer buffers\n");
+		rc = NOTOK;
 	}
-	latencies[latency_count++] = next_latency;
-	if (latency_count % latency_count_multiple != 0) return;
-	now_usec = get_time_usec();
-	if (now_usec - last_time_latencies_reported < usecs_per_report) return;
-
-#ifdef DEBUG_LATENCIES
-	min_l = 1e20; /* greater than any possible latency */
-	max_l = -1.0; /* below any possible latency */
-	sum = 0.0;
-	sum_squares = 0.0;
-	for (int k = 0; k < latency_count; k++) {
-		pa_usec_t l = latencies[k];
-		sum += l;
-		sum_squares += (l*l);
-		if (l < min_l) min_l = l;
-		if (l > max_l) max_l = l;
+	while (rc == OK && !atomic_load(&stop_producer)) {
+		if (frame < info.frame_count) {
+			int frames = info.frame_count - frame < WAV_EFFECT_BLOCK_FRAMES ?
+				info.frame_count - frame : WAV_EFFECT_BLOCK_FRAMES;
+			wav_s16_to_float(sampledata + frame * in_channels, in_buf, (size_t )frames * in_channels);
+			blk.data = in_buf;
+			blk.frames = frames;
+			blk.channels = in_channels;
+			blk.first_frame = frame;
+			rc = wav_pipeline_process(&chain, &blk);
+			frame += frames;
+		} else {
+			rc = wav_pipeline_flush(&chain, &blk);
+			if (blk.frames == 0)
+				break;
+		}
+		if (rc != OK)
+			break;
+		wav_float_to_s16(blk.data, out_buf, (size_t )blk.frames * channels);
+
+		/* whole frames only, sleeping while the ring is full */
+		size_t len = (size_t )blk.frames * out_frame_bytes;
+		size_t done = 0;
+		while (done < len && !atomic_load(&stop_producer)) {
+			size_t room = wav_ring_writable(ring);
+			room -= room % out_frame_bytes;
+			if (room == 0) {
+				usleep(RING_USEC / 8);
+				continue;
+			}
+			done += wav_ring_write(ring, (char * )out_buf + done, len - done < room ? len - done : room);
+		}
 	}
-	avg = sum / latency_count;
-	variance = sum_squares / latency_count;
-	stdev = sqrt(variance);
-	printf("time %lu latcount %d avg %f stdev %f min %f max %f\n", 
-			now_usec, latency_count, avg, stdev, min_l, max_l);
-#endif
-	last_time_latencies_reported = now_usec;
-	latency_count = 0;
+	if (rc != OK)
+		printf("ERROR: effect chain failed, playback stops early\n");
+	free(in_buf);
+	free(out_buf);
+	wav_ring_finish(ring);
+	atomic_store(&producer_done, 1);
+	return NULL;
 }
 
 // This callback gets called when our context changes state.  We really only
@@ -116,29 +197,59 @@ void pa_state_cb(pa_context *c, void *userdata) {
   }
 }
 
+static void stream_drain_cb(pa_stream *s, int success, void *userdata) {
+  pa_mainloop_quit(pa_ml, 0);
+}
+
+// This runs on the server's clock, so it only copies what the producer
+// thread has already made; if the producer has fallen behind, the gap is
+// filled with silence and counted rather than waited for.
 static void stream_request_cb(pa_stream *s, size_t length, void *userdata) {
+  uint64_t start_nsec = get_time_nsec();
+  size_t frame_bytes = BYTES_PER_SAMPLE * channels;
+  size_t avail;
+  void *buf;
+  int done;
+
+  if (draining) return;
+  if (wav_ring_drained(ring)) {
+    draining = 1;
+    pa_operation_unref(pa_stream_drain(s, stream_drain_cb, NULL));
+    return;
+  }
+  if (pa_stream_begin_write(s, &buf, &length) < 0 || !buf) return;
+  length -= length % frame_bytes;
+  done = atomic_load(&producer_done);	/* before avail, so avail has it all */
+  avail = wav_ring_readable(ring);
+  avail -= avail % frame_bytes;
+  if (avail >= length || done) {
+    length = wav_ring_read(ring, buf, avail < length ? avail : length);
+  } else {
+    wav_ring_read(ring, buf, avail);
+    memset((char *)buf + avail, 0, length - avail);
+    ring_underruns++;
+  }
+  if (length == 0)
+    pa_stream_cancel_write(s);
+  else
+    pa_stream_write(s, buf, length, NULL, 0LL, PA_SEEK_RELATIVE);
+  wav_hist_add(&callback_hist, get_time_nsec() - start_nsec);
+}
+
+// Samples the latency on a timer of its own, away from the write callback
+static void latency_timer_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata) {
+  pa_stream *s = userdata;
   pa_usec_t usec;
   int neg;
-  static int samples_consumed = 0;
-  int samples_remaining = sample_count - samples_consumed;
-
-  int samples_requested = length / BYTES_PER_SAMPLE;
-  if (samples_remaining < samples_requested)
-	  samples_requested = samples_remaining;
-  pa_stream_get_latency(s,&usec,&neg);
-  if (pa_debug) {
-    printf("  latency %8d us\n",(int)usec);
-    printf("samples_consumed %d samples_remaining %d length %lu\n", 
-	   samples_consumed, samples_remaining, length);
-  }
-  pa_stream_write(s, &sampledata[samples_consumed], samples_requested*BYTES_PER_SAMPLE, NULL, 0LL, PA_SEEK_RELATIVE);
-  samples_consumed += samples_requested;
-  samples_remaining = sample_count - samples_consumed;
-  if (samples_remaining == 0) {
-	if (pa_debug) printf("no samples remaining\n");
-	pa_mainloop_quit(pa_ml, 0);
+
+  if (pa_stream_get_latency(s, &usec, &neg) == 0) {
+    if (pa_debug)
+      printf("  latency %8d us ring %zu bytes underruns %d\n", (int)usec, wav_ring_readable(ring), ring_underruns);
+    wav_hist_add(&latency_hist, usec);
   }
-  process_latencies(usec);
+  if (get_time_usec() - last_report_usec >= STATS_USEC)
+    report_stats(0);
+  pa_context_rttime_restart(pa_stream_get_context(s), e, pa_rtclock_now() + LATENCY_SAMPLE_USEC);
 }
 
 static void stream_underflow_cb(pa_stream *s, void *userdata) {
@@ -146,12 +257,14 @@ static void stream_underflow_cb(pa_stream *s, void *userdata) {
   // This is very useful for over the network playback that can't handle low latencies
   printf("underflow\n");
   underflows++;
+  underflows_total++;
   if (underflows >= 6 && latency < 2000000) {
     latency = (latency*3)/2;
     bufattr.maxlength = pa_usec_to_bytes(latency,&ss);
     bufattr.tlength = pa_usec_to_bytes(latency,&ss);  
     pa_stream_set_buffer_attr(s, &bufattr, NULL, NULL);
     underflows = 0;
+    latency_increases++;
     printf("latency increased to %d\n", latency);
   }
 }
@@ -173,9 +286,26 @@ int main(int argc, char *argv[]) {
   char * nice_change_str;
   float coeff = 5000;
   char * coeff_str;
+  double speed = 1.0;
+  char * speed_str;
+  char * effects_str;
+  char * stats_str;
 
   pa_debug = getenv(debug_env_var) != NULL;
 
+  stats_str = getenv("STATS");
+  if (stats_str) {
+	  stats_file = strcmp(stats_str, "-") ? fopen(stats_str, "w") : stdout;
+	  if (!stats_file) {
+		  perror(stats_str);
+		  exit(NOTOK);
+	  }
+  }
+  wav_hist_reset(&latency_hist);
+  wav_hist_reset(&callback_hist);
+  wav_hist_reset(&total_latency_hist);
+  wav_hist_reset(&total_callback_hist);
+
   nice_change_str = getenv("NICE_CHANGE");
   if (nice_change_str) {
 	  nice_change = atoi(nice_change_str);
@@ -193,49 +323,54 @@ int main(int argc, char *argv[]) {
   }
   if (pa_debug) printf("frequency coefficient = %f\n", coeff);
 
-  /* read in wave file into sample buffer */
+  speed_str = getenv("SPEED");
+  if (speed_str) {
+	  speed = atof(speed_str);
+	  if (speed < 0.125 || speed > 8.0) {
+		  printf("ERROR: SPEED must be from 0.125 to 8\n");
+		  exit(NOTOK);
+	  }
+  }
 
-  rc = wav_read(argv[1], &sampledata, &sample_count, &channels);
+  /* map wave file so samples are paged in only as they are played */
 
-  /* post process it */
+  rc = wav_map(argv[1], &sample_map, &sampledata, &info);
+  if (rc != OK) exit(NOTOK);
 
-#if 0
-  /* speed it up by factor of 2 */
-  for (int k = 0; (k<<1) < sample_count ; k++) {
-	  sampledata[k] = sampledata[k<<1];
+  /* post process it on the way to the speaker: a speed change is the
+   * samples labelled with a different rate and resampled back */
+
+  struct wav_stream_fmt fmt;
+  char spec[64];
+  fmt.channels = info.channels;
+  fmt.samples_per_sec = (int )(info.samples_per_sec * speed + 0.5);
+  fmt.max_frames = WAV_EFFECT_BLOCK_FRAMES;
+  if (speed != 1.0) {
+	  snprintf(spec, sizeof(spec), "resample:rate=%d", info.samples_per_sec);
+	  if (wav_pipeline_add(&chain, spec)) exit(NOTOK);
   }
-  sample_count /= 2;
-#endif
-
-#if 0
-  /* slow it down by factor of 2 */
-  wav_sample_t * old_sampledata = sampledata;
-  sampledata = malloc(sizeof(wav_sample_t) * sample_count * 2 + 4);
-  for (int k = 0; k < sample_count; k++) {
-	sampledata[2*k] = old_sampledata[k];
+  effects_str = getenv("EFFECTS");
+  if (effects_str) {
+	  effects_str = strdup(effects_str);
+	  for (char * tok = strtok(effects_str, " \t"); tok; tok = strtok(NULL, " \t"))
+		  if (wav_pipeline_add(&chain, tok)) exit(NOTOK);
+	  free(effects_str);
   }
-  if (sample_count > 0) {
-  	sampledata[2*sample_count] = sampledata[2*sample_count - 2];
-  	for (int j = 0; j < sample_count; j++) {
-		/* interpolate linearly between the two values */
-		sampledata[2*j+1] = (sampledata[2*j] + sampledata[2*j + 2]) / 2 ;
-	}
-  }
-#endif
-
-#if 0
-  /* this used to insert a sinusoidal signal into the recording */
-  for (int k = 0; k < sample_count ; k++) {
-	  /* make room for additional signal */
-	  sampledata[k] = (sampledata[k]*0.9);
-	  /* insert weird sinusoidal thingy */
-	  sampledata[k] += ((1<<8) * 
-			    (cos((k/2)/FLOAT_SAMPLES_PER_SEC) * 
-			     sin((k/7))));
-	  assert(sampledata[k] < 1<<15);
-	  //sampledata[k] *= MAX_VOLUME;
+  if (wav_pipeline_init(&chain, &fmt)) exit(NOTOK);
+  channels = chain.out_fmt.channels;
+
+  /* start the effects and let them get a ring ahead before playing */
+
+  if (wav_ring_open((size_t )RING_USEC * chain.out_fmt.samples_per_sec / MICROSEC_PER_SEC *
+		    channels * BYTES_PER_SAMPLE, &ring) != OK)
+	  exit(NOTOK);
+  if (pthread_create(&producer, NULL, produce, NULL)) {
+	  perror("pthread_create");
+	  exit(NOTOK);
   }
-#endif
+  while (wav_ring_writable(ring) >= BYTES_PER_SAMPLE * channels && !atomic_load(&producer_done))
+	  usleep(1000);
+  if (pa_debug) printf("ring %zu bytes, %zu ready\n", wav_ring_size(ring), wav_ring_readable(ring));
 
   // Create a mainloop API and connection to the default server
   pa_ml = pa_mainloop_new();
@@ -263,7 +398,7 @@ int main(int argc, char *argv[]) {
     goto exit;
   }
 
-  ss.rate = 44100;
+  ss.rate = chain.out_fmt.samples_per_sec;
   ss.channels = channels;
   ss.format = PA_SAMPLE_S16LE;
   playstream = pa_stream_new(pa_ctx, "Playback", &ss, NULL);
@@ -294,15 +429,29 @@ int main(int argc, char *argv[]) {
     retval = -1;
     goto exit;
   }
+  start_usec = last_report_usec = get_time_usec();
+  pa_context_rttime_new(pa_ctx, pa_rtclock_now() + LATENCY_SAMPLE_USEC, latency_timer_cb, playstream);
 
   // Run the mainloop until pa_mainloop_quit() is called
-  // (this example never calls it, so the mainloop runs forever).
+  // once the ring is drained and the server has played it all.
   pa_mainloop_run(pa_ml, NULL);
+  report_stats(1);
+  printf("latency p50 %" PRIu64 " p99 %" PRIu64 " max %" PRIu64 " us, callback p99 %" PRIu64 " ns, "
+	 "%d underflows, %d ring underruns\n",
+	 wav_hist_percentile(&total_latency_hist, 0.5), wav_hist_percentile(&total_latency_hist, 0.99),
+	 total_latency_hist.max, wav_hist_percentile(&total_callback_hist, 0.99),
+	 underflows_total, ring_underruns);
 
 exit:
   // clean up and disconnect
+  atomic_store(&stop_producer, 1);
+  pthread_join(producer, NULL);
   pa_context_disconnect(pa_ctx);
   pa_context_unref(pa_ctx);
   pa_mainloop_free(pa_ml);
+  wav_ring_close(ring);
+  wav_pipeline_free(&chain);
+  wav_unmap(sample_map);
+  if (stats_file && stats_file != stdout) fclose(stats_file);
   return retval;
 }
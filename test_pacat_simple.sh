@@ -0,0 +1,65 @@
+#!/bin/bash
+set -eEo pipefail
+
+# script to exercise pacat-simple without a PulseAudio server: -o file.raw
+# must keep exactly the samples of the data chunk, streamed or with -w
+pacat=${PACAT:-./pacat-simple}
+prefix=pacat_test
+stereo=${prefix}_stereo.wav
+mono=${prefix}_mono.wav
+float=${prefix}_f32.wav
+expected=${prefix}_expected.raw
+out=${prefix}_out.raw
+
+function cleanup()
+{
+rm -f $stereo $mono $float $expected $out
+}
+
+trap cleanup EXIT
+cleanup
+
+# data chunk of a .wav file, the samples pacat-simple hands to the server
+function data_chunk()
+{
+local offset=$(grep -obUa data $1 | head -1 | cut -d: -f1)
+local bytes=$(od -An -tu4 -j $((offset + 4)) -N4 $1 | tr -d ' ')
+tail -c +$((offset + 9)) $1 | head -c $bytes
+}
+
+# play $2 with options $1 into $out and compare it with the data chunk
+function check_raw()
+{
+rm -f $out
+$pacat $1 -o $out $2
+data_chunk $2 > $expected
+cmp $expected $out
+echo "$pacat $1 $2 is the data chunk"
+}
+
+./wav_gen -s 2.3 $stereo > /dev/null
+./wav_gen -s 0.77 -c 1 $mono > /dev/null
+./wav_gen -s 0.5 -e f32 $float > /dev/null
+
+check_raw "" $stereo
+check_raw "-c 7 -p 2" $stereo
+check_raw "-c 1 -p 1" $mono
+check_raw "-w" $stereo
+check_raw "-w" $mono
+
+# -w maps the file, which only works for 16-bit samples
+if $pacat -w -o $out $float; then
+	echo "ERROR: -w played $float, which is not 16-bit"
+	exit 1
+fi
+echo "-w refused $float"
+
+# null takes audio at the rate it would be played
+start=$(date +%s%N)
+$pacat -o null $mono
+elapsed_msec=$((($(date +%s%N) - start) / 1000000))
+if [ $elapsed_msec -lt 600 ]; then
+	echo "ERROR: -o null played 770 ms of audio in $elapsed_msec ms"
+	exit 1
+fi
+echo "-o null played 770 ms of audio in $elapsed_msec ms"
@@ -0,0 +1,198 @@
+#!/bin/bash
+set -eEo pipefail
+
+# script to check the tools against each other on files from wav_gen:
+# round trips, bit-identical output across SIMD levels and thread counts,
+# resampled lengths, the limiter's ceiling, the convolver and mixed lengths.
+# WAV_TEST_BIG=1 also writes a file past 4 GiB to check it becomes RF64
+prefix=tools_test
+dir=$(mktemp -d ${prefix}_XXXXXX)
+
+function cleanup()
+{
+rm -rf $dir
+}
+
+trap cleanup EXIT
+
+function fail()
+{
+echo "ERROR: $*"
+exit 1
+}
+
+# data chunk of a RIFF .wav file
+function data_chunk()
+{
+local offset=$(grep -obUa data $1 | head -1 | cut -d: -f1)
+local bytes=$(od -An -tu4 -j $((offset + 4)) -N4 $1 | tr -d ' ')
+head -c $((offset + 8 + bytes)) $1 | tail -c $bytes
+}
+
+function same_data()
+{
+cmp <(data_chunk $1) <(data_chunk $2) || fail "$1 and $2 hold different samples"
+}
+
+# $2 bytes of $1, little-endian
+function le()
+{
+local v=$1
+for ((k = 0; k < $2; k++)); do
+	printf "\\x$(printf %02x $((v & 255)))"
+	v=$((v >> 8))
+done
+}
+
+# field $2 of wav_analyze's json for $1, one line per channel for channel fields
+function analyze()
+{
+./wav_analyze -f json $1 | grep -o "\"$2\":[-0-9.]*" | cut -d: -f2
+}
+
+function frames()
+{
+analyze $1 frames
+}
+
+function xform()
+{
+./wav_transform "$@" > $dir/xform.log || { cat $dir/xform.log; fail "wav_transform $*"; }
+}
+
+# copy round trips, every encoding and more channels than stereo
+
+for enc in u8 s16 s24 s32 f32 f64; do
+	./wav_gen -s 0.7 -e $enc $dir/$enc.wav > /dev/null
+	./copy_wav_file $dir/$enc.wav $dir/copy.wav > /dev/null
+	same_data $dir/$enc.wav $dir/copy.wav
+done
+./copy_wav_file -e f32 $dir/s16.wav $dir/f32_from_s16.wav > /dev/null
+./copy_wav_file -e s16 $dir/f32_from_s16.wav $dir/copy.wav > /dev/null
+same_data $dir/s16.wav $dir/copy.wav
+./wav_gen -s 0.3 -c 6 -e s24 $dir/six.wav > /dev/null
+./copy_wav_file $dir/six.wav $dir/copy.wav > /dev/null
+same_data $dir/six.wav $dir/copy.wav
+./wav_gen -s 0.00007 -c 1 -e u8 $dir/odd.wav > /dev/null
+[ $(($(wc -c < $dir/odd.wav) % 2)) = 0 ] || fail "odd length data chunk is not padded"
+./copy_wav_file $dir/odd.wav $dir/copy.wav > /dev/null
+cmp -s $dir/odd.wav $dir/copy.wav || fail "padded file does not copy the same"
+echo "copies of u8 to f64, 6 channels and an odd length are bit-identical"
+
+# decoding and encoding every encoding give the same bytes at every SIMD level
+
+for enc in u8 s16 s24 s32 f64; do
+	WAV_SIMD=c ./copy_wav_file -e f32 $dir/$enc.wav $dir/dec_c.wav > /dev/null
+	WAV_SIMD=c ./copy_wav_file -e $enc $dir/f32.wav $dir/enc_c.wav > /dev/null
+	for level in sse2 ssse3 avx2 avx512; do
+		WAV_SIMD=$level ./copy_wav_file -e f32 $dir/$enc.wav $dir/dec.wav > /dev/null
+		WAV_SIMD=$level ./copy_wav_file -e $enc $dir/f32.wav $dir/enc.wav > /dev/null
+		cmp -s $dir/dec_c.wav $dir/dec.wav || fail "WAV_SIMD=$level decodes $enc differently"
+		cmp -s $dir/enc_c.wav $dir/enc.wav || fail "WAV_SIMD=$level encodes $enc differently"
+	done
+done
+echo "every encoding converts the same at every SIMD level"
+
+# an RF64 file made by hand reads as the same samples
+
+in=$dir/s16.wav
+fmt_at=$(grep -obUa "fmt " $in | head -1 | cut -d: -f1)
+fmt_len=$((8 + $(od -An -tu4 -j $((fmt_at + 4)) -N4 $in | tr -d ' ')))
+data_bytes=$(data_chunk $in | wc -c)
+{
+	printf "RF64"; le 4294967295 4; printf "WAVE"
+	printf "ds64"; le 28 4
+	le $((4 + 36 + fmt_len + 8 + data_bytes)) 8; le $data_bytes 8; le $((data_bytes / 4)) 8; le 0 4
+	head -c $((fmt_at + fmt_len)) $in | tail -c $fmt_len
+	printf "data"; le 4294967295 4
+	data_chunk $in
+} > $dir/rf64.wav
+./copy_wav_file $dir/rf64.wav $dir/copy.wav > /dev/null
+[ "$(head -c 4 $dir/copy.wav)" = RIFF ] || fail "copy of a small RF64 file is not RIFF"
+same_data $in $dir/copy.wav
+echo "RF64 input reads as the same samples"
+
+if [ "${WAV_TEST_BIG:-0}" = 1 ]; then
+	./wav_gen -s 24400 $dir/big.wav > /dev/null
+	[ "$(head -c 4 $dir/big.wav)" = RF64 ] || fail "a file past 4 GiB was not written as RF64"
+	[ "$(frames $dir/big.wav)" = $((24400 * 44100)) ] || fail "RF64 frame count is wrong"
+	rm -f $dir/big.wav
+	echo "a file past 4 GiB is written as RF64 with every frame"
+fi
+
+# every SIMD level and every thread count give the same output
+
+./wav_gen -s 3.1 $dir/in.wav > /dev/null
+./wav_gen -s 3.1 -e f32 $dir/in_f32.wav > /dev/null
+chains=("-f 4000 -m 100 -l -0.5 -a 0.5"
+	"-x distort:drive=18"
+	"-x distort:drive=24,curve=tube -x eq:b1=highpass:30,b2=peak:2500:-4:1.4"
+	"-x resample:rate=48000"
+	"-x compress:threshold=-18,ratio=4 -x limit:ceiling=-1")
+for chain in "${chains[@]}"; do
+	for in in $dir/in.wav $dir/in_f32.wav; do
+		xform $chain $in $dir/serial.wav
+		for level in c sse2 avx2 avx512; do
+			WAV_SIMD=$level xform $chain $in $dir/level.wav
+			cmp -s $dir/serial.wav $dir/level.wav || fail "WAV_SIMD=$level changes $chain on $in"
+		done
+		for j in 2 3 8; do
+			xform -j $j $chain $in $dir/threads.wav
+			cmp -s $dir/serial.wav $dir/threads.wav || fail "-j $j changes $chain on $in"
+		done
+	done
+	echo "$chain is bit-identical at every SIMD level and thread count"
+done
+
+# resampling gives ceil(frames * out / in) frames
+
+n=$(frames $dir/in.wav)
+for rate in 48000 22050 96000 44101; do
+	xform -x resample:rate=$rate $dir/in.wav $dir/rs.wav
+	want=$(((n * rate + 44099) / 44100))
+	[ "$(frames $dir/rs.wav)" = $want ] || fail "resampling $n frames to $rate gave $(frames $dir/rs.wav), not $want"
+done
+echo "resampled lengths are exact"
+
+# the limiter holds its ceiling on a hot signal, and keeps the length
+
+xform -e f32 -x distort:drive=30,level=9 -x limit:ceiling=-1 $dir/in.wav $dir/hot.wav
+for peak in $(analyze $dir/hot.wav peak_dbfs); do
+	awk -v p=$peak 'BEGIN { exit !(p <= -1.0) }' || fail "limited peak $peak dBFS is over the -1 dB ceiling"
+done
+[ "$(frames $dir/hot.wav)" = $n ] || fail "limiting changed the length"
+echo "limiter holds -1 dBFS"
+
+# convolving with a unit impulse gives back the input, input + IR - 1 frames long
+
+ir_frames=100
+{
+	printf "RIFF"; le $((4 + 24 + 8 + ir_frames * 4)) 4; printf "WAVE"
+	printf "fmt "; le 16 4; le 3 2; le 1 2; le 44100 4; le $((44100 * 4)) 4; le 4 2; le 32 2
+	printf "data"; le $((ir_frames * 4)) 4
+	le 1065353216 4; head -c $(((ir_frames - 1) * 4)) /dev/zero
+} > $dir/impulse.wav
+xform -e f32 -x convolve:ir=$dir/impulse.wav,wet=1,dry=0 $dir/in_f32.wav $dir/conv.wav
+[ "$(frames $dir/conv.wav)" = $((n + ir_frames - 1)) ] || fail "convolved length is not $n + $ir_frames - 1"
+paste <(data_chunk $dir/in_f32.wav | od -An -v -tf4 -w4) <(data_chunk $dir/conv.wav | od -An -v -tf4 -w4) |
+	awk '{ d = NF == 1 ? $1 : $2 - $1; if (d > 1e-5 || d < -1e-5) { print NR ": " $0; exit 1 } }' ||
+	fail "convolving with a unit impulse changed the samples"
+echo "a unit impulse convolves to the input"
+
+# mixed and joined lengths
+
+./wav_gen -s 1 $dir/a.wav > /dev/null
+./wav_gen -s 0.5 -c 1 $dir/b.wav > /dev/null
+./wav_mix -o $dir/mix.wav $dir/a.wav $dir/b.wav:offset=2 > /dev/null
+[ "$(frames $dir/mix.wav)" = $((44100 * 5 / 2)) ] || fail "summed length is wrong"
+./wav_mix -c -o $dir/mix.wav $dir/a.wav $dir/b.wav > /dev/null
+[ "$(frames $dir/mix.wav)" = $((44100 * 3 / 2)) ] || fail "joined length is wrong"
+./wav_mix -c -o $dir/mix.wav $dir/a.wav $dir/b.wav:offset=-0.25 > /dev/null
+[ "$(frames $dir/mix.wav)" = $((44100 * 5 / 4)) ] || fail "overlapped length is wrong"
+for j in 1 7; do
+	./wav_mix -j $j -o $dir/mix$j.wav $dir/a.wav $dir/b.wav:gain=-3,pan=0.5,offset=0.3 > /dev/null
+done
+cmp -s $dir/mix1.wav $dir/mix7.wav || fail "wav_mix -j changes the mix"
+echo "mixed and joined lengths are right, and the same for any thread count"
+
+echo "all checks passed"
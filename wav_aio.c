@@ -0,0 +1,319 @@
+/* background positional I/O, see wav_aio.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "wav_file_access.h"
+#include "wav_aio.h"
+
+/* one request, kept until it has moved all its bytes */
+struct aio_op {
+	int	fd;
+	char *	buf;		/* next byte to transfer */
+	size_t	len;		/* bytes still to transfer */
+	off_t	offset;
+	int	write;
+	int	busy;
+};
+
+struct wav_aio {
+	int		depth;
+	int		pending;
+	struct aio_op	ops[WAV_AIO_MAX_DEPTH];
+
+	/* io_uring, ring_fd is -1 when falling back to pread */
+	int		ring_fd;
+	void *		sq_ring;
+	size_t		sq_ring_bytes;
+	void *		cq_ring;	/* same mapping as sq_ring on most kernels */
+	size_t		cq_ring_bytes;
+	struct io_uring_sqe *sqes;
+	size_t		sqes_bytes;
+	unsigned *	sq_head;
+	unsigned *	sq_tail;
+	unsigned *	sq_mask;
+	unsigned *	sq_array;
+	unsigned *	cq_head;
+	unsigned *	cq_tail;
+	unsigned *	cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* pread fallback, tags done but not yet waited for, oldest first */
+	int		done[WAV_AIO_MAX_DEPTH];
+	int		done_rc[WAV_AIO_MAX_DEPTH];
+	int		done_first;
+	int		done_count;
+};
+
+static int syscall_error(char * msg) {
+	printf("ERROR: %s: %s\n", msg, strerror(errno));
+	return(NOTOK);
+}
+
+/* finish op with plain pread/pwrite. return OK if done, NOTOK otherwise */
+
+static int op_sync(struct aio_op *op)
+{
+	while (op->len > 0) {
+		ssize_t count = op->write ? pwrite(op->fd, op->buf, op->len, op->offset) :
+					    pread(op->fd, op->buf, op->len, op->offset);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0)
+			return syscall_error(op->write ? "could not write sample data" : "could not read sample data");
+		if (count == 0) {
+			printf("ERROR: unexpected end of file\n");
+			return NOTOK;
+		}
+		op->buf += count;
+		op->len -= count;
+		op->offset += count;
+	}
+	return OK;
+}
+
+static int ring_setup(struct wav_aio *aio)
+{
+	struct io_uring_params p;
+	char * env = getenv("WAV_AIO");
+
+	if (env && !strcmp(env, "pread"))
+		return NOTOK;
+	memset(&p, 0, sizeof(p));
+	aio->ring_fd = syscall(__NR_io_uring_setup, aio->depth, &p);
+	if (aio->ring_fd < 0)
+		return NOTOK;
+
+	aio->sq_ring_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	aio->cq_ring_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (aio->cq_ring_bytes > aio->sq_ring_bytes)
+			aio->sq_ring_bytes = aio->cq_ring_bytes;
+		aio->cq_ring_bytes = aio->sq_ring_bytes;
+	}
+	aio->sq_ring = mmap(NULL, aio->sq_ring_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			    aio->ring_fd, IORING_OFF_SQ_RING);
+	if (aio->sq_ring == MAP_FAILED)
+		goto fail_ring;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		aio->cq_ring = aio->sq_ring;
+	} else {
+		aio->cq_ring = mmap(NULL, aio->cq_ring_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+				    aio->ring_fd, IORING_OFF_CQ_RING);
+		if (aio->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+	aio->sqes_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+	aio->sqes = (struct io_uring_sqe * )mmap(NULL, aio->sqes_bytes, PROT_READ|PROT_WRITE,
+						  MAP_SHARED|MAP_POPULATE, aio->ring_fd, IORING_OFF_SQES);
+	if (aio->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	aio->sq_head = (unsigned * )((char * )aio->sq_ring + p.sq_off.head);
+	aio->sq_tail = (unsigned * )((char * )aio->sq_ring + p.sq_off.tail);
+	aio->sq_mask = (unsigned * )((char * )aio->sq_ring + p.sq_off.ring_mask);
+	aio->sq_array = (unsigned * )((char * )aio->sq_ring + p.sq_off.array);
+	aio->cq_head = (unsigned * )((char * )aio->cq_ring + p.cq_off.head);
+	aio->cq_tail = (unsigned * )((char * )aio->cq_ring + p.cq_off.tail);
+	aio->cq_mask = (unsigned * )((char * )aio->cq_ring + p.cq_off.ring_mask);
+	aio->cqes = (struct io_uring_cqe * )((char * )aio->cq_ring + p.cq_off.cqes);
+	return OK;
+
+fail_cq:
+	if (aio->cq_ring != aio->sq_ring)
+		munmap(aio->cq_ring, aio->cq_ring_bytes);
+fail_sq:
+	munmap(aio->sq_ring, aio->sq_ring_bytes);
+fail_ring:
+	close(aio->ring_fd);
+	aio->ring_fd = -1;
+	return NOTOK;
+}
+
+int wav_aio_open(int depth, struct wav_aio **aio_out)
+{
+	struct wav_aio * aio;
+
+	if (depth < 1 || depth > WAV_AIO_MAX_DEPTH) {
+		printf("ERROR: I/O depth must be from 1 to %d\n", WAV_AIO_MAX_DEPTH);
+		return NOTOK;
+	}
+	aio = (struct wav_aio * )calloc(1, sizeof(struct wav_aio));
+	if (!aio)
+		return syscall_error("malloc");
+	aio->depth = depth;
+	aio->ring_fd = -1;
+	ring_setup(aio);
+	*aio_out = aio;
+	return OK;
+}
+
+const char * wav_aio_backend(struct wav_aio *aio)
+{
+	return aio->ring_fd >= 0 ? "io_uring" : "pread";
+}
+
+int wav_aio_pending(struct wav_aio *aio)
+{
+	return aio->pending;
+}
+
+/* queue what is left of op on the ring and tell the kernel */
+
+static int ring_submit(struct wav_aio *aio, int tag)
+{
+	struct aio_op * op = &aio->ops[tag];
+	unsigned tail = *aio->sq_tail;
+	unsigned index = tail & *aio->sq_mask;
+	struct io_uring_sqe * sqe = &aio->sqes[index];
+	int rc;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = op->fd;
+	sqe->addr = (unsigned long )op->buf;
+	sqe->len = op->len > (1u << 30) ? (1u << 30) : op->len;
+	sqe->off = op->offset;
+	sqe->user_data = tag;
+	aio->sq_array[index] = index;
+
+	/* the kernel must see the entry before it sees the new tail */
+	__atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	do {
+		rc = syscall(__NR_io_uring_enter, aio->ring_fd, 1, 0, 0, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		return syscall_error("io_uring_enter");
+	return OK;
+}
+
+static int submit(struct wav_aio *aio, int fd, void *buf, size_t len, off_t offset, int tag, int write)
+{
+	struct aio_op * op;
+	int rc;
+
+	if (tag < 0 || tag >= aio->depth || aio->ops[tag].busy) {
+		printf("ERROR: I/O tag %d is not free\n", tag);
+		return NOTOK;
+	}
+	op = &aio->ops[tag];
+	op->fd = fd;
+	op->buf = (char * )buf;
+	op->len = len;
+	op->offset = offset;
+	op->write = write;
+	op->busy = 1;
+	aio->pending++;
+	if (aio->ring_fd >= 0 && len > 0) {
+		if (ring_submit(aio, tag) == OK)
+			return OK;
+		op->busy = 0;
+		aio->pending--;
+		return NOTOK;
+	}
+
+	/* no ring, do it now and remember the result for wav_aio_wait() */
+	rc = op_sync(op);
+	aio->done[(aio->done_first + aio->done_count) % WAV_AIO_MAX_DEPTH] = tag;
+	aio->done_rc[(aio->done_first + aio->done_count) % WAV_AIO_MAX_DEPTH] = rc;
+	aio->done_count++;
+	return OK;
+}
+
+int wav_aio_read(struct wav_aio *aio, int fd, void *buf, size_t len, off_t offset, int tag)
+{
+	return submit(aio, fd, buf, len, offset, tag, 0);
+}
+
+int wav_aio_write(struct wav_aio *aio, int fd, const void *buf, size_t len, off_t offset, int tag)
+{
+	return submit(aio, fd, (void * )buf, len, offset, tag, 1);
+}
+
+int wav_aio_wait(struct wav_aio *aio, int *tag_out)
+{
+	struct aio_op * op;
+	int tag, res, rc;
+
+	*tag_out = -1;
+	if (aio->pending == 0) {
+		printf("ERROR: waiting with no I/O in flight\n");
+		return NOTOK;
+	}
+	if (aio->done_count > 0) {
+		tag = aio->done[aio->done_first];
+		rc = aio->done_rc[aio->done_first];
+		aio->done_first = (aio->done_first + 1) % WAV_AIO_MAX_DEPTH;
+		aio->done_count--;
+		aio->ops[tag].busy = 0;
+		aio->pending--;
+		*tag_out = tag;
+		return rc;
+	}
+
+	for (;;) {
+		unsigned head = *aio->cq_head;
+
+		if (head == __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (syscall(__NR_io_uring_enter, aio->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+			    errno != EINTR) {
+				*tag_out = -1;
+				return syscall_error("io_uring_enter");
+			}
+			continue;
+		}
+		tag = (int )aio->cqes[head & *aio->cq_mask].user_data;
+		res = aio->cqes[head & *aio->cq_mask].res;
+		__atomic_store_n(aio->cq_head, head + 1, __ATOMIC_RELEASE);
+		op = &aio->ops[tag];
+
+		/* a failed request gets one more try without the ring, which also
+		 * covers kernels that have io_uring but not IORING_OP_READ/WRITE */
+		if (res < 0) {
+			rc = op_sync(op);
+		} else if (res == 0) {
+			printf("ERROR: unexpected end of file\n");
+			rc = NOTOK;
+		} else {
+			op->buf += res;
+			op->len -= res;
+			op->offset += res;
+			if (op->len > 0) {
+				/* short transfer, queue the rest */
+				if (ring_submit(aio, tag) == OK)
+					continue;
+				rc = NOTOK;
+			} else {
+				rc = OK;
+			}
+		}
+		op->busy = 0;
+		aio->pending--;
+		*tag_out = tag;
+		return rc;
+	}
+}
+
+void wav_aio_close(struct wav_aio *aio)
+{
+	int tag;
+
+	/* the kernel may still be writing into caller's buffers,
+	 * unless the ring itself has failed (tag of -1) */
+	while (aio->pending > 0)
+		if (wav_aio_wait(aio, &tag) != OK && tag < 0)
+			break;
+	if (aio->ring_fd >= 0) {
+		munmap(aio->sqes, aio->sqes_bytes);
+		if (aio->cq_ring != aio->sq_ring)
+			munmap(aio->cq_ring, aio->cq_ring_bytes);
+		munmap(aio->sq_ring, aio->sq_ring_bytes);
+		close(aio->ring_fd);
+	}
+	free(aio);
+}
@@ -0,0 +1,64 @@
+#ifndef _wav_aio_h_
+# define _wav_aio_h_ 1
+
+/* positional reads and writes that run in the background while the
+ * caller computes, so disk time hides behind CPU time.
+ *
+ * Built on io_uring (Linux 5.6 or later) through the raw system calls.
+ * Where io_uring is missing or refused, or if the environment variable
+ * WAV_AIO=pread, every request is done with pread()/pwrite() as it is
+ * submitted instead, so callers work the same either way, just without
+ * the overlap.
+ *
+ * Each request carries a tag from 0 to depth-1 that comes back when it
+ * completes, usually the index of the caller's buffer.  Only one request
+ * per tag may be in flight.  Short transfers are continued until the
+ * whole length is done, so a completion always means all of it.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* most requests in flight at once */
+#define WAV_AIO_MAX_DEPTH 64
+
+/* opaque handle, see wav_aio.c */
+struct wav_aio;
+
+/*
+ * input:
+ *   depth - how many requests may be in flight, up to WAV_AIO_MAX_DEPTH
+ * output:
+ *   aio_out - returns handle to submit requests to
+ * returns 0 if OK, non-0 otherwise
+ */
+int wav_aio_open(int depth, struct wav_aio **aio_out);
+
+/* "io_uring" or "pread", for reporting */
+const char * wav_aio_backend(struct wav_aio *aio);
+
+/*
+ * start reading len bytes at offset of fd into buf, or writing them from buf.
+ * buf must stay untouched until tag comes back from wav_aio_wait()
+ * returns 0 if submitted, non-0 otherwise
+ */
+int wav_aio_read(struct wav_aio *aio, int fd, void *buf, size_t len, off_t offset, int tag);
+int wav_aio_write(struct wav_aio *aio, int fd, const void *buf, size_t len, off_t offset, int tag);
+
+/*
+ * wait for the next request to complete, in any order
+ * output:
+ *   tag_out - tag of the request that completed
+ * returns:
+ *   0 - if it transferred all its bytes
+ *   non-0 if it failed, or if nothing was in flight
+ */
+int wav_aio_wait(struct wav_aio *aio, int *tag_out);
+
+/* how many requests are in flight */
+int wav_aio_pending(struct wav_aio *aio);
+
+/* wait for anything still in flight, then free handle */
+void wav_aio_close(struct wav_aio *aio);
+
+#endif
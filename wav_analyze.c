@@ -0,0 +1,84 @@
+/* measure peak, RMS, DC offset, true peak and loudness of .wav files
+ * in one streaming pass each, see wav_analyzer.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "wav_file_access.h"
+#include "wav_analyzer.h"
+
+static void usage(const char * msg)
+{
+	printf("ERROR: %s\n", msg);
+	printf("usage: wav_analyze [ -f text|json ] input.wav...\n");
+	printf("json writes one line per file\n");
+	exit(NOTOK);
+}
+
+static int analyze_file(char * path, int json)
+{
+	struct wav_reader * rdr;
+	struct wav_analyzer * an = NULL;
+	struct wav_analysis res;
+	struct wav_info info;
+	float * block_buf;
+	int frames;
+	int rc;
+
+	if (wav_reader_open(path, &rdr, &info))
+		return NOTOK;
+	block_buf = (float * )malloc(sizeof(float) * WAV_BLOCK_FRAMES * info.channels);
+	if (!block_buf) {
+		printf("ERROR: could not allocate block buffer\n");
+		wav_reader_close(rdr);
+		return NOTOK;
+	}
+	rc = wav_analyzer_open(info.channels, info.samples_per_sec, &an);
+	while (rc == OK) {
+		rc = wav_reader_read_float(rdr, block_buf, WAV_BLOCK_FRAMES, &frames);
+		if (rc != OK || frames == 0)
+			break;
+		wav_analyzer_add(an, block_buf, frames);
+	}
+	if (rc == OK) {
+		wav_analyzer_result(an, &res);
+		if (json)
+			wav_analysis_json(&res, path, stdout);
+		else
+			wav_analysis_print(&res, path, stdout);
+	}
+	if (an)
+		wav_analyzer_close(an);
+	free(block_buf);
+	wav_reader_close(rdr);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	int json = 0;
+	int failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				json = 0;
+			else if (!strcmp(optarg, "json"))
+				json = 1;
+			else
+				usage("format must be text or json");
+			break;
+		default:
+			usage("option parse error");
+		}
+	}
+	if (optind >= argc)
+		usage("input .wav filename must be supplied");
+	for (int k = optind; k < argc; k++)
+		if (analyze_file(argv[k], json) != OK)
+			failed++;
+	return failed ? NOTOK : OK;
+}
@@ -0,0 +1,520 @@
+/* single-pass level and loudness measurement, see wav_analyzer.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include "wav_planar.h"
+#include "wav_simd.h"
+#include "wav_analyzer.h"
+
+/* frames moved into planar channels at a time */
+#define BLOCK_FRAMES 4096
+
+/* partial sums and peaks kept side by side, so the loops vectorize
+ * and add up in the same order at every SIMD level */
+#define LANES 8
+
+/* true-peak interpolator: TP_TAPS per phase, up to TP_MAX_PHASES phases */
+#define TP_TAPS 12
+#define TP_MAX_PHASES 4
+#define TP_KAISER_BETA 5.0
+
+/* loudness gating */
+#define SUBS_PER_MOMENTARY 4	/* 100 ms sub-blocks in a 400 ms block */
+#define SUBS_PER_SHORT_TERM 30	/* ... and in 3 s */
+#define ABSOLUTE_GATE -70.0	/* LUFS */
+#define RELATIVE_GATE -10.0	/* LU under the absolute-gated loudness */
+#define HIST_TOP 10.0		/* LUFS, louder blocks go in the top bin */
+#define HIST_STEP 0.01		/* LU per bin */
+#define HIST_BINS ((int )((HIST_TOP - ABSOLUTE_GATE) / HIST_STEP))
+
+/* second-order section, transposed direct form II */
+struct biquad {
+	double	b0, b1, b2, a1, a2;
+};
+
+struct wav_analyzer {
+	int		channels;
+	int		samples_per_sec;
+	int64_t		frames;
+	struct wav_planar block;	/* the frames being measured, per channel */
+
+	/* levels */
+	float		peak[WAV_MAX_CHANNELS];
+	float		true_peak[WAV_MAX_CHANNELS];
+	double		sum[WAV_MAX_CHANNELS];
+	double		sum_squares[WAV_MAX_CHANNELS];
+
+	/* true peak */
+	int		phases;		/* oversampling factor, 1 for none */
+	float		tp_coeffs[TP_MAX_PHASES][TP_TAPS];
+	struct wav_planar tp_in;	/* TP_TAPS - 1 frames of history, then the block */
+	float *		tp_out;		/* one phase of one channel */
+
+	/* loudness */
+	struct biquad	shelf;		/* K-weighting: high shelf ... */
+	struct biquad	highpass;	/* ... then high-pass */
+	double		kz[WAV_MAX_CHANNELS][4];
+	double		weight[WAV_MAX_CHANNELS];
+	int		sub_frames;	/* frames in 100 ms */
+	int		sub_pos;	/* frames into the current sub-block */
+	double		sub_acc[WAV_MAX_CHANNELS];
+	double		subs[SUBS_PER_SHORT_TERM];	/* weighted mean squares of recent sub-blocks, a ring */
+	int64_t		sub_count;
+	double		max_momentary;	/* mean squares, not yet in LUFS */
+	double		max_short_term;
+	double *	hist_sum;	/* mean squares of the gating blocks in each bin */
+	int64_t *	hist_count;
+	double		gated_sum;	/* over every block above the absolute gate */
+	int64_t		gated_count;
+};
+
+static double lufs(double mean_square)
+{
+	return mean_square > 0.0 ? -0.691 + 10.0 * log10(mean_square) : -HUGE_VAL;
+}
+
+static int hist_bin(double loudness)
+{
+	int bin = (int )((loudness - ABSOLUTE_GATE) / HIST_STEP);
+
+	return bin < 0 ? 0 : (bin >= HIST_BINS ? HIST_BINS - 1 : bin);
+}
+
+/* the BS.1770 K-weighting filters, given there for 48 kHz, redesigned
+ * from their analog prototypes for the actual rate */
+
+static void k_weighting(struct wav_analyzer *an)
+{
+	double rate = an->samples_per_sec;
+	double f0 = 1681.974450955533, gain_db = 3.999843853973347, q = 0.7071752369554196;
+	double k = tan(M_PI * f0 / rate);
+	double vh = pow(10.0, gain_db / 20.0);
+	double vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+
+	an->shelf.b0 = (vh + vb * k / q + k * k) / a0;
+	an->shelf.b1 = 2.0 * (k * k - vh) / a0;
+	an->shelf.b2 = (vh - vb * k / q + k * k) / a0;
+	an->shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+	an->shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(M_PI * f0 / rate);
+	a0 = 1.0 + k / q + k * k;
+	an->highpass.b0 = 1.0;
+	an->highpass.b1 = -2.0;
+	an->highpass.b2 = 1.0;
+	an->highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+	an->highpass.a2 = (1.0 - k / q + k * k) / a0;
+}
+
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+
+	for (int k = 1; k < 50 && term > sum * 1e-12; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/* Kaiser-windowed sinc interpolator cut off at the input Nyquist
+ * frequency, split into phases and normalized so each passes DC at unity */
+
+static void true_peak_filter(struct wav_analyzer *an)
+{
+	int len = an->phases * TP_TAPS;
+	double half = (len - 1) / 2.0;
+
+	for (int p = 0; p < an->phases; p++) {
+		double sum = 0.0;
+		for (int j = 0; j < TP_TAPS; j++) {
+			int i = j * an->phases + p;
+			double t = (i - half) / an->phases;
+			double sinc = t == 0.0 ? 1.0 : sin(M_PI * t) / (M_PI * t);
+			double r = (i - half) / (half + 1.0);
+			an->tp_coeffs[p][j] = sinc * bessel_i0(TP_KAISER_BETA * sqrt(1.0 - r * r)) / bessel_i0(TP_KAISER_BETA);
+			sum += an->tp_coeffs[p][j];
+		}
+		for (int j = 0; j < TP_TAPS; j++)
+			an->tp_coeffs[p][j] /= sum;
+	}
+}
+
+int wav_analyzer_open(int channels, int samples_per_sec, struct wav_analyzer **an_out)
+{
+	struct wav_analyzer * an;
+
+	if (channels < 1 || channels > WAV_MAX_CHANNELS || samples_per_sec < 1000) {
+		printf("ERROR: cannot analyze %d channels at %d samples/sec\n", channels, samples_per_sec);
+		return NOTOK;
+	}
+	an = (struct wav_analyzer * )calloc(1, sizeof(struct wav_analyzer));
+	if (!an) {
+		printf("ERROR: could not allocate analyzer\n");
+		return NOTOK;
+	}
+	an->channels = channels;
+	an->samples_per_sec = samples_per_sec;
+	an->phases = samples_per_sec < 88200 ? 4 : (samples_per_sec < 176400 ? 2 : 1);
+	an->sub_frames = samples_per_sec / 10;
+	for (int c = 0; c < channels; c++)
+		an->weight[c] = 1.0;
+	if (channels == 6) {
+		/* 5.1 as L R C LFE Ls Rs */
+		an->weight[3] = 0.0;
+		an->weight[4] = an->weight[5] = 1.41;
+	}
+	k_weighting(an);
+	true_peak_filter(an);
+	an->hist_sum = (double * )malloc(sizeof(double) * HIST_BINS);
+	an->hist_count = (int64_t * )malloc(sizeof(int64_t) * HIST_BINS);
+	an->tp_out = (float * )malloc(sizeof(float) * BLOCK_FRAMES);
+	if (!an->hist_sum || !an->hist_count || !an->tp_out ||
+	    wav_planar_alloc(channels, BLOCK_FRAMES, &an->block) != OK ||
+	    wav_planar_alloc(channels, TP_TAPS - 1 + BLOCK_FRAMES, &an->tp_in) != OK) {
+		printf("ERROR: could not allocate analyzer buffers\n");
+		wav_analyzer_close(an);
+		return NOTOK;
+	}
+	wav_analyzer_reset(an);
+	*an_out = an;
+	return OK;
+}
+
+void wav_analyzer_reset(struct wav_analyzer *an)
+{
+	an->frames = 0;
+	memset(an->peak, 0, sizeof(an->peak));
+	memset(an->true_peak, 0, sizeof(an->true_peak));
+	memset(an->sum, 0, sizeof(an->sum));
+	memset(an->sum_squares, 0, sizeof(an->sum_squares));
+	for (int c = 0; c < an->channels; c++)
+		memset(an->tp_in.ch[c], 0, sizeof(float) * (TP_TAPS - 1));
+	memset(an->kz, 0, sizeof(an->kz));
+	memset(an->sub_acc, 0, sizeof(an->sub_acc));
+	an->sub_pos = 0;
+	an->sub_count = 0;
+	an->max_momentary = 0.0;
+	an->max_short_term = 0.0;
+	memset(an->hist_sum, 0, sizeof(double) * HIST_BINS);
+	memset(an->hist_count, 0, sizeof(int64_t) * HIST_BINS);
+	an->gated_sum = 0.0;
+	an->gated_count = 0;
+}
+
+/* peak, sum and sum of squares of one channel, and its true peak by
+ * running the interpolator one phase at a time over the whole block */
+
+static inline __attribute__((always_inline))
+void measure_channel_body(struct wav_analyzer *an, int c, int n)
+{
+	const float * x = an->block.ch[c];
+	float * in = an->tp_in.ch[c];
+	float * out = an->tp_out;
+	float peak[LANES] = { 0 };
+	double sum[LANES] = { 0 }, squares[LANES] = { 0 };
+	int k = 0;
+
+	for (; k + LANES <= n; k += LANES) {
+		for (int l = 0; l < LANES; l++) {
+			float v = x[k + l], a = fabsf(v);
+			peak[l] = a > peak[l] ? a : peak[l];
+			sum[l] += v;
+			squares[l] += (double )v * v;
+		}
+	}
+	for (int l = 0; k < n; k++, l++) {
+		float v = x[k], a = fabsf(v);
+		peak[l] = a > peak[l] ? a : peak[l];
+		sum[l] += v;
+		squares[l] += (double )v * v;
+	}
+	for (int l = 0; l < LANES; l++) {
+		an->peak[c] = peak[l] > an->peak[c] ? peak[l] : an->peak[c];
+		an->sum[c] += sum[l];
+		an->sum_squares[c] += squares[l];
+	}
+	if (an->phases == 1)
+		return;
+
+	memcpy(in + TP_TAPS - 1, x, sizeof(float) * n);
+	for (int p = 0; p < an->phases; p++) {
+		const float * h = an->tp_coeffs[p];
+		for (k = 0; k < n; k++)
+			out[k] = h[0] * in[k + TP_TAPS - 1];
+		for (int j = 1; j < TP_TAPS; j++) {
+			const float * src = in + TP_TAPS - 1 - j;
+			float hj = h[j];
+			for (k = 0; k < n; k++)
+				out[k] += hj * src[k];
+		}
+		for (int l = 0; l < LANES; l++)
+			peak[l] = 0.0f;
+		for (k = 0; k + LANES <= n; k += LANES) {
+			for (int l = 0; l < LANES; l++) {
+				float a = fabsf(out[k + l]);
+				peak[l] = a > peak[l] ? a : peak[l];
+			}
+		}
+		for (int l = 0; k < n; k++, l++) {
+			float a = fabsf(out[k]);
+			peak[l] = a > peak[l] ? a : peak[l];
+		}
+		for (int l = 0; l < LANES; l++)
+			an->true_peak[c] = peak[l] > an->true_peak[c] ? peak[l] : an->true_peak[c];
+	}
+	memmove(in, in + n, sizeof(float) * (TP_TAPS - 1));
+}
+
+static void measure_channel_c(struct wav_analyzer *an, int c, int n)
+{
+	measure_channel_body(an, c, n);
+}
+
+#ifdef WAV_SIMD_X86
+WAV_TARGET_AVX2
+static void measure_channel_avx2(struct wav_analyzer *an, int c, int n)
+{
+	measure_channel_body(an, c, n);
+}
+
+WAV_TARGET_AVX512
+static void measure_channel_avx512(struct wav_analyzer *an, int c, int n)
+{
+	measure_channel_body(an, c, n);
+}
+#endif
+
+static void (*measure_channel)(struct wav_analyzer *an, int c, int n) = measure_channel_c;
+
+__attribute__((constructor))
+static void pick_measure_channel(void)
+{
+#ifdef WAV_SIMD_X86
+	int level = wav_simd_level();
+
+	if (level >= WAV_SIMD_AVX512)
+		measure_channel = measure_channel_avx512;
+	else if (level >= WAV_SIMD_AVX2)
+		measure_channel = measure_channel_avx2;
+#endif
+}
+
+/* K-weight n samples of channel c and return the sum of their squares.
+ * Each sample depends on the last, so this one stays scalar */
+
+static double k_weighted_energy(struct wav_analyzer *an, int c, const float *x, int n)
+{
+	const struct biquad * s = &an->shelf, * h = &an->highpass;
+	double * z = an->kz[c];
+	double z0 = z[0], z1 = z[1], z2 = z[2], z3 = z[3];
+	double energy = 0.0;
+
+	for (int k = 0; k < n; k++) {
+		double v = x[k];
+		double y = s->b0 * v + z0;
+		double w;
+
+		z0 = s->b1 * v - s->a1 * y + z1;
+		z1 = s->b2 * v - s->a2 * y;
+		w = h->b0 * y + z2;
+		z2 = h->b1 * y - h->a1 * w + z3;
+		z3 = h->b2 * y - h->a2 * w;
+		energy += w * w;
+	}
+
+	/* after silence the state decays into denormals, which are slow */
+	z[0] = fabs(z0) < 1e-30 ? 0.0 : z0;
+	z[1] = fabs(z1) < 1e-30 ? 0.0 : z1;
+	z[2] = fabs(z2) < 1e-30 ? 0.0 : z2;
+	z[3] = fabs(z3) < 1e-30 ? 0.0 : z3;
+	return energy;
+}
+
+/* a 100 ms sub-block is complete: it ends a 400 ms gating block and a 3 s window */
+
+static void end_sub_block(struct wav_analyzer *an)
+{
+	double energy = 0.0, momentary = 0.0, short_term = 0.0;
+
+	for (int c = 0; c < an->channels; c++) {
+		energy += an->weight[c] * an->sub_acc[c];
+		an->sub_acc[c] = 0.0;
+	}
+	an->subs[an->sub_count % SUBS_PER_SHORT_TERM] = energy / an->sub_frames;
+	an->sub_count++;
+	an->sub_pos = 0;
+
+	if (an->sub_count >= SUBS_PER_MOMENTARY) {
+		for (int s = 0; s < SUBS_PER_MOMENTARY; s++)
+			momentary += an->subs[(an->sub_count - 1 - s) % SUBS_PER_SHORT_TERM];
+		momentary /= SUBS_PER_MOMENTARY;
+		if (momentary > an->max_momentary)
+			an->max_momentary = momentary;
+		if (lufs(momentary) > ABSOLUTE_GATE) {
+			int bin = hist_bin(lufs(momentary));
+			an->hist_sum[bin] += momentary;
+			an->hist_count[bin]++;
+			an->gated_sum += momentary;
+			an->gated_count++;
+		}
+	}
+	if (an->sub_count >= SUBS_PER_SHORT_TERM) {
+		for (int s = 0; s < SUBS_PER_SHORT_TERM; s++)
+			short_term += an->subs[s];
+		short_term /= SUBS_PER_SHORT_TERM;
+		if (short_term > an->max_short_term)
+			an->max_short_term = short_term;
+	}
+}
+
+void wav_analyzer_add(struct wav_analyzer *an, const float *in, int frames)
+{
+	while (frames > 0) {
+		int n = frames < BLOCK_FRAMES ? frames : BLOCK_FRAMES;
+
+		wav_deinterleave(in, an->channels, an->block.ch, n);
+		for (int c = 0; c < an->channels; c++)
+			measure_channel(an, c, n);
+
+		/* loudness, a piece at a time so none crosses a sub-block */
+		for (int k = 0; k < n; ) {
+			int piece = an->sub_frames - an->sub_pos;
+			if (piece > n - k)
+				piece = n - k;
+			for (int c = 0; c < an->channels; c++)
+				an->sub_acc[c] += k_weighted_energy(an, c, an->block.ch[c] + k, piece);
+			an->sub_pos += piece;
+			k += piece;
+			if (an->sub_pos == an->sub_frames)
+				end_sub_block(an);
+		}
+
+		an->frames += n;
+		in += (size_t )n * an->channels;
+		frames -= n;
+	}
+}
+
+void wav_analyzer_result(struct wav_analyzer *an, struct wav_analysis *res)
+{
+	memset(res, 0, sizeof(*res));
+	res->channels = an->channels;
+	res->samples_per_sec = an->samples_per_sec;
+	res->frames = an->frames;
+	for (int c = 0; c < an->channels; c++) {
+		struct wav_channel_analysis * ch = &res->ch[c];
+		ch->peak = an->peak[c];
+		/* the interpolator can round a little under a full-scale sample */
+		ch->true_peak = an->true_peak[c] > an->peak[c] ? an->true_peak[c] : an->peak[c];
+		if (an->frames) {
+			ch->rms = sqrt(an->sum_squares[c] / an->frames);
+			ch->dc = an->sum[c] / an->frames;
+		}
+		if (ch->true_peak > res->true_peak)
+			res->true_peak = ch->true_peak;
+	}
+	res->max_momentary = lufs(an->max_momentary);
+	res->max_short_term = lufs(an->max_short_term);
+
+	/* blocks within the relative gate, to the nearest bin */
+	res->integrated = -HUGE_VAL;
+	if (an->gated_count) {
+		double sum = 0.0;
+		int64_t count = 0;
+		for (int b = hist_bin(lufs(an->gated_sum / an->gated_count) + RELATIVE_GATE); b < HIST_BINS; b++) {
+			sum += an->hist_sum[b];
+			count += an->hist_count[b];
+		}
+		if (count)
+			res->integrated = lufs(sum / count);
+	}
+}
+
+void wav_analyzer_close(struct wav_analyzer *an)
+{
+	wav_planar_free(&an->block);
+	wav_planar_free(&an->tp_in);
+	free(an->tp_out);
+	free(an->hist_sum);
+	free(an->hist_count);
+	free(an);
+}
+
+/* printing, where silence is -inf in text and null in JSON */
+
+static double db(double level)
+{
+	return level > 0.0 ? 20.0 * log10(level) : -HUGE_VAL;
+}
+
+static void text_value(FILE *f, int width, int decimals, double value)
+{
+	if (isinf(value) || isnan(value))
+		fprintf(f, "%*s", width, "-inf");
+	else
+		fprintf(f, "%*.*f", width, decimals, value);
+}
+
+static void json_value(FILE *f, const char * key, double value)
+{
+	if (isinf(value) || isnan(value))
+		fprintf(f, "\"%s\":null", key);
+	else
+		fprintf(f, "\"%s\":%.2f", key, value);
+}
+
+void wav_analysis_print(const struct wav_analysis *res, const char * name, FILE *f)
+{
+	fprintf(f, "%s: %" PRId64 " frames, %d channels at %d samples/sec\n",
+		name, res->frames, res->channels, res->samples_per_sec);
+	fprintf(f, "  channel  peak dBFS  true peak dBTP  RMS dBFS   DC offset\n");
+	for (int c = 0; c < res->channels; c++) {
+		fprintf(f, "  %7d  ", c);
+		text_value(f, 9, 2, db(res->ch[c].peak));
+		fprintf(f, "  ");
+		text_value(f, 14, 2, db(res->ch[c].true_peak));
+		fprintf(f, "  ");
+		text_value(f, 8, 2, db(res->ch[c].rms));
+		fprintf(f, "  %10.6f\n", res->ch[c].dc);
+	}
+	fprintf(f, "  integrated ");
+	text_value(f, 0, 1, res->integrated);
+	fprintf(f, " LUFS, short-term max ");
+	text_value(f, 0, 1, res->max_short_term);
+	fprintf(f, " LUFS, momentary max ");
+	text_value(f, 0, 1, res->max_momentary);
+	fprintf(f, " LUFS, true peak ");
+	text_value(f, 0, 2, db(res->true_peak));
+	fprintf(f, " dBTP\n");
+}
+
+void wav_analysis_json(const struct wav_analysis *res, const char * name, FILE *f)
+{
+	fprintf(f, "{\"file\":\"%s\",\"frames\":%" PRId64 ",\"channels\":%d,\"samples_per_sec\":%d,",
+		name, res->frames, res->channels, res->samples_per_sec);
+	json_value(f, "integrated_lufs", res->integrated);
+	fprintf(f, ",");
+	json_value(f, "max_short_term_lufs", res->max_short_term);
+	fprintf(f, ",");
+	json_value(f, "max_momentary_lufs", res->max_momentary);
+	fprintf(f, ",");
+	json_value(f, "true_peak_dbtp", db(res->true_peak));
+	fprintf(f, ",\"channel\":[");
+	for (int c = 0; c < res->channels; c++) {
+		fprintf(f, "%s{", c ? "," : "");
+		json_value(f, "peak_dbfs", db(res->ch[c].peak));
+		fprintf(f, ",");
+		json_value(f, "true_peak_dbtp", db(res->ch[c].true_peak));
+		fprintf(f, ",");
+		json_value(f, "rms_dbfs", db(res->ch[c].rms));
+		fprintf(f, ",\"dc\":%.6f}", res->ch[c].dc);
+	}
+	fprintf(f, "]}\n");
+}
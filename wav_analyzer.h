@@ -0,0 +1,71 @@
+#ifndef _wav_analyzer_h_
+# define _wav_analyzer_h_ 1
+
+/* levels and loudness of a stream, measured in one pass as it goes by
+ *
+ * Per channel: sample peak, RMS, DC offset (the mean) and true peak,
+ * which is the peak of the signal between the samples as well, found by
+ * 4x oversampling with a polyphase FIR as in ITU-R BS.1770 (2x at 88.2 and
+ * 96 kHz, none above).  Over all channels: integrated, short-term (3 s)
+ * and momentary (400 ms) loudness per EBU R128 / BS.1770: K-weighted mean
+ * square per 100 ms, 400 ms blocks every 100 ms, an absolute gate at -70
+ * LUFS and a relative gate 10 LU under the mean of what passes that.
+ * Surround channels count 1.41 and LFE nothing when there are 6 (5.1).
+ *
+ * Blocks are split into planar channels (wav_planar.h) so the peak, sum
+ * and FIR loops run on contiguous floats, built per SIMD level (wav_simd.h).
+ * Gating blocks go in a histogram of 0.01 LU bins, so memory does not grow
+ * with the length of the stream.
+ */
+
+#include <stdio.h>
+#include "wav_file_access.h"
+
+/* what wav_analyzer_result() reports, levels are linear full scale = 1 */
+struct wav_channel_analysis {
+	double	peak;
+	double	true_peak;
+	double	rms;
+	double	dc;
+};
+
+struct wav_analysis {
+	int	channels;
+	int	samples_per_sec;
+	int64_t	frames;
+	struct wav_channel_analysis ch[WAV_MAX_CHANNELS];
+	double	true_peak;		/* loudest channel */
+	double	integrated;		/* LUFS, -HUGE_VAL if all of it was gated out */
+	double	max_short_term;		/* LUFS, -HUGE_VAL if under 3 s */
+	double	max_momentary;		/* LUFS, -HUGE_VAL if under 400 ms */
+};
+
+/* opaque handle, see wav_analyzer.c */
+struct wav_analyzer;
+
+/*
+ * input:
+ *   channels - interleaved channels in every block
+ *   samples_per_sec - frame rate, for the filters and gating blocks
+ * output:
+ *   an_out - returns handle
+ * returns 0 if OK, non-0 otherwise
+ */
+int wav_analyzer_open(int channels, int samples_per_sec, struct wav_analyzer **an_out);
+
+/* measure frames interleaved normalized float frames, any number at a time */
+void wav_analyzer_add(struct wav_analyzer *an, const float *in, int frames);
+
+/* what has been measured so far, more can be added afterwards */
+void wav_analyzer_result(struct wav_analyzer *an, struct wav_analysis *res);
+
+/* forget everything added */
+void wav_analyzer_reset(struct wav_analyzer *an);
+
+void wav_analyzer_close(struct wav_analyzer *an);
+
+/* write res as lines of text, or as one JSON object on a line, labelled with name */
+void wav_analysis_print(const struct wav_analysis *res, const char * name, FILE *f);
+void wav_analysis_json(const struct wav_analysis *res, const char * name, FILE *f);
+
+#endif
@@ -0,0 +1,228 @@
+/* running an effect chain with disk I/O in the background, see
+ * wav_pipeline_run_async() in wav_effect.h
+ *
+ * The input is read in I/O blocks of WAV_AIO_BLOCK_FRAMES frames, each in
+ * its own slot with room for the block on disk and for what the chain
+ * makes of it.  A slot goes round
+ *	free -> reading -> read -> (chain runs) -> writing -> free
+ * and every free slot is given the next read straight away, so while the
+ * chain works on one block the reads of the next blocks and the writes of
+ * the last ones are in flight.  Blocks go through the chain in order, in
+ * pieces of the chain's max_frames, so the output is the same as from
+ * wav_pipeline_run().  When the chain can stay in s16 (see
+ * wav_pipeline_can_s16()) blocks skip the trip through float.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wav_effect.h"
+#include "wav_aio.h"
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_READING,
+	SLOT_READ,
+	SLOT_WRITING
+};
+
+struct async_slot {
+	enum slot_state	state;
+	int64_t		block;		/* which I/O block of the input */
+	int		frames;		/* input frames in in_raw */
+	void *		in_raw;		/* input block in the file's encoding */
+	void *		out_raw;	/* chain output in the output encoding */
+};
+
+struct async_run {
+	struct wav_pipeline *	pl;
+	struct wav_aio *	aio;
+	struct wav_writer *	wtr;
+	const struct wav_info *	in_info;
+	const struct wav_info *	out_info;
+	struct async_slot	slots[WAV_AIO_MAX_DEPTH];
+	int			depth;
+	float *			float_buf;	/* one I/O block of input as floats */
+	int			s16;		/* chain runs on the raw samples */
+};
+
+/* wait for one request and move its slot on. return OK if done, NOTOK otherwise */
+
+static int reap(struct async_run *run)
+{
+	int tag;
+
+	if (wav_aio_wait(run->aio, &tag) != OK)
+		return NOTOK;
+	run->slots[tag].state = run->slots[tag].state == SLOT_READING ? SLOT_READ : SLOT_FREE;
+	return OK;
+}
+
+/* queue the write of frames of chain output in slot s. return OK if done, NOTOK otherwise */
+
+static int write_slot(struct async_run *run, int s, int frames)
+{
+	int frame_bytes = run->out_info->channels * run->out_info->bits_per_sample / 8;
+	off_t offset;
+
+	if (wav_writer_claim(run->wtr, frames, &offset) != OK)
+		return NOTOK;
+	run->slots[s].state = SLOT_WRITING;
+	return wav_aio_write(run->aio, wav_writer_fd(run->wtr), run->slots[s].out_raw,
+			     (size_t )frames * frame_bytes, offset, s);
+}
+
+/* run the read block in slot s through the chain and queue the result.
+ * return OK if done, NOTOK otherwise */
+
+static int transform_slot(struct async_run *run, int s)
+{
+	struct async_slot * slot = &run->slots[s];
+	int channels = run->in_info->channels;
+	int out_frame_bytes = run->out_info->channels * run->out_info->bits_per_sample / 8;
+	int piece = run->pl->stage_count ? run->pl->stages[0]->in_fmt.max_frames : WAV_EFFECT_BLOCK_FRAMES;
+	int out_frames = 0;
+	struct wav_block blk;
+
+	if (run->s16) {
+		memcpy(slot->out_raw, slot->in_raw, (size_t )slot->frames * out_frame_bytes);
+		for (int done = 0; done < slot->frames; done += piece)
+			if (wav_pipeline_process_s16(run->pl, (int16_t * )slot->out_raw + (size_t )done * channels,
+						     slot->frames - done < piece ? slot->frames - done : piece) != OK)
+				return NOTOK;
+		return write_slot(run, s, slot->frames);
+	}
+	wav_decode_float(slot->in_raw, run->in_info->format, run->in_info->bits_per_sample,
+			 run->float_buf, (size_t )slot->frames * channels);
+	for (int done = 0; done < slot->frames; done += piece) {
+		blk.data = run->float_buf + (size_t )done * channels;
+		blk.frames = slot->frames - done < piece ? slot->frames - done : piece;
+		blk.channels = channels;
+		if (wav_pipeline_process(run->pl, &blk) != OK)
+			return NOTOK;
+		wav_encode_float(blk.data, run->out_info->format, run->out_info->bits_per_sample,
+				 (char * )slot->out_raw + (size_t )out_frames * out_frame_bytes,
+				 (size_t )blk.frames * blk.channels);
+		out_frames += blk.frames;
+	}
+	return write_slot(run, s, out_frames);
+}
+
+static int find_slot(struct async_run *run, enum slot_state state, int64_t block)
+{
+	for (int s = 0; s < run->depth; s++)
+		if (run->slots[s].state == state && (state == SLOT_FREE || run->slots[s].block == block))
+			return s;
+	return -1;
+}
+
+static int run_slots(struct async_run *run, struct wav_reader *rdr)
+{
+	int64_t next_read = 0, next_run = 0;
+	int eof = 0;
+	int s;
+
+	for (;;) {
+		/* every free slot starts reading a block ahead */
+		while (!eof && (s = find_slot(run, SLOT_FREE, 0)) >= 0) {
+			struct async_slot * slot = &run->slots[s];
+			int frame_bytes = run->in_info->channels * run->in_info->bits_per_sample / 8;
+			off_t offset;
+
+			if (wav_reader_claim(rdr, WAV_AIO_BLOCK_FRAMES, &offset, &slot->frames) != OK)
+				return NOTOK;
+			if (slot->frames == 0) {
+				eof = 1;
+				break;
+			}
+			slot->block = next_read++;
+			slot->state = SLOT_READING;
+			if (wav_aio_read(run->aio, wav_reader_fd(rdr), slot->in_raw,
+					 (size_t )slot->frames * frame_bytes, offset, s) != OK)
+				return NOTOK;
+		}
+
+		/* then the chain takes the oldest block once it is in,
+		 * or if every slot is still writing, waits for one */
+		if (next_run == next_read) {
+			if (eof)
+				break;
+			if (reap(run) != OK)
+				return NOTOK;
+			continue;
+		}
+		while ((s = find_slot(run, SLOT_READ, next_run)) < 0)
+			if (reap(run) != OK)
+				return NOTOK;
+		if (transform_slot(run, s) != OK)
+			return NOTOK;
+		next_run++;
+	}
+
+	/* drain whatever the stages are still holding */
+
+	for (;;) {
+		struct wav_block blk;
+
+		while ((s = find_slot(run, SLOT_FREE, 0)) < 0)
+			if (reap(run) != OK)
+				return NOTOK;
+		if (wav_pipeline_flush(run->pl, &blk) != OK)
+			return NOTOK;
+		if (blk.frames == 0)
+			break;
+		wav_encode_float(blk.data, run->out_info->format, run->out_info->bits_per_sample,
+				 run->slots[s].out_raw, (size_t )blk.frames * blk.channels);
+		if (write_slot(run, s, blk.frames) != OK)
+			return NOTOK;
+	}
+	while (wav_aio_pending(run->aio) > 0)
+		if (reap(run) != OK)
+			return NOTOK;
+	return OK;
+}
+
+int wav_pipeline_run_async(struct wav_pipeline *pl, struct wav_reader *rdr, const struct wav_info *in_info,
+			   struct wav_writer *wtr, const struct wav_info *out_info, int depth)
+{
+	struct async_run run = { 0 };
+	int piece = pl->stage_count ? pl->stages[0]->in_fmt.max_frames : WAV_EFFECT_BLOCK_FRAMES;
+	int max_out = pl->out_fmt.max_frames > piece ? pl->out_fmt.max_frames : piece;
+	size_t in_bytes = (size_t )WAV_AIO_BLOCK_FRAMES * in_info->channels * in_info->bits_per_sample / 8;
+	size_t out_bytes = (size_t )((WAV_AIO_BLOCK_FRAMES + piece - 1) / piece) * max_out *
+			   out_info->channels * out_info->bits_per_sample / 8;
+	int rc = OK;
+
+	if (wav_aio_open(depth, &run.aio) != OK)
+		return NOTOK;
+	printf("%s I/O with %d blocks of %d frames in flight\n",
+		wav_aio_backend(run.aio), depth, WAV_AIO_BLOCK_FRAMES);
+	run.pl = pl;
+	run.wtr = wtr;
+	run.in_info = in_info;
+	run.out_info = out_info;
+	run.depth = depth;
+	run.s16 = wav_pipeline_can_s16(pl, in_info, out_info);
+	run.float_buf = (float * )malloc(sizeof(float) * WAV_AIO_BLOCK_FRAMES * in_info->channels);
+	if (!run.float_buf)
+		rc = NOTOK;
+	for (int s = 0; s < depth && rc == OK; s++) {
+		run.slots[s].in_raw = malloc(in_bytes);
+		run.slots[s].out_raw = malloc(out_bytes);
+		if (!run.slots[s].in_raw || !run.slots[s].out_raw)
+			rc = NOTOK;
+	}
+	if (rc != OK)
+		printf("ERROR: could not allocate I/O blocks\n");
+	else
+		rc = run_slots(&run, rdr);
+
+	/* nothing is freed until the kernel is done with it */
+	wav_aio_close(run.aio);
+	for (int s = 0; s < depth; s++) {
+		free(run.slots[s].in_raw);
+		free(run.slots[s].out_raw);
+	}
+	free(run.float_buf);
+	return rc;
+}
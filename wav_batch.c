@@ -0,0 +1,332 @@
+/* batches of files on a pool of threads, see wav_batch.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "wav_file_access.h"
+#include "wav_batch.h"
+
+#define MAX_PATHNAME_LEN 1024
+#define MAX_MANIFEST_LINE (2 * MAX_PATHNAME_LEN + 16)
+
+/* one worker's share of the items, [head, tail) are still to do.  They are
+ * changed under lock with atomic stores, so take_item() can peek at other
+ * workers' counts without it */
+struct batch_queue {
+	pthread_mutex_t	lock;
+	int		head;
+	int		tail;
+};
+
+struct batch_run {
+	struct wav_batch *	batch;
+	int (*job)(struct wav_batch_worker *worker, struct wav_batch_item *item, void *job_arg);
+	void *			job_arg;
+	struct batch_queue *	queues;
+	struct wav_batch_worker *workers;
+	int			threads;
+	int			failed;		/* jobs that returned non-0 */
+};
+
+struct batch_thread {
+	struct batch_run *	run;
+	struct wav_batch_worker *worker;
+};
+
+int wav_batch_add(struct wav_batch *batch, const char * input, const char * output)
+{
+	struct wav_batch_item * items;
+	struct wav_batch_item * item;
+	struct stat st;
+
+	if (stat(input, &st) < 0) {
+		perror(input);
+		return NOTOK;
+	}
+	items = (struct wav_batch_item * )realloc(batch->items, sizeof(struct wav_batch_item) * (batch->item_count + 1));
+	if (!items) {
+		printf("ERROR: could not allocate batch\n");
+		return NOTOK;
+	}
+	batch->items = items;
+	item = &items[batch->item_count];
+	item->input = strdup(input);
+	item->output = strdup(output);
+	item->input_bytes = st.st_size;
+	if (!item->input || !item->output) {
+		free(item->input);
+		free(item->output);
+		printf("ERROR: could not allocate batch\n");
+		return NOTOK;
+	}
+	batch->item_count++;
+	return OK;
+}
+
+/* one "input output" pair per line. return OK if done, NOTOK otherwise */
+
+static int batch_load(struct wav_batch *batch, const char * manifest)
+{
+	char line[MAX_MANIFEST_LINE];
+	char input[MAX_MANIFEST_LINE], output[MAX_MANIFEST_LINE];
+	FILE * f = fopen(manifest, "r");
+	int line_number = 0;
+	int rc = OK;
+
+	if (!f) {
+		perror(manifest);
+		return NOTOK;
+	}
+	while (rc == OK && fgets(line, sizeof(line), f)) {
+		char * hash = strchr(line, '#');
+		char extra[2];
+
+		line_number++;
+		if (hash)
+			*hash = 0;
+		switch (sscanf(line, "%s %s %1s", input, output, extra)) {
+		case EOF:
+			break;
+		case 2:
+			rc = wav_batch_add(batch, input, output);
+			break;
+		default:
+			printf("ERROR: %s line %d is not input.wav output.wav\n", manifest, line_number);
+			rc = NOTOK;
+		}
+	}
+	fclose(f);
+	return rc;
+}
+
+static int wav_name_filter(const struct dirent *de)
+{
+	const char * dot = strrchr(de->d_name, '.');
+
+	return dot && !strcmp(dot, ".wav");
+}
+
+/* every .wav in input_dir, in name order. return OK if done, NOTOK otherwise */
+
+static int batch_scan(struct wav_batch *batch, const char * input_dir, const char * output_dir)
+{
+	char input[MAX_PATHNAME_LEN], output[MAX_PATHNAME_LEN];
+	struct dirent ** names;
+	int count;
+	int rc = OK;
+
+	count = scandir(input_dir, &names, wav_name_filter, alphasort);
+	if (count < 0) {
+		perror(input_dir);
+		return NOTOK;
+	}
+	for (int k = 0; k < count; k++) {
+		if (rc == OK) {
+			if (snprintf(input, sizeof(input), "%s/%s", input_dir, names[k]->d_name) >= sizeof(input) ||
+			    snprintf(output, sizeof(output), "%s/%s", output_dir, names[k]->d_name) >= sizeof(output)) {
+				printf("ERROR: pathname too long for %s\n", names[k]->d_name);
+				rc = NOTOK;
+			} else {
+				rc = wav_batch_add(batch, input, output);
+			}
+		}
+		free(names[k]);
+	}
+	free(names);
+	return rc;
+}
+
+int wav_batch_open(struct wav_batch *batch, const char * source, const char * output_dir)
+{
+	struct stat st;
+
+	if (stat(source, &st) < 0) {
+		perror(source);
+		return NOTOK;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		if (!output_dir) {
+			printf("ERROR: batch of directory %s needs an output directory\n", source);
+			return NOTOK;
+		}
+		return batch_scan(batch, source, output_dir);
+	}
+	if (output_dir) {
+		printf("ERROR: manifest %s names its own outputs\n", source);
+		return NOTOK;
+	}
+	return batch_load(batch, source);
+}
+
+void * wav_batch_buf(struct wav_batch_worker *worker, int slot, size_t bytes)
+{
+	void * buf;
+
+	if (bytes <= worker->buf_sizes[slot])
+		return worker->bufs[slot];
+	buf = realloc(worker->bufs[slot], bytes);
+	if (!buf) {
+		printf("ERROR: could not allocate %zu byte buffer\n", bytes);
+		return NULL;
+	}
+	worker->bufs[slot] = buf;
+	worker->buf_sizes[slot] = bytes;
+	return buf;
+}
+
+/* next item for worker self, from its own queue or stolen from the fullest one.
+ * returns -1 when there is nothing left anywhere */
+
+static int take_item(struct batch_run *run, int self)
+{
+	struct batch_queue * q = &run->queues[self];
+	int item = -1;
+	int victim = -1;
+	int most = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		item = q->head;
+		__atomic_store_n(&q->head, item + 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&q->lock);
+	if (item >= 0)
+		return item;
+
+	/* the count can change before we lock, the victim is only a good guess */
+	for (int k = 0; k < run->threads; k++) {
+		int left = __atomic_load_n(&run->queues[k].tail, __ATOMIC_RELAXED) -
+			   __atomic_load_n(&run->queues[k].head, __ATOMIC_RELAXED);
+		if (left > most) {
+			most = left;
+			victim = k;
+		}
+	}
+	if (victim < 0)
+		return -1;
+	q = &run->queues[victim];
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		item = q->tail - 1;
+		__atomic_store_n(&q->tail, item, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	/* lost the race, look again */
+	return item >= 0 ? item : take_item(run, self);
+}
+
+static void * batch_worker(void *arg)
+{
+	struct batch_thread * bt = (struct batch_thread * )arg;
+	struct batch_run * run = bt->run;
+	int item;
+
+	while ((item = take_item(run, bt->worker->id)) >= 0) {
+		if (run->job(bt->worker, &run->batch->items[item], run->job_arg) != OK) {
+			printf("ERROR: %s failed\n", run->batch->items[item].input);
+			__atomic_fetch_add(&run->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int wav_batch_run(struct wav_batch *batch, int threads,
+		  int (*job)(struct wav_batch_worker *worker, struct wav_batch_item *item, void *job_arg),
+		  void *job_arg)
+{
+	struct batch_run run = { 0 };
+	struct batch_thread * bts;
+	pthread_t * tids;
+	double start, secs;
+	double total_bytes = 0;
+	int started;
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > batch->item_count)
+		threads = batch->item_count > 0 ? batch->item_count : 1;
+	run.batch = batch;
+	run.job = job;
+	run.job_arg = job_arg;
+	run.threads = threads;
+	run.queues = (struct batch_queue * )calloc(threads, sizeof(struct batch_queue));
+	run.workers = (struct wav_batch_worker * )calloc(threads, sizeof(struct wav_batch_worker));
+	bts = (struct batch_thread * )calloc(threads, sizeof(struct batch_thread));
+	tids = (pthread_t * )calloc(threads, sizeof(pthread_t));
+	if (!run.queues || !run.workers || !bts || !tids) {
+		printf("ERROR: could not allocate thread pool\n");
+		free(run.queues);
+		free(run.workers);
+		free(bts);
+		free(tids);
+		return NOTOK;
+	}
+
+	/* even shares to start with, stealing evens out the rest */
+
+	for (int k = 0; k < threads; k++) {
+		pthread_mutex_init(&run.queues[k].lock, NULL);
+		run.queues[k].head = (int )((long )batch->item_count * k / threads);
+		run.queues[k].tail = (int )((long )batch->item_count * (k + 1) / threads);
+		run.workers[k].id = k;
+		bts[k].run = &run;
+		bts[k].worker = &run.workers[k];
+	}
+	start = now_secs();
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&tids[started], NULL, batch_worker, &bts[started])) {
+			printf("ERROR: could not start worker thread\n");
+			break;
+		}
+	}
+
+	/* if some threads did not start, their shares get stolen by the rest */
+
+	if (started == 0)
+		batch_worker(&bts[0]);
+	for (int k = 0; k < started; k++)
+		pthread_join(tids[k], NULL);
+	secs = now_secs() - start;
+
+	for (int k = 0; k < batch->item_count; k++)
+		total_bytes += batch->items[k].input_bytes;
+	printf("%d files (%d failed) on %d threads in %.3f secs, %.1f files/sec, %.1f MB/sec\n",
+		batch->item_count, run.failed, threads, secs,
+		secs > 0 ? batch->item_count / secs : 0.0,
+		secs > 0 ? total_bytes / secs / 1e6 : 0.0);
+
+	for (int k = 0; k < threads; k++) {
+		pthread_mutex_destroy(&run.queues[k].lock);
+		for (int b = 0; b < WAV_BATCH_BUFS; b++)
+			free(run.workers[k].bufs[b]);
+	}
+	free(run.queues);
+	free(run.workers);
+	free(bts);
+	free(tids);
+	return run.failed ? NOTOK : OK;
+}
+
+void wav_batch_free(struct wav_batch *batch)
+{
+	for (int k = 0; k < batch->item_count; k++) {
+		free(batch->items[k].input);
+		free(batch->items[k].output);
+	}
+	free(batch->items);
+	memset(batch, 0, sizeof(*batch));
+}
@@ -0,0 +1,75 @@
+#ifndef _wav_batch_h_
+# define _wav_batch_h_ 1
+
+/* running one job over many files on a fixed pool of threads, so a night's
+ * worth of files costs one process start instead of one per file.
+ *
+ * Files come from a manifest, one "input.wav output.wav" pair per line
+ * (blank lines and # comments ignored), or from every .wav file in a
+ * directory, written under the same name to an output directory.
+ *
+ * Each worker starts with an even share of the files and takes from the
+ * front of its own share; when that runs out it steals from the back of
+ * the fullest share, so a few long files do not leave threads idle.
+ * Workers keep their sample buffers from one file to the next.
+ */
+
+#include <sys/types.h>
+
+/* sample buffers each worker keeps */
+#define WAV_BATCH_BUFS 4
+
+struct wav_batch_item {
+	char *	input;
+	char *	output;
+	off_t	input_bytes;	/* size of input file, for throughput */
+};
+
+struct wav_batch {
+	struct wav_batch_item *	items;
+	int			item_count;
+};
+
+/* what a job gets besides the file names */
+struct wav_batch_worker {
+	int	id;				/* 0 to threads-1 */
+	void *	bufs[WAV_BATCH_BUFS];		/* see wav_batch_buf() */
+	size_t	buf_sizes[WAV_BATCH_BUFS];
+};
+
+/*
+ * input:
+ *   batch - zero-initialized
+ *   source - manifest file, or directory of .wav files
+ *   output_dir - where outputs go if source is a directory, must be NULL otherwise
+ * returns 0 if every item was added, non-0 otherwise
+ */
+int wav_batch_open(struct wav_batch *batch, const char * source, const char * output_dir);
+
+/* add one pair. returns 0 if OK */
+int wav_batch_add(struct wav_batch *batch, const char * input, const char * output);
+
+/*
+ * input:
+ *   worker - as passed to the job
+ *   slot - which of the worker's buffers, 0 to WAV_BATCH_BUFS-1
+ *   bytes - how big it must be
+ * returns the buffer, grown if needed and otherwise as the last file left it,
+ * or NULL if it could not be allocated
+ */
+void * wav_batch_buf(struct wav_batch_worker *worker, int slot, size_t bytes);
+
+/*
+ * run job on every item using threads workers, then print files/sec and MB/sec.
+ * A job returns 0 if its file was done; failures are counted and the rest
+ * of the batch carries on.
+ * returns 0 if every job succeeded, non-0 otherwise
+ */
+int wav_batch_run(struct wav_batch *batch, int threads,
+		  int (*job)(struct wav_batch_worker *worker, struct wav_batch_item *item, void *job_arg),
+		  void *job_arg);
+
+/* free the items */
+void wav_batch_free(struct wav_batch *batch);
+
+#endif
@@ -0,0 +1,369 @@
+/* time the library on a .wav file, see "make bench" */
+/* each benchmark runs in its own child process so its peak RSS is its own,
+ * and reports the best of several runs so that one slow run does not count.
+ * MB/s is bytes of sample data in the input file per second, whatever the
+ * benchmark does with them, so the numbers can be compared across benchmarks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "wav_file_access.h"
+#include "wav_effect.h"
+#include "wav_simd.h"
+
+#define MAX_PATHNAME_LEN 1024
+#define MAX_BENCH_NAME_LEN 256
+
+enum bench_format { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON };
+
+struct bench_ctx {
+	char *		input;		/* file being benchmarked */
+	char		output[MAX_PATHNAME_LEN];	/* scratch output next to it */
+	struct wav_info	info;
+};
+
+struct bench {
+	const char *	name;
+	int (*run)(struct bench_ctx *ctx, const char * spec, double *secs_out);
+};
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* whole file into memory as 16-bit samples */
+
+static int bench_read(struct bench_ctx *ctx, const char * spec, double *secs_out)
+{
+	wav_sample_t * samples;
+	int64_t sample_count;
+	struct wav_info info;
+	double start = now_secs();
+
+	if (wav_read(ctx->input, &samples, &sample_count, &info))
+		return NOTOK;
+	*secs_out = now_secs() - start;
+	free(samples);
+	return OK;
+}
+
+/* whole file out of memory as 16-bit samples */
+
+static int bench_write(struct bench_ctx *ctx, const char * spec, double *secs_out)
+{
+	wav_sample_t * samples;
+	int64_t sample_count;
+	struct wav_info info;
+	double start;
+	int rc;
+
+	if (wav_read(ctx->input, &samples, &sample_count, &info))
+		return NOTOK;
+	start = now_secs();
+	rc = wav_write(ctx->output, samples, sample_count, &info);
+	*secs_out = now_secs() - start;
+	free(samples);
+	return rc;
+}
+
+/* file to file a block at a time, as copy_wav_file does */
+
+static int bench_copy(struct bench_ctx *ctx, const char * spec, double *secs_out)
+{
+	struct wav_reader * rdr;
+	struct wav_writer * wtr;
+	struct wav_info info;
+	void * block_buf = malloc(sizeof(double) * WAV_BLOCK_FRAMES * ctx->info.channels);
+	double start = now_secs();
+	int frames;
+	int rc;
+
+	if (!block_buf)
+		return NOTOK;
+	rc = wav_reader_open(ctx->input, &rdr, &info);
+	if (rc == OK)
+		rc = wav_writer_open_format(ctx->output, &info, &wtr);
+	while (rc == OK) {
+		rc = wav_reader_read_raw(rdr, block_buf, WAV_BLOCK_FRAMES, &frames);
+		if (rc != OK || frames == 0)
+			break;
+		rc = wav_writer_write_raw(wtr, block_buf, frames);
+	}
+	if (rc == OK) {
+		wav_reader_close(rdr);
+		rc = wav_writer_close(wtr);
+	}
+	*secs_out = now_secs() - start;
+	free(block_buf);
+	return rc;
+}
+
+/* file to normalized floats a block at a time */
+
+static int bench_decode(struct bench_ctx *ctx, const char * spec, double *secs_out)
+{
+	struct wav_reader * rdr;
+	struct wav_info info;
+	float * block_buf = (float * )malloc(sizeof(float) * WAV_BLOCK_FRAMES * ctx->info.channels);
+	double start = now_secs();
+	int frames;
+	int rc;
+
+	if (!block_buf)
+		return NOTOK;
+	rc = wav_reader_open(ctx->input, &rdr, &info);
+	while (rc == OK) {
+		rc = wav_reader_read_float(rdr, block_buf, WAV_BLOCK_FRAMES, &frames);
+		if (rc != OK || frames == 0)
+			break;
+	}
+	if (rc == OK)
+		wav_reader_close(rdr);
+	*secs_out = now_secs() - start;
+	free(block_buf);
+	return rc;
+}
+
+/* one effect stage on floats already in memory, so only the stage is timed */
+
+static int bench_effect(struct bench_ctx *ctx, const char * spec, double *secs_out)
+{
+	struct wav_pipeline chain = { 0 };
+	struct wav_stream_fmt fmt;
+	struct wav_reader * rdr;
+	struct wav_info info;
+	struct wav_block blk;
+	int channels = ctx->info.channels;
+	float * samples = (float * )malloc(sizeof(float) * ctx->info.frame_count * channels);
+	float * block_buf = (float * )malloc(sizeof(float) * WAV_EFFECT_BLOCK_FRAMES * channels);
+	double start;
+	int64_t frames = 0;
+	int got;
+	int rc = NOTOK;
+
+	if (!samples || !block_buf || wav_reader_open(ctx->input, &rdr, &info))
+		return NOTOK;
+	do {
+		rc = wav_reader_read_float(rdr, &samples[frames * channels], WAV_BLOCK_FRAMES, &got);
+		frames += got;
+	} while (rc == OK && got > 0);
+	wav_reader_close(rdr);
+	fmt.channels = channels;
+	fmt.samples_per_sec = info.samples_per_sec;
+	fmt.max_frames = WAV_EFFECT_BLOCK_FRAMES;
+	if (rc || wav_pipeline_add(&chain, spec) || wav_pipeline_init(&chain, &fmt))
+		return NOTOK;
+
+	start = now_secs();
+	for (int64_t f = 0; rc == OK && f < frames; f += WAV_EFFECT_BLOCK_FRAMES) {
+		blk.frames = frames - f < WAV_EFFECT_BLOCK_FRAMES ? frames - f : WAV_EFFECT_BLOCK_FRAMES;
+		blk.channels = channels;
+		blk.data = block_buf;
+		memcpy(block_buf, &samples[(size_t )f * channels], sizeof(float) * blk.frames * channels);
+		rc = wav_pipeline_process(&chain, &blk);
+	}
+	while (rc == OK) {
+		rc = wav_pipeline_flush(&chain, &blk);
+		if (blk.frames == 0)
+			break;
+	}
+	*secs_out = now_secs() - start;
+	wav_pipeline_free(&chain);
+	free(samples);
+	free(block_buf);
+	return rc;
+}
+
+static const struct bench io_benches[] = {
+	{ "read", bench_read },
+	{ "write", bench_write },
+	{ "copy", bench_copy },
+	{ "decode", bench_decode },
+	{ NULL, NULL }
+};
+
+static const struct bench effect_bench = { "effect", bench_effect };
+
+/* run one benchmark repeats times in a child process.
+ * returns OK with best time and the child's peak RSS, NOTOK otherwise */
+
+static int run_child(struct bench_ctx *ctx, const struct bench *b, const char * spec, int repeats,
+		     double *best_out, long *peak_rss_kb_out)
+{
+	struct rusage ru;
+	int pipe_fds[2];
+	int status;
+	pid_t pid;
+	ssize_t got;
+
+	if (pipe(pipe_fds) < 0) {
+		perror("pipe");
+		return NOTOK;
+	}
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return NOTOK;
+	}
+	if (pid == 0) {
+		double best = 0.0;
+
+		/* keep stdout for results, anything the library says goes to stderr */
+		close(pipe_fds[0]);
+		dup2(2, 1);
+		for (int k = 0; k < repeats; k++) {
+			double secs;
+			if (b->run(ctx, spec, &secs) != OK)
+				_exit(NOTOK);
+			if (k == 0 || secs < best)
+				best = secs;
+		}
+		unlink(ctx->output);
+		if (write(pipe_fds[1], &best, sizeof(best)) != sizeof(best))
+			_exit(NOTOK);
+		_exit(OK);
+	}
+	close(pipe_fds[1]);
+	got = read(pipe_fds[0], best_out, sizeof(*best_out));
+	close(pipe_fds[0]);
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		return NOTOK;
+	}
+	if (got != sizeof(*best_out) || !WIFEXITED(status) || WEXITSTATUS(status) != OK) {
+		printf("ERROR: benchmark %s failed\n", spec ? spec : b->name);
+		return NOTOK;
+	}
+	*peak_rss_kb_out = ru.ru_maxrss;
+	return OK;
+}
+
+static void print_result(enum bench_format format, struct bench_ctx *ctx, const char * name,
+			 double secs, long peak_rss_kb)
+{
+	struct wav_info * info = &ctx->info;
+	double bytes = (double )info->frame_count * info->channels * info->bits_per_sample / 8;
+	double audio_secs = (double )info->frame_count / info->samples_per_sec;
+	double mb_per_sec = secs > 0 ? bytes / secs / 1e6 : 0.0;
+	double realtime = secs > 0 ? audio_secs / secs : 0.0;
+
+	switch (format) {
+	case FORMAT_TEXT:
+		printf("%-32s %10.1f MB/s %10.1fx realtime %8ld KB peak RSS\n", name, mb_per_sec, realtime, peak_rss_kb);
+		break;
+	case FORMAT_CSV:
+		printf("\"%s\",\"%s\",%.6f,%.3f,%.3f,%ld,%s\n", name, ctx->input, secs, mb_per_sec, realtime, peak_rss_kb,
+		       wav_simd_name(wav_simd_level()));
+		break;
+	case FORMAT_JSON:
+		printf("{\"bench\":\"%s\",\"file\":\"%s\",\"secs\":%.6f,\"mb_per_sec\":%.3f,"
+		       "\"realtime\":%.3f,\"peak_rss_kb\":%ld,\"simd\":\"%s\"}\n",
+		       name, ctx->input, secs, mb_per_sec, realtime, peak_rss_kb, wav_simd_name(wav_simd_level()));
+		break;
+	}
+}
+
+static void usage(const char * msg)
+{
+	printf("ERROR: %s\n", msg);
+	printf("usage: wav_bench [ -n repeats ] [ -f text|csv|json ] [ -x effect-spec ]... input.wav\n");
+	printf("times read, write, copy, decode and every effect with default parameters,\n");
+	printf("or just the -x effects if any are given\n");
+	printf("WAV_SIMD=c|sse2|ssse3|sse4.1|avx2|avx512 in the environment caps the kernels used\n");
+	exit(NOTOK);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_ctx ctx;
+	struct wav_reader * rdr;
+	enum bench_format format = FORMAT_TEXT;
+	const struct wav_effect_ops * ops;
+	char ** specs;
+	char name[MAX_BENCH_NAME_LEN];
+	int spec_count = 0;
+	int repeats = 3;
+	int failed = 0;
+	double secs;
+	long peak_rss_kb;
+	int opt;
+
+	specs = (char ** )calloc(argc, sizeof(char * ));
+	if (!specs)
+		usage("could not allocate option list");
+	while ((opt = getopt(argc, argv, "n:f:x:")) != -1) {
+		switch (opt) {
+		case 'n':
+			repeats = atoi(optarg);
+			if (repeats < 1)
+				usage("repeats must be at least 1");
+			break;
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				format = FORMAT_TEXT;
+			else if (!strcmp(optarg, "csv"))
+				format = FORMAT_CSV;
+			else if (!strcmp(optarg, "json"))
+				format = FORMAT_JSON;
+			else
+				usage("format must be text, csv or json");
+			break;
+		case 'x':
+			specs[spec_count++] = optarg;
+			break;
+		default:
+			usage("option parse error");
+		}
+	}
+	if (optind != argc - 1)
+		usage("input .wav filename must be supplied");
+	ctx.input = argv[optind];
+	if (snprintf(ctx.output, sizeof(ctx.output), "%s.bench.wav", ctx.input) >= sizeof(ctx.output))
+		usage("input pathname too long");
+	if (wav_reader_open(ctx.input, &rdr, &ctx.info))
+		exit(NOTOK);
+	wav_reader_close(rdr);
+
+	if (format == FORMAT_TEXT)
+		printf("%s: %" PRId64 " frames, %d channels, %s at %d samples/sec, best of %d, %s kernels\n",
+			ctx.input, ctx.info.frame_count, ctx.info.channels,
+			wav_encoding_name(ctx.info.format, ctx.info.bits_per_sample), ctx.info.samples_per_sec, repeats,
+			wav_simd_name(wav_simd_level()));
+	if (format == FORMAT_CSV)
+		printf("bench,file,secs,mb_per_sec,realtime,peak_rss_kb,simd\n");
+
+	for (int k = 0; !spec_count && io_benches[k].name; k++) {
+		if (run_child(&ctx, &io_benches[k], NULL, repeats, &secs, &peak_rss_kb) == OK)
+			print_result(format, &ctx, io_benches[k].name, secs, peak_rss_kb);
+		else
+			failed++;
+	}
+
+	/* every kind of stage with its defaults, unless particular ones were asked for */
+
+	if (!spec_count) {
+		for (int k = 0; (ops = wav_effect_kind(k)); k++)
+			specs[spec_count++] = (char * )ops->name;
+	}
+	for (int k = 0; k < spec_count; k++) {
+		snprintf(name, sizeof(name), "effect:%s", specs[k]);
+		if (run_child(&ctx, &effect_bench, specs[k], repeats, &secs, &peak_rss_kb) == OK)
+			print_result(format, &ctx, name, secs, peak_rss_kb);
+		else
+			failed++;
+	}
+	free(specs);
+	return failed ? NOTOK : OK;
+}
@@ -0,0 +1,994 @@
+/* convert between on-disk .wav sample encodings and normalized floats */
+/* integer kernels come in SSE2, AVX2 and AVX-512 versions (24-bit in SSSE3
+ * rather than SSE2, since it needs a byte shuffle; the saturating s16 mix
+ * also SSSE3, s16 decoding also SSE4.1), all built into every binary;
+ * pick_kernels() chooses among them at startup, see wav_simd.h.
+ * The f64 conversions are a plain loop built once per level instead.
+ * All kernels finish the last few samples with the scalar code, so the
+ * result does not depend on which path was taken.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include "wav_simd.h"
+#ifdef WAV_SIMD_X86
+#include <immintrin.h>
+#endif
+#include "wav_convert.h"
+
+#define S16_SCALE 32768.0f
+#define S24_SCALE 8388608.0f
+#define S32_SCALE 2147483648.0f
+/* largest float below 2^31, so conversion to int32 can not overflow */
+#define S32_MAX_FLOAT 2147483520.0f
+
+struct wav_encoding {
+	const char *	we_name;
+	int		we_format;
+	int		we_bits_per_sample;
+};
+
+static const struct wav_encoding encodings[] = {
+	{ "u8",  WAVE_FORMAT_PCM, 8 },
+	{ "s16", WAVE_FORMAT_PCM, 16 },
+	{ "s24", WAVE_FORMAT_PCM, 24 },
+	{ "s32", WAVE_FORMAT_PCM, 32 },
+	{ "f32", WAVE_FORMAT_IEEE_FLOAT, 32 },
+	{ "f64", WAVE_FORMAT_IEEE_FLOAT, 64 },
+	{ NULL, 0, 0 }
+};
+
+int wav_encoding_supported(int format, int bits_per_sample)
+{
+	return wav_encoding_name(format, bits_per_sample) != NULL;
+}
+
+int wav_parse_encoding(const char * name, int *format_out, int *bits_per_sample_out)
+{
+	for (const struct wav_encoding *we = encodings; we->we_name; we++) {
+		if (!strcmp(name, we->we_name)) {
+			*format_out = we->we_format;
+			*bits_per_sample_out = we->we_bits_per_sample;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+const char * wav_encoding_name(int format, int bits_per_sample)
+{
+	for (const struct wav_encoding *we = encodings; we->we_name; we++)
+		if (we->we_format == format && we->we_bits_per_sample == bits_per_sample)
+			return we->we_name;
+	return NULL;
+}
+
+/* scale, saturate and round one float to an integer in [lo, hi] */
+
+static inline int32_t quantize(float x, float scale, float lo, float hi)
+{
+	x *= scale;
+	x = x < lo ? lo : x;
+	x = x > hi ? hi : x;
+	return (int32_t )lrintf(x);
+}
+
+/* decoders */
+
+static void u8_to_float_c(const uint8_t *in, float *out, size_t count)
+{
+	/* 8-bit .wav samples are unsigned with 128 as silence */
+	for (size_t k = 0; k < count; k++)
+		out[k] = ((int )in[k] - 128) * (1.0f / 128.0f);
+}
+
+#ifdef WAV_SIMD_X86
+static void u8_to_float_sse2(const uint8_t *in, float *out, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / 128.0f);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i silence = _mm_set1_epi16(128);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i * )&in[k]);
+		/* widen to 16 bits, center, then sign-extend to 32 as for s16 */
+		__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(b, zero), silence);
+		__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(b, zero), silence);
+		__m128i s0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16);
+		__m128i s1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16);
+		__m128i s2 = _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16);
+		__m128i s3 = _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16);
+		_mm_storeu_ps(&out[k], _mm_mul_ps(_mm_cvtepi32_ps(s0), scale));
+		_mm_storeu_ps(&out[k+4], _mm_mul_ps(_mm_cvtepi32_ps(s1), scale));
+		_mm_storeu_ps(&out[k+8], _mm_mul_ps(_mm_cvtepi32_ps(s2), scale));
+		_mm_storeu_ps(&out[k+12], _mm_mul_ps(_mm_cvtepi32_ps(s3), scale));
+	}
+	u8_to_float_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX2
+static void u8_to_float_avx2(const uint8_t *in, float *out, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / 128.0f);
+	const __m256i silence = _mm256_set1_epi32(128);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i * )&in[k]);
+		__m256i lo = _mm256_sub_epi32(_mm256_cvtepu8_epi32(b), silence);
+		__m256i hi = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(b, 8)), silence);
+		_mm256_storeu_ps(&out[k], _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+		_mm256_storeu_ps(&out[k+8], _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+	}
+	u8_to_float_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX512
+static void u8_to_float_avx512(const uint8_t *in, float *out, size_t count)
+{
+	const __m512 scale = _mm512_set1_ps(1.0f / 128.0f);
+	const __m512i silence = _mm512_set1_epi32(128);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i * )&in[k]);
+		__m512i s = _mm512_sub_epi32(_mm512_cvtepu8_epi32(b), silence);
+		_mm512_storeu_ps(&out[k], _mm512_mul_ps(_mm512_cvtepi32_ps(s), scale));
+	}
+	u8_to_float_c(in + k, out + k, count - k);
+}
+#endif
+
+static void (*u8_to_float_fn)(const uint8_t *in, float *out, size_t count) = u8_to_float_c;
+
+void wav_u8_to_float(const uint8_t *in, float *out, size_t count)
+{
+	u8_to_float_fn(in, out, count);
+}
+
+static void s16_to_float_c(const int16_t *in, float *out, size_t count)
+{
+	for (size_t k = 0; k < count; k++)
+		out[k] = in[k] * (1.0f / S16_SCALE);
+}
+
+#ifdef WAV_SIMD_X86
+static void s16_to_float_sse2(const int16_t *in, float *out, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / S16_SCALE);
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8) {
+		__m128i s = _mm_loadu_si128((const __m128i * )&in[k]);
+		/* sign-extend by unpacking into the high half and shifting back down */
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+		_mm_storeu_ps(&out[k], _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(&out[k+4], _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+	s16_to_float_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_SSE41
+static void s16_to_float_sse41(const int16_t *in, float *out, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / S16_SCALE);
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8) {
+		__m128i s = _mm_loadu_si128((const __m128i * )&in[k]);
+		__m128i lo = _mm_cvtepi16_epi32(s);
+		__m128i hi = _mm_cvtepi16_epi32(_mm_srli_si128(s, 8));
+		_mm_storeu_ps(&out[k], _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(&out[k+4], _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+	s16_to_float_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX2
+static void s16_to_float_avx2(const int16_t *in, float *out, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / S16_SCALE);
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8) {
+		__m128i s = _mm_loadu_si128((const __m128i * )&in[k]);
+		__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(s));
+		_mm256_storeu_ps(&out[k], _mm256_mul_ps(f, scale));
+	}
+	s16_to_float_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX512
+static void s16_to_float_avx512(const int16_t *in, float *out, size_t count)
+{
+	const __m512 scale = _mm512_set1_ps(1.0f / S16_SCALE);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m256i s = _mm256_loadu_si256((const __m256i * )&in[k]);
+		__m512 f = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(s));
+		_mm512_storeu_ps(&out[k], _mm512_mul_ps(f, scale));
+	}
+	s16_to_float_c(in + k, out + k, count - k);
+}
+#endif
+
+static void (*s16_to_float_fn)(const int16_t *in, float *out, size_t count) = s16_to_float_c;
+
+void wav_s16_to_float(const int16_t *in, float *out, size_t count)
+{
+	s16_to_float_fn(in, out, count);
+}
+
+static void s24_to_float_c(const uint8_t *in, float *out, size_t count)
+{
+	for (size_t k = 0; k < count; k++, in += 3) {
+		/* assemble in the top 24 bits so the shift sign-extends */
+		int32_t v = (int32_t )(((uint32_t )in[0] << 8) | ((uint32_t )in[1] << 16) | ((uint32_t )in[2] << 24));
+		out[k] = (v >> 8) * (1.0f / S24_SCALE);
+	}
+}
+
+#ifdef WAV_SIMD_X86
+/* the vector versions do the same with a byte shuffle: each 3-byte sample
+ * goes into the top of a 32-bit lane, 4 samples per 128 bits */
+
+WAV_TARGET_SSSE3
+static void s24_to_float_ssse3(const uint8_t *in, float *out, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / S24_SCALE);
+	const __m128i spread = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16, in += 48) {
+		__m128i x0 = _mm_loadu_si128((const __m128i * )in);
+		__m128i x1 = _mm_loadu_si128((const __m128i * )(in + 16));
+		__m128i x2 = _mm_loadu_si128((const __m128i * )(in + 32));
+		/* 12 bytes of samples at a time, starting at bytes 0, 12, 24 and 36 */
+		__m128i s[4] = { x0, _mm_alignr_epi8(x1, x0, 12), _mm_alignr_epi8(x2, x1, 8), _mm_srli_si128(x2, 4) };
+
+		for (int j = 0; j < 4; j++) {
+			__m128i v = _mm_srai_epi32(_mm_shuffle_epi8(s[j], spread), 8);
+			_mm_storeu_ps(&out[k + 4 * j], _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+		}
+	}
+	s24_to_float_c(in, out + k, count - k);
+}
+
+WAV_TARGET_AVX2
+static void s24_to_float_avx2(const uint8_t *in, float *out, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / S24_SCALE);
+	const __m256i spread = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+						-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	/* 32-bit words holding bytes 0-15 and 12-27 of a 32-byte run */
+	const __m256i lanes_lo = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+	/* bytes 24-39 and 36-51 of a 48-byte run, from words 4 on */
+	const __m256i lanes_hi = _mm256_setr_epi32(2, 3, 4, 5, 5, 6, 7, 7);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16, in += 48) {
+		__m256i a = _mm256_loadu_si256((const __m256i * )in);
+		__m256i b = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i * )(in + 32)));
+		__m256i v0 = _mm256_permutevar8x32_epi32(a, lanes_lo);
+		__m256i v1 = _mm256_permutevar8x32_epi32(_mm256_permute2x128_si256(a, b, 0x21), lanes_hi);
+
+		v0 = _mm256_srai_epi32(_mm256_shuffle_epi8(v0, spread), 8);
+		v1 = _mm256_srai_epi32(_mm256_shuffle_epi8(v1, spread), 8);
+		_mm256_storeu_ps(&out[k], _mm256_mul_ps(_mm256_cvtepi32_ps(v0), scale));
+		_mm256_storeu_ps(&out[k+8], _mm256_mul_ps(_mm256_cvtepi32_ps(v1), scale));
+	}
+	s24_to_float_c(in, out + k, count - k);
+}
+
+WAV_TARGET_AVX512
+static void s24_to_float_avx512(const uint8_t *in, float *out, size_t count)
+{
+	const __m512 scale = _mm512_set1_ps(1.0f / S24_SCALE);
+	const __m512i spread = _mm512_broadcast_i32x4(_mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+								    -1, 6, 7, 8, -1, 9, 10, 11));
+	const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6, 6, 7, 8, 9, 9, 10, 11, 11);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16, in += 48) {
+		/* masked so it reads the 48 bytes and nothing past them */
+		__m512i x = _mm512_maskz_loadu_epi8(0xFFFFFFFFFFFFULL, in);
+		__m512i v = _mm512_shuffle_epi8(_mm512_permutexvar_epi32(lanes, x), spread);
+
+		v = _mm512_srai_epi32(v, 8);
+		_mm512_storeu_ps(&out[k], _mm512_mul_ps(_mm512_cvtepi32_ps(v), scale));
+	}
+	s24_to_float_c(in, out + k, count - k);
+}
+#endif
+
+static void (*s24_to_float_fn)(const uint8_t *in, float *out, size_t count) = s24_to_float_c;
+
+void wav_s24_to_float(const uint8_t *in, float *out, size_t count)
+{
+	s24_to_float_fn(in, out, count);
+}
+
+static void s32_to_float_c(const int32_t *in, float *out, size_t count)
+{
+	for (size_t k = 0; k < count; k++)
+		out[k] = (float )in[k] * (1.0f / S32_SCALE);
+}
+
+#ifdef WAV_SIMD_X86
+static void s32_to_float_sse2(const int32_t *in, float *out, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / S32_SCALE);
+	size_t k = 0;
+
+	for (; k + 4 <= count; k += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i * )&in[k]);
+		_mm_storeu_ps(&out[k], _mm_mul_ps(_mm_cvtepi32_ps(s), scale));
+	}
+	s32_to_float_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX2
+static void s32_to_float_avx2(const int32_t *in, float *out, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / S32_SCALE);
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i * )&in[k]);
+		_mm256_storeu_ps(&out[k], _mm256_mul_ps(_mm256_cvtepi32_ps(s), scale));
+	}
+	s32_to_float_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX512
+static void s32_to_float_avx512(const int32_t *in, float *out, size_t count)
+{
+	const __m512 scale = _mm512_set1_ps(1.0f / S32_SCALE);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m512i s = _mm512_loadu_si512((const void * )&in[k]);
+		_mm512_storeu_ps(&out[k], _mm512_mul_ps(_mm512_cvtepi32_ps(s), scale));
+	}
+	s32_to_float_c(in + k, out + k, count - k);
+}
+#endif
+
+static void (*s32_to_float_fn)(const int32_t *in, float *out, size_t count) = s32_to_float_c;
+
+void wav_s32_to_float(const int32_t *in, float *out, size_t count)
+{
+	s32_to_float_fn(in, out, count);
+}
+
+/* f64 is a plain loop, built again for each SIMD level so that the
+ * compiler's vectorized narrowing uses the widest registers there are */
+
+static inline __attribute__((always_inline))
+void f64_to_float_body(const double *in, float *out, size_t count)
+{
+	for (size_t k = 0; k < count; k++)
+		out[k] = (float )in[k];
+}
+
+static void f64_to_float_c(const double *in, float *out, size_t count)
+{
+	f64_to_float_body(in, out, count);
+}
+
+#ifdef WAV_SIMD_X86
+WAV_TARGET_AVX2
+static void f64_to_float_avx2(const double *in, float *out, size_t count)
+{
+	f64_to_float_body(in, out, count);
+}
+
+WAV_TARGET_AVX512
+static void f64_to_float_avx512(const double *in, float *out, size_t count)
+{
+	f64_to_float_body(in, out, count);
+}
+#endif
+
+static void (*f64_to_float_fn)(const double *in, float *out, size_t count) = f64_to_float_c;
+
+void wav_f64_to_float(const double *in, float *out, size_t count)
+{
+	f64_to_float_fn(in, out, count);
+}
+
+/* encoders */
+
+static void float_to_u8_c(const float *in, uint8_t *out, size_t count)
+{
+	for (size_t k = 0; k < count; k++)
+		out[k] = (uint8_t )(quantize(in[k], 128.0f, -128.0f, 127.0f) + 128);
+}
+
+#ifdef WAV_SIMD_X86
+static void float_to_u8_sse2(const float *in, uint8_t *out, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(128.0f);
+	const __m128 top = _mm_set1_ps(127.0f);
+	const __m128 bottom = _mm_set1_ps(-128.0f);
+	const __m128i silence = _mm_set1_epi16(128);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m128i s[4];
+
+		for (int j = 0; j < 4; j++) {
+			__m128 f = _mm_mul_ps(_mm_loadu_ps(&in[k + 4 * j]), scale);
+			s[j] = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(f, top), bottom));
+		}
+		/* already in range, so the packs only narrow */
+		__m128i lo = _mm_add_epi16(_mm_packs_epi32(s[0], s[1]), silence);
+		__m128i hi = _mm_add_epi16(_mm_packs_epi32(s[2], s[3]), silence);
+		_mm_storeu_si128((__m128i * )&out[k], _mm_packus_epi16(lo, hi));
+	}
+	float_to_u8_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX2
+static void float_to_u8_avx2(const float *in, uint8_t *out, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(128.0f);
+	const __m256 top = _mm256_set1_ps(127.0f);
+	const __m256 bottom = _mm256_set1_ps(-128.0f);
+	const __m256i silence = _mm256_set1_epi16(128);
+	/* the packs work within 128-bit lanes, this puts the words back in order */
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	size_t k = 0;
+
+	for (; k + 32 <= count; k += 32) {
+		__m256i s[4];
+
+		for (int j = 0; j < 4; j++) {
+			__m256 f = _mm256_mul_ps(_mm256_loadu_ps(&in[k + 8 * j]), scale);
+			s[j] = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(f, top), bottom));
+		}
+		__m256i lo = _mm256_add_epi16(_mm256_packs_epi32(s[0], s[1]), silence);
+		__m256i hi = _mm256_add_epi16(_mm256_packs_epi32(s[2], s[3]), silence);
+		__m256i b = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), order);
+		_mm256_storeu_si256((__m256i * )&out[k], b);
+	}
+	float_to_u8_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX512
+static void float_to_u8_avx512(const float *in, uint8_t *out, size_t count)
+{
+	const __m512 scale = _mm512_set1_ps(128.0f);
+	const __m512 top = _mm512_set1_ps(127.0f);
+	const __m512 bottom = _mm512_set1_ps(-128.0f);
+	const __m512i silence = _mm512_set1_epi32(128);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m512 f = _mm512_mul_ps(_mm512_loadu_ps(&in[k]), scale);
+		__m512i s = _mm512_cvtps_epi32(_mm512_max_ps(_mm512_min_ps(f, top), bottom));
+		/* vpmovdb truncates, the values are already 0 to 255 */
+		_mm_storeu_si128((__m128i * )&out[k], _mm512_cvtepi32_epi8(_mm512_add_epi32(s, silence)));
+	}
+	float_to_u8_c(in + k, out + k, count - k);
+}
+#endif
+
+static void (*float_to_u8_fn)(const float *in, uint8_t *out, size_t count) = float_to_u8_c;
+
+void wav_float_to_u8(const float *in, uint8_t *out, size_t count)
+{
+	float_to_u8_fn(in, out, count);
+}
+
+static void float_to_s16_c(const float *in, int16_t *out, size_t count)
+{
+	for (size_t k = 0; k < count; k++)
+		out[k] = (int16_t )quantize(in[k], S16_SCALE, -S16_SCALE, S16_SCALE - 1.0f);
+}
+
+#ifdef WAV_SIMD_X86
+static void float_to_s16_sse2(const float *in, int16_t *out, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(S16_SCALE);
+	const __m128 top = _mm_set1_ps(S16_SCALE);
+	const __m128 bottom = _mm_set1_ps(-S16_SCALE);
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8) {
+		/* clamp first, cvtps returns INT_MIN for anything out of int32 range */
+		__m128 f_lo = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(&in[k]), scale), top), bottom);
+		__m128 f_hi = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(&in[k+4]), scale), top), bottom);
+		__m128i lo = _mm_cvtps_epi32(f_lo);
+		__m128i hi = _mm_cvtps_epi32(f_hi);
+		/* packs saturates to [-32768, 32767] */
+		_mm_storeu_si128((__m128i * )&out[k], _mm_packs_epi32(lo, hi));
+	}
+	float_to_s16_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX2
+static void float_to_s16_avx2(const float *in, int16_t *out, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(S16_SCALE);
+	const __m256 top = _mm256_set1_ps(S16_SCALE);
+	const __m256 bottom = _mm256_set1_ps(-S16_SCALE);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m256 f_lo = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(&in[k]), scale), top), bottom);
+		__m256 f_hi = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(&in[k+8]), scale), top), bottom);
+		__m256i lo = _mm256_cvtps_epi32(f_lo);
+		__m256i hi = _mm256_cvtps_epi32(f_hi);
+		/* packs works within 128-bit lanes, put the quadwords back in order */
+		__m256i s = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+		_mm256_storeu_si256((__m256i * )&out[k], s);
+	}
+	float_to_s16_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX512
+static void float_to_s16_avx512(const float *in, int16_t *out, size_t count)
+{
+	const __m512 scale = _mm512_set1_ps(S16_SCALE);
+	const __m512 top = _mm512_set1_ps(S16_SCALE);
+	const __m512 bottom = _mm512_set1_ps(-S16_SCALE);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m512 f = _mm512_max_ps(_mm512_min_ps(_mm512_mul_ps(_mm512_loadu_ps(&in[k]), scale), top), bottom);
+		/* vpmovsdw saturates on the way down and keeps the order */
+		_mm256_storeu_si256((__m256i * )&out[k], _mm512_cvtsepi32_epi16(_mm512_cvtps_epi32(f)));
+	}
+	float_to_s16_c(in + k, out + k, count - k);
+}
+#endif
+
+static void (*float_to_s16_fn)(const float *in, int16_t *out, size_t count) = float_to_s16_c;
+
+void wav_float_to_s16(const float *in, int16_t *out, size_t count)
+{
+	float_to_s16_fn(in, out, count);
+}
+
+/* saturating Q15 arithmetic, the scalar form of pmulhrsw then paddsw */
+
+static inline int16_t scale_add_sat(int16_t sample, int16_t gain_q15, int16_t add)
+{
+	int32_t v = (((int32_t )sample * gain_q15 + 0x4000) >> 15) + add;
+
+	return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+static void s16_scale_add_sat_c(int16_t *data, int16_t gain_q15, const int16_t *add, size_t count)
+{
+	for (size_t k = 0; k < count; k++)
+		data[k] = scale_add_sat(data[k], gain_q15, add[k]);
+}
+
+#ifdef WAV_SIMD_X86
+static void s16_scale_add_sat_sse2(int16_t *data, int16_t gain_q15, const int16_t *add, size_t count)
+{
+	const __m128i gain = _mm_set1_epi16(gain_q15);
+	const __m128i round = _mm_set1_epi32(0x4000);
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8) {
+		__m128i d = _mm_loadu_si128((const __m128i * )&data[k]);
+		__m128i a = _mm_loadu_si128((const __m128i * )&add[k]);
+		/* no pmulhrsw before SSSE3, build the 32-bit products from both halves */
+		__m128i lo = _mm_mullo_epi16(d, gain);
+		__m128i hi = _mm_mulhi_epi16(d, gain);
+		__m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 15);
+		__m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 15);
+		_mm_storeu_si128((__m128i * )&data[k], _mm_adds_epi16(_mm_packs_epi32(p0, p1), a));
+	}
+	s16_scale_add_sat_c(data + k, gain_q15, add + k, count - k);
+}
+
+WAV_TARGET_SSSE3
+static void s16_scale_add_sat_ssse3(int16_t *data, int16_t gain_q15, const int16_t *add, size_t count)
+{
+	const __m128i gain = _mm_set1_epi16(gain_q15);
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8) {
+		__m128i d = _mm_loadu_si128((const __m128i * )&data[k]);
+		__m128i a = _mm_loadu_si128((const __m128i * )&add[k]);
+		_mm_storeu_si128((__m128i * )&data[k], _mm_adds_epi16(_mm_mulhrs_epi16(d, gain), a));
+	}
+	s16_scale_add_sat_c(data + k, gain_q15, add + k, count - k);
+}
+
+WAV_TARGET_AVX2
+static void s16_scale_add_sat_avx2(int16_t *data, int16_t gain_q15, const int16_t *add, size_t count)
+{
+	const __m256i gain = _mm256_set1_epi16(gain_q15);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m256i d = _mm256_loadu_si256((const __m256i * )&data[k]);
+		__m256i a = _mm256_loadu_si256((const __m256i * )&add[k]);
+		_mm256_storeu_si256((__m256i * )&data[k], _mm256_adds_epi16(_mm256_mulhrs_epi16(d, gain), a));
+	}
+	s16_scale_add_sat_c(data + k, gain_q15, add + k, count - k);
+}
+
+WAV_TARGET_AVX512
+static void s16_scale_add_sat_avx512(int16_t *data, int16_t gain_q15, const int16_t *add, size_t count)
+{
+	const __m512i gain = _mm512_set1_epi16(gain_q15);
+	size_t k = 0;
+
+	for (; k + 32 <= count; k += 32) {
+		__m512i d = _mm512_loadu_si512((const void * )&data[k]);
+		__m512i a = _mm512_loadu_si512((const void * )&add[k]);
+		_mm512_storeu_si512((void * )&data[k], _mm512_adds_epi16(_mm512_mulhrs_epi16(d, gain), a));
+	}
+	s16_scale_add_sat_c(data + k, gain_q15, add + k, count - k);
+}
+#endif
+
+static void (*s16_scale_add_sat_fn)(int16_t *data, int16_t gain_q15, const int16_t *add, size_t count) = s16_scale_add_sat_c;
+
+void wav_s16_scale_add_sat(int16_t *data, int16_t gain_q15, const int16_t *add, size_t count)
+{
+	s16_scale_add_sat_fn(data, gain_q15, add, count);
+}
+
+static inline int16_t add_sat(int16_t a, int16_t b)
+{
+	int32_t v = (int32_t )a + b;
+
+	return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+static void s16_add_sat_c(int16_t *acc, const int16_t *add, size_t count)
+{
+	for (size_t k = 0; k < count; k++)
+		acc[k] = add_sat(acc[k], add[k]);
+}
+
+#ifdef WAV_SIMD_X86
+static void s16_add_sat_sse2(int16_t *acc, const int16_t *add, size_t count)
+{
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8) {
+		__m128i d = _mm_loadu_si128((const __m128i * )&acc[k]);
+		__m128i a = _mm_loadu_si128((const __m128i * )&add[k]);
+		_mm_storeu_si128((__m128i * )&acc[k], _mm_adds_epi16(d, a));
+	}
+	s16_add_sat_c(acc + k, add + k, count - k);
+}
+
+WAV_TARGET_AVX2
+static void s16_add_sat_avx2(int16_t *acc, const int16_t *add, size_t count)
+{
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m256i d = _mm256_loadu_si256((const __m256i * )&acc[k]);
+		__m256i a = _mm256_loadu_si256((const __m256i * )&add[k]);
+		_mm256_storeu_si256((__m256i * )&acc[k], _mm256_adds_epi16(d, a));
+	}
+	s16_add_sat_c(acc + k, add + k, count - k);
+}
+
+WAV_TARGET_AVX512
+static void s16_add_sat_avx512(int16_t *acc, const int16_t *add, size_t count)
+{
+	size_t k = 0;
+
+	for (; k + 32 <= count; k += 32) {
+		__m512i d = _mm512_loadu_si512((const void * )&acc[k]);
+		__m512i a = _mm512_loadu_si512((const void * )&add[k]);
+		_mm512_storeu_si512((void * )&acc[k], _mm512_adds_epi16(d, a));
+	}
+	s16_add_sat_c(acc + k, add + k, count - k);
+}
+#endif
+
+static void (*s16_add_sat_fn)(int16_t *acc, const int16_t *add, size_t count) = s16_add_sat_c;
+
+void wav_s16_add_sat(int16_t *acc, const int16_t *add, size_t count)
+{
+	s16_add_sat_fn(acc, add, count);
+}
+
+static void float_to_s24_c(const float *in, uint8_t *out, size_t count)
+{
+	for (size_t k = 0; k < count; k++, out += 3) {
+		int32_t v = quantize(in[k], S24_SCALE, -S24_SCALE, S24_SCALE - 1.0f);
+		out[0] = (uint8_t )v;
+		out[1] = (uint8_t )(v >> 8);
+		out[2] = (uint8_t )(v >> 16);
+	}
+}
+
+#ifdef WAV_SIMD_X86
+/* the vector versions quantize 4 samples per 128 bits and shuffle the low
+ * 3 bytes of each lane together */
+
+WAV_TARGET_SSSE3
+static void float_to_s24_ssse3(const float *in, uint8_t *out, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(S24_SCALE);
+	const __m128 top = _mm_set1_ps(S24_SCALE - 1.0f);
+	const __m128 bottom = _mm_set1_ps(-S24_SCALE);
+	const __m128i gather = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16, out += 48) {
+		__m128i p[4];
+
+		for (int j = 0; j < 4; j++) {
+			__m128 f = _mm_mul_ps(_mm_loadu_ps(&in[k + 4 * j]), scale);
+			f = _mm_max_ps(_mm_min_ps(f, top), bottom);
+			p[j] = _mm_shuffle_epi8(_mm_cvtps_epi32(f), gather);
+		}
+		/* 4 runs of 12 bytes into 3 of 16 */
+		_mm_storeu_si128((__m128i * )out, _mm_or_si128(p[0], _mm_slli_si128(p[1], 12)));
+		_mm_storeu_si128((__m128i * )(out + 16), _mm_or_si128(_mm_srli_si128(p[1], 4), _mm_slli_si128(p[2], 8)));
+		_mm_storeu_si128((__m128i * )(out + 32), _mm_or_si128(_mm_srli_si128(p[2], 8), _mm_slli_si128(p[3], 4)));
+	}
+	float_to_s24_c(in + k, out, count - k);
+}
+
+WAV_TARGET_AVX2
+static void float_to_s24_avx2(const float *in, uint8_t *out, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(S24_SCALE);
+	const __m256 top = _mm256_set1_ps(S24_SCALE - 1.0f);
+	const __m256 bottom = _mm256_set1_ps(-S24_SCALE);
+	const __m256i gather = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+						0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	/* the 12 bytes at the bottom of each 128-bit lane, side by side */
+	const __m256i squeeze = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	const __m256i six_words = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8, out += 24) {
+		__m256 f = _mm256_mul_ps(_mm256_loadu_ps(&in[k]), scale);
+		__m256i v;
+
+		f = _mm256_max_ps(_mm256_min_ps(f, top), bottom);
+		v = _mm256_shuffle_epi8(_mm256_cvtps_epi32(f), gather);
+		_mm256_maskstore_epi32((int * )out, six_words, _mm256_permutevar8x32_epi32(v, squeeze));
+	}
+	float_to_s24_c(in + k, out, count - k);
+}
+
+WAV_TARGET_AVX512
+static void float_to_s24_avx512(const float *in, uint8_t *out, size_t count)
+{
+	const __m512 scale = _mm512_set1_ps(S24_SCALE);
+	const __m512 top = _mm512_set1_ps(S24_SCALE - 1.0f);
+	const __m512 bottom = _mm512_set1_ps(-S24_SCALE);
+	const __m512i gather = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+								    10, 12, 13, 14, -1, -1, -1, -1));
+	const __m512i squeeze = _mm512_setr_epi32(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 15, 15, 15, 15);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16, out += 48) {
+		__m512 f = _mm512_mul_ps(_mm512_loadu_ps(&in[k]), scale);
+		__m512i v;
+
+		f = _mm512_max_ps(_mm512_min_ps(f, top), bottom);
+		v = _mm512_shuffle_epi8(_mm512_cvtps_epi32(f), gather);
+		_mm512_mask_storeu_epi8(out, 0xFFFFFFFFFFFFULL, _mm512_permutexvar_epi32(squeeze, v));
+	}
+	float_to_s24_c(in + k, out, count - k);
+}
+#endif
+
+static void (*float_to_s24_fn)(const float *in, uint8_t *out, size_t count) = float_to_s24_c;
+
+void wav_float_to_s24(const float *in, uint8_t *out, size_t count)
+{
+	float_to_s24_fn(in, out, count);
+}
+
+static void float_to_s32_c(const float *in, int32_t *out, size_t count)
+{
+	for (size_t k = 0; k < count; k++)
+		out[k] = quantize(in[k], S32_SCALE, -S32_SCALE, S32_MAX_FLOAT);
+}
+
+#ifdef WAV_SIMD_X86
+static void float_to_s32_sse2(const float *in, int32_t *out, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(S32_SCALE);
+	const __m128 hi = _mm_set1_ps(S32_MAX_FLOAT);
+	const __m128 lo = _mm_set1_ps(-S32_SCALE);
+	size_t k = 0;
+
+	for (; k + 4 <= count; k += 4) {
+		__m128 f = _mm_mul_ps(_mm_loadu_ps(&in[k]), scale);
+		f = _mm_max_ps(_mm_min_ps(f, hi), lo);
+		_mm_storeu_si128((__m128i * )&out[k], _mm_cvtps_epi32(f));
+	}
+	float_to_s32_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX2
+static void float_to_s32_avx2(const float *in, int32_t *out, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(S32_SCALE);
+	const __m256 hi = _mm256_set1_ps(S32_MAX_FLOAT);
+	const __m256 lo = _mm256_set1_ps(-S32_SCALE);
+	size_t k = 0;
+
+	for (; k + 8 <= count; k += 8) {
+		__m256 f = _mm256_mul_ps(_mm256_loadu_ps(&in[k]), scale);
+		f = _mm256_max_ps(_mm256_min_ps(f, hi), lo);
+		_mm256_storeu_si256((__m256i * )&out[k], _mm256_cvtps_epi32(f));
+	}
+	float_to_s32_c(in + k, out + k, count - k);
+}
+
+WAV_TARGET_AVX512
+static void float_to_s32_avx512(const float *in, int32_t *out, size_t count)
+{
+	const __m512 scale = _mm512_set1_ps(S32_SCALE);
+	const __m512 hi = _mm512_set1_ps(S32_MAX_FLOAT);
+	const __m512 lo = _mm512_set1_ps(-S32_SCALE);
+	size_t k = 0;
+
+	for (; k + 16 <= count; k += 16) {
+		__m512 f = _mm512_mul_ps(_mm512_loadu_ps(&in[k]), scale);
+		f = _mm512_max_ps(_mm512_min_ps(f, hi), lo);
+		_mm512_storeu_si512((void * )&out[k], _mm512_cvtps_epi32(f));
+	}
+	float_to_s32_c(in + k, out + k, count - k);
+}
+#endif
+
+static void (*float_to_s32_fn)(const float *in, int32_t *out, size_t count) = float_to_s32_c;
+
+void wav_float_to_s32(const float *in, int32_t *out, size_t count)
+{
+	float_to_s32_fn(in, out, count);
+}
+
+static inline __attribute__((always_inline))
+void float_to_f64_body(const float *in, double *out, size_t count)
+{
+	for (size_t k = 0; k < count; k++)
+		out[k] = in[k];
+}
+
+static void float_to_f64_c(const float *in, double *out, size_t count)
+{
+	float_to_f64_body(in, out, count);
+}
+
+#ifdef WAV_SIMD_X86
+WAV_TARGET_AVX2
+static void float_to_f64_avx2(const float *in, double *out, size_t count)
+{
+	float_to_f64_body(in, out, count);
+}
+
+WAV_TARGET_AVX512
+static void float_to_f64_avx512(const float *in, double *out, size_t count)
+{
+	float_to_f64_body(in, out, count);
+}
+#endif
+
+static void (*float_to_f64_fn)(const float *in, double *out, size_t count) = float_to_f64_c;
+
+void wav_float_to_f64(const float *in, double *out, size_t count)
+{
+	float_to_f64_fn(in, out, count);
+}
+
+/* best version of each kernel for this CPU, before main() so that no
+ * thread can see the table half filled in */
+
+__attribute__((constructor))
+static void pick_kernels(void)
+{
+#ifdef WAV_SIMD_X86
+	int level = wav_simd_level();
+
+	if (level >= WAV_SIMD_AVX512) {
+		u8_to_float_fn = u8_to_float_avx512;
+		s24_to_float_fn = s24_to_float_avx512;
+		float_to_u8_fn = float_to_u8_avx512;
+		float_to_s24_fn = float_to_s24_avx512;
+		f64_to_float_fn = f64_to_float_avx512;
+		float_to_f64_fn = float_to_f64_avx512;
+		s16_to_float_fn = s16_to_float_avx512;
+		s32_to_float_fn = s32_to_float_avx512;
+		float_to_s16_fn = float_to_s16_avx512;
+		float_to_s32_fn = float_to_s32_avx512;
+		s16_scale_add_sat_fn = s16_scale_add_sat_avx512;
+		s16_add_sat_fn = s16_add_sat_avx512;
+	} else if (level >= WAV_SIMD_AVX2) {
+		u8_to_float_fn = u8_to_float_avx2;
+		s24_to_float_fn = s24_to_float_avx2;
+		float_to_u8_fn = float_to_u8_avx2;
+		float_to_s24_fn = float_to_s24_avx2;
+		f64_to_float_fn = f64_to_float_avx2;
+		float_to_f64_fn = float_to_f64_avx2;
+		s16_to_float_fn = s16_to_float_avx2;
+		s32_to_float_fn = s32_to_float_avx2;
+		float_to_s16_fn = float_to_s16_avx2;
+		float_to_s32_fn = float_to_s32_avx2;
+		s16_scale_add_sat_fn = s16_scale_add_sat_avx2;
+		s16_add_sat_fn = s16_add_sat_avx2;
+	} else if (level >= WAV_SIMD_SSE2) {
+		u8_to_float_fn = u8_to_float_sse2;
+		float_to_u8_fn = float_to_u8_sse2;
+		if (level >= WAV_SIMD_SSSE3) {
+			s24_to_float_fn = s24_to_float_ssse3;
+			float_to_s24_fn = float_to_s24_ssse3;
+		}
+		s16_to_float_fn = level >= WAV_SIMD_SSE41 ? s16_to_float_sse41 : s16_to_float_sse2;
+		s32_to_float_fn = s32_to_float_sse2;
+		float_to_s16_fn = float_to_s16_sse2;
+		float_to_s32_fn = float_to_s32_sse2;
+		s16_scale_add_sat_fn = level >= WAV_SIMD_SSSE3 ? s16_scale_add_sat_ssse3 : s16_scale_add_sat_sse2;
+		s16_add_sat_fn = s16_add_sat_sse2;
+	}
+#endif
+}
+
+/* pick the kernel for an encoding */
+
+void wav_decode_float(const void * raw, int format, int bits_per_sample, float *out, size_t count)
+{
+	if (format == WAVE_FORMAT_IEEE_FLOAT) {
+		if (bits_per_sample == 32)
+			memcpy(out, raw, count * sizeof(float));
+		else
+			wav_f64_to_float((const double * )raw, out, count);
+		return;
+	}
+	switch (bits_per_sample) {
+	case 8:
+		wav_u8_to_float((const uint8_t * )raw, out, count);
+		break;
+	case 16:
+		wav_s16_to_float((const int16_t * )raw, out, count);
+		break;
+	case 24:
+		wav_s24_to_float((const uint8_t * )raw, out, count);
+		break;
+	case 32:
+		wav_s32_to_float((const int32_t * )raw, out, count);
+		break;
+	}
+}
+
+void wav_encode_float(const float *in, int format, int bits_per_sample, void * raw, size_t count)
+{
+	if (format == WAVE_FORMAT_IEEE_FLOAT) {
+		if (bits_per_sample == 32)
+			memcpy(raw, in, count * sizeof(float));
+		else
+			wav_float_to_f64(in, (double * )raw, count);
+		return;
+	}
+	switch (bits_per_sample) {
+	case 8:
+		wav_float_to_u8(in, (uint8_t * )raw, count);
+		break;
+	case 16:
+		wav_float_to_s16(in, (int16_t * )raw, count);
+		break;
+	case 24:
+		wav_float_to_s24(in, (uint8_t * )raw, count);
+		break;
+	case 32:
+		wav_float_to_s32(in, (int32_t * )raw, count);
+		break;
+	}
+}
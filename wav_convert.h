@@ -0,0 +1,80 @@
+#ifndef _wav_convert_h_
+# define _wav_convert_h_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* convert between the sample encodings found in .wav files and
+ * normalized float samples, where full scale is [-1.0, 1.0).
+ * Integer encodings are scaled by 2^(bits-1), so 16-bit and 24-bit
+ * samples survive a round trip through float exactly.
+ * Encoding to integers rounds to nearest and saturates at full scale.
+ */
+
+/* wave format codes, from the fmt chunk or the extensible sub-format GUID */
+#define WAVE_FORMAT_PCM 		0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 		0x0003
+#define WAVE_FORMAT_EXTENSIBLE		0xFFFE
+
+/*
+ * input:
+ *   format - WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+ *   bits_per_sample - 8, 16, 24 or 32 for PCM, 32 or 64 for float
+ * returns:
+ *   non-0 if we can convert this encoding, 0 otherwise
+ */
+int wav_encoding_supported(int format, int bits_per_sample);
+
+/*
+ * input:
+ *   name - one of u8, s16, s24, s32, f32, f64
+ * output:
+ *   format_out, bits_per_sample_out - the matching encoding
+ * returns 0 if name was recognized, non-0 otherwise
+ */
+int wav_parse_encoding(const char * name, int *format_out, int *bits_per_sample_out);
+
+/* returns name of an encoding as accepted by wav_parse_encoding() */
+const char * wav_encoding_name(int format, int bits_per_sample);
+
+/*
+ * input:
+ *   raw - count samples in the given on-disk encoding
+ * output:
+ *   out - count normalized float samples
+ */
+void wav_decode_float(const void * raw, int format, int bits_per_sample, float *out, size_t count);
+
+/*
+ * input:
+ *   in - count normalized float samples
+ * output:
+ *   raw - count samples in the given on-disk encoding
+ */
+void wav_encode_float(const float *in, int format, int bits_per_sample, void * raw, size_t count);
+
+/* individual kernels, used by the two functions above */
+void wav_u8_to_float(const uint8_t *in, float *out, size_t count);
+void wav_s16_to_float(const int16_t *in, float *out, size_t count);
+void wav_s24_to_float(const uint8_t *in, float *out, size_t count);
+void wav_s32_to_float(const int32_t *in, float *out, size_t count);
+void wav_f64_to_float(const double *in, float *out, size_t count);
+void wav_float_to_u8(const float *in, uint8_t *out, size_t count);
+void wav_float_to_s16(const float *in, int16_t *out, size_t count);
+void wav_float_to_s24(const float *in, uint8_t *out, size_t count);
+void wav_float_to_s32(const float *in, int32_t *out, size_t count);
+void wav_float_to_f64(const float *in, double *out, size_t count);
+
+/*
+ * saturating fixed-point kernel for effects that stay in s16:
+ *   data[k] = data[k] * gain_q15 / 32768 + add[k], rounded and clamped to
+ *   [-32768, 32767] instead of wrapping
+ * input:
+ *   gain_q15 - gain from -32767 to 32767 meaning -1 to 1
+ */
+void wav_s16_scale_add_sat(int16_t *data, int16_t gain_q15, const int16_t *add, size_t count);
+
+/* acc[k] = acc[k] + add[k], clamped to [-32768, 32767], for summing s16 streams */
+void wav_s16_add_sat(int16_t *acc, const int16_t *add, size_t count);
+
+#endif
@@ -0,0 +1,234 @@
+/* convolution reverb effect stage: convolve the stream with an impulse
+ * response read from a .wav file, see wav_convolver.h
+ *
+ * parameters:
+ *   ir - impulse response .wav file, 1 channel or as many as the stream,
+ *        resampled to the stream's rate if it differs
+ *   wet - gain of the convolved signal, 0 to 10 (default 0.3)
+ *   dry - gain of the original signal, 0 to 10 (default 1)
+ *   block - frames per partition of the head of the response, a power
+ *           of 2 from 64 to 16384 (default 1024).  Smaller is less work
+ *           per frame for short responses, larger for long ones
+ *
+ * the output is as long as the input plus the response, the tail comes
+ * out at flush
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wav_effect.h"
+#include "wav_convolver.h"
+#include "wav_resampler.h"
+
+struct convolve_state {
+	struct wav_convolver *	cv;
+	float			wet;
+	float			dry;
+	int			block;
+	int			channels;
+	int64_t			ir_frames;
+	float *			in_buf;		/* input waiting for a whole block */
+	int			in_frames;
+	float *			wet_buf;	/* one block of convolver output */
+	float *			out_buf;
+	int64_t			frames_in;	/* input frames so far */
+	int64_t			frames_out;	/* output frames so far */
+};
+
+/* read the whole response as floats at rate. return OK if done, NOTOK otherwise */
+
+static int load_ir(struct wav_effect *fx, const char * path, int rate, float **ir_out, int64_t *frames_out, int *channels_out)
+{
+	struct wav_reader * rdr;
+	struct wav_info info;
+	float * ir = NULL;
+	int frames;
+
+	if (wav_reader_open((char * )path, &rdr, &info) != OK)
+		return NOTOK;
+	if (info.frame_count < 1 || info.frame_count > (1 << 26)) {
+		wav_reader_close(rdr);
+		return wav_effect_error(fx, "impulse response must be 1 to 2^26 frames");
+	}
+	ir = (float * )malloc(sizeof(float) * info.frame_count * info.channels);
+	if (!ir) {
+		wav_reader_close(rdr);
+		return wav_effect_error(fx, "could not allocate impulse response");
+	}
+	for (int64_t frame = 0; frame < info.frame_count; frame += frames) {
+		if (wav_reader_read_float(rdr, ir + frame * info.channels, info.frame_count - frame, &frames) != OK ||
+		    frames == 0) {
+			free(ir);
+			wav_reader_close(rdr);
+			return NOTOK;
+		}
+	}
+	wav_reader_close(rdr);
+
+	/* a response recorded at another rate would stretch the room */
+	if (info.samples_per_sec != rate) {
+		struct wav_resampler * rs;
+		int64_t out_frames = 0;
+		int64_t max_frames = info.frame_count * rate / info.samples_per_sec + 2;
+		float * out = (float * )malloc(sizeof(float) * max_frames * info.channels);
+
+		if (!out || wav_resampler_open(info.samples_per_sec, rate, info.channels, WAV_RESAMPLE_TAPS,
+					       info.frame_count, &rs) != OK) {
+			free(out);
+			free(ir);
+			return wav_effect_error(fx, "could not resample impulse response");
+		}
+		wav_resampler_process(rs, ir, info.frame_count, out, &frames);
+		out_frames = frames;
+		do {
+			wav_resampler_flush(rs, out + out_frames * info.channels, max_frames - out_frames, &frames);
+			out_frames += frames;
+		} while (frames > 0);
+		wav_resampler_close(rs);
+		free(ir);
+		ir = out;
+		info.frame_count = out_frames;
+	}
+	*ir_out = ir;
+	*frames_out = info.frame_count;
+	*channels_out = info.channels;
+	return OK;
+}
+
+static int convolve_init(struct wav_effect *fx, struct wav_stream_fmt *fmt)
+{
+	struct convolve_state * st;
+	const char * path = wav_effect_param_str(fx, "ir", NULL);
+	float * ir = NULL;
+	int ir_channels = 1;
+	int rc;
+
+	st = (struct convolve_state * )calloc(1, sizeof(struct convolve_state));
+	if (!st)
+		return wav_effect_error(fx, "could not allocate state");
+	fx->state = st;
+	st->wet = wav_effect_param(fx, "wet", 0.3);
+	st->dry = wav_effect_param(fx, "dry", 1.0);
+	st->block = (int )wav_effect_param(fx, "block", 1024);
+	st->channels = fmt->channels;
+	if (!path)
+		return wav_effect_error(fx, "ir=file.wav is required");
+	if (st->wet < 0.0 || st->wet > 10.0 || st->dry < 0.0 || st->dry > 10.0)
+		return wav_effect_error(fx, "wet and dry must be from 0 to 10");
+	if (st->block < 64 || st->block > 16384 || (st->block & (st->block - 1)))
+		return wav_effect_error(fx, "block must be a power of 2 from 64 to 16384");
+
+	if (load_ir(fx, path, fmt->samples_per_sec, &ir, &st->ir_frames, &ir_channels) != OK)
+		return NOTOK;
+	if (ir_channels != 1 && ir_channels != fmt->channels) {
+		free(ir);
+		return wav_effect_error(fx, "impulse response needs 1 channel or as many as the input");
+	}
+	rc = wav_convolver_open(ir, st->ir_frames, ir_channels, fmt->channels, st->block, &st->cv);
+	free(ir);
+	if (rc != OK)
+		return NOTOK;
+	/* the tail at flush is more than went in, so the chain does not split */
+	fx->warmup_frames = st->ir_frames - 1;
+	fx->latency_frames = WAV_EFFECT_UNBOUNDED;
+
+	/* up to a block more comes out of a call than goes in */
+	st->in_buf = (float * )malloc(sizeof(float) * st->block * fmt->channels);
+	st->wet_buf = (float * )malloc(sizeof(float) * st->block * fmt->channels);
+	st->out_buf = (float * )malloc(sizeof(float) * (fmt->max_frames + st->block) * fmt->channels);
+	if (!st->in_buf || !st->wet_buf || !st->out_buf)
+		return wav_effect_error(fx, "could not allocate buffers");
+	fmt->max_frames += st->block;
+	return OK;
+}
+
+/* convolve the full input block and mix it into out. */
+
+static void run_block(struct convolve_state *st, float *out)
+{
+	int samples = st->block * st->channels;
+
+	wav_convolver_block(st->cv, st->in_buf, st->wet_buf);
+	for (int k = 0; k < samples; k++)
+		out[k] = st->dry * st->in_buf[k] + st->wet * st->wet_buf[k];
+	st->in_frames = 0;
+}
+
+static int convolve_process(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct convolve_state * st = (struct convolve_state * )fx->state;
+	int ch = st->channels;
+	int used = 0;
+	int out_frames = 0;
+
+	while (used < blk->frames) {
+		int take = blk->frames - used;
+		if (take > st->block - st->in_frames)
+			take = st->block - st->in_frames;
+		memcpy(st->in_buf + st->in_frames * ch, blk->data + used * ch, sizeof(float) * take * ch);
+		st->in_frames += take;
+		used += take;
+		if (st->in_frames == st->block) {
+			run_block(st, st->out_buf + out_frames * ch);
+			out_frames += st->block;
+		}
+	}
+	st->frames_in += blk->frames;
+	st->frames_out += out_frames;
+	blk->data = st->out_buf;
+	blk->frames = out_frames;
+	return OK;
+}
+
+/* the rest of the input, then the tail, a block at a time */
+
+static int convolve_flush(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct convolve_state * st = (struct convolve_state * )fx->state;
+	int64_t left = st->frames_in + st->ir_frames - 1 - st->frames_out;
+
+	blk->frames = 0;
+	if (left <= 0)
+		return OK;
+	memset(st->in_buf + st->in_frames * st->channels, 0,
+	       sizeof(float) * (st->block - st->in_frames) * st->channels);
+	run_block(st, blk->data);
+	blk->frames = left < st->block ? left : st->block;
+	st->frames_out += blk->frames;
+	return OK;
+}
+
+static void convolve_reset(struct wav_effect *fx)
+{
+	struct convolve_state * st = (struct convolve_state * )fx->state;
+
+	wav_convolver_reset(st->cv);
+	st->in_frames = 0;
+	st->frames_in = 0;
+	st->frames_out = 0;
+}
+
+static void convolve_destroy(struct wav_effect *fx)
+{
+	struct convolve_state * st = (struct convolve_state * )fx->state;
+
+	if (!st)
+		return;
+	if (st->cv)
+		wav_convolver_close(st->cv);
+	free(st->in_buf);
+	free(st->wet_buf);
+	free(st->out_buf);
+	free(st);
+}
+
+const struct wav_effect_ops wav_convolve_ops = {
+	.name = "convolve",
+	.help = "ir=file.wav wet=0.3 dry=1 block=1024  convolution reverb with an impulse response",
+	.init = convolve_init,
+	.process = convolve_process,
+	.flush = convolve_flush,
+	.reset = convolve_reset,
+	.destroy = convolve_destroy,
+};
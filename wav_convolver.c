@@ -0,0 +1,402 @@
+/* partitioned FFT convolution, see wav_convolver.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "wav_file_access.h"
+#include "wav_fft.h"
+#include "wav_planar.h"
+#include "wav_simd.h"
+#include "wav_convolver.h"
+
+/* one level of equal partitions, covering frames [start, start + parts * size)
+ * of the response.  Buffers are per channel, one after the other */
+struct conv_level {
+	int		size;		/* frames per partition, P */
+	int		start;		/* first frame of the response covered */
+	int		parts;
+	int		bins;		/* P + 1 */
+	int		channels;
+	struct wav_fft *fft;		/* 2P points */
+	float *		ir_re;		/* [channel][part][bins] spectra of the response */
+	float *		ir_im;
+	float *		fdl_re;		/* [channel][part][bins] spectra of recent input */
+	float *		fdl_im;
+	int		fdl_pos;	/* part slot of the newest spectrum */
+	float *		window;		/* [channel][2P] input for the next run */
+	float *		result;		/* [channel][P] output of the last run */
+	float *		time;		/* 2P scratch */
+	float *		acc_re;		/* bins scratch */
+	float *		acc_im;
+
+	/* levels after the first run on a thread of their own */
+	int		threaded;
+	pthread_t	tid;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int		job;		/* set while a run is queued or running */
+	int		quit;
+	int		pending;	/* main thread has a result to collect */
+	int		has_lock;	/* lock and cond were initialized */
+};
+
+struct wav_convolver {
+	int			channels;
+	int			block;
+	int			level_count;
+	struct conv_level	levels[WAV_CONV_MAX_LEVELS];
+	int			ring;		/* frames in hist and sum, power of 2 */
+	float *			hist;		/* [channel][ring] input */
+	float *			sum;		/* [channel][ring] output being added up */
+	int64_t			frames;		/* input frames so far */
+};
+
+/* complex multiply-accumulate over a spectrum, the convolver's hot loop,
+ * built for AVX2 and AVX-512 as well (see wav_simd.h) */
+
+static inline __attribute__((always_inline))
+void mac_body(float * restrict acc_re, float * restrict acc_im, const float * restrict x_re, const float * restrict x_im,
+	      const float * restrict h_re, const float * restrict h_im, int bins)
+{
+	for (int k = 0; k < bins; k++) {
+		acc_re[k] += x_re[k] * h_re[k] - x_im[k] * h_im[k];
+		acc_im[k] += x_re[k] * h_im[k] + x_im[k] * h_re[k];
+	}
+}
+
+static void mac_c(float * restrict acc_re, float * restrict acc_im, const float * restrict x_re, const float * restrict x_im,
+		  const float * restrict h_re, const float * restrict h_im, int bins)
+{
+	mac_body(acc_re, acc_im, x_re, x_im, h_re, h_im, bins);
+}
+
+#ifdef WAV_SIMD_X86
+WAV_TARGET_AVX2
+static void mac_avx2(float * restrict acc_re, float * restrict acc_im, const float * restrict x_re, const float * restrict x_im,
+		     const float * restrict h_re, const float * restrict h_im, int bins)
+{
+	mac_body(acc_re, acc_im, x_re, x_im, h_re, h_im, bins);
+}
+
+WAV_TARGET_AVX512
+static void mac_avx512(float * restrict acc_re, float * restrict acc_im, const float * restrict x_re, const float * restrict x_im,
+		       const float * restrict h_re, const float * restrict h_im, int bins)
+{
+	mac_body(acc_re, acc_im, x_re, x_im, h_re, h_im, bins);
+}
+#endif
+
+static void (*mac)(float * restrict acc_re, float * restrict acc_im, const float * restrict x_re,
+		   const float * restrict x_im, const float * restrict h_re, const float * restrict h_im, int bins) = mac_c;
+
+__attribute__((constructor))
+static void pick_mac(void)
+{
+#ifdef WAV_SIMD_X86
+	int level = wav_simd_level();
+
+	if (level >= WAV_SIMD_AVX512)
+		mac = mac_avx512;
+	else if (level >= WAV_SIMD_AVX2)
+		mac = mac_avx2;
+#endif
+}
+
+/* transform the window, push it on the delay line, multiply-accumulate
+ * against every partition and transform back.  The second half of the
+ * result is the convolution of the newest P frames with the level's
+ * part of the response */
+
+static void run_level(struct conv_level *lv)
+{
+	int bins = lv->bins;
+
+	lv->fdl_pos = (lv->fdl_pos + 1) % lv->parts;
+	for (int c = 0; c < lv->channels; c++) {
+		size_t part_base = (size_t )c * lv->parts;
+		float * x_re = lv->fdl_re + (part_base + lv->fdl_pos) * bins;
+		float * x_im = lv->fdl_im + (part_base + lv->fdl_pos) * bins;
+
+		wav_fft_forward(lv->fft, lv->window + (size_t )c * 2 * lv->size, x_re, x_im);
+		memset(lv->acc_re, 0, sizeof(float) * bins);
+		memset(lv->acc_im, 0, sizeof(float) * bins);
+		for (int p = 0; p < lv->parts; p++) {
+			int slot = (lv->fdl_pos - p + lv->parts) % lv->parts;
+			mac(lv->acc_re, lv->acc_im,
+			    lv->fdl_re + (part_base + slot) * bins, lv->fdl_im + (part_base + slot) * bins,
+			    lv->ir_re + (part_base + p) * bins, lv->ir_im + (part_base + p) * bins, bins);
+		}
+		wav_fft_inverse(lv->fft, lv->acc_re, lv->acc_im, lv->time);
+		memcpy(lv->result + (size_t )c * lv->size, lv->time + lv->size, sizeof(float) * lv->size);
+	}
+}
+
+static void * level_thread(void *arg)
+{
+	struct conv_level * lv = (struct conv_level * )arg;
+
+	pthread_mutex_lock(&lv->lock);
+	for (;;) {
+		while (!lv->job && !lv->quit)
+			pthread_cond_wait(&lv->cond, &lv->lock);
+		if (lv->quit)
+			break;
+		pthread_mutex_unlock(&lv->lock);
+		run_level(lv);
+		pthread_mutex_lock(&lv->lock);
+		lv->job = 0;
+		pthread_cond_broadcast(&lv->cond);
+	}
+	pthread_mutex_unlock(&lv->lock);
+	return NULL;
+}
+
+static void level_start(struct conv_level *lv)
+{
+	if (!lv->threaded) {
+		run_level(lv);
+		return;
+	}
+	pthread_mutex_lock(&lv->lock);
+	lv->job = 1;
+	pthread_cond_broadcast(&lv->cond);
+	pthread_mutex_unlock(&lv->lock);
+}
+
+static void level_wait(struct conv_level *lv)
+{
+	if (!lv->threaded)
+		return;
+	pthread_mutex_lock(&lv->lock);
+	while (lv->job)
+		pthread_cond_wait(&lv->cond, &lv->lock);
+	pthread_mutex_unlock(&lv->lock);
+}
+
+/* allocate a level and transform its partitions of the response.
+ * return OK if done, NOTOK otherwise */
+
+static int level_init(struct conv_level *lv, const float *ir, int ir_frames, int ir_channels, int channels)
+{
+	size_t spectra = (size_t )channels * lv->parts * lv->bins;
+
+	lv->channels = channels;
+	if (wav_fft_open(2 * lv->size, &lv->fft) != OK)
+		return NOTOK;
+	lv->ir_re = (float * )malloc(sizeof(float) * spectra);
+	lv->ir_im = (float * )malloc(sizeof(float) * spectra);
+	lv->fdl_re = (float * )calloc(spectra, sizeof(float));
+	lv->fdl_im = (float * )calloc(spectra, sizeof(float));
+	lv->window = (float * )malloc(sizeof(float) * channels * 2 * lv->size);
+	lv->result = (float * )malloc(sizeof(float) * channels * lv->size);
+	lv->time = (float * )malloc(sizeof(float) * 2 * lv->size);
+	lv->acc_re = (float * )malloc(sizeof(float) * lv->bins);
+	lv->acc_im = (float * )malloc(sizeof(float) * lv->bins);
+	if (!lv->ir_re || !lv->ir_im || !lv->fdl_re || !lv->fdl_im || !lv->window ||
+	    !lv->result || !lv->time || !lv->acc_re || !lv->acc_im) {
+		printf("ERROR: could not allocate convolver\n");
+		return NOTOK;
+	}
+
+	/* each partition zero-padded to 2P, as overlap-save needs */
+	for (int c = 0; c < channels; c++) {
+		int ic = ir_channels == 1 ? 0 : c;
+		for (int p = 0; p < lv->parts; p++) {
+			size_t at = ((size_t )c * lv->parts + p) * lv->bins;
+			for (int k = 0; k < 2 * lv->size; k++) {
+				int frame = lv->start + p * lv->size + k;
+				lv->time[k] = (k < lv->size && frame < ir_frames) ? ir[(size_t )frame * ir_channels + ic] : 0.0f;
+			}
+			wav_fft_forward(lv->fft, lv->time, lv->ir_re + at, lv->ir_im + at);
+		}
+	}
+	return OK;
+}
+
+int wav_convolver_open(const float *ir, int ir_frames, int ir_channels, int channels, int block_frames,
+		       struct wav_convolver **cv_out)
+{
+	struct wav_convolver * cv;
+	int size = block_frames;
+	int start = 0;
+
+	if (block_frames < 16 || block_frames > 65536 || (block_frames & (block_frames - 1))) {
+		printf("ERROR: convolver block %d is not a power of 2 from 16 to 65536\n", block_frames);
+		return NOTOK;
+	}
+	if (channels < 1 || channels > WAV_MAX_CHANNELS) {
+		printf("ERROR: convolver cannot take %d channels\n", channels);
+		return NOTOK;
+	}
+	if (ir_frames < 1 || (ir_channels != 1 && ir_channels != channels)) {
+		printf("ERROR: impulse response needs 1 or %d channels\n", channels);
+		return NOTOK;
+	}
+	cv = (struct wav_convolver * )calloc(1, sizeof(struct wav_convolver));
+	if (!cv) {
+		printf("ERROR: could not allocate convolver\n");
+		return NOTOK;
+	}
+	cv->channels = channels;
+	cv->block = block_frames;
+
+	/* level i has partitions of block * GROWTH^i frames and ends where
+	 * level i+1 starts, at twice its partition size */
+	while (start < ir_frames && cv->level_count < WAV_CONV_MAX_LEVELS) {
+		struct conv_level * lv = &cv->levels[cv->level_count++];
+		int64_t end = (int64_t )2 * WAV_CONV_GROWTH * size;
+
+		if (end >= ir_frames || cv->level_count == WAV_CONV_MAX_LEVELS)
+			end = ir_frames;
+		lv->size = size;
+		lv->start = start;
+		lv->parts = (end - start + size - 1) / size;
+		lv->bins = size + 1;
+		if (level_init(lv, ir, ir_frames, ir_channels, channels) != OK) {
+			wav_convolver_close(cv);
+			return NOTOK;
+		}
+		start = end;
+		size *= WAV_CONV_GROWTH;
+	}
+
+	cv->ring = 2 * cv->levels[cv->level_count - 1].size;
+	cv->hist = (float * )calloc((size_t )channels * cv->ring, sizeof(float));
+	cv->sum = (float * )calloc((size_t )channels * cv->ring, sizeof(float));
+	if (!cv->hist || !cv->sum) {
+		printf("ERROR: could not allocate convolver\n");
+		wav_convolver_close(cv);
+		return NOTOK;
+	}
+
+	/* if a thread does not start its level just runs inline */
+	for (int i = 1; i < cv->level_count; i++) {
+		struct conv_level * lv = &cv->levels[i];
+		pthread_mutex_init(&lv->lock, NULL);
+		pthread_cond_init(&lv->cond, NULL);
+		lv->has_lock = 1;
+		lv->threaded = pthread_create(&lv->tid, NULL, level_thread, lv) == 0;
+	}
+	*cv_out = cv;
+	return OK;
+}
+
+/* copy the 2P input frames before frame end into the level's window */
+
+static void fill_window(struct wav_convolver *cv, struct conv_level *lv, int64_t end)
+{
+	int mask = cv->ring - 1;
+
+	for (int c = 0; c < cv->channels; c++) {
+		const float * hist = cv->hist + (size_t )c * cv->ring;
+		float * window = lv->window + (size_t )c * 2 * lv->size;
+		for (int k = 0; k < 2 * lv->size; k++)
+			window[k] = hist[(end - 2 * lv->size + k) & mask];
+	}
+}
+
+/* add the level's last result to the sum at frame first */
+
+static void add_result(struct wav_convolver *cv, struct conv_level *lv, int64_t first)
+{
+	int mask = cv->ring - 1;
+
+	for (int c = 0; c < cv->channels; c++) {
+		float * sum = cv->sum + (size_t )c * cv->ring;
+		const float * result = lv->result + (size_t )c * lv->size;
+		for (int k = 0; k < lv->size; k++)
+			sum[(first + k) & mask] += result[k];
+	}
+}
+
+int wav_convolver_block(struct wav_convolver *cv, const float *in, float *out)
+{
+	int mask = cv->ring - 1;
+	int64_t first = cv->frames;
+	int64_t end = first + cv->block;
+	float * hist[WAV_MAX_CHANNELS];
+	float * sum[WAV_MAX_CHANNELS];
+
+	/* blocks start at multiples of the block size, so one never wraps the rings */
+	for (int c = 0; c < cv->channels; c++) {
+		hist[c] = cv->hist + (size_t )c * cv->ring + (first & mask);
+		sum[c] = cv->sum + (size_t )c * cv->ring + (first & mask);
+	}
+	wav_deinterleave(in, cv->channels, hist, cv->block);
+	cv->frames = end;
+
+	/* the first level is needed for this very block */
+	fill_window(cv, &cv->levels[0], end);
+	run_level(&cv->levels[0]);
+	add_result(cv, &cv->levels[0], first);
+
+	/* a level's run on the P frames ending at t lands at t + P, so it is
+	 * collected when the next run starts P frames later */
+	for (int i = 1; i < cv->level_count; i++) {
+		struct conv_level * lv = &cv->levels[i];
+		if (end % lv->size != 0)
+			continue;
+		if (lv->pending) {
+			level_wait(lv);
+			add_result(cv, lv, end);
+		}
+		fill_window(cv, lv, end);
+		level_start(lv);
+		lv->pending = 1;
+	}
+
+	wav_interleave((const float * const * )sum, cv->channels, out, cv->block);
+	for (int c = 0; c < cv->channels; c++)
+		memset(sum[c], 0, sizeof(float) * cv->block);
+	return OK;
+}
+
+void wav_convolver_reset(struct wav_convolver *cv)
+{
+	for (int i = 0; i < cv->level_count; i++) {
+		struct conv_level * lv = &cv->levels[i];
+		size_t spectra = (size_t )cv->channels * lv->parts * lv->bins;
+		level_wait(lv);
+		lv->pending = 0;
+		lv->fdl_pos = 0;
+		memset(lv->fdl_re, 0, sizeof(float) * spectra);
+		memset(lv->fdl_im, 0, sizeof(float) * spectra);
+	}
+	memset(cv->hist, 0, sizeof(float) * cv->channels * cv->ring);
+	memset(cv->sum, 0, sizeof(float) * cv->channels * cv->ring);
+	cv->frames = 0;
+}
+
+void wav_convolver_close(struct wav_convolver *cv)
+{
+	for (int i = 0; i < cv->level_count; i++) {
+		struct conv_level * lv = &cv->levels[i];
+		if (lv->threaded) {
+			pthread_mutex_lock(&lv->lock);
+			lv->quit = 1;
+			pthread_cond_broadcast(&lv->cond);
+			pthread_mutex_unlock(&lv->lock);
+			pthread_join(lv->tid, NULL);
+		}
+		if (lv->has_lock) {
+			pthread_mutex_destroy(&lv->lock);
+			pthread_cond_destroy(&lv->cond);
+		}
+		if (lv->fft)
+			wav_fft_close(lv->fft);
+		free(lv->ir_re);
+		free(lv->ir_im);
+		free(lv->fdl_re);
+		free(lv->fdl_im);
+		free(lv->window);
+		free(lv->result);
+		free(lv->time);
+		free(lv->acc_re);
+		free(lv->acc_im);
+	}
+	free(cv->hist);
+	free(cv->sum);
+	free(cv);
+}
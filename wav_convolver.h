@@ -0,0 +1,57 @@
+#ifndef _wav_convolver_h_
+# define _wav_convolver_h_ 1
+
+/* convolution with long impulse responses, a block at a time
+ *
+ * Non-uniformly partitioned overlap-save.  The start of the impulse
+ * response is cut into partitions of one block, and each block of input
+ * is transformed once and multiplied against every partition through a
+ * frequency-domain delay line, so the output for a block is ready as
+ * soon as the block is in.  Further out the partitions grow by
+ * WAV_CONV_GROWTH at each level: a level with partitions of P frames
+ * starts 2P frames into the response, so its result for a span of input
+ * is not needed until P frames after that span ends.  Each such level
+ * runs on a thread of its own in that time, so long tails cost one big
+ * FFT per P frames, off the main thread.
+ *
+ * Spectra are split real/imaginary arrays (see wav_fft.h), so the
+ * complex multiply-accumulates over bins vectorize.
+ */
+
+/* partitions grow by this factor from one level to the next */
+#define WAV_CONV_GROWTH 8
+#define WAV_CONV_MAX_LEVELS 8
+
+/* opaque handle, see wav_convolver.c */
+struct wav_convolver;
+
+/*
+ * input:
+ *   ir - ir_frames interleaved frames of impulse response
+ *   ir_channels - 1 to use the same response for every channel, or channels
+ *   channels - interleaved channels in every block
+ *   block_frames - frames per wav_convolver_block(), a power of 2 from 16 to 65536
+ * output:
+ *   cv_out - returns handle
+ * returns 0 if OK, non-0 otherwise
+ */
+int wav_convolver_open(const float *ir, int ir_frames, int ir_channels, int channels, int block_frames,
+		       struct wav_convolver **cv_out);
+
+/*
+ * input:
+ *   in - block_frames interleaved frames
+ * output:
+ *   out - block_frames interleaved frames of in convolved with the
+ *         response, for the same span of time as in
+ * returns 0 if OK, non-0 otherwise
+ */
+int wav_convolver_block(struct wav_convolver *cv, const float *in, float *out);
+
+/* forget all input, as if just opened */
+void wav_convolver_reset(struct wav_convolver *cv);
+
+/* stop level threads and free handle */
+void wav_convolver_close(struct wav_convolver *cv);
+
+#endif
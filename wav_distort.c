@@ -0,0 +1,552 @@
+/* oversampled waveshaping distortion effect stage, the amp in the chain
+ *
+ * parameters:
+ *   curve - tanh (symmetric soft clipping), tube (asymmetric, so even
+ *           harmonics too) or table (default tanh)
+ *   drive - dB of gain into the curve, 0 to 60 (default 12)
+ *   level - dB of gain after it, -60 to 12 (default 0)
+ *   bias - how lopsided tube is, 0 to 1 (default 0.3)
+ *   table - for curve=table, a file of 2 to 4096 numbers separated by
+ *           spaces, commas or newlines: the output for inputs evenly spaced
+ *           from -1 to 1, straight lines in between and held past the ends
+ *   oversample - 1, 2, 4 or 8 (default 8)
+ *
+ * A curve adds harmonics far above the input's band, which fold back as
+ * inharmonic aliases unless it runs at a higher rate.  Each 2x step up and
+ * back down is a half-band FIR, where every other tap is 0 but the middle
+ * one, so a step costs half its taps per output sample as two polyphase
+ * branches.  Only the step next to the audio band needs a steep filter
+ * (79 taps); at 4x and 8x everything above the audio band is thrown away
+ * by the steps below anyway, so 19 and 11 taps do.  Channels go one at a
+ * time through planar arrays so the filter and curve loops vectorize, with
+ * the whole path built per SIMD level and tanh as a rational function
+ * rather than a libm call.
+ *
+ * Each step down picks the phase that keeps the delay a whole number of
+ * frames (44 at 8x).  That many frames are held back so the output lines
+ * up with the input, and come out at flush.  tube and table can leave a
+ * DC offset, which a 5 Hz high-pass takes out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "wav_effect.h"
+#include "wav_planar.h"
+#include "wav_simd.h"
+
+/* base-rate frames worked on at a time */
+#define CHUNK_FRAMES 512
+
+/* 2x steps, so up to 8x */
+#define MAX_STEPS 3
+
+/* half-band taps either side of the middle that are not 0, for the step
+ * next to the audio band and the ones above it */
+static const int step_half_taps[MAX_STEPS] = { 20, 5, 3 };
+#define MAX_HALF_TAPS 20
+#define HALFBAND_KAISER_BETA 7.0
+
+#define MAX_TABLE 4096
+#define DC_BLOCK_HZ 5.0
+
+enum curve { CURVE_TANH, CURVE_TUBE, CURVE_TABLE };
+
+/* one 2x step: out[2n] = sum of g[j] * (in[n + j + 1 - M] + in[n - j - M]) * 2
+ * and out[2n + 1] = in[n + 1 - M] going up, and the same filter before
+ * taking every other sample going down */
+struct halfband {
+	int	m;			/* taps either side of the middle that are not 0 */
+	float	g[MAX_HALF_TAPS];	/* going down */
+	float	g2[MAX_HALF_TAPS];	/* going up, doubled for the zeros stuffed in */
+	int	phase;			/* which of each pair of samples the step down keeps */
+};
+
+struct distort_state {
+	int		channels;
+	int		curve;
+	int		steps;		/* log2 of oversampling */
+	float		drive;		/* linear */
+	float		level;
+	float		bias;
+	float		bias_out;	/* tanh(bias), so tube passes 0 through 0 */
+	float *		table;
+	int		table_size;
+	int		dc_block;
+	float		dc_r;
+	float		dc_x1[WAV_MAX_CHANNELS];
+	float		dc_y1[WAV_MAX_CHANNELS];
+
+	struct halfband	hb[MAX_STEPS];
+	float *		up[MAX_STEPS][WAV_MAX_CHANNELS];	/* 2m - 1 samples of history, then input */
+	float *		down_even[MAX_STEPS][WAV_MAX_CHANNELS];	/* the same, split into even ... */
+	float *		down_odd[MAX_STEPS][WAV_MAX_CHANNELS];	/* ... and odd samples */
+	float *		even;		/* scratch for one step's branches */
+	float *		odd;
+	float *		work;		/* one channel of a chunk at the highest rate */
+	float *		alloc;		/* behind all of the above */
+	struct wav_planar planes;	/* one chunk of input, then output */
+
+	int		delay;		/* frames, whole, from the steps */
+	int64_t		frame;		/* frames taken in, input and flush padding */
+	int64_t		frames_real;	/* input frames, set at flush */
+	int		flushing;
+};
+
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+
+	for (int k = 1; k < 50; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+	return sum;
+}
+
+/* Kaiser-windowed half-band lowpass, scaled for unity gain at DC */
+static void design_halfband(struct halfband *hb, int m)
+{
+	double half_len = 2 * m;
+	double sum = 0.0;
+
+	hb->m = m;
+	for (int j = 0; j < m; j++) {
+		double k = 2 * j + 1;
+		double r = k / half_len;
+		double sinc = sin(M_PI * k / 2.0) / (M_PI * k / 2.0);
+
+		hb->g[j] = 0.5 * sinc * bessel_i0(HALFBAND_KAISER_BETA * sqrt(1.0 - r * r)) /
+			   bessel_i0(HALFBAND_KAISER_BETA);
+		sum += hb->g[j];
+	}
+	/* middle tap is 0.5, the rest must add up to the other 0.5 */
+	for (int j = 0; j < m; j++) {
+		hb->g[j] *= 0.25 / sum;
+		hb->g2[j] = 2.0f * hb->g[j];
+	}
+}
+
+/* rational approximation, as accurate as float tanh over the clamped range */
+static inline __attribute__((always_inline))
+float tanh_approx(float x)
+{
+	float x2, p, q;
+
+	x = x < -7.90531110763549805f ? -7.90531110763549805f : x;
+	x = x > 7.90531110763549805f ? 7.90531110763549805f : x;
+	x2 = x * x;
+	p = x2 * -2.76076847742355e-16f + 2.00018790482477e-13f;
+	p = x2 * p + -8.60467152213735e-11f;
+	p = x2 * p + 5.12229709037114e-08f;
+	p = x2 * p + 1.48572235717979e-05f;
+	p = x2 * p + 6.37261928875436e-04f;
+	p = x2 * p + 4.89352455891786e-03f;
+	p = x * p;
+	q = x2 * 1.19825839466702e-06f + 1.18534705686654e-04f;
+	q = x2 * q + 2.26843463243900e-03f;
+	q = x2 * q + 4.89352518554385e-03f;
+	return p / q;
+}
+
+static inline __attribute__((always_inline))
+void shape_body(const struct distort_state *st, float * restrict x, int n)
+{
+	switch (st->curve) {
+	case CURVE_TANH:
+		for (int k = 0; k < n; k++)
+			x[k] = tanh_approx(x[k]);
+		break;
+	case CURVE_TUBE:
+		for (int k = 0; k < n; k++)
+			x[k] = tanh_approx(x[k] + st->bias) - st->bias_out;
+		break;
+	case CURVE_TABLE: {
+		const float * table = st->table;
+		float scale = (st->table_size - 1) * 0.5f;
+		int last = st->table_size - 2;
+
+		for (int k = 0; k < n; k++) {
+			float pos = (x[k] + 1.0f) * scale;
+			int i;
+
+			pos = pos < 0.0f ? 0.0f : pos;
+			pos = pos > last + 1.0f ? last + 1.0f : pos;
+			i = (int )pos;
+			i = i > last ? last : i;
+			x[k] = table[i] + (table[i + 1] - table[i]) * (pos - i);
+		}
+		break;
+	}
+	}
+}
+
+/* one step up, n input samples after 2m - 1 of history in in */
+static inline __attribute__((always_inline))
+void up_body(const struct halfband *hb, const float * restrict in, float * restrict even, float * restrict odd, int n)
+{
+	int m = hb->m;
+
+	for (int i = 0; i < n; i++) {
+		odd[i] = in[m + i];
+		even[i] = 0.0f;
+	}
+	for (int j = 0; j < m; j++) {
+		float g = hb->g2[j];
+		const float * a = in + m + j;
+		const float * b = in + m - 1 - j;
+
+		for (int i = 0; i < n; i++)
+			even[i] += g * (a[i] + b[i]);
+	}
+}
+
+/* one step down to n output samples, 2m - 1 samples of history before
+ * n new ones in each of even and odd */
+static inline __attribute__((always_inline))
+void down_body(const struct halfband *hb, const float * restrict even, const float * restrict odd, float * restrict out, int n)
+{
+	int m = hb->m;
+	const float * mid = hb->phase ? even + m : odd + m - 1;
+	const float * side = hb->phase ? odd : even;
+
+	for (int i = 0; i < n; i++)
+		out[i] = 0.5f * mid[i];
+	for (int j = 0; j < m; j++) {
+		float g = hb->g[j];
+		const float * a = side + m + j;
+		const float * b = side + m - 1 - j;
+
+		for (int i = 0; i < n; i++)
+			out[i] += g * (a[i] + b[i]);
+	}
+}
+
+/* x has n frames of channel c, scaled by drive, and gets the output */
+static inline __attribute__((always_inline))
+void run_channel_body(struct distort_state *st, int c, float *x, int n)
+{
+	const float * planes[2];
+	float * split[2];
+	float * src = x;
+	int len = n;
+
+	for (int s = 0; s < st->steps; s++) {
+		const struct halfband * hb = &st->hb[s];
+		int hist = 2 * hb->m - 1;
+		float * u = st->up[s][c];
+
+		memcpy(u + hist, src, sizeof(float) * len);
+		up_body(hb, u, st->even, st->odd, len);
+		memmove(u, u + len, sizeof(float) * hist);
+		planes[0] = st->even;
+		planes[1] = st->odd;
+		wav_interleave(planes, 2, st->work, len);
+		src = st->work;
+		len *= 2;
+	}
+
+	shape_body(st, src, len);
+
+	for (int s = st->steps - 1; s >= 0; s--) {
+		const struct halfband * hb = &st->hb[s];
+		int hist = 2 * hb->m - 1;
+		float * even = st->down_even[s][c];
+		float * odd = st->down_odd[s][c];
+
+		len /= 2;
+		split[0] = even + hist;
+		split[1] = odd + hist;
+		wav_deinterleave(src, 2, split, len);
+		src = s > 0 ? st->work : x;
+		down_body(hb, even, odd, src, len);
+		memmove(even, even + len, sizeof(float) * hist);
+		memmove(odd, odd + len, sizeof(float) * hist);
+	}
+}
+
+static void run_channel_c(struct distort_state *st, int c, float *x, int n)
+{
+	run_channel_body(st, c, x, n);
+}
+
+#ifdef WAV_SIMD_X86
+WAV_TARGET_AVX2
+static void run_channel_avx2(struct distort_state *st, int c, float *x, int n)
+{
+	run_channel_body(st, c, x, n);
+}
+
+WAV_TARGET_AVX512
+static void run_channel_avx512(struct distort_state *st, int c, float *x, int n)
+{
+	run_channel_body(st, c, x, n);
+}
+#endif
+
+static void (*run_channel)(struct distort_state *st, int c, float *x, int n) = run_channel_c;
+
+__attribute__((constructor))
+static void pick_run_channel(void)
+{
+#ifdef WAV_SIMD_X86
+	int level = wav_simd_level();
+
+	if (level >= WAV_SIMD_AVX512)
+		run_channel = run_channel_avx512;
+	else if (level >= WAV_SIMD_AVX2)
+		run_channel = run_channel_avx2;
+#endif
+}
+
+static int load_table(struct wav_effect *fx, struct distort_state *st, const char * path)
+{
+	FILE * f = fopen(path, "r");
+	char word[64];
+	int ch, len = 0;
+
+	if (!f) {
+		perror(path);
+		return wav_effect_error(fx, "could not open table");
+	}
+	st->table = (float * )malloc(sizeof(float) * MAX_TABLE);
+	if (!st->table) {
+		fclose(f);
+		return wav_effect_error(fx, "could not allocate table");
+	}
+	/* numbers are anything between spaces, commas and newlines */
+	do {
+		ch = fgetc(f);
+		if (ch != EOF && ch != ',' && ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r') {
+			if (len < (int )sizeof(word) - 1)
+				word[len++] = ch;
+			continue;
+		}
+		if (!len)
+			continue;
+		word[len] = 0;
+		len = 0;
+		if (st->table_size == MAX_TABLE) {
+			fclose(f);
+			return wav_effect_error(fx, "table has more than 4096 numbers");
+		}
+		char * end;
+		st->table[st->table_size++] = strtof(word, &end);
+		if (*end) {
+			printf("ERROR: %s: %s is not a number\n", path, word);
+			fclose(f);
+			return NOTOK;
+		}
+	} while (ch != EOF);
+	fclose(f);
+	if (st->table_size < 2)
+		return wav_effect_error(fx, "table needs at least 2 numbers");
+	return OK;
+}
+
+static void distort_reset(struct wav_effect *fx)
+{
+	struct distort_state * st = (struct distort_state * )fx->state;
+
+	for (int s = 0; s < st->steps; s++) {
+		int hist = 2 * st->hb[s].m - 1;
+
+		for (int c = 0; c < st->channels; c++) {
+			memset(st->up[s][c], 0, sizeof(float) * hist);
+			memset(st->down_even[s][c], 0, sizeof(float) * hist);
+			memset(st->down_odd[s][c], 0, sizeof(float) * hist);
+		}
+	}
+	memset(st->dc_x1, 0, sizeof(st->dc_x1));
+	memset(st->dc_y1, 0, sizeof(st->dc_y1));
+	st->frame = 0;
+	st->frames_real = 0;
+	st->flushing = 0;
+}
+
+static int distort_init(struct wav_effect *fx, struct wav_stream_fmt *fmt)
+{
+	struct distort_state * st;
+	const char * curve = wav_effect_param_str(fx, "curve", "tanh");
+	const char * table = wav_effect_param_str(fx, "table", NULL);
+	float drive_db = wav_effect_param(fx, "drive", 12.0);
+	float level_db = wav_effect_param(fx, "level", 0.0);
+	float bias = wav_effect_param(fx, "bias", 0.3);
+	int oversample = wav_effect_param(fx, "oversample", 8);
+	size_t floats = 0;
+	float * p;
+	int delay = 0;
+
+	if (drive_db < 0.0 || drive_db > 60.0)
+		return wav_effect_error(fx, "drive must be from 0 to 60 dB");
+	if (level_db < -60.0 || level_db > 12.0)
+		return wav_effect_error(fx, "level must be from -60 to 12 dB");
+	if (bias < 0.0 || bias > 1.0)
+		return wav_effect_error(fx, "bias must be from 0 to 1");
+	if (oversample != 1 && oversample != 2 && oversample != 4 && oversample != 8)
+		return wav_effect_error(fx, "oversample must be 1, 2, 4 or 8");
+
+	st = (struct distort_state * )calloc(1, sizeof(struct distort_state));
+	if (!st)
+		return wav_effect_error(fx, "could not allocate state");
+	fx->state = st;
+	st->channels = fmt->channels;
+	if (!strcmp(curve, "tanh"))
+		st->curve = CURVE_TANH;
+	else if (!strcmp(curve, "tube"))
+		st->curve = CURVE_TUBE;
+	else if (!strcmp(curve, "table"))
+		st->curve = CURVE_TABLE;
+	else
+		return wav_effect_error(fx, "curve must be tanh, tube or table");
+	if ((st->curve == CURVE_TABLE) != (table != NULL))
+		return wav_effect_error(fx, "table= goes with curve=table and only with it");
+	if (table && load_table(fx, st, table))
+		return NOTOK;
+	st->drive = powf(10.0f, drive_db / 20.0f);
+	st->level = powf(10.0f, level_db / 20.0f);
+	st->bias = bias;
+	st->bias_out = tanhf(bias);
+	st->dc_block = st->curve != CURVE_TANH;
+	st->dc_r = 1.0 - 2.0 * M_PI * DC_BLOCK_HZ / fmt->samples_per_sec;
+
+	/* the delay of each step, in its own input samples, is its filter's
+	 * there and back plus what the steps above it add, halved by the step
+	 * down; keeping the even or odd samples makes that come out whole */
+	for (st->steps = 0; (1 << st->steps) < oversample; st->steps++)
+		design_halfband(&st->hb[st->steps], step_half_taps[st->steps]);
+	for (int s = st->steps - 1; s >= 0; s--) {
+		st->hb[s].phase = delay & 1;
+		delay = (2 * (2 * st->hb[s].m - 1) + delay - st->hb[s].phase) / 2;
+	}
+	st->delay = delay;
+
+	/* a frame out depends on no more input than the filters span, there
+	 * and back, but the DC blocker never forgets */
+	fx->latency_frames = delay;
+	fx->warmup_frames = 0;
+	for (int s = 0; s < st->steps; s++)
+		fx->warmup_frames += (4 * st->hb[s].m + (1 << s) - 1) >> s;
+	if (st->dc_block)
+		fx->warmup_frames = WAV_EFFECT_UNBOUNDED;
+
+	for (int s = 0; s < st->steps; s++)
+		floats += (size_t )3 * st->channels * (2 * st->hb[s].m - 1 + (CHUNK_FRAMES << s));
+	floats += (size_t )2 * (CHUNK_FRAMES << MAX_STEPS) + (CHUNK_FRAMES << MAX_STEPS);
+	st->alloc = (float * )malloc(sizeof(float) * floats);
+	if (!st->alloc || wav_planar_alloc(st->channels, CHUNK_FRAMES, &st->planes))
+		return wav_effect_error(fx, "could not allocate buffers");
+	p = st->alloc;
+	for (int s = 0; s < st->steps; s++) {
+		size_t len = 2 * st->hb[s].m - 1 + (CHUNK_FRAMES << s);
+
+		for (int c = 0; c < st->channels; c++) {
+			st->up[s][c] = p;
+			st->down_even[s][c] = p + len;
+			st->down_odd[s][c] = p + 2 * len;
+			p += 3 * len;
+		}
+	}
+	st->even = p;
+	st->odd = p + (CHUNK_FRAMES << MAX_STEPS);
+	st->work = p + 2 * (CHUNK_FRAMES << MAX_STEPS);
+	distort_reset(fx);
+	return OK;
+}
+
+/* take frames in from data and write the ones that are out of the filters'
+ * delay back into data, never ahead of the reading.  returns frames written */
+static int distort_run(struct distort_state *st, float *data, int frames)
+{
+	int ch = st->channels;
+	int out = 0;
+
+	for (int done = 0; done < frames; ) {
+		int n = frames - done < CHUNK_FRAMES ? frames - done : CHUNK_FRAMES;
+		int skip = st->frame < st->delay ? st->delay - st->frame : 0;
+
+		skip = skip > n ? n : skip;
+		wav_deinterleave(data + (size_t )done * ch, ch, st->planes.ch, n);
+		for (int c = 0; c < ch; c++) {
+			float * x = st->planes.ch[c];
+
+			for (int k = 0; k < n; k++)
+				x[k] *= st->drive;
+			run_channel(st, c, x, n);
+			if (st->dc_block) {
+				float x1 = st->dc_x1[c], y1 = st->dc_y1[c];
+
+				for (int k = 0; k < n; k++) {
+					float y = x[k] - x1 + st->dc_r * y1;
+					x1 = x[k];
+					x[k] = y1 = y;
+				}
+				st->dc_x1[c] = x1;
+				st->dc_y1[c] = y1;
+			}
+			for (int k = 0; k < n; k++)
+				x[k] *= st->level;
+		}
+		for (int c = 0; c < ch; c++)
+			st->planes.ch[c] += skip;
+		wav_interleave((const float * const * )st->planes.ch, ch, data + (size_t )out * ch, n - skip);
+		for (int c = 0; c < ch; c++)
+			st->planes.ch[c] -= skip;
+		out += n - skip;
+		done += n;
+		st->frame += n;
+	}
+	return out;
+}
+
+static int distort_process(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct distort_state * st = (struct distort_state * )fx->state;
+
+	blk->frames = distort_run(st, blk->data, blk->frames);
+	return OK;
+}
+
+/* push silence through until every input frame is out */
+
+static int distort_flush(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct distort_state * st = (struct distort_state * )fx->state;
+	int64_t left;
+	int frames;
+
+	if (!st->flushing) {
+		st->frames_real = st->frame;
+		st->flushing = 1;
+	}
+	left = st->frames_real + st->delay - st->frame;
+	frames = left < fx->in_fmt.max_frames ? left : fx->in_fmt.max_frames;
+	memset(blk->data, 0, sizeof(float) * frames * st->channels);
+	blk->frames = distort_run(st, blk->data, frames);
+	return OK;
+}
+
+static void distort_destroy(struct wav_effect *fx)
+{
+	struct distort_state * st = (struct distort_state * )fx->state;
+
+	if (!st)
+		return;
+	free(st->table);
+	free(st->alloc);
+	wav_planar_free(&st->planes);
+	free(st);
+}
+
+const struct wav_effect_ops wav_distort_ops = {
+	.name = "distort",
+	.help = "curve=tanh drive=12 level=0 bias=0.3 table=curve.txt oversample=8  oversampled waveshaper, dB",
+	.init = distort_init,
+	.process = distort_process,
+	.flush = distort_flush,
+	.reset = distort_reset,
+	.destroy = distort_destroy,
+};
@@ -0,0 +1,518 @@
+/* lookahead dynamics effect stages: limit, compress and gate
+ *
+ * limit parameters:
+ *   ceiling - highest output peak in dBFS, -20 to 0 (default -0.3)
+ *   lookahead - ms, 0.1 to 50 (default 5)
+ *   release - ms for the gain to recover most of the way, 1 to 2000 (default 50)
+ *
+ * compress parameters:
+ *   threshold - dBFS where compression starts, -60 to 0 (default -18)
+ *   ratio - 1 to 50 (default 4)
+ *   knee - dB wide soft knee around threshold, 0 to 24 (default 6)
+ *   makeup - dB of gain after compression, 0 to 40 (default 0)
+ *   attack - ms, 0.1 to 500 (default 10)
+ *   release - ms, 1 to 5000 (default 150)
+ *   lookahead - ms, 0.1 to 50 (default 5)
+ *
+ * gate parameters:
+ *   threshold - dBFS under which the gate closes, -90 to 0 (default -50)
+ *   range - dB of attenuation when closed, -90 to 0 (default -60)
+ *   hold - ms the gate stays open after the level drops, 0 to 2000 (default 20)
+ *   attack - ms to open, 0.1 to 500 (default 1)
+ *   release - ms to close, 1 to 5000 (default 100)
+ *   lookahead - ms, 0.1 to 50 (default 5)
+ *
+ * All three work a step of DYN_STEP_FRAMES frames at a time.  The peak of
+ * every channel over a step goes into a monotonic deque that gives the
+ * loudest step from the one before the lookahead window to its end, in
+ * O(1) per step whatever the lookahead.  The stage turns that level into
+ * a target gain, follows it with its attack and release, and averages the
+ * result over the lookahead window, so the gain ramps down over the
+ * lookahead ahead of a peak instead of stepping.  The output is delayed
+ * by the lookahead, rounded up to whole steps, and each step is scaled by
+ * a gain that moves in a straight line from the last step's gain to this
+ * one's, which is a plain vector loop.  Both ends of that line already
+ * allowed for every peak in the step, so a limiter's output stays under
+ * its ceiling; any rounding past it is clamped.
+ *
+ * output is as long as the input, the last lookahead frames come out at flush
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "wav_effect.h"
+#include "wav_simd.h"
+
+#define DYN_STEP_FRAMES 32
+#define LANES 16	/* partial peaks kept side by side, so the loop vectorizes */
+
+struct dyn_state {
+	/* turns the loudest level over the window into a gain, may keep state */
+	float		(*curve)(struct dyn_state *st, float level);
+	int		channels;
+	int		window;		/* lookahead in steps */
+	float		attack;		/* per-step move towards a lower gain */
+	float		release;	/* per-step move towards a higher gain */
+	float		clamp;		/* output is kept within +-clamp */
+
+	/* what curve() works from */
+	float		ceiling;	/* linear */
+	float		threshold;	/* dB */
+	float		open_level;	/* linear */
+	float		slope;		/* 1/ratio - 1 */
+	float		knee;		/* dB */
+	float		makeup;		/* dB */
+	float		range;		/* linear */
+	int		hold;		/* steps */
+	int		hold_left;
+
+	float *		ring;		/* window + 1 steps of input */
+	int		fill;		/* frames in the step being filled */
+	int64_t		step;		/* steps taken in */
+	int64_t *	dq_step;	/* deque of step peaks, decreasing */
+	float *		dq_level;
+	int		dq_head;
+	int		dq_tail;
+	int		dq_size;
+	float		env;		/* gain after attack and release */
+	float *		smooth;		/* window gains being averaged, a ring */
+	double		smooth_sum;
+	float		gain;		/* gain at the end of the last step put out */
+	float *		ramp;		/* (k+1)/DYN_STEP_FRAMES for each sample of a step */
+	float *		out_buf;
+	int64_t		frames_in;
+	int64_t		frames_out;
+	int64_t		frames_real;	/* input frames, set at flush */
+	int		flushing;
+};
+
+static float db_to_gain(float db)
+{
+	return powf(10.0f, db / 20.0f);
+}
+
+static float limit_curve(struct dyn_state *st, float level)
+{
+	return st->ceiling / fmaxf(level, st->ceiling);
+}
+
+/* gain reduction with a quadratic soft knee, plus makeup */
+
+static float compress_curve(struct dyn_state *st, float level)
+{
+	float over = 20.0f * log10f(fmaxf(level, 1e-9f)) - st->threshold;
+	float db;
+
+	if (2.0f * over <= -st->knee)
+		db = 0.0f;
+	else if (2.0f * over < st->knee)
+		db = st->slope * (over + st->knee / 2.0f) * (over + st->knee / 2.0f) / (2.0f * st->knee);
+	else
+		db = st->slope * over;
+	return db_to_gain(db + st->makeup);
+}
+
+static float gate_curve(struct dyn_state *st, float level)
+{
+	if (level >= st->open_level) {
+		st->hold_left = st->hold;
+		return 1.0f;
+	}
+	if (st->hold_left > 0) {
+		st->hold_left--;
+		return 1.0f;
+	}
+	return st->range;
+}
+
+/* largest magnitude of n samples, n a multiple of LANES */
+
+static inline __attribute__((always_inline))
+float peak_body(const float * restrict x, int n)
+{
+	float peak[LANES] = { 0 };
+	float max = 0.0f;
+
+	for (int k = 0; k < n; k += LANES) {
+		for (int l = 0; l < LANES; l++) {
+			float a = fabsf(x[k + l]);
+			peak[l] = a > peak[l] ? a : peak[l];
+		}
+	}
+	for (int l = 0; l < LANES; l++)
+		max = peak[l] > max ? peak[l] : max;
+	return max;
+}
+
+/* dst = src scaled by gain going from g0 towards g0 + dg along ramp */
+
+static inline __attribute__((always_inline))
+void apply_body(const float * restrict src, float * restrict dst, const float * restrict ramp, int n,
+		float g0, float dg, float clamp)
+{
+	for (int k = 0; k < n; k++) {
+		float y = src[k] * (g0 + dg * ramp[k]);
+		y = y < clamp ? y : clamp;
+		dst[k] = y > -clamp ? y : -clamp;
+	}
+}
+
+static float peak_c(const float *x, int n)
+{
+	return peak_body(x, n);
+}
+
+static void apply_c(const float *src, float *dst, const float *ramp, int n, float g0, float dg, float clamp)
+{
+	apply_body(src, dst, ramp, n, g0, dg, clamp);
+}
+
+#ifdef WAV_SIMD_X86
+WAV_TARGET_AVX2
+static float peak_avx2(const float *x, int n)
+{
+	return peak_body(x, n);
+}
+
+WAV_TARGET_AVX2
+static void apply_avx2(const float *src, float *dst, const float *ramp, int n, float g0, float dg, float clamp)
+{
+	apply_body(src, dst, ramp, n, g0, dg, clamp);
+}
+
+WAV_TARGET_AVX512
+static float peak_avx512(const float *x, int n)
+{
+	return peak_body(x, n);
+}
+
+WAV_TARGET_AVX512
+static void apply_avx512(const float *src, float *dst, const float *ramp, int n, float g0, float dg, float clamp)
+{
+	apply_body(src, dst, ramp, n, g0, dg, clamp);
+}
+#endif
+
+static float (*peak_level)(const float *x, int n) = peak_c;
+static void (*apply_gain)(const float *src, float *dst, const float *ramp, int n, float g0, float dg, float clamp) = apply_c;
+
+__attribute__((constructor))
+static void pick_kernels(void)
+{
+#ifdef WAV_SIMD_X86
+	int level = wav_simd_level();
+
+	if (level >= WAV_SIMD_AVX512) {
+		peak_level = peak_avx512;
+		apply_gain = apply_avx512;
+	} else if (level >= WAV_SIMD_AVX2) {
+		peak_level = peak_avx2;
+		apply_gain = apply_avx2;
+	}
+#endif
+}
+
+static void dyn_reset(struct wav_effect *fx)
+{
+	struct dyn_state * st = (struct dyn_state * )fx->state;
+	float rest;
+
+	st->hold_left = 0;
+	rest = st->curve(st, 0.0f);
+	memset(st->ring, 0, sizeof(float) * (st->window + 1) * DYN_STEP_FRAMES * st->channels);
+	for (int k = 0; k < st->window; k++)
+		st->smooth[k] = rest;
+	st->smooth_sum = (double )rest * st->window;
+	st->env = rest;
+	st->gain = rest;
+	st->dq_head = st->dq_tail = 0;
+	st->fill = 0;
+	st->step = 0;
+	st->frames_in = 0;
+	st->frames_out = 0;
+	st->frames_real = 0;
+	st->flushing = 0;
+}
+
+/* per-step coefficient for a one-pole that gets most of the way in ms */
+
+static float step_coef(float ms, int samples_per_sec)
+{
+	return 1.0f - expf(-1000.0f * DYN_STEP_FRAMES / (ms * samples_per_sec));
+}
+
+/* what every kind of stage shares, after its own parameters are read */
+
+static int dyn_init(struct wav_effect *fx, struct wav_stream_fmt *fmt, struct dyn_state *st, float lookahead_ms)
+{
+	int step_samples = DYN_STEP_FRAMES * fmt->channels;
+
+	if (lookahead_ms < 0.1 || lookahead_ms > 50.0)
+		return wav_effect_error(fx, "lookahead must be from 0.1 to 50 ms");
+	st->channels = fmt->channels;
+	st->window = (int )ceil(lookahead_ms * fmt->samples_per_sec / (1000.0 * DYN_STEP_FRAMES));
+	if (st->window < 1)
+		st->window = 1;
+	st->dq_size = st->window + 4;	/* window + 2 steps, one just pushed, one slot free */
+	st->ring = (float * )malloc(sizeof(float) * (st->window + 1) * step_samples);
+	st->dq_step = (int64_t * )malloc(sizeof(int64_t) * st->dq_size);
+	st->dq_level = (float * )malloc(sizeof(float) * st->dq_size);
+	st->smooth = (float * )malloc(sizeof(float) * st->window);
+	st->ramp = (float * )malloc(sizeof(float) * step_samples);
+	/* up to a step more comes out of a call than goes in */
+	st->out_buf = (float * )malloc(sizeof(float) * (fmt->max_frames + DYN_STEP_FRAMES) * fmt->channels);
+	if (!st->ring || !st->dq_step || !st->dq_level || !st->smooth || !st->ramp || !st->out_buf)
+		return wav_effect_error(fx, "could not allocate buffers");
+	for (int k = 0; k < step_samples; k++)
+		st->ramp[k] = (float )(k / fmt->channels + 1) / DYN_STEP_FRAMES;
+	fmt->max_frames += DYN_STEP_FRAMES;
+	/* the envelope's release never forgets a peak exactly */
+	fx->warmup_frames = WAV_EFFECT_UNBOUNDED;
+	fx->latency_frames = st->window * DYN_STEP_FRAMES;
+	dyn_reset(fx);
+	return OK;
+}
+
+static struct dyn_state * alloc_state(struct wav_effect *fx)
+{
+	struct dyn_state * st = (struct dyn_state * )calloc(1, sizeof(struct dyn_state));
+
+	if (!st)
+		wav_effect_error(fx, "could not allocate state");
+	fx->state = st;
+	return st;
+}
+
+static int limit_init(struct wav_effect *fx, struct wav_stream_fmt *fmt)
+{
+	struct dyn_state * st;
+	float ceiling_db = wav_effect_param(fx, "ceiling", -0.3);
+	float release_ms = wav_effect_param(fx, "release", 50.0);
+
+	if (ceiling_db < -20.0 || ceiling_db > 0.0)
+		return wav_effect_error(fx, "ceiling must be from -20 to 0 dB");
+	if (release_ms < 1.0 || release_ms > 2000.0)
+		return wav_effect_error(fx, "release must be from 1 to 2000 ms");
+	if (!(st = alloc_state(fx)))
+		return NOTOK;
+	st->curve = limit_curve;
+	st->ceiling = db_to_gain(ceiling_db);
+	st->clamp = st->ceiling;
+	st->attack = 1.0f;
+	st->release = step_coef(release_ms, fmt->samples_per_sec);
+	return dyn_init(fx, fmt, st, wav_effect_param(fx, "lookahead", 5.0));
+}
+
+static int compress_init(struct wav_effect *fx, struct wav_stream_fmt *fmt)
+{
+	struct dyn_state * st;
+	float threshold = wav_effect_param(fx, "threshold", -18.0);
+	float ratio = wav_effect_param(fx, "ratio", 4.0);
+	float knee = wav_effect_param(fx, "knee", 6.0);
+	float makeup = wav_effect_param(fx, "makeup", 0.0);
+	float attack_ms = wav_effect_param(fx, "attack", 10.0);
+	float release_ms = wav_effect_param(fx, "release", 150.0);
+
+	if (threshold < -60.0 || threshold > 0.0)
+		return wav_effect_error(fx, "threshold must be from -60 to 0 dB");
+	if (ratio < 1.0 || ratio > 50.0)
+		return wav_effect_error(fx, "ratio must be from 1 to 50");
+	if (knee < 0.0 || knee > 24.0)
+		return wav_effect_error(fx, "knee must be from 0 to 24 dB");
+	if (makeup < 0.0 || makeup > 40.0)
+		return wav_effect_error(fx, "makeup must be from 0 to 40 dB");
+	if (attack_ms < 0.1 || attack_ms > 500.0)
+		return wav_effect_error(fx, "attack must be from 0.1 to 500 ms");
+	if (release_ms < 1.0 || release_ms > 5000.0)
+		return wav_effect_error(fx, "release must be from 1 to 5000 ms");
+	if (!(st = alloc_state(fx)))
+		return NOTOK;
+	st->curve = compress_curve;
+	st->threshold = threshold;
+	st->slope = 1.0f / ratio - 1.0f;
+	st->knee = knee;
+	st->makeup = makeup;
+	st->clamp = INFINITY;
+	st->attack = step_coef(attack_ms, fmt->samples_per_sec);
+	st->release = step_coef(release_ms, fmt->samples_per_sec);
+	return dyn_init(fx, fmt, st, wav_effect_param(fx, "lookahead", 5.0));
+}
+
+static int gate_init(struct wav_effect *fx, struct wav_stream_fmt *fmt)
+{
+	struct dyn_state * st;
+	float threshold = wav_effect_param(fx, "threshold", -50.0);
+	float range = wav_effect_param(fx, "range", -60.0);
+	float hold_ms = wav_effect_param(fx, "hold", 20.0);
+	float attack_ms = wav_effect_param(fx, "attack", 1.0);
+	float release_ms = wav_effect_param(fx, "release", 100.0);
+
+	if (threshold < -90.0 || threshold > 0.0)
+		return wav_effect_error(fx, "threshold must be from -90 to 0 dB");
+	if (range < -90.0 || range > 0.0)
+		return wav_effect_error(fx, "range must be from -90 to 0 dB");
+	if (hold_ms < 0.0 || hold_ms > 2000.0)
+		return wav_effect_error(fx, "hold must be from 0 to 2000 ms");
+	if (attack_ms < 0.1 || attack_ms > 500.0)
+		return wav_effect_error(fx, "attack must be from 0.1 to 500 ms");
+	if (release_ms < 1.0 || release_ms > 5000.0)
+		return wav_effect_error(fx, "release must be from 1 to 5000 ms");
+	if (!(st = alloc_state(fx)))
+		return NOTOK;
+	st->curve = gate_curve;
+	st->open_level = db_to_gain(threshold);
+	st->range = db_to_gain(range);
+	st->hold = (int )(hold_ms * fmt->samples_per_sec / (1000.0 * DYN_STEP_FRAMES) + 0.5);
+	st->clamp = INFINITY;
+	/* opening is the gain going up, closing it going down */
+	st->attack = step_coef(release_ms, fmt->samples_per_sec);
+	st->release = step_coef(attack_ms, fmt->samples_per_sec);
+	return dyn_init(fx, fmt, st, wav_effect_param(fx, "lookahead", 5.0));
+}
+
+/* take in the step that has just filled, and put out the one leaving the
+ * lookahead into out.  returns frames put out */
+
+static int run_step(struct dyn_state *st, float *out)
+{
+	int W = st->window;
+	int samples = DYN_STEP_FRAMES * st->channels;
+	const float * in = st->ring + (st->step % (W + 1)) * samples;
+	float level = peak_level(in, samples);
+	float target, gain;
+	int64_t leaving;
+	int pos;
+
+	/* loudest step from one before the window to its end */
+	while (st->dq_tail != st->dq_head &&
+	       st->dq_level[(st->dq_tail + st->dq_size - 1) % st->dq_size] <= level)
+		st->dq_tail = (st->dq_tail + st->dq_size - 1) % st->dq_size;
+	st->dq_step[st->dq_tail] = st->step;
+	st->dq_level[st->dq_tail] = level;
+	st->dq_tail = (st->dq_tail + 1) % st->dq_size;
+	if (st->dq_step[st->dq_head] < st->step - W - 1)
+		st->dq_head = (st->dq_head + 1) % st->dq_size;
+
+	target = st->curve(st, st->dq_level[st->dq_head]);
+	st->env += (target - st->env) * (target < st->env ? st->attack : st->release);
+	pos = st->step % W;
+	st->smooth_sum += st->env - st->smooth[pos];
+	st->smooth[pos] = st->env;
+	gain = (float )(st->smooth_sum / W);
+
+	/* the step W behind this one leaves the ring */
+	leaving = st->step++ - W;
+	if (leaving >= 0)
+		apply_gain(st->ring + (leaving % (W + 1)) * samples, out, st->ramp, samples,
+			   st->gain, gain - st->gain, st->clamp);
+	st->gain = gain;
+	return leaving >= 0 ? DYN_STEP_FRAMES : 0;
+}
+
+/* take frames in from in, or silence if in is NULL, and put whole steps
+ * out into out.  returns frames put out */
+
+static int dyn_run(struct dyn_state *st, const float *in, int frames, float *out)
+{
+	int ch = st->channels;
+	int used = 0;
+	int out_frames = 0;
+
+	while (used < frames) {
+		float * slot = st->ring + ((st->step % (st->window + 1)) * DYN_STEP_FRAMES + st->fill) * ch;
+		int take = frames - used;
+
+		if (take > DYN_STEP_FRAMES - st->fill)
+			take = DYN_STEP_FRAMES - st->fill;
+		if (in)
+			memcpy(slot, in + (size_t )used * ch, sizeof(float) * take * ch);
+		else
+			memset(slot, 0, sizeof(float) * take * ch);
+		st->fill += take;
+		used += take;
+		if (st->fill == DYN_STEP_FRAMES) {
+			out_frames += run_step(st, out + (size_t )out_frames * ch);
+			st->fill = 0;
+		}
+	}
+	return out_frames;
+}
+
+static int dyn_process(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct dyn_state * st = (struct dyn_state * )fx->state;
+
+	st->frames_in += blk->frames;
+	blk->frames = dyn_run(st, blk->data, blk->frames, st->out_buf);
+	blk->data = st->out_buf;
+	st->frames_out += blk->frames;
+	return OK;
+}
+
+/* push silence through, a step at a time, until every input frame is out */
+
+static int dyn_flush(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct dyn_state * st = (struct dyn_state * )fx->state;
+	int room = fx->in_fmt.max_frames + DYN_STEP_FRAMES;	/* what the next stage takes */
+	int64_t left;
+	int out = 0;
+
+	if (!st->flushing) {
+		st->frames_real = st->frames_in;
+		st->flushing = 1;
+	}
+	left = st->frames_real - st->frames_out;
+	while (out < left && out + DYN_STEP_FRAMES <= room)
+		out += dyn_run(st, NULL, DYN_STEP_FRAMES - st->fill, blk->data + (size_t )out * st->channels);
+	blk->frames = out < left ? out : left;
+	st->frames_out += blk->frames;
+	return OK;
+}
+
+static void dyn_destroy(struct wav_effect *fx)
+{
+	struct dyn_state * st = (struct dyn_state * )fx->state;
+
+	if (!st)
+		return;
+	free(st->ring);
+	free(st->dq_step);
+	free(st->dq_level);
+	free(st->smooth);
+	free(st->ramp);
+	free(st->out_buf);
+	free(st);
+}
+
+const struct wav_effect_ops wav_limit_ops = {
+	.name = "limit",
+	.help = "ceiling=-0.3 lookahead=5 release=50  lookahead brickwall limiter, dB and ms",
+	.init = limit_init,
+	.process = dyn_process,
+	.flush = dyn_flush,
+	.reset = dyn_reset,
+	.destroy = dyn_destroy,
+};
+
+const struct wav_effect_ops wav_compress_ops = {
+	.name = "compress",
+	.help = "threshold=-18 ratio=4 knee=6 makeup=0 attack=10 release=150 lookahead=5  compressor, dB and ms",
+	.init = compress_init,
+	.process = dyn_process,
+	.flush = dyn_flush,
+	.reset = dyn_reset,
+	.destroy = dyn_destroy,
+};
+
+const struct wav_effect_ops wav_gate_ops = {
+	.name = "gate",
+	.help = "threshold=-50 range=-60 hold=20 attack=1 release=100 lookahead=5  noise gate, dB and ms",
+	.init = gate_init,
+	.process = dyn_process,
+	.flush = dyn_flush,
+	.reset = dyn_reset,
+	.destroy = dyn_destroy,
+};
@@ -0,0 +1,398 @@
+/* effect stage chains, see wav_effect.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "wav_effect.h"
+
+#define MAX_SPEC_LEN 1024
+
+/* every kind of stage that can appear in a spec */
+static const struct wav_effect_ops * const effect_kinds[] = {
+	&wav_ripple_ops,
+	&wav_resample_ops,
+	&wav_convolve_ops,
+	&wav_limit_ops,
+	&wav_compress_ops,
+	&wav_gate_ops,
+	&wav_meter_ops,
+	&wav_distort_ops,
+	&wav_eq_ops,
+	NULL
+};
+
+static struct wav_effect_param * find_param(struct wav_effect *fx, const char * key)
+{
+	for (int k = 0; k < fx->param_count; k++) {
+		if (!strcmp(fx->params[k].key, key)) {
+			fx->params[k].used = 1;
+			return &fx->params[k];
+		}
+	}
+	return NULL;
+}
+
+double wav_effect_param(struct wav_effect *fx, const char * key, double default_value)
+{
+	struct wav_effect_param * p = find_param(fx, key);
+	return p ? atof(p->value) : default_value;
+}
+
+const char * wav_effect_param_str(struct wav_effect *fx, const char * key, const char * default_value)
+{
+	struct wav_effect_param * p = find_param(fx, key);
+	return p ? p->value : default_value;
+}
+
+int wav_effect_error(struct wav_effect *fx, const char * msg)
+{
+	printf("ERROR: %s: %s\n", fx->ops->name, msg);
+	return NOTOK;
+}
+
+static void free_effect(struct wav_effect *fx)
+{
+	if (fx->ops->destroy)
+		fx->ops->destroy(fx);
+	for (int k = 0; k < fx->param_count; k++) {
+		free(fx->params[k].key);
+		free(fx->params[k].value);
+	}
+	free(fx);
+}
+
+/* parse name:key=value,key=value into a new stage. return OK if done, NOTOK otherwise */
+
+int wav_pipeline_add(struct wav_pipeline *pl, const char * spec)
+{
+	char buf[MAX_SPEC_LEN];
+	char * name, * params, * pair, * save;
+	struct wav_effect * fx;
+	struct wav_effect ** stages;
+	int k;
+
+	if (strlen(spec) >= sizeof(buf)) {
+		printf("ERROR: effect spec too long: %s\n", spec);
+		return NOTOK;
+	}
+	strcpy(buf, spec);
+	name = buf;
+	params = strchr(buf, ':');
+	if (params)
+		*params++ = 0;
+
+	fx = (struct wav_effect * )calloc(1, sizeof(struct wav_effect));
+	if (!fx) {
+		printf("ERROR: could not allocate effect\n");
+		return NOTOK;
+	}
+	for (k = 0; effect_kinds[k]; k++)
+		if (!strcmp(name, effect_kinds[k]->name))
+			break;
+	if (!effect_kinds[k]) {
+		printf("ERROR: unknown effect %s\n", name);
+		free(fx);
+		return NOTOK;
+	}
+	fx->ops = effect_kinds[k];
+
+	for (pair = params ? strtok_r(params, ",", &save) : NULL; pair; pair = strtok_r(NULL, ",", &save)) {
+		char * eq = strchr(pair, '=');
+		if (!eq || eq == pair) {
+			printf("ERROR: effect %s parameter %s is not key=value\n", name, pair);
+			free_effect(fx);
+			return NOTOK;
+		}
+		if (fx->param_count == WAV_EFFECT_MAX_PARAMS) {
+			printf("ERROR: effect %s has too many parameters\n", name);
+			free_effect(fx);
+			return NOTOK;
+		}
+		*eq = 0;
+		fx->params[fx->param_count].key = strdup(pair);
+		fx->params[fx->param_count].value = strdup(eq + 1);
+		fx->param_count++;
+	}
+
+	stages = (struct wav_effect ** )realloc(pl->stages, sizeof(struct wav_effect * ) * (pl->stage_count + 1));
+	if (!stages) {
+		free_effect(fx);
+		printf("ERROR: could not allocate effect chain\n");
+		return NOTOK;
+	}
+	pl->stages = stages;
+	pl->stages[pl->stage_count++] = fx;
+	return OK;
+}
+
+/* one spec per line, # starts a comment. return OK if done, NOTOK otherwise */
+
+int wav_pipeline_load(struct wav_pipeline *pl, const char * chain_filename)
+{
+	char line[MAX_SPEC_LEN];
+	FILE * f = fopen(chain_filename, "r");
+	int rc = OK;
+
+	if (!f) {
+		perror(chain_filename);
+		return NOTOK;
+	}
+	while (rc == OK && fgets(line, sizeof(line), f)) {
+		char * start = line;
+		char * end;
+		char * hash = strchr(line, '#');
+		if (hash)
+			*hash = 0;
+		while (isspace(*start))
+			start++;
+		end = start + strlen(start);
+		while (end > start && isspace(end[-1]))
+			*--end = 0;
+		if (*start)
+			rc = wav_pipeline_add(pl, start);
+	}
+	fclose(f);
+	return rc;
+}
+
+int wav_pipeline_init(struct wav_pipeline *pl, const struct wav_stream_fmt *fmt)
+{
+	struct wav_stream_fmt next_fmt = *fmt;
+	int max_samples = fmt->max_frames * fmt->channels;
+
+	for (int k = 0; k < pl->stage_count; k++) {
+		struct wav_effect * fx = pl->stages[k];
+		fx->in_fmt = next_fmt;
+		if (fx->ops->init(fx, &next_fmt) != OK)
+			return NOTOK;
+		for (int p = 0; p < fx->param_count; p++) {
+			if (!fx->params[p].used) {
+				printf("ERROR: effect %s has no parameter %s\n", fx->ops->name, fx->params[p].key);
+				return NOTOK;
+			}
+		}
+		if (next_fmt.max_frames * next_fmt.channels > max_samples)
+			max_samples = next_fmt.max_frames * next_fmt.channels;
+	}
+	pl->out_fmt = next_fmt;
+
+	/* stages flush into this, it must hold the largest block any stage emits */
+	pl->flush_buf = (float * )malloc(sizeof(float) * max_samples);
+	if (!pl->flush_buf) {
+		printf("ERROR: could not allocate flush buffer\n");
+		return NOTOK;
+	}
+	pl->flush_stage = 0;
+	return OK;
+}
+
+/* run blk through stages first_stage and after. return OK if done, NOTOK otherwise */
+
+static int process_from(struct wav_pipeline *pl, int first_stage, struct wav_block *blk)
+{
+	for (int k = first_stage; k < pl->stage_count && blk->frames > 0; k++) {
+		struct wav_effect * fx = pl->stages[k];
+		blk->first_frame = fx->frames_in;
+		fx->frames_in += blk->frames;
+		if (fx->ops->process(fx, blk) != OK)
+			return NOTOK;
+	}
+	return OK;
+}
+
+int wav_pipeline_set(struct wav_pipeline *pl, int stage, const char * key, const char * value)
+{
+	struct wav_effect * fx;
+
+	if (stage < 0 || stage >= pl->stage_count) {
+		printf("ERROR: no effect stage %d\n", stage);
+		return NOTOK;
+	}
+	fx = pl->stages[stage];
+	if (!fx->ops->set)
+		return wav_effect_error(fx, "parameters can not be changed while running");
+	return fx->ops->set(fx, key, value);
+}
+
+int wav_pipeline_process(struct wav_pipeline *pl, struct wav_block *blk)
+{
+	return process_from(pl, 0, blk);
+}
+
+int wav_pipeline_can_s16(struct wav_pipeline *pl, const struct wav_info *in_info, const struct wav_info *out_info)
+{
+	if (pl->stage_count == 0 ||
+	    in_info->format != WAVE_FORMAT_PCM || in_info->bits_per_sample != 16 ||
+	    out_info->format != WAVE_FORMAT_PCM || out_info->bits_per_sample != 16)
+		return 0;
+	for (int k = 0; k < pl->stage_count; k++)
+		if (!pl->stages[k]->ops->process_s16)
+			return 0;
+	return 1;
+}
+
+int wav_pipeline_process_s16(struct wav_pipeline *pl, int16_t *data, int frames)
+{
+	for (int k = 0; k < pl->stage_count; k++) {
+		struct wav_effect * fx = pl->stages[k];
+		int64_t first_frame = fx->frames_in;
+		fx->frames_in += frames;
+		if (fx->ops->process_s16(fx, data, frames, first_frame) != OK)
+			return NOTOK;
+	}
+	return OK;
+}
+
+int wav_pipeline_flush(struct wav_pipeline *pl, struct wav_block *blk)
+{
+	blk->frames = 0;
+	while (pl->flush_stage < pl->stage_count) {
+		struct wav_effect * fx = pl->stages[pl->flush_stage];
+		if (fx->ops->flush) {
+			blk->data = pl->flush_buf;
+			blk->channels = pl->flush_stage + 1 < pl->stage_count ?
+				pl->stages[pl->flush_stage + 1]->in_fmt.channels : pl->out_fmt.channels;
+			if (fx->ops->flush(fx, blk) != OK)
+				return NOTOK;
+			if (blk->frames > 0)
+				return process_from(pl, pl->flush_stage + 1, blk);
+		}
+		/* this stage is drained, move on to the next one */
+		pl->flush_stage++;
+	}
+	return OK;
+}
+
+int wav_pipeline_run(struct wav_pipeline *pl, struct wav_reader *rdr, struct wav_writer *wtr)
+{
+	int channels = pl->stage_count ? pl->stages[0]->in_fmt.channels : pl->out_fmt.channels;
+	float * block_buf;
+	int rc;
+
+	block_buf = (float * )malloc(sizeof(float) * WAV_EFFECT_BLOCK_FRAMES * channels);
+	if (!block_buf) {
+		printf("ERROR: could not allocate block buffer\n");
+		return NOTOK;
+	}
+	rc = wav_pipeline_run_buf(pl, rdr, wtr, block_buf);
+	free(block_buf);
+	return rc;
+}
+
+int wav_pipeline_run_buf(struct wav_pipeline *pl, struct wav_reader *rdr, struct wav_writer *wtr, float *block_buf)
+{
+	int channels = pl->stage_count ? pl->stages[0]->in_fmt.channels : pl->out_fmt.channels;
+	struct wav_block blk;
+	int frames;
+	int rc = OK;
+
+	for (;;) {
+		rc = wav_reader_read_float(rdr, block_buf, WAV_EFFECT_BLOCK_FRAMES, &frames);
+		if (rc != OK || frames == 0)
+			break;
+		blk.data = block_buf;
+		blk.frames = frames;
+		blk.channels = channels;
+		rc = wav_pipeline_process(pl, &blk);
+		if (rc == OK)
+			rc = wav_writer_write_float(wtr, blk.data, blk.frames);
+		if (rc != OK)
+			break;
+	}
+
+	/* drain whatever the stages are still holding */
+
+	while (rc == OK) {
+		rc = wav_pipeline_flush(pl, &blk);
+		if (rc != OK || blk.frames == 0)
+			break;
+		rc = wav_writer_write_float(wtr, blk.data, blk.frames);
+	}
+	return rc;
+}
+
+int wav_pipeline_run_s16(struct wav_pipeline *pl, struct wav_reader *rdr, struct wav_writer *wtr, int16_t *block_buf)
+{
+	struct wav_block blk;
+	int frames;
+	int rc;
+
+	for (;;) {
+		rc = wav_reader_read_raw(rdr, block_buf, WAV_EFFECT_BLOCK_FRAMES, &frames);
+		if (rc != OK || frames == 0)
+			break;
+		rc = wav_pipeline_process_s16(pl, block_buf, frames);
+		if (rc == OK)
+			rc = wav_writer_write_raw(wtr, block_buf, frames);
+		if (rc != OK)
+			break;
+	}
+
+	/* drain whatever the stages are still holding */
+
+	while (rc == OK) {
+		rc = wav_pipeline_flush(pl, &blk);
+		if (rc != OK || blk.frames == 0)
+			break;
+		rc = wav_writer_write_float(wtr, blk.data, blk.frames);
+	}
+	return rc;
+}
+
+void wav_pipeline_seek(struct wav_pipeline *pl, int64_t frame)
+{
+	for (int k = 0; k < pl->stage_count; k++) {
+		struct wav_effect * fx = pl->stages[k];
+		if (fx->ops->reset)
+			fx->ops->reset(fx);
+		fx->frames_in = frame;
+	}
+	pl->flush_stage = 0;
+}
+
+int wav_pipeline_can_split(struct wav_pipeline *pl)
+{
+	for (int k = 0; k < pl->stage_count; k++) {
+		struct wav_effect * fx = pl->stages[k];
+		const struct wav_stream_fmt * next_fmt = (k + 1 < pl->stage_count) ? 
+			&pl->stages[k + 1]->in_fmt : &pl->out_fmt;
+		if (next_fmt->samples_per_sec != fx->in_fmt.samples_per_sec ||
+		    fx->warmup_frames == WAV_EFFECT_UNBOUNDED ||
+		    (fx->ops->flush && fx->latency_frames == WAV_EFFECT_UNBOUNDED))
+			return 0;
+	}
+	return 1;
+}
+
+int wav_pipeline_warmup_frames(struct wav_pipeline *pl)
+{
+	int warmup = 0;
+
+	/* history needed by each stage adds up along the chain */
+	for (int k = 0; k < pl->stage_count; k++)
+		warmup += pl->stages[k]->warmup_frames;
+	return warmup;
+}
+
+void wav_pipeline_free(struct wav_pipeline *pl)
+{
+	for (int k = 0; k < pl->stage_count; k++)
+		free_effect(pl->stages[k]);
+	free(pl->stages);
+	free(pl->flush_buf);
+	memset(pl, 0, sizeof(*pl));
+}
+
+const struct wav_effect_ops * wav_effect_kind(int k)
+{
+	if (k < 0 || k >= sizeof(effect_kinds) / sizeof(effect_kinds[0]))
+		return NULL;
+	return effect_kinds[k];
+}
+
+void wav_effect_list(void)
+{
+	for (int k = 0; effect_kinds[k]; k++)
+		printf("  %-12s %s\n", effect_kinds[k]->name, effect_kinds[k]->help);
+}
@@ -0,0 +1,244 @@
+#ifndef _wav_effect_h_
+# define _wav_effect_h_ 1
+
+/* chain of effect stages that audio flows through a block at a time,
+ * like the pedals and stages of a guitar amp.
+ *
+ * Blocks are small enough to stay in L1/L2 cache while every stage
+ * works on them, so a chain of N effects makes one pass over memory
+ * instead of N.
+ *
+ * A stage is described by a spec string:  name:key=value,key=value
+ * for example  ripple:freq=4000,mod=100,lr=-1,amp=0.5
+ * A chain file has one spec per line, blank lines and # comments are ignored.
+ */
+
+#include "wav_file_access.h"
+
+/* frames per block pushed through the chain, 8 KiB of stereo floats */
+#define WAV_EFFECT_BLOCK_FRAMES 1024
+
+#define WAV_EFFECT_MAX_PARAMS 16
+
+/* warmup_frames or latency_frames of a stage that has no finite bound */
+#define WAV_EFFECT_UNBOUNDED (-1)
+
+/* shape of the audio flowing into (and out of) a stage */
+struct wav_stream_fmt {
+	int	channels;
+	int	samples_per_sec;
+	int	max_frames;	/* most frames a stage will ever see in one block */
+};
+
+/* a block of interleaved normalized float frames */
+struct wav_block {
+	float *	data;
+	int	frames;		/* frames in data */
+	int	channels;
+	int64_t	first_frame;	/* index of data[0] in the stream entering this stage */
+};
+
+struct wav_effect;
+
+/* what every kind of stage implements */
+struct wav_effect_ops {
+	const char *	name;
+	const char *	help;	/* one line describing parameters */
+
+	/* read parameters, allocate state.  May change fmt for later stages,
+	 * e.g. a resampler changes samples_per_sec.  returns 0 if OK */
+	int (*init)(struct wav_effect *fx, struct wav_stream_fmt *fmt);
+
+	/* transform one block, either in place or by pointing blk->data at
+	 * a buffer owned by the stage.  returns 0 if OK */
+	int (*process)(struct wav_effect *fx, struct wav_block *blk);
+
+	/* same as process() but on interleaved s16 samples, in place, with
+	 * saturating fixed-point arithmetic, for chains that read and write s16
+	 * without going through float.  May be NULL, only used when every
+	 * stage in the chain has it */
+	int (*process_s16)(struct wav_effect *fx, int16_t *data, int frames, int64_t first_frame);
+
+	/* at end of input, put any frames the stage still holds (reverb tail,
+	 * lookahead) into blk and return 0; set blk->frames to 0 when there
+	 * are no more.  blk->data has room for max_frames.  May be NULL */
+	int (*flush)(struct wav_effect *fx, struct wav_block *blk);
+
+	/* change parameter key to value between blocks, taking effect from the
+	 * next one.  returns 0 if OK.  May be NULL if nothing can change */
+	int (*set)(struct wav_effect *fx, const char * key, const char * value);
+
+	/* forget all history, as if init() had just been called.  Used when
+	 * a chain jumps to a new position in the stream.  May be NULL if the
+	 * stage keeps no history */
+	void (*reset)(struct wav_effect *fx);
+
+	/* free state.  May be NULL */
+	void (*destroy)(struct wav_effect *fx);
+};
+
+struct wav_effect_param {
+	char *	key;
+	char *	value;
+	int	used;	/* set when the stage looks it up, to catch typos */
+};
+
+/* one stage in a chain */
+struct wav_effect {
+	const struct wav_effect_ops * ops;
+	struct wav_effect_param	params[WAV_EFFECT_MAX_PARAMS];
+	int			param_count;
+	struct wav_stream_fmt	in_fmt;		/* what init() was given */
+	int64_t			frames_in;	/* frames passed to process() so far */
+	int			warmup_frames;	/* set by init(): how many frames of input history
+						 * determine the output, 0 if none, WAV_EFFECT_UNBOUNDED
+						 * if all of it does (IIR filters, envelopes, meters) */
+	int			latency_frames;	/* set by init(): how many frames the output lags
+						 * the input, given back by flush() so the output is
+						 * as long as the input; WAV_EFFECT_UNBOUNDED if
+						 * flush() gives more (a reverb tail) */
+	void *			state;		/* owned by the stage */
+};
+
+/* look up parameter key, returning default_value if it was not given */
+double wav_effect_param(struct wav_effect *fx, const char * key, double default_value);
+const char * wav_effect_param_str(struct wav_effect *fx, const char * key, const char * default_value);
+
+/* report a stage error, returns non-0 so it can be returned directly */
+int wav_effect_error(struct wav_effect *fx, const char * msg);
+
+struct wav_pipeline {
+	struct wav_effect **	stages;
+	int			stage_count;
+	struct wav_stream_fmt	out_fmt;	/* what comes out of the last stage */
+	float *			flush_buf;
+	int			flush_stage;	/* next stage to drain at end of input */
+};
+
+/*
+ * input:
+ *   pl - zero-initialized pipeline
+ *   spec - stage description as above
+ * returns 0 if stage was appended to chain, non-0 otherwise
+ */
+int wav_pipeline_add(struct wav_pipeline *pl, const char * spec);
+
+/* append every stage in a chain file. returns 0 if OK */
+int wav_pipeline_load(struct wav_pipeline *pl, const char * chain_filename);
+
+/*
+ * input:
+ *   fmt - format of blocks that will be passed to wav_pipeline_process()
+ * initializes every stage in order, pl->out_fmt says what comes out
+ * returns 0 if OK
+ */
+int wav_pipeline_init(struct wav_pipeline *pl, const struct wav_stream_fmt *fmt);
+
+/* change parameter key of stage number stage (from 0) to value while the
+ * chain runs, see set() above.  returns 0 if OK */
+int wav_pipeline_set(struct wav_pipeline *pl, int stage, const char * key, const char * value);
+
+/* push one block through every stage, blk may point to a stage's buffer afterwards */
+int wav_pipeline_process(struct wav_pipeline *pl, struct wav_block *blk);
+
+/* returns non-0 if in_info and out_info are both s16 and every stage has
+ * process_s16(), so the input can be turned into the output with
+ * wav_pipeline_process_s16() alone, never going through float */
+int wav_pipeline_can_s16(struct wav_pipeline *pl, const struct wav_info *in_info, const struct wav_info *out_info);
+
+/* push up to max_frames frames of interleaved s16 samples through every stage, in place */
+int wav_pipeline_process_s16(struct wav_pipeline *pl, int16_t *data, int frames);
+
+/* call repeatedly at end of input, each time blk gets the next frames held back
+ * by some stage, run through the rest of the chain.  blk->frames is 0 when done */
+int wav_pipeline_flush(struct wav_pipeline *pl, struct wav_block *blk);
+
+/* read every frame from rdr, run it through the chain and write to wtr.
+ * returns 0 if OK */
+int wav_pipeline_run(struct wav_pipeline *pl, struct wav_reader *rdr, struct wav_writer *wtr);
+
+/* same as wav_pipeline_run() but reads into the caller's block_buf, which has room
+ * for WAV_EFFECT_BLOCK_FRAMES frames of input, so it can be kept between files */
+int wav_pipeline_run_buf(struct wav_pipeline *pl, struct wav_reader *rdr, struct wav_writer *wtr, float *block_buf);
+
+/* same as wav_pipeline_run_buf() for a chain that wav_pipeline_can_s16() says
+ * can stay in s16, block_buf has room for WAV_EFFECT_BLOCK_FRAMES frames of s16 */
+int wav_pipeline_run_s16(struct wav_pipeline *pl, struct wav_reader *rdr, struct wav_writer *wtr, int16_t *block_buf);
+
+/* frames per read and write when the chain runs with background I/O,
+ * and how many of those blocks are in flight at once */
+#define WAV_AIO_BLOCK_FRAMES (16 * WAV_EFFECT_BLOCK_FRAMES)
+#define WAV_AIO_DEPTH 4
+
+/*
+ * same as wav_pipeline_run(), but reads ahead and writes behind in the
+ * background (see wav_aio.h) while the chain works on the block in between.
+ * Output is bit-identical to wav_pipeline_run().
+ * input:
+ *   in_info - encoding of rdr
+ *   out_info - encoding of wtr
+ *   depth - I/O blocks in flight, at least 3 to overlap reads and writes with compute
+ * returns 0 if OK
+ */
+int wav_pipeline_run_async(struct wav_pipeline *pl, struct wav_reader *rdr, const struct wav_info *in_info,
+			   struct wav_writer *wtr, const struct wav_info *out_info, int depth);
+
+/* position every stage at frame of the input stream, discarding history.
+ * only valid for a chain that wav_pipeline_can_split() */
+void wav_pipeline_seek(struct wav_pipeline *pl, int64_t frame);
+
+/* returns non-0 if every stage keeps the sample rate, depends on a bounded
+ * history and puts out as many frames as it takes in, some of them late,
+ * so that the chain can be run on separate ranges of the input and the
+ * results put side by side */
+int wav_pipeline_can_split(struct wav_pipeline *pl);
+
+/* frames of input history needed before a range so that its output
+ * matches a run from the start of the stream */
+int wav_pipeline_warmup_frames(struct wav_pipeline *pl);
+
+/*
+ * run a chain over the input file with threads workers, each taking
+ * ranges of frames from a shared queue and writing its output in place.
+ * Output is bit-identical to wav_pipeline_run() for chains that
+ * wav_pipeline_can_split().
+ * input:
+ *   build - called once per worker to fill in a zero-initialized chain 
+ *           just like the one being run, returns 0 if OK
+ *   build_arg - passed to build
+ *   input_wav_filename - file to read, each worker opens its own reader
+ *   fmt - what wav_pipeline_init() is given
+ *   wtr - output, opened with the chain's output format
+ *   out_info - encoding of wtr
+ *   threads - how many workers
+ * returns 0 if OK
+ */
+int wav_pipeline_run_parallel(int (*build)(struct wav_pipeline *pl, void *build_arg), void *build_arg,
+			      char * input_wav_filename, const struct wav_stream_fmt *fmt,
+			      struct wav_writer *wtr, const struct wav_info *out_info, int threads);
+
+/* destroy every stage and free the chain */
+void wav_pipeline_free(struct wav_pipeline *pl);
+
+/* print the name and parameters of every kind of stage */
+void wav_effect_list(void);
+
+/* k-th kind of stage, NULL past the last one */
+const struct wav_effect_ops * wav_effect_kind(int k);
+
+/* stage kinds, one per effect source file */
+extern const struct wav_effect_ops wav_ripple_ops;
+extern const struct wav_effect_ops wav_resample_ops;
+extern const struct wav_effect_ops wav_convolve_ops;
+extern const struct wav_effect_ops wav_limit_ops;
+extern const struct wav_effect_ops wav_compress_ops;
+extern const struct wav_effect_ops wav_gate_ops;
+extern const struct wav_effect_ops wav_meter_ops;
+extern const struct wav_effect_ops wav_distort_ops;
+extern const struct wav_effect_ops wav_eq_ops;
+
+/* gains of the left and right channels of a stereo ripple for a
+ * left-right direction from -1 to 1 */
+void wav_ripple_pan(float left_right, float *left, float *right);
+
+#endif
@@ -0,0 +1,445 @@
+/* parametric EQ effect stage: a cascade of biquad filters on every channel
+ *
+ * parameters:
+ *   b1 ... b16 - one band each, in number order, as type:freq:gain:q
+ *                where type is peak, lowshelf or highshelf, or as
+ *                type:freq:q where type is lowpass, highpass, bandpass
+ *                or notch.  freq is Hz, gain dB from -30 to 30, q from
+ *                0.1 to 30 (default 0.707).  e.g.
+ *                eq:b1=highpass:30,b2=lowshelf:120:3,b3=peak:2500:-4:1.4
+ *
+ * Coefficients are the usual cookbook ones, worked out when the stage
+ * starts and again only when a band is changed with wav_pipeline_set(),
+ * before the next block.  Filters run in double: a 30 Hz high-pass has
+ * poles so close to 1 that float state adds noise at about -75 dB.
+ *
+ * The bands of one channel run in series, so one sample has to go through
+ * band 1 before band 2 can take it.  Rather than running band by band,
+ * every band of every channel is a lane of one vector of transposed
+ * direct form II filters, and the bands are run as a wavefront: in one
+ * step band k of each channel takes the sample band k-1 put out the step
+ * before, so band 1 is on sample t while band k is on sample t-k+1, and
+ * all the lanes work at once.  A block of n frames takes n+bands-1 steps,
+ * the first and last few with lanes whose sample is outside the block
+ * left alone, so the output is not delayed.
+ *
+ * Nothing is held back, so there is no flush.  An IIR filter's output
+ * depends on all the input before it, so the stage's warm-up is
+ * WAV_EFFECT_UNBOUNDED and a chain with an EQ in it does not split across
+ * threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "wav_effect.h"
+#include "wav_simd.h"
+
+#define MAX_BANDS 16
+#define LANE_ALIGN 8		/* lanes are padded to a whole AVX-512 vector */
+
+enum band_type { PEAK, LOWSHELF, HIGHSHELF, LOWPASS, HIGHPASS, BANDPASS, NOTCH };
+
+static const char * const band_names[] = {
+	"peak", "lowshelf", "highshelf", "lowpass", "highpass", "bandpass", "notch", NULL
+};
+
+struct eq_band {
+	enum band_type	type;
+	double		freq;
+	double		gain;	/* dB */
+	double		q;
+};
+
+struct eq_state {
+	int		channels;
+	int		samples_per_sec;
+	int		bands;
+	int		lanes;		/* channels * bands, padded to LANE_ALIGN */
+	struct eq_band	band[MAX_BANDS];
+	int		dirty;		/* band changed since the coefficients were worked out */
+	/* per lane, lane c * bands + k is band k of channel c */
+	double *	b0;
+	double *	b1;
+	double *	b2;
+	double *	a1;
+	double *	a2;
+	double *	z1;
+	double *	z2;
+	int *		band_of;
+	/* lanes + 1 outputs of the last step, shifted up one so lane l's input
+	 * is lane l-1's output, and the one being written */
+	double *	hist[2];
+};
+
+/* parse type:freq:gain:q or type:freq:q into band.  returns 0 if OK */
+
+static int parse_band(struct wav_effect *fx, const char * spec, int samples_per_sec, struct eq_band *band)
+{
+	char type[16];
+	double v[3];
+	int len, count, t;
+
+	len = strcspn(spec, ":");
+	if (len == 0 || len >= (int )sizeof(type))
+		return wav_effect_error(fx, "band must start with its type");
+	memcpy(type, spec, len);
+	type[len] = 0;
+	for (t = 0; band_names[t]; t++)
+		if (!strcmp(type, band_names[t]))
+			break;
+	if (!band_names[t])
+		return wav_effect_error(fx, "band type must be peak, lowshelf, highshelf, lowpass, highpass, bandpass or notch");
+	count = spec[len] ? sscanf(spec + len, ":%lf:%lf:%lf", &v[0], &v[1], &v[2]) : 0;
+
+	band->type = (enum band_type )t;
+	band->gain = 0.0;
+	band->q = M_SQRT1_2;
+	if (t <= HIGHSHELF) {
+		if (count < 2)
+			return wav_effect_error(fx, "peak and shelf bands are type:freq:gain[:q]");
+		band->gain = v[1];
+		if (count == 3)
+			band->q = v[2];
+	} else {
+		if (count < 1 || count > 2)
+			return wav_effect_error(fx, "pass and notch bands are type:freq[:q]");
+		if (count == 2)
+			band->q = v[1];
+	}
+	band->freq = v[0];
+	if (band->freq < 1.0 || band->freq > 0.49 * samples_per_sec)
+		return wav_effect_error(fx, "band freq must be from 1 Hz to just under half the sample rate");
+	if (band->gain < -30.0 || band->gain > 30.0)
+		return wav_effect_error(fx, "band gain must be from -30 to 30 dB");
+	if (band->q < 0.1 || band->q > 30.0)
+		return wav_effect_error(fx, "band q must be from 0.1 to 30");
+	return OK;
+}
+
+/* cookbook biquad for band, normalized so a0 is 1, into every channel's lane */
+
+static void compute_coeffs(struct eq_state *st)
+{
+	for (int k = 0; k < st->bands; k++) {
+		const struct eq_band * bd = &st->band[k];
+		double w0 = 2.0 * M_PI * bd->freq / st->samples_per_sec;
+		double cw = cos(w0);
+		double alpha = sin(w0) / (2.0 * bd->q);
+		double A = pow(10.0, bd->gain / 40.0);
+		double sa = 2.0 * sqrt(A) * alpha;
+		double b0, b1, b2, a0, a1, a2;
+
+		switch (bd->type) {
+		case PEAK:
+			b0 = 1.0 + alpha * A;
+			b1 = -2.0 * cw;
+			b2 = 1.0 - alpha * A;
+			a0 = 1.0 + alpha / A;
+			a1 = -2.0 * cw;
+			a2 = 1.0 - alpha / A;
+			break;
+		case LOWSHELF:
+			b0 = A * ((A + 1.0) - (A - 1.0) * cw + sa);
+			b1 = 2.0 * A * ((A - 1.0) - (A + 1.0) * cw);
+			b2 = A * ((A + 1.0) - (A - 1.0) * cw - sa);
+			a0 = (A + 1.0) + (A - 1.0) * cw + sa;
+			a1 = -2.0 * ((A - 1.0) + (A + 1.0) * cw);
+			a2 = (A + 1.0) + (A - 1.0) * cw - sa;
+			break;
+		case HIGHSHELF:
+			b0 = A * ((A + 1.0) + (A - 1.0) * cw + sa);
+			b1 = -2.0 * A * ((A - 1.0) + (A + 1.0) * cw);
+			b2 = A * ((A + 1.0) + (A - 1.0) * cw - sa);
+			a0 = (A + 1.0) - (A - 1.0) * cw + sa;
+			a1 = 2.0 * ((A - 1.0) - (A + 1.0) * cw);
+			a2 = (A + 1.0) - (A - 1.0) * cw - sa;
+			break;
+		case LOWPASS:
+			b0 = (1.0 - cw) / 2.0;
+			b1 = 1.0 - cw;
+			b2 = (1.0 - cw) / 2.0;
+			a0 = 1.0 + alpha;
+			a1 = -2.0 * cw;
+			a2 = 1.0 - alpha;
+			break;
+		case HIGHPASS:
+			b0 = (1.0 + cw) / 2.0;
+			b1 = -(1.0 + cw);
+			b2 = (1.0 + cw) / 2.0;
+			a0 = 1.0 + alpha;
+			a1 = -2.0 * cw;
+			a2 = 1.0 - alpha;
+			break;
+		case BANDPASS:
+			b0 = alpha;
+			b1 = 0.0;
+			b2 = -alpha;
+			a0 = 1.0 + alpha;
+			a1 = -2.0 * cw;
+			a2 = 1.0 - alpha;
+			break;
+		default:
+			b0 = 1.0;
+			b1 = -2.0 * cw;
+			b2 = 1.0;
+			a0 = 1.0 + alpha;
+			a1 = -2.0 * cw;
+			a2 = 1.0 - alpha;
+			break;
+		}
+		for (int c = 0; c < st->channels; c++) {
+			int l = c * st->bands + k;
+			st->b0[l] = b0 / a0;
+			st->b1[l] = b1 / a0;
+			st->b2[l] = b2 / a0;
+			st->a1[l] = a1 / a0;
+			st->a2[l] = a2 / a0;
+		}
+	}
+	st->dirty = 0;
+}
+
+/* one step of every lane from cur into next */
+
+static inline __attribute__((always_inline))
+void step_body(const double * restrict b0, const double * restrict b1, const double * restrict b2,
+	       const double * restrict a1, const double * restrict a2, double * restrict z1, double * restrict z2,
+	       const double * restrict cur, double * restrict next, int lanes)
+{
+	for (int l = 0; l < lanes; l++) {
+		double in = cur[l];
+		double y = b0[l] * in + z1[l];
+
+		z1[l] = (b1[l] * in - a1[l] * y) + z2[l];
+		z2[l] = b2[l] * in - a2[l] * y;
+		next[l + 1] = y;
+	}
+}
+
+/* same, but only lanes whose sample t - band is in [0, n) move on */
+
+static inline __attribute__((always_inline))
+void step_masked_body(const double * restrict b0, const double * restrict b1, const double * restrict b2,
+		      const double * restrict a1, const double * restrict a2, double * restrict z1, double * restrict z2,
+		      const int * restrict band_of, const double * restrict cur, double * restrict next,
+		      int lanes, int t, int n)
+{
+	for (int l = 0; l < lanes; l++) {
+		double in = cur[l];
+		double y = b0[l] * in + z1[l];
+		double s1 = (b1[l] * in - a1[l] * y) + z2[l];
+		double s2 = b2[l] * in - a2[l] * y;
+		int active = (unsigned )(t - band_of[l]) < (unsigned )n;
+
+		z1[l] = active ? s1 : z1[l];
+		z2[l] = active ? s2 : z2[l];
+		next[l + 1] = y;
+	}
+}
+
+static inline __attribute__((always_inline))
+void run_block_body(struct eq_state *st, float *data, int n)
+{
+	const double * b0 = st->b0, * b1 = st->b1, * b2 = st->b2, * a1 = st->a1, * a2 = st->a2;
+	double * z1 = st->z1, * z2 = st->z2;
+	double * hist[2] = { st->hist[0], st->hist[1] };
+	int ch = st->channels;
+	int B = st->bands;
+	int lanes = st->lanes;
+	int last = B - 1;
+
+	for (int t = 0; t < n + last; t++) {
+		double * cur = hist[t & 1];
+		double * next = hist[~t & 1];
+
+		/* band 0 of each channel takes sample t */
+		if (t < n)
+			for (int c = 0; c < ch; c++)
+				cur[c * B] = data[(size_t )t * ch + c];
+		/* lanes start one by one, all run in the middle, then stop one by one */
+		if (t < last || t >= n)
+			step_masked_body(b0, b1, b2, a1, a2, z1, z2, st->band_of, cur, next, lanes, t, n);
+		else
+			step_body(b0, b1, b2, a1, a2, z1, z2, cur, next, lanes);
+		/* band B-1 puts out sample t-B+1, which has been read already */
+		if (t >= last)
+			for (int c = 0; c < ch; c++)
+				data[(size_t )(t - last) * ch + c] = (float )next[c * B + B];
+	}
+
+	/* after silence the state decays into denormals, which are slow */
+	for (int l = 0; l < lanes; l++) {
+		z1[l] = fabs(z1[l]) < 1e-30 ? 0.0 : z1[l];
+		z2[l] = fabs(z2[l]) < 1e-30 ? 0.0 : z2[l];
+	}
+}
+
+static void run_block_c(struct eq_state *st, float *data, int n)
+{
+	run_block_body(st, data, n);
+}
+
+#ifdef WAV_SIMD_X86
+WAV_TARGET_AVX2
+static void run_block_avx2(struct eq_state *st, float *data, int n)
+{
+	run_block_body(st, data, n);
+}
+
+WAV_TARGET_AVX512
+static void run_block_avx512(struct eq_state *st, float *data, int n)
+{
+	run_block_body(st, data, n);
+}
+#endif
+
+static void (*run_block)(struct eq_state *st, float *data, int n) = run_block_c;
+
+__attribute__((constructor))
+static void pick_run_block(void)
+{
+#ifdef WAV_SIMD_X86
+	int level = wav_simd_level();
+
+	if (level >= WAV_SIMD_AVX512)
+		run_block = run_block_avx512;
+	else if (level >= WAV_SIMD_AVX2)
+		run_block = run_block_avx2;
+#endif
+}
+
+static void eq_reset(struct wav_effect *fx)
+{
+	struct eq_state * st = (struct eq_state * )fx->state;
+
+	memset(st->z1, 0, sizeof(double) * st->lanes);
+	memset(st->z2, 0, sizeof(double) * st->lanes);
+}
+
+static double * alloc_lanes(int count)
+{
+	size_t bytes = (sizeof(double) * count + 63) & ~(size_t )63;
+	double * p = (double * )aligned_alloc(64, bytes);
+
+	if (p)
+		memset(p, 0, bytes);
+	return p;
+}
+
+static int eq_init(struct wav_effect *fx, struct wav_stream_fmt *fmt)
+{
+	struct eq_state * st;
+	char key[8];
+	int used;
+
+	st = (struct eq_state * )calloc(1, sizeof(struct eq_state));
+	if (!st)
+		return wav_effect_error(fx, "could not allocate state");
+	fx->state = st;
+	st->channels = fmt->channels;
+	st->samples_per_sec = fmt->samples_per_sec;
+	for (int k = 1; k <= MAX_BANDS; k++) {
+		const char * spec;
+
+		snprintf(key, sizeof(key), "b%d", k);
+		spec = wav_effect_param_str(fx, key, NULL);
+		if (!spec)
+			continue;
+		if (parse_band(fx, spec, st->samples_per_sec, &st->band[st->bands]))
+			return NOTOK;
+		st->bands++;
+	}
+	if (st->bands == 0)
+		return wav_effect_error(fx, "needs at least one band, b1=type:freq...");
+
+	used = st->channels * st->bands;
+	st->lanes = (used + LANE_ALIGN - 1) / LANE_ALIGN * LANE_ALIGN;
+	st->b0 = alloc_lanes(st->lanes);
+	st->b1 = alloc_lanes(st->lanes);
+	st->b2 = alloc_lanes(st->lanes);
+	st->a1 = alloc_lanes(st->lanes);
+	st->a2 = alloc_lanes(st->lanes);
+	st->z1 = alloc_lanes(st->lanes);
+	st->z2 = alloc_lanes(st->lanes);
+	st->band_of = (int * )alloc_lanes(st->lanes);
+	st->hist[0] = alloc_lanes(st->lanes + 1);
+	st->hist[1] = alloc_lanes(st->lanes + 1);
+	if (!st->b0 || !st->b1 || !st->b2 || !st->a1 || !st->a2 || !st->z1 || !st->z2 ||
+	    !st->band_of || !st->hist[0] || !st->hist[1])
+		return wav_effect_error(fx, "could not allocate lanes");
+	/* padding lanes have all-zero coefficients and put out silence */
+	for (int l = 0; l < used; l++)
+		st->band_of[l] = l % st->bands;
+	fx->warmup_frames = WAV_EFFECT_UNBOUNDED;
+	compute_coeffs(st);
+	return OK;
+}
+
+static int eq_process(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct eq_state * st = (struct eq_state * )fx->state;
+
+	if (st->dirty)
+		compute_coeffs(st);
+	run_block(st, blk->data, blk->frames);
+	return OK;
+}
+
+/* change band bN to a new type:freq:gain:q, keeping the filter state so
+ * there is no click beyond the change itself */
+
+static int eq_set(struct wav_effect *fx, const char * key, const char * value)
+{
+	struct eq_state * st = (struct eq_state * )fx->state;
+	struct eq_band band;
+	int k = 0, n;
+	char key_n[8];
+
+	/* bands are numbered by the order of the keys given at init */
+	for (n = 1; n <= MAX_BANDS; n++) {
+		snprintf(key_n, sizeof(key_n), "b%d", n);
+		if (!wav_effect_param_str(fx, key_n, NULL))
+			continue;
+		if (!strcmp(key, key_n))
+			break;
+		k++;
+	}
+	if (n > MAX_BANDS)
+		return wav_effect_error(fx, "only bands given at the start can be changed");
+	if (parse_band(fx, value, st->samples_per_sec, &band))
+		return NOTOK;
+	st->band[k] = band;
+	st->dirty = 1;
+	return OK;
+}
+
+static void eq_destroy(struct wav_effect *fx)
+{
+	struct eq_state * st = (struct eq_state * )fx->state;
+
+	if (!st)
+		return;
+	free(st->b0);
+	free(st->b1);
+	free(st->b2);
+	free(st->a1);
+	free(st->a2);
+	free(st->z1);
+	free(st->z2);
+	free(st->band_of);
+	free(st->hist[0]);
+	free(st->hist[1]);
+	free(st);
+}
+
+const struct wav_effect_ops wav_eq_ops = {
+	.name = "eq",
+	.help = "b1=peak:1000:-3:1.4 b2=lowshelf:100:4 b3=highpass:30 ...  up to 16 biquad bands, Hz dB q",
+	.init = eq_init,
+	.process = eq_process,
+	.set = eq_set,
+	.reset = eq_reset,
+	.destroy = eq_destroy,
+};
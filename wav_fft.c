@@ -0,0 +1,168 @@
+/* real FFT, see wav_fft.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "wav_file_access.h"
+#include "wav_fft.h"
+
+#define WAV_FFT_MAX_LEN (1 << 24)
+
+struct wav_fft {
+	int	n;		/* real length */
+	int	half;		/* complex length, n/2 */
+	int *	bitrev;		/* half entries */
+	float *	tw_re;		/* twiddles for the butterflies of span h at [h, 2h) */
+	float *	tw_im;
+	float *	split_re;	/* e^(-2 pi i k / n) for k up to half, to untangle */
+	float *	split_im;
+	float *	work_re;	/* half complex points */
+	float *	work_im;
+};
+
+int wav_fft_open(int n, struct wav_fft **fft_out)
+{
+	struct wav_fft * fft;
+	int half = n / 2;
+	int bits = 0;
+
+	if (n < 4 || n > WAV_FFT_MAX_LEN || (n & (n - 1))) {
+		printf("ERROR: FFT length %d is not a power of 2 from 4 to %d\n", n, WAV_FFT_MAX_LEN);
+		return NOTOK;
+	}
+	fft = (struct wav_fft * )calloc(1, sizeof(struct wav_fft));
+	if (!fft) {
+		printf("ERROR: could not allocate FFT\n");
+		return NOTOK;
+	}
+	fft->n = n;
+	fft->half = half;
+	fft->bitrev = (int * )malloc(sizeof(int) * half);
+	fft->tw_re = (float * )malloc(sizeof(float) * half);
+	fft->tw_im = (float * )malloc(sizeof(float) * half);
+	fft->split_re = (float * )malloc(sizeof(float) * (half + 1));
+	fft->split_im = (float * )malloc(sizeof(float) * (half + 1));
+	fft->work_re = (float * )malloc(sizeof(float) * half);
+	fft->work_im = (float * )malloc(sizeof(float) * half);
+	if (!fft->bitrev || !fft->tw_re || !fft->tw_im || !fft->split_re || !fft->split_im ||
+	    !fft->work_re || !fft->work_im) {
+		printf("ERROR: could not allocate FFT\n");
+		wav_fft_close(fft);
+		return NOTOK;
+	}
+
+	while ((1 << bits) < half)
+		bits++;
+	for (int k = 0; k < half; k++) {
+		int r = 0;
+		for (int b = 0; b < bits; b++)
+			if (k & (1 << b))
+				r |= 1 << (bits - 1 - b);
+		fft->bitrev[k] = r;
+	}
+	for (int h = 1; h < half; h *= 2) {
+		for (int j = 0; j < h; j++) {
+			fft->tw_re[h + j] = cos(M_PI * j / h);
+			fft->tw_im[h + j] = -sin(M_PI * j / h);
+		}
+	}
+	for (int k = 0; k <= half; k++) {
+		fft->split_re[k] = cos(2.0 * M_PI * k / n);
+		fft->split_im[k] = -sin(2.0 * M_PI * k / n);
+	}
+	*fft_out = fft;
+	return OK;
+}
+
+/* in-place complex FFT of the half points in work, already in bit-reversed order */
+
+static void complex_fft(struct wav_fft *fft)
+{
+	float * restrict re = fft->work_re;
+	float * restrict im = fft->work_im;
+	int half = fft->half;
+
+	for (int h = 1; h < half; h *= 2) {
+		const float * wr = fft->tw_re + h;
+		const float * wi = fft->tw_im + h;
+		for (int start = 0; start < half; start += 2 * h) {
+			float * ar = re + start, * ai = im + start;
+			float * br = ar + h, * bi = ai + h;
+			for (int j = 0; j < h; j++) {
+				float tr = br[j] * wr[j] - bi[j] * wi[j];
+				float ti = br[j] * wi[j] + bi[j] * wr[j];
+				br[j] = ar[j] - tr;
+				bi[j] = ai[j] - ti;
+				ar[j] += tr;
+				ai[j] += ti;
+			}
+		}
+	}
+}
+
+void wav_fft_forward(struct wav_fft *fft, const float *in, float *re, float *im)
+{
+	int half = fft->half;
+	float * zr = fft->work_re;
+	float * zi = fft->work_im;
+
+	/* even samples are the real parts, odd ones the imaginary parts */
+	for (int k = 0; k < half; k++) {
+		int r = fft->bitrev[k];
+		zr[r] = in[2*k];
+		zi[r] = in[2*k+1];
+	}
+	complex_fft(fft);
+
+	/* X[k] = E[k] + W^k O[k], where E and O are the spectra of the even
+	 * and odd samples and Z[k] = E[k] + i O[k] */
+	for (int k = 0; k <= half; k++) {
+		int a = k == half ? 0 : k;
+		int b = k == 0 ? 0 : half - k;
+		float er = 0.5f * (zr[a] + zr[b]), ei = 0.5f * (zi[a] - zi[b]);
+		float odd_r = 0.5f * (zi[a] + zi[b]), odd_i = -0.5f * (zr[a] - zr[b]);
+		re[k] = er + fft->split_re[k] * odd_r - fft->split_im[k] * odd_i;
+		im[k] = ei + fft->split_re[k] * odd_i + fft->split_im[k] * odd_r;
+	}
+}
+
+void wav_fft_inverse(struct wav_fft *fft, const float *re, const float *im, float *out)
+{
+	int half = fft->half;
+	float * zr = fft->work_re;
+	float * zi = fft->work_im;
+	float scale = 1.0f / half;
+
+	/* back to Z[k] = E[k] + i O[k], conjugated so a forward FFT inverts it */
+	for (int k = 0; k < half; k++) {
+		int b = half - k;
+		float xr = re[k], xi = k == 0 ? 0.0f : im[k];
+		float yr = re[b], yi = b == half ? 0.0f : -im[b];
+		float er = 0.5f * (xr + yr), ei = 0.5f * (xi + yi);
+		float dr = 0.5f * (xr - yr), di = 0.5f * (xi - yi);
+		/* O = (X[k] - conj X[half-k]) W^-k / 2 */
+		float odd_r = dr * fft->split_re[k] + di * fft->split_im[k];
+		float odd_i = di * fft->split_re[k] - dr * fft->split_im[k];
+		int r = fft->bitrev[k];
+		zr[r] = er - odd_i;
+		zi[r] = -(ei + odd_r);
+	}
+	complex_fft(fft);
+	for (int k = 0; k < half; k++) {
+		out[2*k] = zr[k] * scale;
+		out[2*k+1] = -zi[k] * scale;
+	}
+}
+
+void wav_fft_close(struct wav_fft *fft)
+{
+	free(fft->bitrev);
+	free(fft->tw_re);
+	free(fft->tw_im);
+	free(fft->split_re);
+	free(fft->split_im);
+	free(fft->work_re);
+	free(fft->work_im);
+	free(fft);
+}
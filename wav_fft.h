@@ -0,0 +1,44 @@
+#ifndef _wav_fft_h_
+# define _wav_fft_h_ 1
+
+/* fast Fourier transform of real signals, for convolution and analysis
+ *
+ * A real sequence of n points is packed into n/2 complex points, run
+ * through an iterative radix-2 complex FFT and untangled into the n/2+1
+ * bins a real signal has.  Spectra are split: real parts in one array and
+ * imaginary parts in another, so loops over bins (and the butterflies
+ * inside the FFT) vectorize without shuffles.
+ */
+
+/* opaque handle, see wav_fft.c */
+struct wav_fft;
+
+/*
+ * input:
+ *   n - transform length, a power of 2 from 4 to 2^24
+ * output:
+ *   fft_out - returns handle holding twiddle tables for that length
+ * returns 0 if OK, non-0 otherwise
+ */
+int wav_fft_open(int n, struct wav_fft **fft_out);
+
+/*
+ * input:
+ *   in - n real samples
+ * output:
+ *   re, im - n/2+1 bins each, unnormalized: a unit impulse gives all 1s
+ */
+void wav_fft_forward(struct wav_fft *fft, const float *in, float *re, float *im);
+
+/*
+ * input:
+ *   re, im - n/2+1 bins each, im[0] and im[n/2] are ignored
+ * output:
+ *   out - n real samples, scaled by 1/n so that inverse(forward(x)) == x
+ */
+void wav_fft_inverse(struct wav_fft *fft, const float *re, const float *im, float *out);
+
+/* free handle */
+void wav_fft_close(struct wav_fft *fft);
+
+#endif
@@ -10,26 +10,38 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "wav_file_access.h"
+#include "wav_convert.h"
 
 #define OK 	0
 #define NOTOK 	1
 
-#define WAV_HEADER_BUFFER_SIZE (1<<10)
-#define WAV_SAMPLES_PER_SEC 44100
+#define WAV_MAX_FMT_LEN 40
 #define STRUCT_ID_LEN 4
 #define BYTES_PER_SAMPLE 2
 #define MAX_PATHNAME_LEN 1024
 #define BITS_PER_BYTE 8
 
+/* frames per call when wav_read() and wav_write() move a whole file */
+#define WAV_WHOLE_FILE_FRAMES (1 << 24)
+
 #define WAV_DEBUG_UNDEFINED (char *)(-1L)
 /* dont do printf in normal case unless user requests */
 static char * wav_debug = (char * )WAV_DEBUG_UNDEFINED;
 
 /* structs frequently encoumtered in .wav files */
 
+/* every chunk after the RIFF header starts with this */
+
+struct wav_chunk_header {
+	char		wch_idstr[STRUCT_ID_LEN];
+	uint32_t	wch_chunk_size;		/* length of body that follows */
+};
+
 struct wav_header {
 	char		wh_riffstr[STRUCT_ID_LEN]; /* should be what's in riffstr below */
 	uint32_t	wh_file_length;
@@ -37,6 +49,28 @@ struct wav_header {
 };
 static char * riffstr = "RIFF";
 static char * wavestr = "WAVE";
+static char * rf64str = "RF64";
+static char * bw64str = "BW64";
+
+/* a 32-bit size field holding this means "look in ds64" */
+#define WAV_SIZE_IN_DS64 0xFFFFFFFFu
+
+/* body of the ds64 chunk that comes first in an RF64 file, 
+ * followed by table_length entries for other chunks over 4 GiB.
+ * read and written as WAV_DS64_LEN bytes, the struct is padded */
+
+struct wav_ds64 {
+	uint64_t	wds_riff_size;
+	uint64_t	wds_data_size;
+	uint64_t	wds_sample_count;
+	uint32_t	wds_table_length;
+};
+#define WAV_DS64_LEN 28
+#define WAV_DS64_ENTRY_LEN 12	/* chunk id then 64-bit size */
+static char * ds64str = "ds64";
+
+/* writers reserve room for a ds64 chunk with one of these */
+static char * junkstr = "JUNK";
 
 struct wav_fmt {
 	char		wf_fmtstr[STRUCT_ID_LEN]; /* should be what's in fmtstr below */
@@ -50,7 +84,6 @@ struct wav_fmt {
 };
 static char * fmtstr = "fmt ";
 
-#if 0
 /* in some .wav formats, this appears after the wav_fmt struct
  * The wf_len field tells you whether this will happen or not
  */
@@ -59,15 +92,26 @@ struct wav_fmt_extension {
 	uint16_t	wfe_extension_size;
 	uint16_t	wfe_number_valid_bits;
 	uint32_t	wfe_speaker_position_mask;
-	uint16_t	wfe_wave_format_code;
-#define                  WAVE_FORMAT_PCM 		0x0001
-#define                  WAVE_FORMAT_IEEE_FLOAT 	0x0003
+	uint16_t	wfe_wave_format_code;	/* first 2 bytes of sub-format GUID */
+/* other format codes are in wav_convert.h */
 #define                  WAVE_FORMAT_ALAW		0x0006
 #define                  WAVE_FORMAT_MULAW		0x0007
-#define                  WAVE_FORMAT_EXTENSIBLE		0xFFFE
 	uint8_t         wfe_guid[14];
 };
-#endif
+
+/* what follows the chunk header in an extensible fmt chunk */
+#define WAV_FMT_EXTENSIBLE_LEN (sizeof(struct wav_fmt) - 8 + sizeof(struct wav_fmt_extension))
+
+/* rest of the KSDATAFORMAT_SUBTYPE GUID after the format code */
+static const uint8_t subformat_guid_tail[14] = {
+	0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+};
+
+/* usual speaker positions for a channel count written as extensible:
+ * 3.0, quad, 5.0, 5.1, 6.1, 7.1, and none given past that */
+static const uint32_t speaker_masks[] = {
+	0, 0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x13F, 0x63F
+};
 
 
 /* this structure follows the wav_fmt(_extension) structure */
@@ -121,288 +165,1001 @@ static void chk_dbg(void) {
 
 /* print out samples in a column-aligned decimal format */
 
-void print_samples(wav_sample_t * sample_buf, int sample_count)
+void print_samples(wav_sample_t * sample_buf, int64_t sample_count)
 {
 	static const int cols_per_row = 16;
 
-	for (int sample = 0; sample < sample_count; sample++) {
+	for (int64_t sample = 0; sample < sample_count; sample++) {
 		printf("%6d ", sample_buf[sample]);
 		if ((sample+1) % cols_per_row == 0)
 			printf("\n");
 	}
 }
 
-/* read .wav file PCM samples into buffer. 
- * return OK if done, NOTOK otherwise 
- * caller is responsible for freeing the buffer allocated and returned in sample_buf_out
- */
-
-int wav_read(char * wav_filename_p, wav_sample_t **sample_buf_out, int *sample_count_out, int *channels_out)
-{
-	int fd;
-	int count;
-	/* int chunk = 0; */
-	/* uint64_t offset = 0; */
-	int file_len;
-	int extension_size;
-	struct wav_header *wh_p;
-	struct wav_fmt *wf_p;
-	struct wav_list *wl_p;
-	struct wav_data *wd_p;
-	/* struct wav_fmt_extension *wfe_p; */
-	struct wav_fact *wfct_p;
-	unsigned char * buf;
-	struct stat st;
-	uint32_t sample_buf_size;
-	off_t file_offset, off;
-	uint32_t number_samples;
-	int expected_block_alignment;
+/* state for reading a .wav file a block at a time */
+
+struct wav_reader {
+	int		wr_fd;
+	struct wav_info	wr_info;
+	int		wr_frame_bytes;	/* bytes per frame on disk */
+	off_t		wr_data_offset;	/* file offset of first frame */
+	int64_t		wr_next_frame;	/* frame that next wav_reader_read() returns */
+	struct wav_chunk *wr_chunks;	/* index of every chunk in the file */
+	int		wr_chunk_count;
+	void *		wr_raw_buf;	/* on-disk samples waiting to be converted */
+	size_t		wr_raw_size;
+	float *		wr_float_buf;	/* floats waiting to be converted to 16-bit */
+	size_t		wr_float_size;
+};
 
-	/* initialize outputs */
+/* state for writing a .wav file a block at a time */
+
+struct wav_writer {
+	int		ww_fd;
+	struct wav_info	ww_info;	/* channels, rate and encoding to write */
+	int		ww_frame_bytes;	/* bytes per frame on disk */
+	uint64_t	ww_data_bytes;	/* sample bytes written so far */
+	int		ww_data_offset;	/* file offset of first sample */
+	char		ww_final_path[MAX_PATHNAME_LEN];
+	char		ww_temp_path[MAX_PATHNAME_LEN];
+	void *		ww_raw_buf;	/* converted samples waiting to be written */
+	size_t		ww_raw_size;
+	float *		ww_float_buf;	/* 16-bit samples converted to float */
+	size_t		ww_float_size;
+};
 
-	*sample_buf_out = (wav_sample_t * )NULL;
-	*sample_count_out = 0;
-	*channels_out = 0;
-	chk_dbg();
+/* make sure *buf_p has room for need bytes. return OK if so, NOTOK otherwise */
 
-	/* allocate buffer to read headers */
+static int grow_buf(void **buf_p, size_t *size_p, size_t need)
+{
+	void * buf;
 
-	buf = (unsigned char * )malloc(WAV_HEADER_BUFFER_SIZE);
+	if (need <= *size_p)
+		return OK;
+	buf = realloc(*buf_p, need);
 	if (!buf)
 		return syscall_error("malloc");
+	*buf_p = buf;
+	*size_p = need;
+	return OK;
+}
 
-	/* open file and read header */
+/* pread exactly len bytes at offset, a large read can come back in pieces.
+ * return OK if done, NOTOK otherwise */
 
-	fd = open(wav_filename_p, O_RDONLY);
-	if (fd < 0)
-		return syscall_error(wav_filename_p);
-	count = read(fd, buf, WAV_HEADER_BUFFER_SIZE);
-	if (wav_debug)
-		printf("read %d bytes from file %s\n", count, wav_filename_p);
-	if (count < 0)
-		return syscall_error(".wav header");
-	if (count < (sizeof(struct wav_header) + sizeof(struct wav_fmt) + sizeof(struct wav_fact)))
-		return usage(".wav file too short");
+static int pread_all(int fd, void * buf, size_t len, off_t offset, char * what)
+{
+	while (len > 0) {
+		ssize_t count = pread(fd, buf, len, offset);
+		if (count < 0)
+			return syscall_error(what);
+		if (count == 0)
+			return usage(what);
+		buf = (char * )buf + count;
+		len -= count;
+		offset += count;
+	}
+	return OK;
+}
+
+/* add a chunk to the index, growing it as needed. return OK if done, NOTOK otherwise */
+
+static int add_chunk(struct wav_chunk **chunks_p, int *chunk_count_p, char * id, uint64_t size, off_t body_offset)
+{
+	struct wav_chunk * chunks = *chunks_p;
+	struct wav_chunk * wc_p;
+	int count = *chunk_count_p;
+
+	if ((count & (count - 1)) == 0) {
+		/* count is 0 or a power of 2, time to double */
+		chunks = (struct wav_chunk * )realloc(chunks, sizeof(struct wav_chunk) * (count ? count * 2 : 8));
+		if (!chunks)
+			return syscall_error("malloc");
+		*chunks_p = chunks;
+	}
+	wc_p = &chunks[count];
+	memcpy(wc_p->wc_id, id, STRUCT_ID_LEN);
+	wc_p->wc_id[STRUCT_ID_LEN] = 0;
+	wc_p->wc_offset = body_offset;
+	wc_p->wc_size = size;
+	*chunk_count_p = count + 1;
+	return OK;
+}
+
+/* size of a chunk whose 32-bit size field says WAV_SIZE_IN_DS64, from the
+ * ds64 table.  return OK if found, NOTOK otherwise */
+
+static int ds64_table_size(int fd, off_t table_offset, uint32_t table_length, char * id, uint64_t *size_out)
+{
+	unsigned char entry[WAV_DS64_ENTRY_LEN];
+
+	for (uint32_t k = 0; k < table_length; k++) {
+		if (pread_all(fd, entry, sizeof(entry), table_offset + (off_t )k * sizeof(entry), 
+			      "could not read ds64 table") != OK)
+			return NOTOK;
+		if (!not_match_str((char * )entry, id)) {
+			memcpy(size_out, entry + STRUCT_ID_LEN, sizeof(*size_out));
+			return OK;
+		}
+	}
+	return usage("chunk size missing from ds64 table");
+}
+
+/* walk every RIFF chunk in an open file with pread, skipping chunks
+ * we do not understand no matter how big they are, and validate the ones we do.
+ * return OK and fill in info_out, data_offset_out and the chunk index if valid, 
+ * NOTOK otherwise.  Caller must free *chunks_out in either case.
+ */
+
+static int wav_parse_headers(int fd, char * wav_filename_p, struct wav_info *info_out, off_t *data_offset_out,
+			     struct wav_chunk **chunks_out, int *chunk_count_out)
+{
+	struct wav_header wh;
+	struct wav_chunk_header wch;
+	struct wav_fmt wf;
+	struct wav_fmt_extension wfe;
+	struct wav_fact wfct;
+	struct wav_list wl;
+	struct wav_ds64 ds64;
+	struct stat st;
+	off_t offset, body_offset, riff_end;
+	off_t ds64_table_offset = 0;
+	uint64_t chunk_size;
+	int have_fmt = 0, have_fact = 0, have_data = 0;
+	int is_rf64;
+	uint64_t data_bytes = 0;
+	int expected_block_alignment;
+	int format;
+
+	*chunks_out = NULL;
+	*chunk_count_out = 0;
 
 	/* parse RIFF header */
 
-	wh_p = (struct wav_header * )buf;
-	if (not_match_str(riffstr, wh_p->wh_riffstr) || not_match_str(wavestr, wh_p->wh_wavestr))
+	if (pread_all(fd, &wh, sizeof(wh), 0, ".wav file too short") != OK)
+		return NOTOK;
+	is_rf64 = !not_match_str(rf64str, wh.wh_riffstr) || !not_match_str(bw64str, wh.wh_riffstr);
+	if ((not_match_str(riffstr, wh.wh_riffstr) && !is_rf64) || not_match_str(wavestr, wh.wh_wavestr))
 		return usage("invalid WAV file");
-	file_len = wh_p->wh_file_length;
 	if (fstat(fd, &st))
 		return syscall_error("stat");
-	if (st.st_size - 8 != file_len)
+
+	/* in RF64 the real sizes are in a ds64 chunk that must come first */
+
+	memset(&ds64, 0, sizeof(ds64));
+	if (is_rf64) {
+		if (pread_all(fd, &wch, sizeof(wch), sizeof(wh), "truncated ds64 chunk") != OK)
+			return NOTOK;
+		if (not_match_str(ds64str, wch.wch_idstr) || wch.wch_chunk_size < WAV_DS64_LEN)
+			return usage("RF64 file does not start with ds64 chunk");
+		if (pread_all(fd, &ds64, WAV_DS64_LEN, sizeof(wh) + sizeof(wch), "could not read ds64 chunk") != OK)
+			return NOTOK;
+		if (WAV_DS64_LEN + (uint64_t )ds64.wds_table_length * WAV_DS64_ENTRY_LEN > wch.wch_chunk_size)
+			return usage("ds64 table longer than chunk");
+		ds64_table_offset = sizeof(wh) + sizeof(wch) + WAV_DS64_LEN;
+		if (wh.wh_file_length != WAV_SIZE_IN_DS64)
+			ds64.wds_riff_size = wh.wh_file_length;
+	} else {
+		ds64.wds_riff_size = wh.wh_file_length;
+	}
+	/* an odd RIFF size leaves out the pad byte after the last chunk */
+	if (st.st_size - 8 != ds64.wds_riff_size &&
+	    !((ds64.wds_riff_size & 1) && st.st_size - 9 == ds64.wds_riff_size))
 		return usage("file length error");
 	if (wav_debug)
-		printf("file length = %u bytes\n", file_len);
+		printf("file %s length = %" PRIu64 " bytes%s\n", wav_filename_p, ds64.wds_riff_size, is_rf64 ? " (RF64)" : "");
+	riff_end = (off_t )ds64.wds_riff_size + 8;
+
+	/* walk the chunks, each one is an id and a length followed by the body */
+
+	for (offset = sizeof(wh); offset + (off_t )sizeof(wch) <= riff_end; ) {
+		if (pread_all(fd, &wch, sizeof(wch), offset, "truncated chunk header") != OK)
+			return NOTOK;
+		body_offset = offset + sizeof(wch);
+		chunk_size = wch.wch_chunk_size;
+		if (is_rf64 && chunk_size == WAV_SIZE_IN_DS64) {
+			if (!not_match_str(datastr, wch.wch_idstr))
+				chunk_size = ds64.wds_data_size;
+			else if (ds64_table_size(fd, ds64_table_offset, ds64.wds_table_length, 
+						 wch.wch_idstr, &chunk_size) != OK)
+				return NOTOK;
+		}
+		if (body_offset + chunk_size > riff_end)
+			return usage("chunk extends past end of file");
+		if (add_chunk(chunks_out, chunk_count_out, wch.wch_idstr, chunk_size, body_offset) != OK)
+			return NOTOK;
+		if (wav_debug)
+			printf("chunk %.4s at offset %lu length %" PRIu64 "\n", wch.wch_idstr, body_offset, chunk_size);
+
+		if (!not_match_str(fmtstr, wch.wch_idstr)) {
+			if (wch.wch_chunk_size < sizeof(wf) - sizeof(wch))
+				return usage("invalid wav_fmt chunk");
+			if (pread_all(fd, &wf, sizeof(wf), offset, "could not read wav_fmt chunk") != OK)
+				return NOTOK;
+			if (wf.wf_fmt == WAVE_FORMAT_EXTENSIBLE) {
+				if (wch.wch_chunk_size < WAV_FMT_EXTENSIBLE_LEN)
+					return usage("extensible wav_fmt chunk too short");
+				if (pread_all(fd, &wfe, sizeof(wfe), offset + sizeof(wf), 
+					      "could not read format extension") != OK)
+					return NOTOK;
+				if (wav_debug)
+					printf("extension number_valid_bits=%u speaker_position_mask=%x wave_format_code=%x\n", 
+						wfe.wfe_number_valid_bits, wfe.wfe_speaker_position_mask, wfe.wfe_wave_format_code);
+			}
+			have_fmt = 1;
+		} else if (!not_match_str(factstr, wch.wch_idstr)) {
+			if (wch.wch_chunk_size != 4)
+				return usage("fact structure length is not 4");
+			if (pread_all(fd, &wfct, sizeof(wfct), offset, "could not read fact chunk") != OK)
+				return NOTOK;
+			if (wav_debug)
+				printf("fact samples/chan = %u\n", wfct.wfct_number_samples);
+			have_fact = 1;
+		} else if (!not_match_str(liststr, wch.wch_idstr)) {
+			if (wch.wch_chunk_size >= STRUCT_ID_LEN &&
+			    pread_all(fd, &wl, sizeof(wl), offset, "could not read LIST chunk") == OK &&
+			    not_match_str(infostr, wl.wl_list_type_id))
+				printf("unrecognized LIST type found\n");
+		} else if (!not_match_str(datastr, wch.wch_idstr)) {
+			if (!have_data) {
+				*data_offset_out = body_offset;
+				data_bytes = chunk_size;
+				have_data = 1;
+			}
+		}
+
+		/* chunk bodies are padded to an even length */
+
+		offset = body_offset + chunk_size + (chunk_size & 1);
+	}
 
-	/* parse format structure */
+	/* validate format structure */
 
-	wf_p = (struct wav_fmt * )((char * )wh_p + sizeof(struct wav_header));
-	if (not_match_str(fmtstr, wf_p->wf_fmtstr))
-		return usage("invalid wav_fmt chunk");
+	if (!have_fmt)
+		return usage("no wav_fmt chunk");
+	if (!have_data)
+		return usage("no wav_data chunk");
 	if (wav_debug)
 		printf(
 	 	 "wf_len=%u wf_fmt=%u wf_channels=%u wf_samples_per_sec=%u wf_bytes_per_sec=%u wf_block_align=%u wf_bits_per_sample=%u\n",
-	 	 wf_p->wf_len, wf_p->wf_fmt, wf_p->wf_channels, 
-	 	 wf_p->wf_samples_per_sec, wf_p->wf_bytes_per_sec, wf_p->wf_block_align, wf_p->wf_bits_per_sample);
-	if (wf_p->wf_bits_per_sample != 16)
-		return usage("only support 16 bits per sample at this time");
-	if (wf_p->wf_channels < 1 || wf_p->wf_channels > 2)
-		return usage("only 1 or 2 channels supported ");
-	if (wf_p->wf_samples_per_sec != WAV_SAMPLES_PER_SEC)
-		return usage("only fixed samples per sec supported ");
-	if (wf_p->wf_bits_per_sample != 16)
-		return usage("only 16 bits per sample supported");
-	if (wf_p->wf_bytes_per_sec != WAV_SAMPLES_PER_SEC * BYTES_PER_SAMPLE * wf_p->wf_channels)
+	 	 wf.wf_len, wf.wf_fmt, wf.wf_channels, 
+	 	 wf.wf_samples_per_sec, wf.wf_bytes_per_sec, wf.wf_block_align, wf.wf_bits_per_sample);
+	if (wf.wf_len != 16 && wf.wf_len != 18 && wf.wf_len != WAV_MAX_FMT_LEN)
+		return usage("invalid wf_len");
+	format = (wf.wf_fmt == WAVE_FORMAT_EXTENSIBLE) ? wfe.wfe_wave_format_code : wf.wf_fmt;
+	if (!wav_encoding_supported(format, wf.wf_bits_per_sample))
+		return usage("unsupported sample encoding");
+	if (wf.wf_channels < 1 || wf.wf_channels > WAV_MAX_CHANNELS)
+		return usage("too many channels");
+	if (wf.wf_samples_per_sec == 0)
+		return usage("zero samples per sec");
+	expected_block_alignment = wf.wf_bits_per_sample * wf.wf_channels / BITS_PER_BYTE ;
+	if (wf.wf_block_align != expected_block_alignment)
+		return usage("expect block alignment channels * bytes per sample");
+	if (wf.wf_bytes_per_sec != wf.wf_samples_per_sec * wf.wf_block_align)
 		return usage("inconsistent bytes per second");
-	expected_block_alignment = wf_p->wf_bits_per_sample * wf_p->wf_channels / BITS_PER_BYTE ;
-	if (wf_p->wf_block_align != expected_block_alignment)
-		return usage("expect block alignment channels * 2 bytes");
-
-	extension_size = sizeof(wf_p->wf_fmtstr) + sizeof(wf_p->wf_len) + wf_p->wf_len;
-	if (wf_p->wf_len == 16) {
-		;
-	} else if (wf_p->wf_len == 18) {
-		;
-	} else if (wf_p->wf_len == 40) {
-		return usage("unsupported format extension block");
-#if 0
-		extension_size = 22;
-		if (wfe_p->wfe_extension_size != extension_size)
-			usage("extension size not 22 bytes");
-		printf("extension number_valid_bits=%u speaker_position_mask=%x wave_format_code=%x ", 
-			wfe_p->wfe_number_valid_bits, wfe_p->wfe_speaker_position_mask, wfe_p->wfe_wave_format_code);
-		printf("guid: ");
-		for (int k = 2; k < 16; k++) {
-			printf("%02x", wfe_p->wfe_guid[k]);
-		printf("\n");
-		}
-#endif 
+
+	/* return what caller needs to find the samples */
+
+	info_out->channels = wf.wf_channels;
+	info_out->samples_per_sec = wf.wf_samples_per_sec;
+	info_out->format = format;
+	info_out->bits_per_sample = wf.wf_bits_per_sample;
+	if (have_fact && is_rf64 && wfct.wfct_number_samples == WAV_SIZE_IN_DS64) {
+		info_out->frame_count = ds64.wds_sample_count;
+	} else if (have_fact) {
+		info_out->frame_count = wfct.wfct_number_samples;
 	} else {
-		return usage("invalid wf_len");
+		info_out->frame_count = data_bytes / wf.wf_block_align;
 	}
+	if (info_out->frame_count > data_bytes / wf.wf_block_align)
+		return usage("fact sample count larger than data chunk");
 	if (wav_debug)
-		printf("extension size %d\n", extension_size);
+		printf("data chunk size=%" PRIu64 " number frames = %" PRId64 " file offset = %lu\n", 
+			data_bytes, info_out->frame_count, *data_offset_out);
+	return OK;
+}
 
-	/* parse LIST chunk if there is one */
+/* open .wav file and index its chunks, positioned at the first frame.
+ * return OK if done, NOTOK otherwise
+ */
 
-	wl_p = (struct wav_list * )((char * )wf_p + extension_size);
-	if (!not_match_str(liststr, wl_p->wl_liststr)) {
-		char extract_4byte_id[STRUCT_ID_LEN+1] = {0};
-		strncpy(extract_4byte_id, wl_p->wl_list_type_id, STRUCT_ID_LEN);
-		if (wav_debug)
-			printf("LIST structure found with length %u header %4s\n", wl_p->wl_chunk_size, extract_4byte_id);
-		if (not_match_str(infostr, wl_p->wl_list_type_id)) {
-			printf("unrecognized LIST type found\n");
-		}
-		wfct_p = (struct wav_fact * )((char * )wl_p + sizeof(wl_p->wl_chunk_size) + sizeof(wl_p->wl_list_type_id) + wl_p->wl_chunk_size);
-	} else {
-		wfct_p = (struct wav_fact * )((char * )wf_p + extension_size);
+int wav_reader_open(char * wav_filename_p, struct wav_reader **reader_out, struct wav_info *info_out)
+{
+	struct wav_reader * rdr;
+
+	*reader_out = NULL;
+	chk_dbg();
+
+	rdr = (struct wav_reader * )calloc(1, sizeof(struct wav_reader));
+	if (!rdr)
+		return syscall_error("malloc");
+	rdr->wr_fd = open(wav_filename_p, O_RDONLY);
+	if (rdr->wr_fd < 0) {
+		free(rdr);
+		return syscall_error(wav_filename_p);
+	}
+	if (wav_parse_headers(rdr->wr_fd, wav_filename_p, &rdr->wr_info, &rdr->wr_data_offset,
+			      &rdr->wr_chunks, &rdr->wr_chunk_count) != OK) {
+		wav_reader_close(rdr);
+		return NOTOK;
 	}
+	rdr->wr_frame_bytes = rdr->wr_info.channels * rdr->wr_info.bits_per_sample / BITS_PER_BYTE;
+	*info_out = rdr->wr_info;
+	*reader_out = rdr;
+	return OK;
+}
 
-	/* parse optional fact chunk */
+/* read up to max_frames frames at the current position into caller's block buffer,
+ * in the file's own encoding.
+ * return OK if done (frames_out == 0 at end of data), NOTOK otherwise
+ */
 
-	if (!not_match_str(factstr, wfct_p->wfct_factstr)) {
-		if (wfct_p->wfct_chunk_size != 4)
-			return usage("fact structure length is not 4");
-		if (wav_debug)
-			printf("fact samples/chan = %u\n", wfct_p->wfct_number_samples);
-		wd_p = (struct wav_data * )((char * )wfct_p + sizeof(wfct_p->wfct_factstr) + sizeof(wfct_p->wfct_chunk_size) + wfct_p->wfct_chunk_size);
-	} else {
-		wd_p = (struct wav_data * )wfct_p;
-		wfct_p = NULL;
+int wav_reader_read_raw(struct wav_reader *rdr, void *block_buf, int max_frames, int *frames_out)
+{
+	int64_t frames = rdr->wr_info.frame_count - rdr->wr_next_frame;
+	int frame_bytes = rdr->wr_frame_bytes;
+	off_t offset = rdr->wr_data_offset + (off_t )rdr->wr_next_frame * frame_bytes;
+
+	*frames_out = 0;
+	if (frames > max_frames)
+		frames = max_frames;
+	if (frames <= 0)
+		return OK;
+	if (pread_all(rdr->wr_fd, (void * )block_buf, (size_t )frames * frame_bytes, offset, 
+		      "could not read all sample data") != OK)
+		return NOTOK;
+	rdr->wr_next_frame += frames;
+	*frames_out = frames;
+	return OK;
+}
+
+/* take the next max_frames frames as wav_reader_read_raw() would, but leave
+ * the reading to the caller. return OK if done (frames_out == 0 at end of data)
+ */
+
+int wav_reader_claim(struct wav_reader *rdr, int max_frames, off_t *offset_out, int *frames_out)
+{
+	int64_t frames = rdr->wr_info.frame_count - rdr->wr_next_frame;
+
+	if (frames > max_frames)
+		frames = max_frames;
+	if (frames < 0)
+		frames = 0;
+	*offset_out = rdr->wr_data_offset + (off_t )rdr->wr_next_frame * rdr->wr_frame_bytes;
+	*frames_out = frames;
+	rdr->wr_next_frame += frames;
+	return OK;
+}
+
+int wav_reader_fd(struct wav_reader *rdr)
+{
+	return rdr->wr_fd;
+}
+
+/* read up to max_frames frames and convert them to normalized floats.
+ * return OK if done (frames_out == 0 at end of data), NOTOK otherwise
+ */
+
+int wav_reader_read_float(struct wav_reader *rdr, float *block_buf, int max_frames, int *frames_out)
+{
+	struct wav_info *info = &rdr->wr_info;
+	int frames;
+
+	/* 32-bit float needs no conversion, read it straight into caller's buffer */
+	if (info->format == WAVE_FORMAT_IEEE_FLOAT && info->bits_per_sample == 32)
+		return wav_reader_read_raw(rdr, block_buf, max_frames, frames_out);
+
+	*frames_out = 0;
+	if (grow_buf(&rdr->wr_raw_buf, &rdr->wr_raw_size, (size_t )max_frames * rdr->wr_frame_bytes) != OK)
+		return NOTOK;
+	if (wav_reader_read_raw(rdr, rdr->wr_raw_buf, max_frames, &frames) != OK)
+		return NOTOK;
+	wav_decode_float(rdr->wr_raw_buf, info->format, info->bits_per_sample, block_buf, 
+			 (size_t )frames * info->channels);
+	*frames_out = frames;
+	return OK;
+}
+
+/* read up to max_frames frames as 16-bit samples, converting if the file is not 16-bit.
+ * return OK if done (frames_out == 0 at end of data), NOTOK otherwise
+ */
+
+int wav_reader_read(struct wav_reader *rdr, wav_sample_t *block_buf, int max_frames, int *frames_out)
+{
+	struct wav_info *info = &rdr->wr_info;
+	int frames;
+
+	if (info->format == WAVE_FORMAT_PCM && info->bits_per_sample == 16)
+		return wav_reader_read_raw(rdr, block_buf, max_frames, frames_out);
+
+	*frames_out = 0;
+	if (grow_buf((void ** )&rdr->wr_float_buf, &rdr->wr_float_size, 
+		     sizeof(float) * max_frames * info->channels) != OK)
+		return NOTOK;
+	if (wav_reader_read_float(rdr, rdr->wr_float_buf, max_frames, &frames) != OK)
+		return NOTOK;
+	wav_float_to_s16(rdr->wr_float_buf, block_buf, (size_t )frames * info->channels);
+	*frames_out = frames;
+	return OK;
+}
+
+/* position reader so next read starts at frame. return OK if done, NOTOK otherwise */
+
+int wav_reader_seek(struct wav_reader *rdr, int64_t frame)
+{
+	if (frame < 0 || frame > rdr->wr_info.frame_count)
+		return usage("seek past end of data");
+	rdr->wr_next_frame = frame;
+	return OK;
+}
+
+/* position reader so next read starts at the frame playing at time seconds */
+
+int wav_reader_seek_time(struct wav_reader *rdr, double seconds)
+{
+	return wav_reader_seek(rdr, (int64_t )(seconds * rdr->wr_info.samples_per_sec));
+}
+
+/* return index of chunks found in file */
+
+void wav_reader_chunks(struct wav_reader *rdr, const struct wav_chunk **chunks_out, int *chunk_count_out)
+{
+	*chunks_out = rdr->wr_chunks;
+	*chunk_count_out = rdr->wr_chunk_count;
+}
+
+/* trade the raw sample buffer for the caller's */
+
+void wav_reader_swap_buf(struct wav_reader *rdr, void **buf, size_t *size)
+{
+	void * old_buf = rdr->wr_raw_buf;
+	size_t old_size = rdr->wr_raw_size;
+
+	rdr->wr_raw_buf = *buf;
+	rdr->wr_raw_size = *size;
+	*buf = old_buf;
+	*size = old_size;
+}
+
+void wav_reader_close(struct wav_reader *rdr)
+{
+	if (!rdr)
+		return;
+	if (rdr->wr_fd >= 0)
+		close(rdr->wr_fd);
+	free(rdr->wr_chunks);
+	free(rdr->wr_raw_buf);
+	free(rdr->wr_float_buf);
+	free(rdr);
+}
+
+/* state for a memory-mapped .wav file */
+
+struct wav_map {
+	void *		wm_addr;
+	size_t		wm_len;
+};
+
+/* map .wav file read-only and point caller at the data chunk.
+ * return OK if done, NOTOK otherwise
+ */
+
+int wav_map(char * wav_filename_p, struct wav_map **map_out, const wav_sample_t **samples_out, struct wav_info *info_out)
+{
+	struct wav_map * map;
+	struct stat st;
+	off_t data_offset = 0;
+	size_t data_bytes, willneed_bytes;
+	struct wav_chunk * chunks;
+	int chunk_count;
+	int fd, rc;
+
+	*map_out = NULL;
+	*samples_out = NULL;
+	chk_dbg();
+
+	fd = open(wav_filename_p, O_RDONLY);
+	if (fd < 0)
+		return syscall_error(wav_filename_p);
+	rc = wav_parse_headers(fd, wav_filename_p, info_out, &data_offset, &chunks, &chunk_count);
+	free(chunks);
+	if (rc != OK) {
+		close(fd);
+		return NOTOK;
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		return syscall_error("stat");
+	}
+	if (info_out->format != WAVE_FORMAT_PCM || info_out->bits_per_sample != 16) {
+		close(fd);
+		return usage("can only map 16-bit PCM samples");
+	}
+	data_bytes = (size_t )info_out->frame_count * info_out->channels * BYTES_PER_SAMPLE;
+	if (data_offset + data_bytes > st.st_size) {
+		close(fd);
+		return usage("data chunk extends past end of file");
+	}
+	map = (struct wav_map * )calloc(1, sizeof(struct wav_map));
+	if (!map) {
+		close(fd);
+		return syscall_error("malloc");
+	}
+	map->wm_len = st.st_size;
+	map->wm_addr = mmap(NULL, map->wm_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);  /* mapping holds its own reference to the file */
+	if (map->wm_addr == MAP_FAILED) {
+		free(map);
+		return syscall_error("mmap");
 	}
 
-	/* parse data chunk */
+	/* samples are consumed front to back, so ask for aggressive readahead
+	 * and start reading the first part of the data chunk right away 
+	 */
 
-	if (not_match_str(datastr, wd_p->wd_datastr))
-		return usage("invalid wav_data structure");
+	/* these are only hints, so failure is not fatal */
+	if (madvise(map->wm_addr, map->wm_len, MADV_SEQUENTIAL) && wav_debug)
+		printf("madvise sequential: %s\n", strerror(errno));
+	willneed_bytes = data_offset + (data_bytes < WAV_MAP_WILLNEED_BYTES ? data_bytes : WAV_MAP_WILLNEED_BYTES);
+	if (madvise(map->wm_addr, willneed_bytes, MADV_WILLNEED) && wav_debug)
+		printf("madvise willneed: %s\n", strerror(errno));
 	if (wav_debug)
-		printf("data chunk size=%u\n", wd_p->wd_chunk_size);
+		printf("mapped %lu bytes, data at offset %lu\n", map->wm_len, data_offset);
+
+	*samples_out = (const wav_sample_t * )((char * )map->wm_addr + data_offset);
+	*map_out = map;
+	return OK;
+}
+
+void wav_unmap(struct wav_map *map)
+{
+	if (!map)
+		return;
+	munmap(map->wm_addr, map->wm_len);
+	free(map);
+}
+
+/* read .wav file PCM samples into buffer. 
+ * return OK if done, NOTOK otherwise 
+ * caller is responsible for freeing the buffer allocated and returned in sample_buf_out
+ */
+
+int wav_read(char * wav_filename_p, wav_sample_t **sample_buf_out, int64_t *sample_count_out, struct wav_info *info_out)
+{
+	struct wav_reader * rdr;
+	struct wav_info info;
+	int64_t number_samples;
+	size_t sample_buf_size;
+	int frames_read;
+
+	/* initialize outputs */
+
+	*sample_buf_out = (wav_sample_t * )NULL;
+	*sample_count_out = 0;
+	memset(info_out, 0, sizeof(*info_out));
+
+	if (wav_reader_open(wav_filename_p, &rdr, &info) != OK)
+		return NOTOK;
 
 	/* read samples */
 
-	if (wfct_p) {
-		number_samples = wfct_p->wfct_number_samples * wf_p->wf_channels;
-	} else {
-		number_samples = wd_p->wd_chunk_size / BYTES_PER_SAMPLE;
-	}
+	number_samples = info.frame_count * info.channels;
 	if (wav_debug)
-		printf("number samples = %d\n", number_samples);
+		printf("number samples = %" PRId64 "\n", number_samples);
 	sample_buf_size = sizeof(wav_sample_t) * number_samples;
 	if (wav_debug)
-		printf("allocating sample buf of %u bytes\n", sample_buf_size);
+		printf("allocating sample buf of %zu bytes\n", sample_buf_size);
 	wav_sample_t * sample_buf = (wav_sample_t * )malloc(sample_buf_size);
-	if (!sample_buf)
+	if (!sample_buf) {
+		wav_reader_close(rdr);
 		return usage("could not allocate sample buf");
-	memset(sample_buf, 0, sample_buf_size);
-	file_offset = (off_t )((unsigned char * )wd_p + sizeof(struct wav_data) - buf);
-	if (wav_debug)
-		printf("file offset = %lu\n", file_offset);
-	off = lseek(fd, file_offset, SEEK_SET);
-	if (off != file_offset)
-		return syscall_error("could not set file offset for sample read");
-	count = read(fd, (void * )sample_buf, sample_buf_size);
-	if (wav_debug)
-		printf("read %d bytes of sample data\n", count);
-	if (count < 0)
-		return syscall_error("could not read samples");
-	if (count < sample_buf_size)
-		return usage("could not read all sample data");
+	}
+
+	/* frame counts in one call are int, so read in pieces */
+
+	for (int64_t frame = 0; frame < info.frame_count; frame += frames_read) {
+		if (wav_reader_read(rdr, sample_buf + frame * info.channels, WAV_WHOLE_FILE_FRAMES, &frames_read) != OK ||
+		    frames_read == 0) {
+			free(sample_buf);
+			wav_reader_close(rdr);
+			return NOTOK;
+		}
+	}
+	wav_reader_close(rdr);
 
 	/* return sample buf and sample count */
 
 	*sample_count_out = number_samples;
 	*sample_buf_out = sample_buf;
-	*channels_out = wf_p->wf_channels;
+	*info_out = info;
 
 	return OK;
 }
 
+/* fill in RIFF, ds64 (or JUNK holding its place), format, fact (for float samples)
+ * and data headers for a file with data_bytes of samples and write them at the
+ * start of the file.  Past 4 GiB the file becomes RF64 and the 32-bit sizes
+ * point at ds64, otherwise ds64 stays JUNK and it is a plain RIFF file.
+ * returns length of headers, or -1 if they could not be written
+ */
 
-/* write wav file. return OK if written. NOTOK otherwise */
-
-int wav_write(char * wav_filename_p, wav_sample_t *sample_buf_in, int sample_count, int channels)
+static int wav_write_headers(int fd, struct wav_info *info, uint64_t data_bytes)
 {
-	char temp_file_path[MAX_PATHNAME_LEN] = { 0 };
+	unsigned char hdr_buf[sizeof(struct wav_header) + sizeof(struct wav_chunk_header) + WAV_DS64_LEN +
+			      sizeof(struct wav_fmt) + sizeof(struct wav_fmt_extension) + 
+			      sizeof(struct wav_fact) + sizeof(struct wav_data)];
+	unsigned char * next = hdr_buf;
 	struct wav_header wh;
+	struct wav_chunk_header wch;
+	struct wav_ds64 ds64;
 	struct wav_fmt wf;
+	struct wav_fmt_extension wfe;
+	struct wav_fact wfct;
 	struct wav_data wd;
-	int fd;
+	int is_float = (info->format == WAVE_FORMAT_IEEE_FLOAT);
+	int is_extensible = (info->channels > 2);
+	int is_rf64;
+	uint16_t cb_size = 0;
+	uint64_t frames;
+	int hdr_len;
+	int rc;
+
+	/* initialize format header, non-PCM formats need the cbSize field and
+	 * more than 2 channels need the extensible format to say which is which */
+
+	memcpy(wf.wf_fmtstr, fmtstr, STRUCT_ID_LEN);
+	wf.wf_len = is_extensible ? WAV_FMT_EXTENSIBLE_LEN : (is_float ? 18 : 16);
+	wf.wf_fmt = is_extensible ? WAVE_FORMAT_EXTENSIBLE : info->format;
+	wf.wf_channels = info->channels;
+	wf.wf_bits_per_sample = info->bits_per_sample;
+	wf.wf_samples_per_sec = info->samples_per_sec;
+	wf.wf_bytes_per_sec = wf.wf_bits_per_sample * wf.wf_samples_per_sec * wf.wf_channels / BITS_PER_BYTE;
+	wf.wf_block_align = wf.wf_bits_per_sample * wf.wf_channels / BITS_PER_BYTE;
+	frames = data_bytes / wf.wf_block_align;
+	memset(&wfe, 0, sizeof(wfe));
+	wfe.wfe_extension_size = sizeof(wfe) - sizeof(wfe.wfe_extension_size);
+	wfe.wfe_number_valid_bits = info->bits_per_sample;
+	wfe.wfe_speaker_position_mask =
+		info->channels < (int )(sizeof(speaker_masks) / sizeof(speaker_masks[0])) ? speaker_masks[info->channels] : 0;
+	wfe.wfe_wave_format_code = info->format;
+	memcpy(wfe.wfe_guid, subformat_guid_tail, sizeof(wfe.wfe_guid));
+
+	/* now we know how long the headers are, and so whether it all fits in 4 GiB */
+
+	hdr_len = sizeof(wh) + sizeof(wch) + WAV_DS64_LEN + sizeof(wf) + 
+		  (is_extensible ? sizeof(wfe) : (is_float ? sizeof(cb_size) : 0)) +
+		  (is_float ? sizeof(wfct) : 0) + sizeof(wd);
+	memset(&ds64, 0, sizeof(ds64));
+	ds64.wds_riff_size = hdr_len + data_bytes - 8;
+	is_rf64 = (ds64.wds_riff_size > UINT32_MAX);
+
+	/* initialize fact and data structs */
+
+	memcpy(wfct.wfct_factstr, factstr, STRUCT_ID_LEN);
+	wfct.wfct_chunk_size = sizeof(wfct.wfct_number_samples);
+	wfct.wfct_number_samples = is_rf64 ? WAV_SIZE_IN_DS64 : frames;
+	memcpy(wd.wd_datastr, datastr, STRUCT_ID_LEN);
+	wd.wd_chunk_size = is_rf64 ? WAV_SIZE_IN_DS64 : data_bytes;
+
+	/* initialize .wav header and ds64 or its placeholder */
+
+	memcpy(wh.wh_riffstr, is_rf64 ? rf64str : riffstr, STRUCT_ID_LEN);
+	memcpy(wh.wh_wavestr, wavestr, STRUCT_ID_LEN);
+	wh.wh_file_length = is_rf64 ? WAV_SIZE_IN_DS64 : ds64.wds_riff_size;
+	memcpy(wch.wch_idstr, is_rf64 ? ds64str : junkstr, STRUCT_ID_LEN);
+	wch.wch_chunk_size = WAV_DS64_LEN;
+	if (is_rf64) {
+		ds64.wds_data_size = data_bytes;
+		ds64.wds_sample_count = frames;
+	} else {
+		ds64.wds_riff_size = 0;
+	}
+	if (wav_debug) printf("riff size %" PRIu64 "%s\n", hdr_len + data_bytes - 8, is_rf64 ? " (RF64)" : "");
+
+	/* lay them out and write them all at once */
+
+	memcpy(next, &wh, sizeof(wh));
+	next += sizeof(wh);
+	memcpy(next, &wch, sizeof(wch));
+	next += sizeof(wch);
+	memcpy(next, &ds64, WAV_DS64_LEN);
+	next += WAV_DS64_LEN;
+	memcpy(next, &wf, sizeof(wf));
+	next += sizeof(wf);
+	if (is_extensible) {
+		memcpy(next, &wfe, sizeof(wfe));
+		next += sizeof(wfe);
+	} else if (is_float) {
+		memcpy(next, &cb_size, sizeof(cb_size));
+		next += sizeof(cb_size);
+	}
+	if (is_float) {
+		memcpy(next, &wfct, sizeof(wfct));
+		next += sizeof(wfct);
+	}
+	memcpy(next, &wd, sizeof(wd));
+	rc = pwrite(fd, hdr_buf, hdr_len, 0);
+	if (rc < 0) {
+		syscall_error("could not write wav headers");
+		return -1;
+	}
+	if (rc != hdr_len) {
+		usage("could not write complete headers");
+		return -1;
+	}
+	return hdr_len;
+}
+
+/* create temp file next to the final path, write placeholder headers 
+ * and leave it positioned for the first block of samples.
+ * return OK if done, NOTOK otherwise
+ */
+
+int wav_writer_open_format(char * wav_filename_p, const struct wav_info *format, struct wav_writer **writer_out)
+{
+	struct wav_writer * wtr;
 	int rc;
+	int hdr_len;
 	char *dot;
 
+	*writer_out = NULL;
 	chk_dbg();
-	if (channels != 1 && channels != 2)
-		return usage("only 1 or 2 channels supported");
+	if (format->channels < 1 || format->channels > WAV_MAX_CHANNELS)
+		return usage("too many channels");
+	if (!wav_encoding_supported(format->format, format->bits_per_sample))
+		return usage("unsupported sample encoding");
+	if (format->samples_per_sec <= 0)
+		return usage("samples per sec must be positive");
 
 	/* construct temp file name in same directory, write to that, rename at end */
 
 	dot = rindex(wav_filename_p, '.');
-	if (strcmp(dot, ".wav"))
+	if (!dot || strcmp(dot, ".wav"))
 		return usage("input filename must end in .wav");
+	if (strlen(wav_filename_p) + strlen(".tmp") >= MAX_PATHNAME_LEN)
+		return usage("output pathname too long");
 	if (wav_debug)
 		printf("output filename %s\n", wav_filename_p);
-	strcpy(temp_file_path, wav_filename_p);
-	strcat(temp_file_path, ".tmp");
-	rc = unlink(temp_file_path);
-	if (rc != OK && errno != ENOENT)
-		return syscall_error(temp_file_path);
-	if ((wav_debug != 0) && (rc == OK)) printf("%s unlinked\n", temp_file_path);
-	fd = open(temp_file_path, O_CREAT|O_WRONLY|O_EXCL, 0644);
-	if (fd < 0)
+	wtr = (struct wav_writer * )calloc(1, sizeof(struct wav_writer));
+	if (!wtr)
+		return syscall_error("malloc");
+	wtr->ww_info = *format;
+	wtr->ww_frame_bytes = format->channels * format->bits_per_sample / BITS_PER_BYTE;
+	strcpy(wtr->ww_final_path, wav_filename_p);
+	strcpy(wtr->ww_temp_path, wav_filename_p);
+	strcat(wtr->ww_temp_path, ".tmp");
+	rc = unlink(wtr->ww_temp_path);
+	if (rc != OK && errno != ENOENT) {
+		rc = syscall_error(wtr->ww_temp_path);
+		free(wtr);
+		return rc;
+	}
+	if ((wav_debug != 0) && (rc == OK)) printf("%s unlinked\n", wtr->ww_temp_path);
+	wtr->ww_fd = open(wtr->ww_temp_path, O_CREAT|O_WRONLY|O_EXCL, 0644);
+	if (wtr->ww_fd < 0) {
+		free(wtr);
 		return syscall_error("open for write");
+	}
 
-	/* initialize .wav header and write it */
+	/* headers are rewritten with real lengths at close */
 
-	memcpy(wh.wh_riffstr, riffstr, STRUCT_ID_LEN);
-	memcpy(wh.wh_wavestr, wavestr, STRUCT_ID_LEN);
-	wh.wh_file_length = sizeof(wh) + sizeof(wf) + sizeof(wd) + (sample_count * BYTES_PER_SAMPLE) - 8;
-	if (wav_debug) printf("wh_file_length %d\n", wh.wh_file_length);
-	rc = write(fd, (uint8_t * )&wh, sizeof(wh));
-	if (rc < 0) return syscall_error("could not write wav header");
-	if (rc != sizeof(wh)) return usage("could not write complete header");
+	hdr_len = wav_write_headers(wtr->ww_fd, &wtr->ww_info, 0);
+	if (hdr_len < 0 || lseek(wtr->ww_fd, hdr_len, SEEK_SET) < 0) {
+		close(wtr->ww_fd);
+		unlink(wtr->ww_temp_path);
+		free(wtr);
+		return NOTOK;
+	}
+	wtr->ww_data_offset = hdr_len;
+	*writer_out = wtr;
+	return OK;
+}
 
-	/* initialize format header and write it */
+/* open writer for 16-bit PCM. return OK if done, NOTOK otherwise */
 
-	memcpy(wf.wf_fmtstr, fmtstr, STRUCT_ID_LEN);
-	wf.wf_len = 16;
-	wf.wf_fmt = 1;  /* FIXME */
-	wf.wf_channels = channels;
-	wf.wf_bits_per_sample = BYTES_PER_SAMPLE * BITS_PER_BYTE;
-	wf.wf_samples_per_sec = WAV_SAMPLES_PER_SEC;
-	wf.wf_bytes_per_sec = wf.wf_bits_per_sample * wf.wf_samples_per_sec * wf.wf_channels / BITS_PER_BYTE;
-	wf.wf_block_align = wf.wf_bits_per_sample * wf.wf_channels / BITS_PER_BYTE;
-	rc = write(fd ,(uint8_t * )&wf, sizeof(wf));
-	if (rc < 0) return syscall_error("could not write wav format");
-	if (rc != sizeof(wf)) return usage("could not write complete format");
+int wav_writer_open(char * wav_filename_p, int channels, int samples_per_sec, struct wav_writer **writer_out)
+{
+	struct wav_info format = { 0 };
 
-	/* initialize data struct and write it */
+	format.channels = channels;
+	format.samples_per_sec = samples_per_sec;
+	format.format = WAVE_FORMAT_PCM;
+	format.bits_per_sample = BYTES_PER_SAMPLE * BITS_PER_BYTE;
+	return wav_writer_open_format(wav_filename_p, &format, writer_out);
+}
 
-	memcpy(wd.wd_datastr, datastr, STRUCT_ID_LEN);
-	wd.wd_chunk_size = sample_count * BYTES_PER_SAMPLE;
-	rc = write(fd ,(uint8_t * )&wd, sizeof(wd));
-	if (rc < 0) return syscall_error("could not write data header struct");
-	if (rc != sizeof(wd)) return usage("could not write complete data header struct");
+/* append a block of frames already in the output encoding. 
+ * return OK if written, NOTOK otherwise 
+ */
 
-	/* write the samples */
+int wav_writer_write_raw(struct wav_writer *wtr, const void *block_buf, int frames)
+{
+	size_t block_bytes = (size_t )frames * wtr->ww_frame_bytes;
+	ssize_t rc;
 
-	if (wav_debug)
-		printf("writing %d bytes of data\n", wd.wd_chunk_size);
-	rc = write(fd ,(uint8_t * )sample_buf_in, wd.wd_chunk_size);
+	if (frames <= 0)
+		return OK;
+	rc = pwrite(wtr->ww_fd, (uint8_t * )block_buf, block_bytes, wtr->ww_data_offset + wtr->ww_data_bytes);
 	if (rc < 0) return syscall_error("could not write sample data");
-	if (rc < wd.wd_chunk_size) return usage("could not write complete sample data");
+	if (rc < block_bytes) return usage("could not write complete sample data");
+	wtr->ww_data_bytes += block_bytes;
+	return OK;
+}
+
+/* append room for frames as wav_writer_write_raw() would, but leave the
+ * writing to the caller. return OK
+ */
+
+int wav_writer_claim(struct wav_writer *wtr, int frames, off_t *offset_out)
+{
+	*offset_out = wtr->ww_data_offset + wtr->ww_data_bytes;
+	if (frames > 0)
+		wtr->ww_data_bytes += (uint64_t )frames * wtr->ww_frame_bytes;
+	return OK;
+}
 
-	/* close and rename file */
+int wav_writer_fd(struct wav_writer *wtr)
+{
+	return wtr->ww_fd;
+}
+
+/* trade the raw sample buffer for the caller's */
+
+void wav_writer_swap_buf(struct wav_writer *wtr, void **buf, size_t *size)
+{
+	void * old_buf = wtr->ww_raw_buf;
+	size_t old_size = wtr->ww_raw_size;
+
+	wtr->ww_raw_buf = *buf;
+	wtr->ww_raw_size = *size;
+	*buf = old_buf;
+	*size = old_size;
+}
+
+/* size the data chunk for frame_count frames so that blocks can be written
+ * at their own positions. return OK if done, NOTOK otherwise 
+ */
 
-	rc = close(fd);
-	if (rc < 0) return syscall_error("close written file");
-	if (wav_debug) printf("renaming %s to %s\n", temp_file_path, wav_filename_p);
-	rc = rename(temp_file_path, wav_filename_p);
+int wav_writer_reserve(struct wav_writer *wtr, int64_t frame_count)
+{
+	uint64_t data_bytes = (uint64_t )frame_count * wtr->ww_frame_bytes;
+
+	if (wtr->ww_data_bytes != 0)
+		return usage("cannot reserve after frames were appended");
+	if (ftruncate(wtr->ww_fd, (off_t )wtr->ww_data_offset + data_bytes) < 0)
+		return syscall_error("could not size output file");
+	wtr->ww_data_bytes = data_bytes;
+	return OK;
+}
+
+/* write a block of frames already in the output encoding at first_frame.
+ * only touches the file, so several threads may call it at once.
+ * return OK if written, NOTOK otherwise 
+ */
+
+int wav_writer_write_raw_at(struct wav_writer *wtr, const void *block_buf, int frames, int64_t first_frame)
+{
+	size_t block_bytes = (size_t )frames * wtr->ww_frame_bytes;
+	off_t offset = (off_t )first_frame * wtr->ww_frame_bytes;
+	ssize_t rc;
+
+	if (frames <= 0)
+		return OK;
+	if (first_frame < 0 || offset + block_bytes > wtr->ww_data_bytes)
+		return usage("block is outside reserved data");
+	rc = pwrite(wtr->ww_fd, block_buf, block_bytes, wtr->ww_data_offset + offset);
+	if (rc < 0) return syscall_error("could not write sample data");
+	if (rc < block_bytes) return usage("could not write complete sample data");
+	return OK;
+}
+
+/* convert a block of normalized float frames to the output encoding and append it.
+ * return OK if written, NOTOK otherwise 
+ */
+
+int wav_writer_write_float(struct wav_writer *wtr, const float *block_buf, int frames)
+{
+	struct wav_info *info = &wtr->ww_info;
+
+	if (info->format == WAVE_FORMAT_IEEE_FLOAT && info->bits_per_sample == 32)
+		return wav_writer_write_raw(wtr, block_buf, frames);
+	if (grow_buf(&wtr->ww_raw_buf, &wtr->ww_raw_size, (size_t )frames * wtr->ww_frame_bytes) != OK)
+		return NOTOK;
+	wav_encode_float(block_buf, info->format, info->bits_per_sample, wtr->ww_raw_buf, 
+			 (size_t )frames * info->channels);
+	return wav_writer_write_raw(wtr, wtr->ww_raw_buf, frames);
+}
+
+/* append a block of 16-bit frames, converting if output is not 16-bit.
+ * return OK if written, NOTOK otherwise 
+ */
+
+int wav_writer_write(struct wav_writer *wtr, wav_sample_t *block_buf, int frames)
+{
+	struct wav_info *info = &wtr->ww_info;
+	size_t samples = (size_t )frames * info->channels;
+
+	if (info->format == WAVE_FORMAT_PCM && info->bits_per_sample == 16)
+		return wav_writer_write_raw(wtr, block_buf, frames);
+	if (grow_buf((void ** )&wtr->ww_float_buf, &wtr->ww_float_size, sizeof(float) * samples) != OK)
+		return NOTOK;
+	wav_s16_to_float(block_buf, wtr->ww_float_buf, samples);
+	return wav_writer_write_float(wtr, wtr->ww_float_buf, frames);
+}
+
+/* free writer and its buffers */
+
+static void wav_writer_free(struct wav_writer *wtr)
+{
+	free(wtr->ww_raw_buf);
+	free(wtr->ww_float_buf);
+	free(wtr);
+}
+
+/* patch headers, close and rename file. return OK if done, NOTOK otherwise */
+
+int wav_writer_close(struct wav_writer *wtr)
+{
+	static const uint8_t pad = 0;
+	int rc;
+
+	if (wav_debug)
+		printf("wrote %" PRIu64 " bytes of data\n", wtr->ww_data_bytes);
+
+	/* an odd length data chunk is followed by a pad byte, not counted in
+	 * the chunk or RIFF sizes */
+	if ((wtr->ww_data_bytes & 1) &&
+	    pwrite(wtr->ww_fd, &pad, 1, wtr->ww_data_offset + wtr->ww_data_bytes) != 1) {
+		syscall_error("could not write pad byte");
+		wav_writer_abort(wtr);
+		return NOTOK;
+	}
+	if (wav_write_headers(wtr->ww_fd, &wtr->ww_info, wtr->ww_data_bytes) < 0) {
+		close(wtr->ww_fd);
+		wav_writer_free(wtr);
+		return NOTOK;
+	}
+	rc = close(wtr->ww_fd);
+	if (rc < 0) {
+		wav_writer_free(wtr);
+		return syscall_error("close written file");
+	}
+	if (wav_debug) printf("renaming %s to %s\n", wtr->ww_temp_path, wtr->ww_final_path);
+	rc = rename(wtr->ww_temp_path, wtr->ww_final_path);
+	wav_writer_free(wtr);
 	if (rc < 0) return syscall_error("rename to final filename");
 
 	return OK;
 }
 
+/* give up on a file being written, nothing is left behind */
+
+void wav_writer_abort(struct wav_writer *wtr)
+{
+	close(wtr->ww_fd);
+	unlink(wtr->ww_temp_path);
+	wav_writer_free(wtr);
+}
+
+/* write wav file. return OK if written. NOTOK otherwise */
+
+int wav_write(char * wav_filename_p, wav_sample_t *sample_buf_in, int64_t sample_count, const struct wav_info *info)
+{
+	struct wav_writer * wtr;
+	int channels = info->channels;
+	int64_t frame_count = sample_count / channels;
+
+	if (wav_writer_open(wav_filename_p, channels, info->samples_per_sec, &wtr) != OK)
+		return NOTOK;
+	for (int64_t frame = 0; frame < frame_count; frame += WAV_WHOLE_FILE_FRAMES) {
+		int64_t frames = frame_count - frame;
+		if (frames > WAV_WHOLE_FILE_FRAMES)
+			frames = WAV_WHOLE_FILE_FRAMES;
+		if (wav_writer_write(wtr, sample_buf_in + frame * channels, frames) != OK) {
+			wav_writer_abort(wtr);
+			return NOTOK;
+		}
+	}
+	return wav_writer_close(wtr);
+}
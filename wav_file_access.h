@@ -2,6 +2,8 @@
 # define _test_wav_access_h_ 1
 
 #include <stdint.h>
+#include <sys/types.h>
+#include "wav_convert.h"
 
 #ifndef PI
 #define PI 3.14159
@@ -18,16 +20,22 @@
 #define BYTES_PER_SAMPLE 2
 #define MAX_VOLUME (1<<15)
 
-/* this function only supports 16-bit PCM samples at this time */
+/* wav_read() and friends return 16-bit samples whatever the file holds,
+ * use the _float and _raw block functions below to get full precision */
 typedef int16_t wav_sample_t;
 
+/* see below */
+struct wav_info;
+
 /*
  * input:
  *   wav_filename_p - pathname of .wav file to read and return samples from
  * output:
  *   sample_buf_out - returns pointer to sample buffer (uint16_t *)
  *   sample_count_out - returns number of samples in buffer
- *   channels_out - number of sound channels (1 or 2)
+ *   info_out - returns channels, sample rate, frame count and format of
+ *              the file, the samples in sample_buf_out are 16-bit whatever
+ *              format says
  * returns:
  *   0 - if samples were read and returned
  *   non-0 otherwise
@@ -35,23 +43,242 @@ typedef int16_t wav_sample_t;
  * caller must free sample_buf_out after using
  * subroutine will exit with non-zero status if any error is encountered
  */
-int wav_read(char * wav_filename_p, wav_sample_t **sample_buf_out, int *sample_count_out, int *channels_out);
+int wav_read(char * wav_filename_p, wav_sample_t **sample_buf_out, int64_t *sample_count_out, struct wav_info *info_out);
 
 /*
  * input:
  *  sample_buf - array of sample values
  *  sample_count - number of sample values in array
  */
-void print_samples(wav_sample_t * sample_buf, int sample_count);
+void print_samples(wav_sample_t * sample_buf, int64_t sample_count);
 
 /*
  * input:
  *   wav_filename_p - write .wav file to this path
  *   sample_buf_in - array of sample values
- *   sample_count - how many samples in each channel
- *   channels - how many channels 
+ *   sample_count - how many sample values in array
+ *   info - channels and samples_per_sec to write, as 16-bit PCM
+ * returns 0 if successful, non-0 otherwise
+ */
+int wav_write(char * wav_filename_p, wav_sample_t *sample_buf_in, int64_t sample_count, const struct wav_info *info);
+
+/* block-at-a-time access, so that tools can process a file of any length
+ * in constant memory.  A "frame" is one sample from every channel,
+ * blocks are arrays of interleaved frames.
+ *
+ * Frame counts and positions are 64-bit.  Files over 4 GiB are read and
+ * written as RF64 (EBU Tech 3306, BW64 is the same layout), where a ds64
+ * chunk right after the header holds the 64-bit sizes.  The writer always
+ * leaves room for ds64 in a JUNK chunk, so a file that grows past 4 GiB is
+ * turned into RF64 when it is closed and plain RIFF otherwise.
+ */
+
+/* most sound channels a file may have, more than 2 are written as WAVE_FORMAT_EXTENSIBLE */
+#define WAV_MAX_CHANNELS 32
+
+/* default number of frames per block for streaming tools */
+#define WAV_BLOCK_FRAMES 4096
+
+/* what we learned about a .wav file from its headers */
+struct wav_info {
+	int	channels;		/* number of sound channels, 1 to WAV_MAX_CHANNELS */
+	int	samples_per_sec;	/* frames per second */
+	int64_t	frame_count;		/* total frames in data chunk */
+	int	format;			/* WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT */
+	int	bits_per_sample;	/* size of one sample on disk */
+};
+
+/* one entry in the index of RIFF chunks built when a file is opened */
+struct wav_chunk {
+	char	wc_id[5];	/* 4-byte chunk id, NUL-terminated */
+	off_t	wc_offset;	/* file offset of chunk body */
+	uint64_t wc_size;	/* length of chunk body in bytes, from ds64 in RF64 files */
+};
+
+/* opaque handles, see wav_file_access.c */
+struct wav_reader;
+struct wav_writer;
+
+/*
+ * input:
+ *   wav_filename_p - pathname of .wav file to read
+ * output:
+ *   reader_out - returns handle to pass to wav_reader_read()
+ *   info_out - returns channels, sample rate and frame count
+ * returns:
+ *   0 - if headers were parsed and the file is positioned at first frame
+ *   non-0 otherwise
+ */
+int wav_reader_open(char * wav_filename_p, struct wav_reader **reader_out, struct wav_info *info_out);
+
+/*
+ * input:
+ *   reader - handle from wav_reader_open()
+ *   block_buf - room for max_frames interleaved frames
+ *   max_frames - how many frames to read at most
+ * output:
+ *   frames_out - how many frames were read, 0 at end of data
+ * returns:
+ *   0 - if successful
+ *   non-0 otherwise
+ */
+int wav_reader_read(struct wav_reader *reader, wav_sample_t *block_buf, int max_frames, int *frames_out);
+
+/* same as wav_reader_read() but returns normalized floats, see wav_convert.h */
+int wav_reader_read_float(struct wav_reader *reader, float *block_buf, int max_frames, int *frames_out);
+
+/* same as wav_reader_read() but returns samples in the file's own encoding */
+int wav_reader_read_raw(struct wav_reader *reader, void *block_buf, int max_frames, int *frames_out);
+
+/*
+ * for callers that do their own I/O, e.g. through wav_aio.h
+ * input:
+ *   reader - handle from wav_reader_open()
+ *   max_frames - how many frames to take at most
+ * output:
+ *   offset_out - where in the file the frames are, in the file's own encoding
+ *   frames_out - how many frames were taken, 0 at end of data
+ * advances the position just like wav_reader_read_raw(), without reading
+ * returns 0 if successful, non-0 otherwise
+ */
+int wav_reader_claim(struct wav_reader *reader, int max_frames, off_t *offset_out, int *frames_out);
+
+/* file descriptor to read claimed frames from */
+int wav_reader_fd(struct wav_reader *reader);
+
+/*
+ * input:
+ *   reader - handle from wav_reader_open()
+ *   frame - index of frame that next wav_reader_read() will return,
+ *           or frame_count to position at end of data
+ * returns 0 if successful, non-0 otherwise
+ */
+int wav_reader_seek(struct wav_reader *reader, int64_t frame);
+
+/* same as wav_reader_seek() but with position in seconds from start of data */
+int wav_reader_seek_time(struct wav_reader *reader, double seconds);
+
+/*
+ * output:
+ *   chunks_out - returns every chunk found in the file, in file order
+ *   chunk_count_out - returns number of entries in chunks_out
+ * index belongs to the reader and is freed by wav_reader_close()
+ */
+void wav_reader_chunks(struct wav_reader *reader, const struct wav_chunk **chunks_out, int *chunk_count_out);
+
+/*
+ * input/output:
+ *   buf, size - buffer from malloc() and its size (or NULL and 0), swapped
+ *               with the one the reader decodes from, so a caller going
+ *               through many files can lend each reader the same buffer
+ * the reader grows what it is given and frees what it holds at close
+ */
+void wav_reader_swap_buf(struct wav_reader *reader, void **buf, size_t *size);
+
+/* close file and free handle */
+void wav_reader_close(struct wav_reader *reader);
+
+/*
+ * input:
+ *   wav_filename_p - write .wav file to this path, created atomically at close
+ *   format - channels, samples_per_sec, format and bits_per_sample to write,
+ *            frame_count is ignored
+ * output:
+ *   writer_out - returns handle to pass to wav_writer_write()
+ * returns 0 if successful, non-0 otherwise
+ */
+int wav_writer_open_format(char * wav_filename_p, const struct wav_info *format, struct wav_writer **writer_out);
+
+/* same as wav_writer_open_format() for 16-bit PCM */
+int wav_writer_open(char * wav_filename_p, int channels, int samples_per_sec, struct wav_writer **writer_out);
+
+/*
+ * input:
+ *   writer - handle from wav_writer_open()
+ *   block_buf - interleaved frames to append
+ *   frames - how many frames in block_buf
+ * returns 0 if successful, non-0 otherwise
+ */
+int wav_writer_write(struct wav_writer *writer, wav_sample_t *block_buf, int frames);
+
+/* same as wav_writer_write() but takes normalized floats, see wav_convert.h */
+int wav_writer_write_float(struct wav_writer *writer, const float *block_buf, int frames);
+
+/* same as wav_writer_write() but takes samples already in the output encoding */
+int wav_writer_write_raw(struct wav_writer *writer, const void *block_buf, int frames);
+
+/*
+ * for callers that do their own I/O, e.g. through wav_aio.h
+ * input:
+ *   writer - handle from wav_writer_open()
+ *   frames - how many frames to append
+ * output:
+ *   offset_out - where in the file the frames go, in the output encoding
+ * counts them as written just like wav_writer_write_raw(), the caller must
+ * finish writing them before wav_writer_close()
+ * returns 0 if successful, non-0 otherwise
+ */
+int wav_writer_claim(struct wav_writer *writer, int frames, off_t *offset_out);
+
+/* file descriptor to write claimed frames to */
+int wav_writer_fd(struct wav_writer *writer);
+
+/* same as wav_reader_swap_buf() for the buffer the writer encodes into */
+void wav_writer_swap_buf(struct wav_writer *writer, void **buf, size_t *size);
+
+/*
+ * input:
+ *   writer - handle from wav_writer_open(), nothing appended yet
+ *   frame_count - how many frames the data chunk will hold
+ * makes the file big enough for wav_writer_write_raw_at(), which is then
+ * the only way to fill it in.
+ * returns 0 if successful, non-0 otherwise
+ */
+int wav_writer_reserve(struct wav_writer *writer, int64_t frame_count);
+
+/* write frames in the output encoding at frame first_frame of the reserved
+ * data.  Safe to call from several threads at once on separate frames */
+int wav_writer_write_raw_at(struct wav_writer *writer, const void *block_buf, int frames, int64_t first_frame);
+
+/*
+ * patch RIFF and data chunk lengths to match what was written, as RF64
+ * if the file is over 4 GiB,
+ * then close and rename into place.  Handle is freed in any case.
  * returns 0 if successful, non-0 otherwise
  */
-int wav_write(char * wav_filename_p, wav_sample_t *sample_buf_in, int sample_count, int channels);
+int wav_writer_close(struct wav_writer *writer);
+
+/* close and remove the temp file without touching the output path, frees handle */
+void wav_writer_abort(struct wav_writer *writer);
+
+/* zero-copy, read-only access to the samples of a .wav file.
+ * The whole file is mapped and the caller gets a pointer straight into
+ * the data chunk, so pages are only faulted in as they are consumed.
+ */
+
+/* bytes at the start of the data chunk to prefetch asynchronously when mapping */
+#define WAV_MAP_WILLNEED_BYTES (4<<20)
+
+/* opaque handle, see wav_file_access.c */
+struct wav_map;
+
+/*
+ * input:
+ *   wav_filename_p - pathname of .wav file to map
+ * output:
+ *   map_out - returns handle to pass to wav_unmap()
+ *   samples_out - returns pointer to first interleaved frame in the data chunk
+ *   info_out - returns channels, sample rate and frame count
+ * returns:
+ *   0 - if file was mapped
+ *   non-0 otherwise
+ *
+ * samples_out is valid until wav_unmap() is called
+ * only 16-bit PCM files can be mapped
+ */
+int wav_map(char * wav_filename_p, struct wav_map **map_out, const wav_sample_t **samples_out, struct wav_info *info_out);
+
+/* unmap file and free handle */
+void wav_unmap(struct wav_map *map);
 
 #endif
@@ -0,0 +1,96 @@
+/* generate a synthetic .wav file for tests and benchmarks */
+/* signal is a sine sweep with a little noise on top, so that every sample
+ * changes and nothing compresses or short-circuits in the code under test */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include "wav_file_access.h"
+
+#define GEN_AMPLITUDE 0.5
+#define GEN_NOISE 0.01
+#define GEN_START_HZ 100.0
+#define GEN_END_HZ 4000.0
+
+static void usage(const char * msg)
+{
+	printf("ERROR: %s\n", msg);
+	printf("usage: wav_gen [ -s seconds ] [ -c channels ] [ -e encoding ] [ -r samples-per-sec ] output.wav\n");
+	printf("defaults are 10 seconds of 2 channels of s16 at 44100\n");
+	printf("encoding is one of u8, s16, s24, s32, f32, f64\n");
+	exit(NOTOK);
+}
+
+int main(int argc, char **argv)
+{
+	struct wav_info info = { 0 };
+	struct wav_writer * wtr;
+	float * block_buf;
+	double seconds = 10.0;
+	double phase = 0.0;
+	long frames_left;
+	long frame = 0;
+	unsigned int seed = 1;
+	int rc;
+	int opt;
+
+	info.channels = 2;
+	info.samples_per_sec = SAMPLES_PER_SEC;
+	info.format = WAVE_FORMAT_PCM;
+	info.bits_per_sample = 16;
+	while ((opt = getopt(argc, argv, "s:c:e:r:")) != -1) {
+		switch (opt) {
+		case 's':
+			seconds = atof(optarg);
+			break;
+		case 'c':
+			info.channels = atoi(optarg);
+			break;
+		case 'e':
+			if (wav_parse_encoding(optarg, &info.format, &info.bits_per_sample))
+				usage("unknown encoding");
+			break;
+		case 'r':
+			info.samples_per_sec = atoi(optarg);
+			break;
+		default:
+			usage("option parse error");
+		}
+	}
+	if (optind != argc - 1)
+		usage("output .wav filename must be supplied");
+	if (seconds <= 0.0)
+		usage("seconds must be positive");
+
+	rc = wav_writer_open_format(argv[optind], &info, &wtr);
+	if (rc) return rc;
+	block_buf = (float * )malloc(sizeof(float) * WAV_BLOCK_FRAMES * info.channels);
+	if (!block_buf) {
+		wav_writer_abort(wtr);
+		usage("could not allocate block buffer");
+	}
+
+	/* exponential sweep over the whole file, each channel a little out of phase */
+
+	frames_left = (long )(seconds * info.samples_per_sec);
+	while (frames_left > 0) {
+		int frames = frames_left < WAV_BLOCK_FRAMES ? frames_left : WAV_BLOCK_FRAMES;
+		for (int k = 0; k < frames; k++, frame++) {
+			double hz = GEN_START_HZ * pow(GEN_END_HZ / GEN_START_HZ, frame / (seconds * info.samples_per_sec));
+			phase += 2.0 * M_PI * hz / info.samples_per_sec;
+			for (int c = 0; c < info.channels; c++) {
+				double noise = GEN_NOISE * (2.0 * rand_r(&seed) / RAND_MAX - 1.0);
+				block_buf[k * info.channels + c] = GEN_AMPLITUDE * sin(phase + c * 0.5) + noise;
+			}
+		}
+		rc = wav_writer_write_float(wtr, block_buf, frames);
+		if (rc) {
+			wav_writer_abort(wtr);
+			return rc;
+		}
+		frames_left -= frames;
+	}
+	free(block_buf);
+	return wav_writer_close(wtr);
+}
@@ -0,0 +1,119 @@
+/* log-bucketed histograms, see wav_hist.h */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "wav_hist.h"
+
+/* values below WAV_HIST_SUB_BUCKETS get a bucket each, above that each
+ * power of 2 is split into WAV_HIST_SUB_BUCKETS by the bits after the top one */
+
+static int bucket_of(uint64_t value)
+{
+	int top;
+
+	if (value < WAV_HIST_SUB_BUCKETS)
+		return (int )value;
+	top = 63 - __builtin_clzll(value);
+	return (top - WAV_HIST_SUB_BITS + 1) * WAV_HIST_SUB_BUCKETS +
+		(int )((value >> (top - WAV_HIST_SUB_BITS)) & (WAV_HIST_SUB_BUCKETS - 1));
+}
+
+/* middle of the values that land in bucket b */
+
+static uint64_t bucket_value(int b)
+{
+	int shift;
+
+	if (b < WAV_HIST_SUB_BUCKETS)
+		return b;
+	shift = b / WAV_HIST_SUB_BUCKETS - 1;
+	return ((uint64_t )(WAV_HIST_SUB_BUCKETS + b % WAV_HIST_SUB_BUCKETS) << shift) +
+		((uint64_t )1 << shift) / 2;
+}
+
+void wav_hist_reset(struct wav_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void wav_hist_add(struct wav_hist *h, uint64_t value)
+{
+	h->buckets[bucket_of(value)]++;
+	h->count++;
+	h->sum += value;
+	h->sum_squares += (double )value * value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+void wav_hist_merge(struct wav_hist *h, const struct wav_hist *from)
+{
+	if (from->count == 0)
+		return;
+	for (int b = 0; b < WAV_HIST_BUCKETS; b++)
+		h->buckets[b] += from->buckets[b];
+	h->count += from->count;
+	h->sum += from->sum;
+	h->sum_squares += from->sum_squares;
+	if (from->min < h->min)
+		h->min = from->min;
+	if (from->max > h->max)
+		h->max = from->max;
+}
+
+uint64_t wav_hist_percentile(const struct wav_hist *h, double fraction)
+{
+	uint64_t rank, seen = 0;
+
+	if (h->count == 0)
+		return 0;
+	rank = (uint64_t )ceil(fraction * h->count);
+	if (rank < 1)
+		rank = 1;
+	for (int b = 0; b < WAV_HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank) {
+			/* the ends are known exactly */
+			uint64_t value = bucket_value(b);
+			if (value < h->min)
+				value = h->min;
+			if (value > h->max)
+				value = h->max;
+			return value;
+		}
+	}
+	return h->max;
+}
+
+double wav_hist_mean(const struct wav_hist *h)
+{
+	return h->count ? h->sum / h->count : 0.0;
+}
+
+double wav_hist_stdev(const struct wav_hist *h)
+{
+	double mean = wav_hist_mean(h);
+	double variance;
+
+	if (h->count == 0)
+		return 0.0;
+	variance = h->sum_squares / h->count - mean * mean;
+	return variance > 0.0 ? sqrt(variance) : 0.0;
+}
+
+void wav_hist_json(const struct wav_hist *h, FILE *f)
+{
+	fprintf(f, "{\"count\":%llu,\"mean\":%.1f,\"stdev\":%.1f,\"min\":%llu,"
+		"\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+		(unsigned long long )h->count, wav_hist_mean(h), wav_hist_stdev(h),
+		(unsigned long long )(h->count ? h->min : 0),
+		(unsigned long long )wav_hist_percentile(h, 0.5),
+		(unsigned long long )wav_hist_percentile(h, 0.9),
+		(unsigned long long )wav_hist_percentile(h, 0.99),
+		(unsigned long long )wav_hist_percentile(h, 0.999),
+		(unsigned long long )h->max);
+}
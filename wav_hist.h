@@ -0,0 +1,53 @@
+#ifndef _wav_hist_h_
+# define _wav_hist_h_ 1
+
+/* histograms of latencies and durations in constant memory
+ *
+ * Values are bucketed by their leading bits: WAV_HIST_SUB_BUCKETS buckets
+ * for every power of 2, so a percentile read back is within 1/16 of the
+ * value that went in, from 1 microsecond to days, in a few KB.  Adding a
+ * value is a count of leading zeros and an increment, cheap enough for an
+ * audio callback.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define WAV_HIST_SUB_BITS 4
+#define WAV_HIST_SUB_BUCKETS (1 << WAV_HIST_SUB_BITS)
+#define WAV_HIST_BUCKETS ((64 - WAV_HIST_SUB_BITS + 1) * WAV_HIST_SUB_BUCKETS)
+
+struct wav_hist {
+	uint64_t	count;
+	uint64_t	min;
+	uint64_t	max;
+	double		sum;
+	double		sum_squares;
+	uint64_t	buckets[WAV_HIST_BUCKETS];
+};
+
+/* empty h, a zeroed one also needs this to track min */
+void wav_hist_reset(struct wav_hist *h);
+
+/* count one value */
+void wav_hist_add(struct wav_hist *h, uint64_t value);
+
+/* add every value counted in from into h */
+void wav_hist_merge(struct wav_hist *h, const struct wav_hist *from);
+
+/*
+ * input:
+ *   fraction - 0.5 for the median, 0.99 for p99 and so on
+ * returns value that fraction of those counted are at or below, 0 if empty
+ */
+uint64_t wav_hist_percentile(const struct wav_hist *h, double fraction);
+
+double wav_hist_mean(const struct wav_hist *h);
+
+/* standard deviation about the mean */
+double wav_hist_stdev(const struct wav_hist *h);
+
+/* write a JSON object with count, mean, stdev, min, p50, p90, p99, p999 and max */
+void wav_hist_json(const struct wav_hist *h, FILE *f);
+
+#endif
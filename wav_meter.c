@@ -0,0 +1,127 @@
+/* meter effect stage: pass audio through unchanged while measuring it
+ * with wav_analyzer.h, and report at the end of the stream
+ *
+ * parameters:
+ *   label - name the report goes under (default meter), to tell a meter
+ *           before the other stages from one after them
+ *   file - append the report to this file as a JSON line instead of
+ *          printing it as text
+ *
+ * the report is made when the chain is flushed.  Because a meter has to
+ * see the whole stream, a chain with one in it does not split across
+ * threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "wav_effect.h"
+#include "wav_convert.h"
+#include "wav_analyzer.h"
+
+struct meter_state {
+	struct wav_analyzer *	an;
+	const char *		label;
+	const char *		file;
+	float *			float_buf;	/* one block of s16 input, as floats */
+	int			reported;
+};
+
+static int meter_init(struct wav_effect *fx, struct wav_stream_fmt *fmt)
+{
+	struct meter_state * st;
+
+	st = (struct meter_state * )calloc(1, sizeof(struct meter_state));
+	if (!st)
+		return wav_effect_error(fx, "could not allocate state");
+	fx->state = st;
+	st->label = wav_effect_param_str(fx, "label", "meter");
+	st->file = wav_effect_param_str(fx, "file", NULL);
+	fx->warmup_frames = WAV_EFFECT_UNBOUNDED;
+	st->float_buf = (float * )malloc(sizeof(float) * fmt->max_frames * fmt->channels);
+	if (!st->float_buf)
+		return wav_effect_error(fx, "could not allocate buffer");
+	return wav_analyzer_open(fmt->channels, fmt->samples_per_sec, &st->an);
+}
+
+static int meter_process(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct meter_state * st = (struct meter_state * )fx->state;
+
+	wav_analyzer_add(st->an, blk->data, blk->frames);
+	return OK;
+}
+
+static int meter_process_s16(struct wav_effect *fx, int16_t *data, int frames, int64_t first_frame)
+{
+	struct meter_state * st = (struct meter_state * )fx->state;
+
+	wav_s16_to_float(data, st->float_buf, (size_t )frames * fx->in_fmt.channels);
+	wav_analyzer_add(st->an, st->float_buf, frames);
+	return OK;
+}
+
+static int report(struct wav_effect *fx)
+{
+	struct meter_state * st = (struct meter_state * )fx->state;
+	struct wav_analysis res;
+	FILE * f;
+
+	st->reported = 1;
+	wav_analyzer_result(st->an, &res);
+	if (!st->file) {
+		wav_analysis_print(&res, st->label, stdout);
+		return OK;
+	}
+	f = fopen(st->file, "a");
+	if (!f) {
+		perror(st->file);
+		return wav_effect_error(fx, "could not open report file");
+	}
+	wav_analysis_json(&res, st->label, f);
+	if (fclose(f)) {
+		perror(st->file);
+		return NOTOK;
+	}
+	return OK;
+}
+
+/* holds nothing back, the end of the stream is just when to report */
+
+static int meter_flush(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct meter_state * st = (struct meter_state * )fx->state;
+
+	blk->frames = 0;
+	return st->reported ? OK : report(fx);
+}
+
+static void meter_reset(struct wav_effect *fx)
+{
+	struct meter_state * st = (struct meter_state * )fx->state;
+
+	wav_analyzer_reset(st->an);
+	st->reported = 0;
+}
+
+static void meter_destroy(struct wav_effect *fx)
+{
+	struct meter_state * st = (struct meter_state * )fx->state;
+
+	if (!st)
+		return;
+	if (st->an)
+		wav_analyzer_close(st->an);
+	free(st->float_buf);
+	free(st);
+}
+
+const struct wav_effect_ops wav_meter_ops = {
+	.name = "meter",
+	.help = "label=meter file=report.jsonl  peak, RMS, DC, true peak and EBU R128 loudness, passed through",
+	.init = meter_init,
+	.process = meter_process,
+	.process_s16 = meter_process_s16,
+	.flush = meter_flush,
+	.reset = meter_reset,
+	.destroy = meter_destroy,
+};
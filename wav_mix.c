@@ -0,0 +1,131 @@
+/* sum or join any number of .wav files into one, see wav_mixer.h
+ *
+ * each input may be followed by :key=value,... with keys
+ *   gain - dB (default 0)
+ *   pan - -1 left to 1 right (default 0)
+ *   offset - seconds from the start when summing, or gap after the previous
+ *            input when joining, less than 0 to overlap it (default 0)
+ * e.g. wav_mix -o out.wav drums.wav vox.wav:gain=-3,offset=4.5 pad.wav:pan=-0.5
+ * every input must be at the same sample rate
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "wav_file_access.h"
+#include "wav_convert.h"
+#include "wav_mixer.h"
+
+static void usage(const char * msg)
+{
+	printf("ERROR: %s\n", msg);
+	printf("usage: wav_mix [ -c ] [ -j threads ] [ -a float|s16 ] [ -e encoding ] [ -n channels ]\n");
+	printf("               -o output.wav input.wav[:gain=dB,pan=p,offset=secs]...\n");
+	printf("-c joins the inputs one after another instead of summing them\n");
+	printf("-j reads inputs on that many threads (default 4), output is the same for any number\n");
+	printf("-a s16 sums s16 inputs with saturation, the default when every input and the output are s16\n");
+	printf("encoding of output is one of u8, s16, s24, s32, f32, f64 (default same as first input)\n");
+	printf("channels of output default to the most any input has, at least 2 if any is panned\n");
+	printf("every input must be at the same sample rate, use wav_transform -x resample:rate=... first\n");
+	exit(NOTOK);
+}
+
+/* split path:key=value,... into in, where the last : starts the parameters
+ * only if a key=value follows it, so paths may have colons too */
+static void parse_input(char * arg, struct wav_mix_input *in)
+{
+	char * params = strrchr(arg, ':');
+	char * pair, * save;
+
+	memset(in, 0, sizeof(*in));
+	in->path = arg;
+	if (!params || !strchr(params, '='))
+		return;
+	*params++ = 0;
+	for (pair = strtok_r(params, ",", &save); pair; pair = strtok_r(NULL, ",", &save)) {
+		char * eq = strchr(pair, '=');
+		if (!eq || eq == pair) {
+			printf("ERROR: %s: parameter %s is not key=value\n", arg, pair);
+			exit(NOTOK);
+		}
+		*eq++ = 0;
+		if (!strcmp(pair, "gain"))
+			in->gain = atof(eq);
+		else if (!strcmp(pair, "pan"))
+			in->pan = atof(eq);
+		else if (!strcmp(pair, "offset"))
+			in->offset = atof(eq);
+		else {
+			printf("ERROR: %s: unknown parameter %s\n", arg, pair);
+			exit(NOTOK);
+		}
+	}
+	if (in->pan < -1.0 || in->pan > 1.0) {
+		printf("ERROR: %s: pan must be from -1 to 1\n", arg);
+		exit(NOTOK);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct wav_mix_opts opts;
+	struct wav_mix_input * inputs;
+	char * output = NULL;
+	int input_count;
+	int opt;
+	int rc;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.mode = WAV_MIX_SUM;
+	opts.accumulate = WAV_MIX_AUTO;
+	opts.threads = 4;
+	while ((opt = getopt(argc, argv, "cj:a:e:n:o:")) != -1) {
+		switch (opt) {
+		case 'c':
+			opts.mode = WAV_MIX_CONCAT;
+			break;
+		case 'j':
+			opts.threads = atoi(optarg);
+			if (opts.threads < 1)
+				usage("thread count must be at least 1");
+			break;
+		case 'a':
+			if (!strcmp(optarg, "float"))
+				opts.accumulate = WAV_MIX_FLOAT;
+			else if (!strcmp(optarg, "s16"))
+				opts.accumulate = WAV_MIX_S16;
+			else
+				usage("accumulation must be float or s16");
+			break;
+		case 'e':
+			if (wav_parse_encoding(optarg, &opts.format, &opts.bits_per_sample))
+				usage("unknown output encoding");
+			break;
+		case 'n':
+			opts.channels = atoi(optarg);
+			if (opts.channels < 1 || opts.channels > WAV_MAX_CHANNELS)
+				usage("channels must be from 1 to 32");
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage("option parse error");
+		}
+	}
+	if (!output)
+		usage("output .wav filename must be supplied with -o");
+	input_count = argc - optind;
+	if (input_count < 1)
+		usage("input .wav filenames must be supplied");
+	inputs = (struct wav_mix_input * )calloc(input_count, sizeof(struct wav_mix_input));
+	if (!inputs)
+		usage("could not allocate input list");
+	for (int k = 0; k < input_count; k++)
+		parse_input(argv[optind + k], &inputs[k]);
+
+	rc = wav_mix_files(inputs, input_count, &opts, output);
+	free(inputs);
+	return rc ? NOTOK : OK;
+}
@@ -0,0 +1,584 @@
+/* streamed k-way mixing and joining of .wav files, see wav_mixer.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "wav_convert.h"
+#include "wav_simd.h"
+#include "wav_mixer.h"
+
+/* slots in the ring for each reader thread */
+#define SLOTS_PER_THREAD 2
+
+enum slot_state {
+	SLOT_FREE,		/* the mixing thread is filling in a job */
+	SLOT_QUEUED,		/* waiting for a reader */
+	SLOT_BUSY,		/* a reader has it */
+	SLOT_READY		/* waiting to be added in */
+};
+
+/* one input and how its channels go into the output's */
+struct mix_source {
+	const struct wav_mix_input * in;
+	struct wav_info	info;
+	int		frame_bytes;	/* on disk */
+	int64_t		start;		/* output frame it starts at */
+	int64_t		end;
+	struct wav_reader * rdr;	/* open from its first job until its last is added in */
+
+	/* out[c] = x[src0[c]] * gain0[c] + x[src1[c]] * gain1[c] */
+	unsigned char	src0[WAV_MAX_CHANNELS];
+	unsigned char	src1[WAV_MAX_CHANNELS];
+	float		gain0[WAV_MAX_CHANNELS];
+	float		gain1[WAV_MAX_CHANNELS];
+	int32_t		q0[WAV_MAX_CHANNELS];	/* the same in Q15, for s16 */
+	int32_t		q1[WAV_MAX_CHANNELS];
+};
+
+/* frames of one input for one output block */
+struct mix_job {
+	int		source;		/* -1 for a block that no input plays in */
+	int		fd;
+	off_t		offset;		/* of the frames in the file */
+	int		frames;
+	int		out_pos;	/* frame of the output block they start at */
+	int		block_frames;	/* frames in the output block */
+	int		first_in_block;
+	int		last_in_block;
+	int		last_of_source;
+};
+
+struct mix_slot {
+	struct mix_job	job;
+	int		state;
+	int		rc;
+	void *		data;		/* job.frames frames of output channels, float or s16 */
+};
+
+struct mix_state {
+	struct mix_source * sources;
+	int		source_count;
+	int		channels;	/* output */
+	int		s16;		/* accumulate in s16 */
+	int64_t		frames;		/* output */
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	queued;		/* a slot became SLOT_QUEUED, or stop */
+	pthread_cond_t	ready;		/* a slot became SLOT_READY */
+	struct mix_slot * slots;
+	int		slot_count;
+	int64_t		next_take;	/* job readers take next, they go in order */
+	int		stop;
+
+	/* where the mixing thread is in making jobs */
+	int64_t		gen_block;
+	int		gen_source;	/* next source to look at in gen_block */
+	int		gen_emitted;	/* jobs made for gen_block so far */
+};
+
+/* buffers each reader keeps from one job to the next */
+struct mix_reader {
+	struct mix_state * ms;
+	void *		raw;
+	size_t		raw_size;
+	float *		decoded;
+	size_t		decoded_size;
+};
+
+static int grow(void **buf_p, size_t *size_p, size_t need)
+{
+	void * buf;
+
+	if (need <= *size_p)
+		return OK;
+	buf = realloc(*buf_p, need);
+	if (!buf) {
+		printf("ERROR: could not allocate mix buffer\n");
+		return NOTOK;
+	}
+	*buf_p = buf;
+	*size_p = need;
+	return OK;
+}
+
+/* channel map and gains of one source, see wav_mixer.h */
+static void plan_channels(struct mix_source *src, int out_channels)
+{
+	int ic = src->info.channels;
+	double gain = pow(10.0, src->in->gain / 20.0);
+	double pan = src->in->pan;
+	double g[WAV_MAX_CHANNELS];
+
+	memset(src->src0, 0, sizeof(src->src0));
+	memset(src->src1, 0, sizeof(src->src1));
+	memset(g, 0, sizeof(g));
+	for (int c = 0; c < out_channels; c++)
+		src->gain1[c] = 0.0f;
+	if (out_channels == 1) {
+		g[0] = ic == 1 ? gain : gain / 2;
+		if (ic > 1) {
+			src->src1[0] = 1;
+			src->gain1[0] = gain / 2;
+		}
+	} else if (ic == 1) {
+		g[0] = gain * cos((pan + 1.0) * M_PI / 4.0);
+		g[1] = gain * sin((pan + 1.0) * M_PI / 4.0);
+	} else {
+		for (int c = 0; c < out_channels && c < ic; c++) {
+			src->src0[c] = c;
+			g[c] = gain;
+		}
+		g[0] *= pan > 0.0 ? 1.0 - pan : 1.0;
+		g[1] *= pan < 0.0 ? 1.0 + pan : 1.0;
+	}
+	for (int c = 0; c < out_channels; c++) {
+		src->gain0[c] = g[c];
+		src->q0[c] = lrint(src->gain0[c] * 32768.0);
+		src->q1[c] = lrint(src->gain1[c] * 32768.0);
+	}
+}
+
+/* s16 sums are exact and stay in range when no channel's gains add up past unity */
+static int can_mix_s16(const struct mix_state *ms, const struct wav_info *out)
+{
+	if (out->format != WAVE_FORMAT_PCM || out->bits_per_sample != 16)
+		return 0;
+	for (int s = 0; s < ms->source_count; s++) {
+		const struct mix_source * src = &ms->sources[s];
+
+		if (src->info.format != WAVE_FORMAT_PCM || src->info.bits_per_sample != 16)
+			return 0;
+		for (int c = 0; c < ms->channels; c++)
+			if (src->q0[c] < 0 || src->q1[c] < 0 || src->q0[c] + src->q1[c] > 32768)
+				return 0;
+	}
+	return 1;
+}
+
+static void map_float(const struct mix_source *src, int out_channels, const float *x, float *out, int frames)
+{
+	int ic = src->info.channels;
+
+	for (int k = 0; k < frames; k++, x += ic, out += out_channels)
+		for (int c = 0; c < out_channels; c++)
+			out[c] = x[src->src0[c]] * src->gain0[c] + x[src->src1[c]] * src->gain1[c];
+}
+
+static void map_s16(const struct mix_source *src, int out_channels, const int16_t *x, int16_t *out, int frames)
+{
+	int ic = src->info.channels;
+
+	for (int k = 0; k < frames; k++, x += ic, out += out_channels) {
+		for (int c = 0; c < out_channels; c++) {
+			int32_t v = (x[src->src0[c]] * src->q0[c] + x[src->src1[c]] * src->q1[c] + 0x4000) >> 15;
+			out[c] = v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+		}
+	}
+}
+
+static int read_all(int fd, void *buf, size_t len, off_t offset, const char * path)
+{
+	while (len > 0) {
+		ssize_t count = pread(fd, buf, len, offset);
+		if (count <= 0) {
+			printf("ERROR: %s: %s\n", path, count < 0 ? strerror(errno) : "file ended early");
+			return NOTOK;
+		}
+		buf = (char * )buf + count;
+		len -= count;
+		offset += count;
+	}
+	return OK;
+}
+
+/* read, decode and map the frames of a job into its slot */
+static int run_job(struct mix_reader *rd, struct mix_slot *slot)
+{
+	struct mix_state * ms = rd->ms;
+	const struct mix_job * job = &slot->job;
+	const struct mix_source * src;
+	size_t samples;
+
+	if (job->source < 0)
+		return OK;
+	src = &ms->sources[job->source];
+	samples = (size_t )job->frames * src->info.channels;
+	if (grow(&rd->raw, &rd->raw_size, (size_t )job->frames * src->frame_bytes) ||
+	    read_all(job->fd, rd->raw, (size_t )job->frames * src->frame_bytes, job->offset, src->in->path))
+		return NOTOK;
+	if (ms->s16) {
+		map_s16(src, ms->channels, (const int16_t * )rd->raw, (int16_t * )slot->data, job->frames);
+		return OK;
+	}
+	if (grow((void ** )&rd->decoded, &rd->decoded_size, samples * sizeof(float)))
+		return NOTOK;
+	wav_decode_float(rd->raw, src->info.format, src->info.bits_per_sample, rd->decoded, samples);
+	map_float(src, ms->channels, rd->decoded, (float * )slot->data, job->frames);
+	return OK;
+}
+
+static void * reader_thread(void *arg)
+{
+	struct mix_reader * rd = (struct mix_reader * )arg;
+	struct mix_state * ms = rd->ms;
+	struct mix_slot * slot;
+
+	for (;;) {
+		pthread_mutex_lock(&ms->lock);
+		while (!ms->stop && ms->slots[ms->next_take % ms->slot_count].state != SLOT_QUEUED)
+			pthread_cond_wait(&ms->queued, &ms->lock);
+		if (ms->stop) {
+			pthread_mutex_unlock(&ms->lock);
+			break;
+		}
+		slot = &ms->slots[ms->next_take++ % ms->slot_count];
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&ms->lock);
+
+		slot->rc = run_job(rd, slot);
+
+		pthread_mutex_lock(&ms->lock);
+		slot->state = SLOT_READY;
+		pthread_cond_broadcast(&ms->ready);
+		pthread_mutex_unlock(&ms->lock);
+	}
+	return NULL;
+}
+
+static int plays_in(const struct mix_source *src, int64_t block_start, int64_t block_end)
+{
+	return src->start < block_end && src->end > block_start;
+}
+
+/* make the next job in output order, or set *done at the end of the output.
+ * returns 0 if OK, non-0 if an input would not open or read */
+static int next_job(struct mix_state *ms, struct mix_job *job, int *done)
+{
+	int64_t block_start = ms->gen_block * WAV_MIX_BLOCK_FRAMES;
+	int64_t block_end = block_start + WAV_MIX_BLOCK_FRAMES;
+	struct mix_source * src;
+	int64_t from, to;
+	int s, more;
+
+	*done = block_start >= ms->frames;
+	if (*done)
+		return OK;
+	if (block_end > ms->frames)
+		block_end = ms->frames;
+	memset(job, 0, sizeof(*job));
+	job->source = -1;
+	job->block_frames = block_end - block_start;
+	job->first_in_block = ms->gen_emitted == 0;
+
+	for (s = ms->gen_source; s < ms->source_count; s++)
+		if (plays_in(&ms->sources[s], block_start, block_end))
+			break;
+	for (more = s + 1; more < ms->source_count; more++)
+		if (plays_in(&ms->sources[more], block_start, block_end))
+			break;
+	job->last_in_block = more >= ms->source_count;
+	if (job->last_in_block) {
+		ms->gen_block++;
+		ms->gen_source = 0;
+		ms->gen_emitted = 0;
+	} else {
+		ms->gen_source = more;
+		ms->gen_emitted++;
+	}
+	if (s == ms->source_count)
+		return OK;	/* silence */
+
+	src = &ms->sources[s];
+	from = src->start > block_start ? src->start : block_start;
+	to = src->end < block_end ? src->end : block_end;
+	if (!src->rdr && wav_reader_open(src->in->path, &src->rdr, &src->info))
+		return NOTOK;
+	job->source = s;
+	job->fd = wav_reader_fd(src->rdr);
+	job->out_pos = from - block_start;
+	if (wav_reader_claim(src->rdr, to - from, &job->offset, &job->frames) || job->frames != to - from) {
+		printf("ERROR: %s: could not read frames %" PRId64 " to %" PRId64 "\n", src->in->path, from - src->start, to - src->start);
+		return NOTOK;
+	}
+	job->last_of_source = to == src->end;
+	return OK;
+}
+
+/* float accumulation, built per SIMD level like the other kernels */
+
+static inline __attribute__((always_inline))
+void add_float_body(float * restrict acc, const float * restrict add, size_t count)
+{
+	for (size_t k = 0; k < count; k++)
+		acc[k] += add[k];
+}
+
+static void add_float_c(float * restrict acc, const float * restrict add, size_t count)
+{
+	add_float_body(acc, add, count);
+}
+
+#ifdef WAV_SIMD_X86
+WAV_TARGET_AVX2
+static void add_float_avx2(float * restrict acc, const float * restrict add, size_t count)
+{
+	add_float_body(acc, add, count);
+}
+
+WAV_TARGET_AVX512
+static void add_float_avx512(float * restrict acc, const float * restrict add, size_t count)
+{
+	add_float_body(acc, add, count);
+}
+#endif
+
+static void (*add_float)(float * restrict acc, const float * restrict add, size_t count) = add_float_c;
+
+__attribute__((constructor))
+static void pick_add_float(void)
+{
+#ifdef WAV_SIMD_X86
+	int level = wav_simd_level();
+
+	if (level >= WAV_SIMD_AVX512)
+		add_float = add_float_avx512;
+	else if (level >= WAV_SIMD_AVX2)
+		add_float = add_float_avx2;
+#endif
+}
+
+/* add a finished slot into the block, and write the block when it is whole */
+static int add_slot(struct mix_state *ms, struct mix_slot *slot, void *acc, struct wav_writer *wtr)
+{
+	const struct mix_job * job = &slot->job;
+	size_t sample_size = ms->s16 ? sizeof(int16_t) : sizeof(float);
+	size_t pos = (size_t )job->out_pos * ms->channels;
+	size_t count = (size_t )job->frames * ms->channels;
+
+	if (slot->rc)
+		return NOTOK;
+	if (job->first_in_block)
+		memset(acc, 0, (size_t )job->block_frames * ms->channels * sample_size);
+	if (job->source >= 0) {
+		if (ms->s16)
+			wav_s16_add_sat((int16_t * )acc + pos, (const int16_t * )slot->data, count);
+		else
+			add_float((float * )acc + pos, (const float * )slot->data, count);
+		if (job->last_of_source) {
+			wav_reader_close(ms->sources[job->source].rdr);
+			ms->sources[job->source].rdr = NULL;
+		}
+	}
+	if (!job->last_in_block)
+		return OK;
+	if (ms->s16)
+		return wav_writer_write_raw(wtr, acc, job->block_frames);
+	return wav_writer_write_float(wtr, (const float * )acc, job->block_frames);
+}
+
+/* queue jobs into free slots and add in ready ones, in order, until the end */
+static int mix_blocks(struct mix_state *ms, void *acc, struct wav_writer *wtr)
+{
+	int64_t queue_pos = 0, add_pos = 0;
+	int done = 0;
+	int rc = OK;
+
+	for (;;) {
+		while (rc == OK && !done && queue_pos - add_pos < ms->slot_count) {
+			struct mix_slot * slot = &ms->slots[queue_pos % ms->slot_count];
+
+			/* free slots are only touched by this thread */
+			rc = next_job(ms, &slot->job, &done);
+			if (rc != OK || done)
+				break;
+			pthread_mutex_lock(&ms->lock);
+			slot->state = SLOT_QUEUED;
+			pthread_cond_broadcast(&ms->queued);
+			pthread_mutex_unlock(&ms->lock);
+			queue_pos++;
+		}
+		if (add_pos == queue_pos)
+			break;
+
+		/* on error, still wait for what was queued so no reader is left busy */
+		struct mix_slot * ready = &ms->slots[add_pos % ms->slot_count];
+		pthread_mutex_lock(&ms->lock);
+		while (ready->state != SLOT_READY)
+			pthread_cond_wait(&ms->ready, &ms->lock);
+		pthread_mutex_unlock(&ms->lock);
+		if (rc == OK)
+			rc = add_slot(ms, ready, acc, wtr);
+		pthread_mutex_lock(&ms->lock);
+		ready->state = SLOT_FREE;
+		pthread_mutex_unlock(&ms->lock);
+		add_pos++;
+	}
+	return rc;
+}
+
+/* open every input for its format and length, and lay them out on the output */
+static int plan_sources(struct mix_state *ms, const struct wav_mix_input *inputs, const struct wav_mix_opts *opts,
+			struct wav_info *out)
+{
+	int64_t prev_end = 0;
+	int panned = 0;
+
+	ms->channels = 0;
+	for (int s = 0; s < ms->source_count; s++) {
+		struct mix_source * src = &ms->sources[s];
+		struct wav_reader * rdr;
+		int64_t offset;
+
+		src->in = &inputs[s];
+		if (wav_reader_open(inputs[s].path, &rdr, &src->info))
+			return NOTOK;
+		wav_reader_close(rdr);
+		if (s == 0) {
+			*out = src->info;
+		} else if (src->info.samples_per_sec != out->samples_per_sec) {
+			printf("ERROR: %s is at %d samples/sec and %s at %d, resample one first\n",
+			       inputs[s].path, src->info.samples_per_sec, inputs[0].path, out->samples_per_sec);
+			return NOTOK;
+		}
+		src->frame_bytes = src->info.channels * src->info.bits_per_sample / 8;
+		offset = llrint(inputs[s].offset * out->samples_per_sec);
+		if (opts->mode == WAV_MIX_CONCAT) {
+			src->start = prev_end + offset > 0 ? prev_end + offset : 0;
+		} else if (offset < 0) {
+			printf("ERROR: %s: offset must not be negative when summing\n", inputs[s].path);
+			return NOTOK;
+		} else {
+			src->start = offset;
+		}
+		src->end = src->start + src->info.frame_count;
+		prev_end = src->end;
+		if (src->end > ms->frames)
+			ms->frames = src->end;
+		if (src->info.channels > ms->channels)
+			ms->channels = src->info.channels;
+		if (inputs[s].pan != 0.0)
+			panned = 1;
+	}
+	if (panned && ms->channels < 2)
+		ms->channels = 2;
+	if (opts->channels)
+		ms->channels = opts->channels;
+	if (opts->format) {
+		out->format = opts->format;
+		out->bits_per_sample = opts->bits_per_sample;
+	}
+	out->channels = ms->channels;
+	out->frame_count = ms->frames;
+	for (int s = 0; s < ms->source_count; s++)
+		plan_channels(&ms->sources[s], ms->channels);
+	return OK;
+}
+
+int wav_mix_files(const struct wav_mix_input *inputs, int input_count, const struct wav_mix_opts *opts,
+		  char * output_path)
+{
+	struct mix_state ms;
+	struct mix_reader * readers = NULL;
+	pthread_t * tids = NULL;
+	struct wav_writer * wtr = NULL;
+	struct wav_info out;
+	void * acc = NULL;
+	size_t slot_bytes;
+	int started = 0;
+	int rc;
+
+	if (input_count < 1 || opts->threads < 1 || opts->channels < 0 || opts->channels > WAV_MAX_CHANNELS) {
+		printf("ERROR: nothing to mix\n");
+		return NOTOK;
+	}
+	memset(&ms, 0, sizeof(ms));
+	ms.source_count = input_count;
+	ms.sources = (struct mix_source * )calloc(input_count, sizeof(struct mix_source));
+	if (!ms.sources) {
+		printf("ERROR: could not allocate inputs\n");
+		return NOTOK;
+	}
+	rc = plan_sources(&ms, inputs, opts, &out);
+	if (rc == OK) {
+		ms.s16 = opts->accumulate != WAV_MIX_FLOAT && can_mix_s16(&ms, &out);
+		if (opts->accumulate == WAV_MIX_S16 && !ms.s16) {
+			printf("ERROR: s16 mixing needs s16 inputs and output, and no gain over 0 dB\n");
+			rc = NOTOK;
+		}
+	}
+	if (rc == OK) {
+		printf("%s %d inputs into %" PRId64 " frames of %d channels at %d samples/sec, %s\n",
+		       opts->mode == WAV_MIX_CONCAT ? "joining" : "summing", input_count, ms.frames, ms.channels,
+		       out.samples_per_sec, ms.s16 ? "saturating s16" : "float");
+		rc = wav_writer_open_format(output_path, &out, &wtr);
+	}
+
+	if (rc == OK) {
+		ms.slot_count = opts->threads * SLOTS_PER_THREAD;
+		slot_bytes = (size_t )WAV_MIX_BLOCK_FRAMES * ms.channels * (ms.s16 ? sizeof(int16_t) : sizeof(float));
+		ms.slots = (struct mix_slot * )calloc(ms.slot_count, sizeof(struct mix_slot));
+		readers = (struct mix_reader * )calloc(opts->threads, sizeof(struct mix_reader));
+		tids = (pthread_t * )calloc(opts->threads, sizeof(pthread_t));
+		acc = malloc(slot_bytes);
+		rc = ms.slots && readers && tids && acc ? OK : NOTOK;
+		for (int k = 0; rc == OK && k < ms.slot_count; k++) {
+			ms.slots[k].data = malloc(slot_bytes);
+			if (!ms.slots[k].data)
+				rc = NOTOK;
+		}
+		if (rc != OK)
+			printf("ERROR: could not allocate mix buffers\n");
+	}
+
+	if (rc == OK) {
+		pthread_mutex_init(&ms.lock, NULL);
+		pthread_cond_init(&ms.queued, NULL);
+		pthread_cond_init(&ms.ready, NULL);
+		for (; started < opts->threads; started++) {
+			readers[started].ms = &ms;
+			if (pthread_create(&tids[started], NULL, reader_thread, &readers[started])) {
+				printf("ERROR: could not start reader thread\n");
+				rc = NOTOK;
+				break;
+			}
+		}
+		if (rc == OK)
+			rc = mix_blocks(&ms, acc, wtr);
+		pthread_mutex_lock(&ms.lock);
+		ms.stop = 1;
+		pthread_cond_broadcast(&ms.queued);
+		pthread_mutex_unlock(&ms.lock);
+		for (int k = 0; k < started; k++)
+			pthread_join(tids[k], NULL);
+		pthread_cond_destroy(&ms.ready);
+		pthread_cond_destroy(&ms.queued);
+		pthread_mutex_destroy(&ms.lock);
+	}
+
+	if (wtr) {
+		if (rc == OK)
+			rc = wav_writer_close(wtr);
+		else
+			wav_writer_abort(wtr);
+	}
+	for (int s = 0; s < ms.source_count; s++)
+		if (ms.sources[s].rdr)
+			wav_reader_close(ms.sources[s].rdr);
+	for (int k = 0; readers && k < opts->threads; k++) {
+		free(readers[k].raw);
+		free(readers[k].decoded);
+	}
+	for (int k = 0; ms.slots && k < ms.slot_count; k++)
+		free(ms.slots[k].data);
+	free(ms.slots);
+	free(readers);
+	free(tids);
+	free(acc);
+	free(ms.sources);
+	return rc;
+}
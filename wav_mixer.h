@@ -0,0 +1,71 @@
+#ifndef _wav_mixer_h_
+# define _wav_mixer_h_ 1
+
+/* summing or joining any number of .wav files into one, streamed
+ *
+ * The output is made a block of WAV_MIX_BLOCK_FRAMES frames at a time.  For
+ * each block, every input that plays in it becomes a job: read its frames,
+ * decode them, and apply its gain and pan while mapping its channels onto
+ * the output's.  A pool of reader threads works through the jobs in a ring
+ * of 2 slots per thread, while the calling thread adds finished slots into
+ * the block in input order and writes it out.  So inputs are read in
+ * parallel, memory is the ring and one block however many inputs there
+ * are or however long they run, and the output is the same for any number
+ * of threads.  Inputs are only open while they play.
+ *
+ * Summing is in float, or when every input and the output are s16 and no
+ * gain is over unity, in s16 with saturating SIMD adds (wav_s16_add_sat()),
+ * which clip as they go the way a fixed-point mixer does.
+ *
+ * Channels: a mono input is panned into the first two output channels
+ * with constant power (-3 dB each in the middle), a stereo or wider
+ * input goes channel for channel with pan as balance on the first two,
+ * and inputs mixed down to mono average their first two channels.
+ * Every input must be at the same sample rate.
+ */
+
+#include "wav_file_access.h"
+
+/* output frames mixed at a time */
+#define WAV_MIX_BLOCK_FRAMES 16384
+
+enum wav_mix_mode {
+	WAV_MIX_SUM,		/* play inputs on top of each other */
+	WAV_MIX_CONCAT		/* play inputs one after another */
+};
+
+enum wav_mix_accumulate {
+	WAV_MIX_AUTO,		/* s16 if it can, float otherwise */
+	WAV_MIX_FLOAT,
+	WAV_MIX_S16
+};
+
+struct wav_mix_input {
+	char *	path;
+	double	gain;		/* dB */
+	double	pan;		/* -1 left to 1 right */
+	double	offset;		/* seconds, from the start of the output when
+				 * summing, or from the end of the previous input
+				 * when joining, where less than 0 overlaps it */
+};
+
+struct wav_mix_opts {
+	int	mode;			/* enum wav_mix_mode */
+	int	accumulate;		/* enum wav_mix_accumulate */
+	int	threads;		/* reader threads, 1 or more */
+	int	channels;		/* 0 for the most any input has, at least 2 if any is panned */
+	int	format;			/* output encoding, 0 for that of the first input */
+	int	bits_per_sample;
+};
+
+/*
+ * input:
+ *   inputs - input_count files to mix, in the order they are added up
+ *   opts - how
+ *   output_path - .wav file to write
+ * returns 0 if successful, non-0 otherwise
+ */
+int wav_mix_files(const struct wav_mix_input *inputs, int input_count, const struct wav_mix_opts *opts,
+		  char * output_path);
+
+#endif
@@ -0,0 +1,91 @@
+/* oscillators by recursive rotation, see wav_osc.h */
+
+#include <string.h>
+#include <math.h>
+#include "wav_osc.h"
+#include "wav_simd.h"
+
+#define TWO_PI (2.0 * M_PI)
+
+void wav_osc_init(struct wav_osc *osc, double freq, int samples_per_sec, double phase)
+{
+	osc->step = TWO_PI * freq / samples_per_sec;
+	osc->phase = phase;
+	osc->period_start = -1;
+}
+
+/* fill period_buf with the WAV_OSC_PERIOD_FRAMES values starting at period_start.
+ * WAV_OSC_LANES is one AVX2 register, so there is an AVX2 build of it too */
+
+static inline __attribute__((always_inline))
+void fill_period_body(struct wav_osc *osc, int64_t period_start)
+{
+	float re[WAV_OSC_LANES], im[WAV_OSC_LANES];
+	float rot_re, rot_im;
+	float * out = osc->period_buf;
+
+	/* seed each lane exactly, reducing the phase in double so that
+	 * it stays accurate however far into the stream we are */
+
+	for (int l = 0; l < WAV_OSC_LANES; l++) {
+		double p = fmod(osc->phase + osc->step * ((double )period_start + l), TWO_PI);
+		re[l] = cos(p);
+		im[l] = sin(p);
+	}
+	rot_re = cos(osc->step * WAV_OSC_LANES);
+	rot_im = sin(osc->step * WAV_OSC_LANES);
+
+	/* each pass emits one value per lane and rotates every lane forward */
+
+	for (int n = 0; n < WAV_OSC_PERIOD_FRAMES; n += WAV_OSC_LANES) {
+		for (int l = 0; l < WAV_OSC_LANES; l++) {
+			float r = re[l], i = im[l];
+			out[n + l] = r;
+			re[l] = r * rot_re - i * rot_im;
+			im[l] = r * rot_im + i * rot_re;
+		}
+	}
+	osc->period_start = period_start;
+}
+
+static void fill_period_c(struct wav_osc *osc, int64_t period_start)
+{
+	fill_period_body(osc, period_start);
+}
+
+#ifdef WAV_SIMD_X86
+WAV_TARGET_AVX2
+static void fill_period_avx2(struct wav_osc *osc, int64_t period_start)
+{
+	fill_period_body(osc, period_start);
+}
+#endif
+
+static void (*osc_fill_period)(struct wav_osc *osc, int64_t period_start) = fill_period_c;
+
+__attribute__((constructor))
+static void pick_fill_period(void)
+{
+#ifdef WAV_SIMD_X86
+	if (wav_simd_level() >= WAV_SIMD_AVX2)
+		osc_fill_period = fill_period_avx2;
+#endif
+}
+
+void wav_osc_generate(struct wav_osc *osc, int64_t first_frame, float *out, int frames)
+{
+	while (frames > 0) {
+		int64_t period_start = first_frame - first_frame % WAV_OSC_PERIOD_FRAMES;
+		int offset = first_frame - period_start;
+		int count = WAV_OSC_PERIOD_FRAMES - offset;
+
+		if (count > frames)
+			count = frames;
+		if (osc->period_start != period_start)
+			osc_fill_period(osc, period_start);
+		memcpy(out, &osc->period_buf[offset], sizeof(float) * count);
+		out += count;
+		first_frame += count;
+		frames -= count;
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef _wav_osc_h_
+# define _wav_osc_h_ 1
+
+/* sinusoid oscillators and LFOs for modulation effects
+ *
+ * Instead of calling cos() per sample, WAV_OSC_LANES consecutive frames
+ * are held as unit complex numbers and all rotated forward together by
+ * one complex multiply, which the compiler turns into a few SIMD
+ * instructions per WAV_OSC_LANES samples.
+ * Rounding error grows with each rotation, so the lanes are reseeded
+ * from an exact cos/sin every WAV_OSC_PERIOD_FRAMES frames.  Reseeding
+ * happens at fixed multiples of the absolute frame index, so the value
+ * for a frame does not depend on how the stream was cut into blocks.
+ */
+
+#include <stdint.h>
+
+#define WAV_OSC_LANES 8
+#define WAV_OSC_PERIOD_FRAMES 256
+
+struct wav_osc {
+	double	step;		/* radians per frame */
+	double	phase;		/* radians at frame 0 */
+	int64_t	period_start;	/* first frame held in period_buf, -1 if none */
+	float	period_buf[WAV_OSC_PERIOD_FRAMES];
+};
+
+/*
+ * input:
+ *   freq - frequency in Hz
+ *   samples_per_sec - frame rate of the stream
+ *   phase - radians at frame 0, use -PI/2 to get a sine
+ */
+void wav_osc_init(struct wav_osc *osc, double freq, int samples_per_sec, double phase);
+
+/*
+ * input:
+ *   first_frame - absolute frame index of out[0]
+ *   frames - how many values to generate
+ * output:
+ *   out - cos(phase + 2 * PI * freq * frame / samples_per_sec) for each frame
+ */
+void wav_osc_generate(struct wav_osc *osc, int64_t first_frame, float *out, int frames);
+
+#endif
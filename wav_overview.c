@@ -0,0 +1,107 @@
+/* build waveform overview sidecars for .wav files, or draw columns from one,
+ * see wav_peaks.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "wav_file_access.h"
+#include "wav_peaks.h"
+
+static void usage(const char * msg)
+{
+	printf("ERROR: %s\n", msg);
+	printf("usage: wav_overview [ -r ] input.wav...\n");
+	printf("       wav_overview -q start:end:columns [ -c channel ] input.wav\n");
+	printf("-r rebuilds sidecars even if they are up to date, otherwise only missing or out of date ones are built\n");
+	printf("-q prints min, max and RMS of each column over start to end seconds, building the sidecar if need be\n");
+	printf("channel counts from 0, default is all channels together\n");
+	exit(NOTOK);
+}
+
+static int refresh(char * path, int rebuild)
+{
+	struct wav_peaks * pk;
+	struct wav_info info;
+
+	if (!rebuild && wav_peaks_open(path, 0, &pk, &info) == OK) {
+		wav_peaks_close(pk);
+		printf("%s: up to date\n", path);
+		return OK;
+	}
+	if (wav_peaks_build(path))
+		return NOTOK;
+	printf("%s: built\n", path);
+	return OK;
+}
+
+static int query(char * path, double start, double end, int columns, int channel)
+{
+	struct wav_peaks * pk;
+	struct wav_info info;
+	float * min, * max, * rms;
+	int rc;
+
+	if (wav_peaks_open(path, 1, &pk, &info))
+		return NOTOK;
+	min = (float * )malloc(sizeof(float) * columns);
+	max = (float * )malloc(sizeof(float) * columns);
+	rms = (float * )malloc(sizeof(float) * columns);
+	if (!min || !max || !rms) {
+		printf("ERROR: could not allocate columns\n");
+		rc = NOTOK;
+	} else if (channel >= info.channels) {
+		printf("ERROR: %s has %d channels\n", path, info.channels);
+		rc = NOTOK;
+	} else {
+		rc = wav_peaks_query(pk, channel, (int64_t )(start * info.samples_per_sec),
+				     (int64_t )(end * info.samples_per_sec), columns, min, max, rms);
+	}
+	for (int col = 0; rc == OK && col < columns; col++)
+		printf("%d %.5f %.5f %.5f\n", col, min[col], max[col], rms[col]);
+	free(min);
+	free(max);
+	free(rms);
+	wav_peaks_close(pk);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	double start = 0.0, end = 0.0;
+	int columns = 0;
+	int channel = -1;
+	int rebuild = 0;
+	int failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "rq:c:")) != -1) {
+		switch (opt) {
+		case 'r':
+			rebuild = 1;
+			break;
+		case 'q':
+			if (sscanf(optarg, "%lf:%lf:%d", &start, &end, &columns) != 3 || end <= start || columns < 1)
+				usage("query must be start:end:columns with end after start");
+			break;
+		case 'c':
+			channel = atoi(optarg);
+			if (channel < 0)
+				usage("channel must be 0 or more");
+			break;
+		default:
+			usage("option parse error");
+		}
+	}
+	if (optind >= argc)
+		usage("input .wav filename must be supplied");
+	if (columns) {
+		if (argc - optind > 1)
+			usage("query one .wav file at a time");
+		return query(argv[optind], start, end, columns, channel);
+	}
+	for (int k = optind; k < argc; k++)
+		if (refresh(argv[k], rebuild) != OK)
+			failed++;
+	return failed ? NOTOK : OK;
+}
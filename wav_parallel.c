@@ -0,0 +1,215 @@
+/* running an effect chain on several cores, see wav_pipeline_run_parallel() in wav_effect.h
+ *
+ * The input is cut into ranges of whole blocks and the ranges are handed
+ * out from a shared counter, so a worker that finishes early just takes
+ * the next one.  There are a few ranges per worker to even out the load.
+ * Each worker has its own reader, chain and buffers, and writes its output
+ * straight to its place in the output file, so workers share nothing but
+ * the counter.
+ *
+ * Stages with a bounded history (the distortion's half-band filters) are
+ * primed by starting each range warmup_frames early and throwing away
+ * what comes out of the warm-up, and stages whose output lags their input
+ * are fed past the end of the range until all of it is out, or flushed at
+ * the end of the file, so every range comes out as it would from a single
+ * pass.  IIR filters, envelopes and meters depend on the whole stream and
+ * no warm-up makes them bit-identical, so wav_pipeline_can_split() keeps
+ * chains with them, and with a reverb tail or a rate change, on one thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include "wav_effect.h"
+
+/* ranges handed out per worker, more balances better but warms up more often */
+#define RANGES_PER_THREAD 4
+
+/* ranges are at least this many blocks */
+#define MIN_RANGE_BLOCKS 16
+
+struct parallel_job {
+	int (*build)(struct wav_pipeline *pl, void *build_arg);
+	void *			build_arg;
+	char *			input_wav_filename;
+	const struct wav_stream_fmt *fmt;
+	struct wav_writer *	wtr;
+	const struct wav_info *	out_info;
+	int64_t			frame_count;
+	int64_t			range_frames;
+	int64_t			range_count;
+	int64_t			next_range;	/* next range to hand out */
+	int			failed;		/* set by a worker that hit an error */
+};
+
+/* put out frames [start, end) after warming up the chain, on the raw
+ * samples if s16 (see wav_pipeline_can_s16()). return OK if done, NOTOK otherwise */
+
+static int run_range(struct parallel_job *job, struct wav_pipeline *pl, struct wav_reader *rdr,
+		     float *in_buf, void *out_buf, int warmup, int s16, int64_t start, int64_t end)
+{
+	const struct wav_info * out_info = job->out_info;
+	int frame_bytes = out_info->channels * out_info->bits_per_sample / 8;
+	int64_t pos = start > warmup ? start - warmup : 0;	/* next frame in */
+	int64_t out_pos = pos;					/* next frame out */
+	struct wav_block blk;
+	int frames, first, last;
+
+	if (wav_reader_seek(rdr, pos) != OK)
+		return NOTOK;
+	wav_pipeline_seek(pl, pos);
+	while (out_pos < end) {
+		if (pos < job->frame_count) {
+			int want = job->frame_count - pos > job->fmt->max_frames ?
+				   job->fmt->max_frames : job->frame_count - pos;
+
+			/* warm-up blocks stop at start, where a single pass starts a block */
+			if (pos < start && want > start - pos)
+				want = start - pos;
+			if ((s16 ? wav_reader_read_raw(rdr, out_buf, want, &frames) :
+				   wav_reader_read_float(rdr, in_buf, want, &frames)) != OK)
+				return NOTOK;
+			if (frames != want) {
+				printf("ERROR: input ended at frame %" PRId64 "\n", pos + frames);
+				return NOTOK;
+			}
+			pos += frames;
+			if (s16 && wav_pipeline_process_s16(pl, (int16_t * )out_buf, frames) != OK)
+				return NOTOK;
+			blk.data = in_buf;
+			blk.frames = frames;
+			blk.channels = job->fmt->channels;
+			if (!s16 && wav_pipeline_process(pl, &blk) != OK)
+				return NOTOK;
+		} else {
+			/* the file ends inside the range, what the stages hold is the rest of it */
+			if (s16 || wav_pipeline_flush(pl, &blk) != OK)
+				return NOTOK;
+			if (blk.frames == 0) {
+				printf("ERROR: effect chain ended at frame %" PRId64 "\n", out_pos);
+				return NOTOK;
+			}
+		}
+
+		/* keep only what falls in the range */
+		first = out_pos < start ? start - out_pos : 0;
+		last = end - out_pos < blk.frames ? end - out_pos : blk.frames;
+		if (last > first) {
+			if (!s16)
+				wav_encode_float(blk.data + (size_t )first * blk.channels, out_info->format,
+						 out_info->bits_per_sample, out_buf,
+						 (size_t )(last - first) * out_info->channels);
+			if (wav_writer_write_raw_at(job->wtr, (char * )out_buf + (size_t )(s16 ? first : 0) * frame_bytes,
+						    last - first, out_pos + first) != OK)
+				return NOTOK;
+		}
+		out_pos += blk.frames;
+	}
+	return OK;
+}
+
+static void * parallel_worker(void *arg)
+{
+	struct parallel_job * job = (struct parallel_job * )arg;
+	const struct wav_info * out_info = job->out_info;
+	struct wav_pipeline pl = { 0 };
+	struct wav_reader * rdr = NULL;
+	struct wav_info info;
+	float * in_buf = NULL;
+	void * out_buf = NULL;
+	int rc = NOTOK;
+	int s16;
+	int64_t range;
+
+	if (job->build(&pl, job->build_arg) != OK || wav_pipeline_init(&pl, job->fmt) != OK)
+		goto done;
+	if (wav_reader_open(job->input_wav_filename, &rdr, &info) != OK)
+		goto done;
+	in_buf = (float * )malloc(sizeof(float) * job->fmt->max_frames * job->fmt->channels);
+	out_buf = malloc((size_t )job->fmt->max_frames * out_info->channels * out_info->bits_per_sample / 8);
+	if (!in_buf || !out_buf) {
+		printf("ERROR: could not allocate worker buffers\n");
+		goto done;
+	}
+	s16 = wav_pipeline_can_s16(&pl, &info, out_info);
+	rc = OK;
+	while (rc == OK && !__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+		int64_t start, end;
+
+		range = __atomic_fetch_add(&job->next_range, 1, __ATOMIC_RELAXED);
+		if (range >= job->range_count)
+			break;
+		start = range * job->range_frames;
+		end = start + job->range_frames;
+		if (end > job->frame_count)
+			end = job->frame_count;
+		rc = run_range(job, &pl, rdr, in_buf, out_buf, wav_pipeline_warmup_frames(&pl), s16, start, end);
+	}
+done:
+	if (rc != OK)
+		__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+	free(in_buf);
+	free(out_buf);
+	if (rdr)
+		wav_reader_close(rdr);
+	wav_pipeline_free(&pl);
+	return NULL;
+}
+
+int wav_pipeline_run_parallel(int (*build)(struct wav_pipeline *pl, void *build_arg), void *build_arg,
+			      char * input_wav_filename, const struct wav_stream_fmt *fmt,
+			      struct wav_writer *wtr, const struct wav_info *out_info, int threads)
+{
+	struct parallel_job job = { 0 };
+	struct wav_reader * rdr;
+	struct wav_info info;
+	pthread_t * tids;
+	int64_t range_blocks;
+	int started;
+
+	if (wav_reader_open(input_wav_filename, &rdr, &info) != OK)
+		return NOTOK;
+	wav_reader_close(rdr);
+	if (threads < 1)
+		threads = 1;
+
+	/* whole blocks per range, so ranges start where a single pass would
+	 * start a block */
+
+	range_blocks = (info.frame_count + fmt->max_frames - 1) / fmt->max_frames;
+	range_blocks = (range_blocks + threads * RANGES_PER_THREAD - 1) / (threads * RANGES_PER_THREAD);
+	if (range_blocks < MIN_RANGE_BLOCKS)
+		range_blocks = MIN_RANGE_BLOCKS;
+	job.build = build;
+	job.build_arg = build_arg;
+	job.input_wav_filename = input_wav_filename;
+	job.fmt = fmt;
+	job.wtr = wtr;
+	job.out_info = out_info;
+	job.frame_count = info.frame_count;
+	job.range_frames = range_blocks * fmt->max_frames;
+	job.range_count = (info.frame_count + job.range_frames - 1) / job.range_frames;
+	if (threads > job.range_count)
+		threads = job.range_count > 0 ? job.range_count : 1;
+	printf("%d threads working on %" PRId64 " ranges of %" PRId64 " frames\n", threads, job.range_count, job.range_frames);
+
+	if (wav_writer_reserve(wtr, info.frame_count) != OK)
+		return NOTOK;
+	tids = (pthread_t * )calloc(threads, sizeof(pthread_t));
+	if (!tids) {
+		printf("ERROR: could not allocate thread list\n");
+		return NOTOK;
+	}
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&tids[started], NULL, parallel_worker, &job)) {
+			printf("ERROR: could not start worker thread\n");
+			__atomic_store_n(&job.failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	for (int k = 0; k < started; k++)
+		pthread_join(tids[k], NULL);
+	free(tids);
+	return job.failed ? NOTOK : OK;
+}
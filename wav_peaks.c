@@ -0,0 +1,537 @@
+/* waveform overview sidecar files, see wav_peaks.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wav_planar.h"
+#include "wav_peaks.h"
+
+#define PEAKS_MAGIC "WAVPEAKS"
+#define PEAKS_SUFFIX ".peaks"
+
+/* entries of each level kept before they are written out */
+#define LEVEL_BUF_ENTRIES 1024
+
+/* what the sidecar starts with, in host byte order like the samples */
+struct peaks_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	channels;
+	uint32_t	samples_per_sec;
+	uint32_t	base_frames;	/* frames per level 0 entry */
+	uint32_t	levels;
+	uint32_t	unused;
+	uint64_t	frames;
+
+	/* the .wav this was built from */
+	uint64_t	wav_size;
+	int64_t		wav_mtime_sec;
+	int64_t		wav_mtime_nsec;
+	uint64_t	wav_hash;
+
+	/* where each level is, in bytes from the start of the sidecar,
+	 * and how many entries of channels peaks_entry it has */
+	uint64_t	level_offset[WAV_PEAKS_MAX_LEVELS];
+	uint64_t	level_entries[WAV_PEAKS_MAX_LEVELS];
+};
+
+/* one channel of one entry */
+struct peaks_entry {
+	int16_t		min;
+	int16_t		max;
+	uint16_t	rms;
+};
+
+/* size, mtime and hash of a .wav file */
+struct fingerprint {
+	uint64_t	size;
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	uint64_t	hash;
+};
+
+struct wav_peaks {
+	void *		map;
+	size_t		map_len;
+	const struct peaks_header * hdr;
+};
+
+/* an entry of one channel being summed up while building */
+struct peaks_acc {
+	float		min;
+	float		max;
+	double		sum_squares;
+	int64_t		frames;
+};
+
+struct peaks_level {
+	struct peaks_acc	acc[WAV_MAX_CHANNELS];
+	int			children;	/* entries of the level below in acc */
+	struct peaks_entry *	buf;		/* LEVEL_BUF_ENTRIES entries waiting */
+	int			buffered;
+	uint64_t		written;	/* entries written out before buf */
+};
+
+static int peaks_error(const char * msg)
+{
+	printf("ERROR: %s: %s\n", msg, strerror(errno));
+	return NOTOK;
+}
+
+static int sidecar_path(const char * wav_path, char * path)
+{
+	if (snprintf(path, PATH_MAX, "%s%s", wav_path, PEAKS_SUFFIX) >= PATH_MAX) {
+		printf("ERROR: %s: pathname too long\n", wav_path);
+		return NOTOK;
+	}
+	return OK;
+}
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t h, const unsigned char * p, size_t len)
+{
+	for (size_t k = 0; k < len; k++) {
+		h ^= p[k];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* hashes the size and the first and last WAV_PEAKS_HASH_BYTES, which
+ * take in the headers and catch most rewrites without reading the samples */
+static int fingerprint_wav(const char * wav_path, struct fingerprint *fp)
+{
+	unsigned char * buf;
+	struct stat st;
+	off_t offsets[2];
+	ssize_t len;
+	int fd;
+	int rc = OK;
+
+	fd = open(wav_path, O_RDONLY);
+	if (fd < 0)
+		return peaks_error(wav_path);
+	if (fstat(fd, &st)) {
+		close(fd);
+		return peaks_error("stat");
+	}
+	buf = (unsigned char * )malloc(WAV_PEAKS_HASH_BYTES);
+	if (!buf) {
+		close(fd);
+		return peaks_error("malloc");
+	}
+	fp->size = st.st_size;
+	fp->mtime_sec = st.st_mtim.tv_sec;
+	fp->mtime_nsec = st.st_mtim.tv_nsec;
+	fp->hash = hash_bytes(0xcbf29ce484222325ULL, (const unsigned char * )&fp->size, sizeof(fp->size));
+	offsets[0] = 0;
+	offsets[1] = st.st_size > WAV_PEAKS_HASH_BYTES ? st.st_size - WAV_PEAKS_HASH_BYTES : 0;
+	for (int k = 0; k < 2 && rc == OK; k++) {
+		len = pread(fd, buf, WAV_PEAKS_HASH_BYTES, offsets[k]);
+		if (len < 0)
+			rc = peaks_error("read");
+		else
+			fp->hash = hash_bytes(fp->hash, buf, len);
+	}
+	free(buf);
+	close(fd);
+	return rc;
+}
+
+/* level 0 entries cover base frames, and each level up twice as many */
+static int plan_levels(struct peaks_header *hdr)
+{
+	uint64_t offset = sizeof(struct peaks_header);
+	uint64_t frames_per_entry = hdr->base_frames;
+	int level = 0;
+
+	for (;;) {
+		if (level == WAV_PEAKS_MAX_LEVELS) {
+			printf("ERROR: too many frames for a waveform overview\n");
+			return NOTOK;
+		}
+		hdr->level_offset[level] = offset;
+		hdr->level_entries[level] = (hdr->frames + frames_per_entry - 1) / frames_per_entry;
+		offset += hdr->level_entries[level] * hdr->channels * sizeof(struct peaks_entry);
+		level++;
+		if (frames_per_entry >= hdr->frames)
+			break;
+		frames_per_entry *= 2;
+	}
+	hdr->levels = level;
+	return OK;
+}
+
+static int write_level(int fd, const struct peaks_header *hdr, int level, struct peaks_level *lv)
+{
+	size_t len = (size_t )lv->buffered * hdr->channels * sizeof(struct peaks_entry);
+	off_t offset = hdr->level_offset[level] + lv->written * hdr->channels * sizeof(struct peaks_entry);
+
+	if (lv->written + lv->buffered > hdr->level_entries[level]) {
+		printf("ERROR: waveform overview level %d has more entries than planned\n", level);
+		return NOTOK;
+	}
+	if (pwrite(fd, lv->buf, len, offset) != (ssize_t )len)
+		return peaks_error("write");
+	lv->written += lv->buffered;
+	lv->buffered = 0;
+	return OK;
+}
+
+static int16_t quantize_down(float v)
+{
+	float s = floorf(v * 32767.0f);
+
+	return s < -32768.0f ? -32768 : s > 32767.0f ? 32767 : (int16_t )s;
+}
+
+static int16_t quantize_up(float v)
+{
+	float s = ceilf(v * 32767.0f);
+
+	return s < -32768.0f ? -32768 : s > 32767.0f ? 32767 : (int16_t )s;
+}
+
+/* finish the entry summed up in level's acc, and add it to the level above */
+static int end_entry(int fd, const struct peaks_header *hdr, struct peaks_level *levels, int level)
+{
+	struct peaks_level * lv = &levels[level];
+	struct peaks_level * up = level + 1 < hdr->levels ? &levels[level + 1] : NULL;
+	struct peaks_entry * e = &lv->buf[lv->buffered * hdr->channels];
+
+	for (int c = 0; c < hdr->channels; c++) {
+		struct peaks_acc * a = &lv->acc[c];
+		double rms = a->frames ? sqrt(a->sum_squares / a->frames) : 0.0;
+
+		e[c].min = quantize_down(a->min);
+		e[c].max = quantize_up(a->max);
+		e[c].rms = rms >= 1.0 ? 65535 : (uint16_t )lrint(rms * 65535.0);
+		if (up) {
+			struct peaks_acc * u = &up->acc[c];
+
+			if (up->children == 0 || a->min < u->min)
+				u->min = a->min;
+			if (up->children == 0 || a->max > u->max)
+				u->max = a->max;
+			u->sum_squares += a->sum_squares;
+			u->frames += a->frames;
+		}
+		a->sum_squares = 0.0;
+		a->frames = 0;
+	}
+	lv->children = 0;
+	if (++lv->buffered == LEVEL_BUF_ENTRIES && write_level(fd, hdr, level, lv))
+		return NOTOK;
+	if (up && ++up->children == 2)
+		return end_entry(fd, hdr, levels, level + 1);
+	return OK;
+}
+
+/* sum frames of planar samples into the current level 0 entry */
+static void add_frames(const struct peaks_header *hdr, struct peaks_level *lv, const struct wav_planar *pb,
+		       int first, int frames)
+{
+	for (int c = 0; c < hdr->channels; c++) {
+		const float * x = pb->ch[c] + first;
+		struct peaks_acc * a = &lv->acc[c];
+		float mn = lv->children ? a->min : x[0];
+		float mx = lv->children ? a->max : x[0];
+		double sum_squares = 0.0;
+
+		for (int k = 0; k < frames; k++) {
+			mn = x[k] < mn ? x[k] : mn;
+			mx = x[k] > mx ? x[k] : mx;
+			sum_squares += (double )x[k] * x[k];
+		}
+		a->min = mn;
+		a->max = mx;
+		a->sum_squares += sum_squares;
+		a->frames += frames;
+	}
+	/* at level 0 children counts frames */
+	lv->children += frames;
+}
+
+/* read every frame, filling in the levels and writing them to fd */
+static int build_levels(struct wav_reader *rdr, int fd, const struct peaks_header *hdr)
+{
+	struct peaks_level * levels;
+	struct wav_planar pb;
+	float * block_buf;
+	int frames;
+	int rc;
+
+	memset(&pb, 0, sizeof(pb));
+	levels = (struct peaks_level * )calloc(hdr->levels, sizeof(struct peaks_level));
+	block_buf = (float * )malloc(sizeof(float) * WAV_BLOCK_FRAMES * hdr->channels);
+	rc = levels && block_buf ? wav_planar_alloc(hdr->channels, WAV_BLOCK_FRAMES, &pb) : peaks_error("malloc");
+	for (int l = 0; rc == OK && l < hdr->levels; l++) {
+		levels[l].buf = (struct peaks_entry * )malloc(sizeof(struct peaks_entry) * LEVEL_BUF_ENTRIES * hdr->channels);
+		if (!levels[l].buf)
+			rc = peaks_error("malloc");
+	}
+	while (rc == OK) {
+		rc = wav_reader_read_float(rdr, block_buf, WAV_BLOCK_FRAMES, &frames);
+		if (rc != OK || frames == 0)
+			break;
+		wav_deinterleave(block_buf, hdr->channels, pb.ch, frames);
+		for (int done = 0; done < frames && rc == OK; ) {
+			int n = hdr->base_frames - levels[0].children;
+
+			if (n > frames - done)
+				n = frames - done;
+			add_frames(hdr, &levels[0], &pb, done, n);
+			done += n;
+			if (levels[0].children == hdr->base_frames)
+				rc = end_entry(fd, hdr, levels, 0);
+		}
+	}
+
+	/* the last entry of each level may be short */
+	for (int l = 0; rc == OK && l < hdr->levels; l++) {
+		if (levels[l].children)
+			rc = end_entry(fd, hdr, levels, l);
+		if (rc == OK && levels[l].buffered)
+			rc = write_level(fd, hdr, l, &levels[l]);
+		if (rc == OK && levels[l].written != hdr->level_entries[l]) {
+			printf("ERROR: .wav file ended early, %" PRIu64 " of %" PRIu64 " overview entries at level %d\n",
+			       levels[l].written, hdr->level_entries[l], l);
+			rc = NOTOK;
+		}
+	}
+
+	if (levels)
+		for (int l = 0; l < hdr->levels; l++)
+			free(levels[l].buf);
+	free(levels);
+	free(block_buf);
+	wav_planar_free(&pb);
+	return rc;
+}
+
+int wav_peaks_build(char * wav_filename_p)
+{
+	struct peaks_header hdr;
+	struct fingerprint fp;
+	struct wav_reader * rdr;
+	struct wav_info info;
+	char path[PATH_MAX];
+	char temp_path[PATH_MAX + 8];
+	int fd;
+	int rc;
+
+	if (sidecar_path(wav_filename_p, path))
+		return NOTOK;
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+	/* taken before reading, so a .wav that changes meanwhile looks out of date */
+	if (fingerprint_wav(wav_filename_p, &fp))
+		return NOTOK;
+	if (wav_reader_open(wav_filename_p, &rdr, &info))
+		return NOTOK;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PEAKS_MAGIC, sizeof(hdr.magic));
+	hdr.version = WAV_PEAKS_VERSION;
+	hdr.channels = info.channels;
+	hdr.samples_per_sec = info.samples_per_sec;
+	hdr.base_frames = WAV_PEAKS_BASE_FRAMES;
+	hdr.frames = info.frame_count;
+	hdr.wav_size = fp.size;
+	hdr.wav_mtime_sec = fp.mtime_sec;
+	hdr.wav_mtime_nsec = fp.mtime_nsec;
+	hdr.wav_hash = fp.hash;
+	if (plan_levels(&hdr)) {
+		wav_reader_close(rdr);
+		return NOTOK;
+	}
+
+	fd = open(temp_path, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+	if (fd < 0) {
+		wav_reader_close(rdr);
+		return peaks_error(temp_path);
+	}
+	rc = build_levels(rdr, fd, &hdr);
+	if (rc == OK && pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		rc = peaks_error("write");
+	if (close(fd) && rc == OK)
+		rc = peaks_error(temp_path);
+	if (rc == OK && rename(temp_path, path))
+		rc = peaks_error(path);
+	if (rc != OK)
+		unlink(temp_path);
+	wav_reader_close(rdr);
+	return rc;
+}
+
+/* returns OK if the mapped sidecar is whole and belongs to fp's .wav */
+static int check_sidecar(const struct wav_peaks *pk, const struct fingerprint *fp)
+{
+	const struct peaks_header * hdr = pk->hdr;
+	uint64_t frames_per_entry;
+	uint64_t entry_bytes;
+
+	if (pk->map_len < sizeof(struct peaks_header) || memcmp(hdr->magic, PEAKS_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != WAV_PEAKS_VERSION)
+		return NOTOK;
+	if (hdr->wav_size != fp->size || hdr->wav_mtime_sec != fp->mtime_sec ||
+	    hdr->wav_mtime_nsec != fp->mtime_nsec || hdr->wav_hash != fp->hash)
+		return NOTOK;
+	if (hdr->channels < 1 || hdr->channels > WAV_MAX_CHANNELS || hdr->base_frames < 1 ||
+	    hdr->levels < 1 || hdr->levels > WAV_PEAKS_MAX_LEVELS || hdr->frames > INT64_MAX)
+		return NOTOK;
+
+	/* the levels have to be the ones plan_levels() makes for these frames,
+	 * since queries index them by frame without looking at the count */
+	entry_bytes = hdr->channels * sizeof(struct peaks_entry);
+	frames_per_entry = hdr->base_frames;
+	for (int l = 0; l < hdr->levels; l++) {
+		if (hdr->level_entries[l] != hdr->frames / frames_per_entry + (hdr->frames % frames_per_entry != 0))
+			return NOTOK;
+		if ((l + 1 < hdr->levels) != (frames_per_entry < hdr->frames))
+			return NOTOK;
+		if (hdr->level_offset[l] > pk->map_len ||
+		    hdr->level_entries[l] > (pk->map_len - hdr->level_offset[l]) / entry_bytes)
+			return NOTOK;
+		frames_per_entry *= 2;
+	}
+	return OK;
+}
+
+/* map wav_path's sidecar if it is up to date, returns OK if so */
+static int map_sidecar(const char * wav_path, const char * path, struct wav_peaks *pk)
+{
+	struct fingerprint fp;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			peaks_error(path);
+		return NOTOK;
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		return peaks_error("stat");
+	}
+	pk->map_len = st.st_size;
+	pk->map = pk->map_len ? mmap(NULL, pk->map_len, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);  /* mapping holds its own reference to the file */
+	if (pk->map == MAP_FAILED) {
+		pk->map = NULL;
+		return NOTOK;
+	}
+	pk->hdr = (const struct peaks_header * )pk->map;
+	if (fingerprint_wav(wav_path, &fp) || check_sidecar(pk, &fp)) {
+		munmap(pk->map, pk->map_len);
+		pk->map = NULL;
+		return NOTOK;
+	}
+	return OK;
+}
+
+int wav_peaks_open(char * wav_filename_p, int build, struct wav_peaks **peaks_out, struct wav_info *info_out)
+{
+	struct wav_peaks * pk;
+	char path[PATH_MAX];
+
+	if (sidecar_path(wav_filename_p, path))
+		return NOTOK;
+	pk = (struct wav_peaks * )calloc(1, sizeof(struct wav_peaks));
+	if (!pk)
+		return peaks_error("malloc");
+	if (map_sidecar(wav_filename_p, path, pk) &&
+	    (!build || wav_peaks_build(wav_filename_p) || map_sidecar(wav_filename_p, path, pk))) {
+		free(pk);
+		return NOTOK;
+	}
+	memset(info_out, 0, sizeof(*info_out));
+	info_out->channels = pk->hdr->channels;
+	info_out->samples_per_sec = pk->hdr->samples_per_sec;
+	info_out->frame_count = pk->hdr->frames;
+	*peaks_out = pk;
+	return OK;
+}
+
+int wav_peaks_query(struct wav_peaks *peaks, int channel, int64_t first_frame, int64_t end_frame, int columns,
+		    float *min, float *max, float *rms)
+{
+	const struct peaks_header * hdr = peaks->hdr;
+	int64_t span = end_frame - first_frame;
+	int64_t frames = hdr->frames;
+	int64_t base = hdr->base_frames;
+	int first_ch = channel < 0 ? 0 : channel;
+	int end_ch = channel < 0 ? hdr->channels : channel + 1;
+	int top = 0;
+
+	if (channel >= (int )hdr->channels || columns < 1 || span < 1) {
+		printf("ERROR: bad waveform overview query\n");
+		return NOTOK;
+	}
+
+	/* coarsest level with entries no wider than a column */
+	while (top + 1 < hdr->levels && (base << (top + 1)) * columns <= span)
+		top++;
+
+	for (int col = 0; col < columns; col++) {
+		int64_t c0 = first_frame + span * col / columns;
+		int64_t c1 = first_frame + span * (col + 1) / columns;
+		int16_t mn = 32767, mx = -32768;
+		double sum_squares = 0.0;
+		int64_t weight = 0;
+
+		/* columns narrower than a frame still show the frame they are on */
+		if (c1 <= c0)
+			c1 = c0 + 1;
+		if (c0 < 0)
+			c0 = 0;
+		if (c1 > frames)
+			c1 = frames;
+
+		/* tile the column with the widest entries that fit in it, so only
+		 * the level 0 entries at its edges reach into the next column */
+		for (int64_t p = c0 - c0 % base; p < c1; ) {
+			const struct peaks_entry * ent;
+			int64_t width;
+			int64_t len;
+			int level = top;
+
+			while (level > 0 && (p < c0 || p % (base << level) || (p + (base << level) > c1 && c1 < frames)))
+				level--;
+			width = base << level;
+			len = (p + width < frames ? p + width : frames) - p;
+			ent = (const struct peaks_entry * )((const char * )peaks->map + hdr->level_offset[level]) +
+			      p / width * hdr->channels;
+			for (int c = first_ch; c < end_ch; c++) {
+				mn = ent[c].min < mn ? ent[c].min : mn;
+				mx = ent[c].max > mx ? ent[c].max : mx;
+				sum_squares += (double )ent[c].rms * ent[c].rms * len;
+				weight += len;
+			}
+			p += width;
+		}
+		if (min)
+			min[col] = weight ? mn / 32767.0f : 0.0f;
+		if (max)
+			max[col] = weight ? mx / 32767.0f : 0.0f;
+		if (rms)
+			rms[col] = weight ? sqrt(sum_squares / weight) / 65535.0 : 0.0f;
+	}
+	return OK;
+}
+
+void wav_peaks_close(struct wav_peaks *peaks)
+{
+	if (peaks->map)
+		munmap(peaks->map, peaks->map_len);
+	free(peaks);
+}
@@ -0,0 +1,78 @@
+#ifndef _wav_peaks_h_
+# define _wav_peaks_h_ 1
+
+/* waveform overviews: a min/max/RMS pyramid kept in a sidecar file next to
+ * the .wav, so a waveform can be drawn at any zoom without reading samples
+ *
+ * Level 0 has one entry per WAV_PEAKS_BASE_FRAMES frames of each channel,
+ * each level above has one per two entries of the level below, up to a
+ * single entry for the whole file.  A query for some pixel columns over a
+ * range of frames tiles each column with entries no wider than it, the
+ * widest that fit in the middle and finer ones towards its edges, so a
+ * transient shows in a neighbouring column only if it is within the same
+ * level 0 entry, and the cost is O(columns * levels) whatever the range.
+ * Zoomed in past level 0 the columns get the envelope of the entry they
+ * fall in.
+ *
+ * Entries are 6 bytes per channel: min and max as s16 rounded outwards,
+ * so the drawn waveform never comes up short of the samples, and RMS as
+ * u16.  With about two entries per WAV_PEAKS_BASE_FRAMES frames over all
+ * the levels, the sidecar is about 1/40 the size of the s16 data.
+ *
+ * The sidecar is in.wav.peaks, starting with a versioned header that
+ * records the .wav's size, mtime and a hash of its first and last
+ * WAV_PEAKS_HASH_BYTES bytes.  It is out of date if any of them differ,
+ * and is written to a temporary name and renamed into place, so readers
+ * see a whole old one or a whole new one.
+ */
+
+#include "wav_file_access.h"
+
+#define WAV_PEAKS_VERSION 1
+#define WAV_PEAKS_BASE_FRAMES 256
+#define WAV_PEAKS_HASH_BYTES 65536
+#define WAV_PEAKS_MAX_LEVELS 48
+
+/* opaque handle, see wav_peaks.c */
+struct wav_peaks;
+
+/*
+ * input:
+ *   wav_filename_p - .wav file to build in.wav.peaks for, reads every frame
+ * returns 0 if the sidecar was written, non-0 otherwise
+ */
+int wav_peaks_build(char * wav_filename_p);
+
+/*
+ * input:
+ *   wav_filename_p - .wav file whose sidecar to open, only its size,
+ *                    mtime and hashed bytes are read
+ *   build - build the sidecar first if it is missing or out of date
+ * output:
+ *   peaks_out - returns handle, the sidecar is mapped into memory
+ *   info_out - returns channels, sample rate and frame count of the .wav
+ * returns:
+ *   0 - if an up to date sidecar was opened
+ *   non-0 otherwise, quietly if it was just missing or out of date
+ */
+int wav_peaks_open(char * wav_filename_p, int build, struct wav_peaks **peaks_out, struct wav_info *info_out);
+
+/*
+ * input:
+ *   peaks - handle from wav_peaks_open()
+ *   channel - which channel, or -1 for all of them together
+ *   first_frame, end_frame - range [first_frame, end_frame) to draw, may
+ *                            run past either end of the file
+ *   columns - how many equal columns to split the range into
+ * output:
+ *   min, max, rms - columns entries each, normalized so full scale is 1,
+ *                   any of them may be NULL.  Columns wholly outside the
+ *                   file are 0.
+ * returns 0 if successful, non-0 otherwise
+ */
+int wav_peaks_query(struct wav_peaks *peaks, int channel, int64_t first_frame, int64_t end_frame, int columns,
+		    float *min, float *max, float *rms);
+
+void wav_peaks_close(struct wav_peaks *peaks);
+
+#endif
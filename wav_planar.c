@@ -0,0 +1,116 @@
+/* planar float buffers and (de)interleaving, see wav_planar.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wav_planar.h"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+int wav_planar_alloc(int channels, int max_frames, struct wav_planar *pb)
+{
+	/* round each plane up so the next one starts aligned */
+	size_t stride = ((size_t )max_frames * sizeof(float) + WAV_PLANAR_ALIGN - 1) & ~(size_t )(WAV_PLANAR_ALIGN - 1);
+
+	memset(pb, 0, sizeof(*pb));
+	if (channels < 1 || channels > WAV_MAX_CHANNELS || max_frames < 1) {
+		printf("ERROR: planar buffer of %d channels of %d frames\n", channels, max_frames);
+		return NOTOK;
+	}
+	pb->data = (float * )aligned_alloc(WAV_PLANAR_ALIGN, stride * channels);
+	if (!pb->data) {
+		printf("ERROR: could not allocate planar buffer\n");
+		return NOTOK;
+	}
+	memset(pb->data, 0, stride * channels);
+	pb->channels = channels;
+	pb->max_frames = max_frames;
+	for (int c = 0; c < channels; c++)
+		pb->ch[c] = (float * )((char * )pb->data + stride * c);
+	return OK;
+}
+
+void wav_planar_free(struct wav_planar *pb)
+{
+	free(pb->data);
+	memset(pb, 0, sizeof(*pb));
+}
+
+/* the loops below are written once and inlined with channels a constant
+ * for mono and stereo, so those compile to straight copies and shuffles */
+
+static inline __attribute__((always_inline))
+void deinterleave_n(const float *in, const int channels, float * const *planes, int frames)
+{
+	for (int c = 0; c < channels; c++) {
+		float * p = planes[c];
+		const float * src = in + c;
+		for (int k = 0; k < frames; k++)
+			p[k] = src[(size_t )k * channels];
+	}
+}
+
+static inline __attribute__((always_inline))
+void interleave_n(const float * const *planes, const int channels, float *out, int frames)
+{
+	for (int c = 0; c < channels; c++) {
+		const float * p = planes[c];
+		float * dst = out + c;
+		for (int k = 0; k < frames; k++)
+			dst[(size_t )k * channels] = p[k];
+	}
+}
+
+void wav_deinterleave(const float *in, int channels, float * const *planes, int frames)
+{
+	int k = 0;
+
+	if (channels == 1) {
+		memcpy(planes[0], in, sizeof(float) * frames);
+		return;
+	}
+	if (channels != 2) {
+		deinterleave_n(in, channels, planes, frames);
+		return;
+	}
+#ifdef __SSE2__
+	for (; k + 4 <= frames; k += 4) {
+		__m128 a = _mm_loadu_ps(in + 2 * k);		/* l0 r0 l1 r1 */
+		__m128 b = _mm_loadu_ps(in + 2 * k + 4);	/* l2 r2 l3 r3 */
+		_mm_storeu_ps(planes[0] + k, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(planes[1] + k, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+#endif
+	{
+		float * const tail[2] = { planes[0] + k, planes[1] + k };
+		deinterleave_n(in + 2 * k, 2, tail, frames - k);
+	}
+}
+
+void wav_interleave(const float * const *planes, int channels, float *out, int frames)
+{
+	int k = 0;
+
+	if (channels == 1) {
+		memcpy(out, planes[0], sizeof(float) * frames);
+		return;
+	}
+	if (channels != 2) {
+		interleave_n(planes, channels, out, frames);
+		return;
+	}
+#ifdef __SSE2__
+	for (; k + 4 <= frames; k += 4) {
+		__m128 l = _mm_loadu_ps(planes[0] + k);
+		__m128 r = _mm_loadu_ps(planes[1] + k);
+		_mm_storeu_ps(out + 2 * k, _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(out + 2 * k + 4, _mm_unpackhi_ps(l, r));
+	}
+#endif
+	{
+		const float * const tail[2] = { planes[0] + k, planes[1] + k };
+		interleave_n(tail, 2, out + 2 * k, frames - k);
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef _wav_planar_h_
+# define _wav_planar_h_ 1
+
+/* planar (one array per channel) float buffers, and moving samples
+ * between them and the interleaved frames files and effect blocks use
+ *
+ * Kernels that work a channel at a time, filters and FFTs, read planes
+ * so their inner loops are contiguous and carry no channel arithmetic.
+ * Interleaving is done once at the edges, with the mono and stereo cases
+ * compiled separately (SSE2 shuffles for stereo) and a plain loop for
+ * any other count up to WAV_MAX_CHANNELS.
+ */
+
+#include "wav_file_access.h"
+
+/* planes start this many bytes apart and aligned to it */
+#define WAV_PLANAR_ALIGN 64
+
+struct wav_planar {
+	int	channels;
+	int	max_frames;
+	float *	ch[WAV_MAX_CHANNELS];	/* ch[c][k] is frame k of channel c */
+	float *	data;			/* one allocation behind all the planes */
+};
+
+/*
+ * input:
+ *   channels - 1 to WAV_MAX_CHANNELS
+ *   max_frames - frames each plane holds
+ * output:
+ *   pb - planes, zeroed
+ * returns OK or NOTOK
+ */
+int wav_planar_alloc(int channels, int max_frames, struct wav_planar *pb);
+
+/* free the planes, pb may be zeroed or freed already */
+void wav_planar_free(struct wav_planar *pb);
+
+/* planes[c][k] = in[k * channels + c] for frames frames, planes need not be aligned */
+void wav_deinterleave(const float *in, int channels, float * const *planes, int frames);
+
+/* out[k * channels + c] = planes[c][k] for frames frames */
+void wav_interleave(const float * const *planes, int channels, float *out, int frames);
+
+#endif
@@ -0,0 +1,91 @@
+/* resample effect stage: change the sample rate of the stream with the
+ * polyphase filter in wav_resampler.h
+ *
+ * parameters:
+ *   rate - output frames per second, 1000 to 768000
+ *   taps - filter length, multiple of 8 from 8 to 512 (default 64)
+ *
+ * the stage holds back taps/2 input frames, which come out at flush
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "wav_effect.h"
+#include "wav_resampler.h"
+
+struct resample_state {
+	struct wav_resampler *	rs;
+	float *			out_buf;
+	int			max_out;	/* frames out_buf holds */
+};
+
+static int resample_init(struct wav_effect *fx, struct wav_stream_fmt *fmt)
+{
+	struct resample_state * st;
+	int rate = (int )wav_effect_param(fx, "rate", 48000);
+	int taps = (int )wav_effect_param(fx, "taps", WAV_RESAMPLE_TAPS);
+
+	if (rate < 1000 || rate > 768000)
+		return wav_effect_error(fx, "rate must be from 1000 to 768000");
+	st = (struct resample_state * )calloc(1, sizeof(struct resample_state));
+	if (!st)
+		return wav_effect_error(fx, "could not allocate state");
+	fx->state = st;
+	if (wav_resampler_open(fmt->samples_per_sec, rate, fmt->channels, taps, fmt->max_frames, &st->rs))
+		return NOTOK;
+	st->max_out = wav_resampler_max_out(st->rs, fmt->max_frames);
+	st->out_buf = (float * )malloc(sizeof(float) * st->max_out * fmt->channels);
+	if (!st->out_buf)
+		return wav_effect_error(fx, "could not allocate output buffer");
+	fmt->samples_per_sec = rate;
+	fmt->max_frames = st->max_out;
+	return OK;
+}
+
+static int resample_process(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct resample_state * st = (struct resample_state * )fx->state;
+	int frames;
+
+	if (wav_resampler_process(st->rs, blk->data, blk->frames, st->out_buf, &frames))
+		return NOTOK;
+	blk->data = st->out_buf;
+	blk->frames = frames;
+	return OK;
+}
+
+static int resample_flush(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct resample_state * st = (struct resample_state * )fx->state;
+
+	return wav_resampler_flush(st->rs, blk->data, st->max_out, &blk->frames);
+}
+
+static void resample_reset(struct wav_effect *fx)
+{
+	struct resample_state * st = (struct resample_state * )fx->state;
+
+	wav_resampler_reset(st->rs);
+}
+
+static void resample_destroy(struct wav_effect *fx)
+{
+	struct resample_state * st = (struct resample_state * )fx->state;
+
+	if (!st)
+		return;
+	if (st->rs)
+		wav_resampler_close(st->rs);
+	free(st->out_buf);
+	free(st);
+}
+
+const struct wav_effect_ops wav_resample_ops = {
+	.name = "resample",
+	.help = "rate=48000 taps=64  windowed-sinc sample-rate conversion",
+	.init = resample_init,
+	.process = resample_process,
+	.flush = resample_flush,
+	.reset = resample_reset,
+	.destroy = resample_destroy,
+};
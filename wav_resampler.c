@@ -0,0 +1,299 @@
+/* windowed-sinc polyphase sample-rate conversion, see wav_resampler.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "wav_file_access.h"
+#include "wav_planar.h"
+#include "wav_simd.h"
+#include "wav_resampler.h"
+
+/* Kaiser window shape, about 90 dB of stopband */
+#define KAISER_BETA 8.6
+
+/* passband edge as a fraction of the lower Nyquist frequency */
+#define CUTOFF 0.94
+
+/* longest filter after widening for downsampling */
+#define WAV_RESAMPLE_MAX_WIDE_TAPS 4096
+
+/* history frames are shifted down when they are consumed, so the
+ * inner products always read taps contiguous floats per channel */
+struct wav_resampler {
+	int		channels;
+	int		taps;
+	int64_t		up;		/* L output frames ... */
+	int64_t		down;		/* ... for every M input frames */
+	int		phases;		/* rows in coeffs, not counting the extra last one */
+	float *		coeffs;		/* (phases + 1) rows of taps */
+	float **	hist;		/* per channel input history */
+	int		hist_cap;
+	int		hist_len;	/* frames in hist */
+	int		max_in;
+	int64_t		pos;		/* hist index of first tap for next output */
+	int64_t		frac;		/* how far past pos it is, in 1/up frames */
+	int64_t		frames_in;	/* input frames so far */
+	int64_t		frames_out;	/* output frames so far */
+	int		padded;		/* flush has added the trailing zeros */
+};
+
+static int64_t gcd(int64_t a, int64_t b)
+{
+	while (b) {
+		int64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* zeroth-order modified Bessel function, for the Kaiser window */
+
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+
+	for (int k = 1; k < 50 && term > sum * 1e-12; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/* row p of the table is for an output p/phases of a frame past the first
+ * tap's frame, normalized so every phase passes DC at unity gain */
+
+static void fill_coeffs(struct wav_resampler *rs)
+{
+	double cutoff = 0.5 * CUTOFF * (rs->up < rs->down ? (double )rs->up / rs->down : 1.0);
+	double half = rs->taps / 2.0;
+
+	for (int p = 0; p <= rs->phases; p++) {
+		float * row = rs->coeffs + (size_t )p * rs->taps;
+		double sum = 0.0;
+
+		for (int k = 0; k < rs->taps; k++) {
+			/* distance in input frames from tap k to the output */
+			double d = (double )p / rs->phases + half - 1 - k;
+			double x = 2.0 * cutoff * d;
+			double sinc = (x == 0.0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+			double r = d / half;
+			double window = (r >= 1.0 || r <= -1.0) ? 0.0 : bessel_i0(KAISER_BETA * sqrt(1.0 - r * r)) / bessel_i0(KAISER_BETA);
+			row[k] = 2.0 * cutoff * sinc * window;
+			sum += row[k];
+		}
+		for (int k = 0; k < rs->taps; k++)
+			row[k] /= sum;
+	}
+}
+
+int wav_resampler_open(int in_rate, int out_rate, int channels, int taps, int max_in_frames,
+		       struct wav_resampler **rs_out)
+{
+	struct wav_resampler * rs;
+	int64_t g;
+
+	if (in_rate <= 0 || out_rate <= 0 || channels <= 0 || channels > WAV_MAX_CHANNELS || max_in_frames <= 0) {
+		printf("ERROR: bad resampler rates %d -> %d\n", in_rate, out_rate);
+		return NOTOK;
+	}
+	if (taps < WAV_RESAMPLE_MIN_TAPS || taps > WAV_RESAMPLE_MAX_TAPS || taps % WAV_RESAMPLE_LANES) {
+		printf("ERROR: resampler taps must be a multiple of %d from %d to %d\n",
+			WAV_RESAMPLE_LANES, WAV_RESAMPLE_MIN_TAPS, WAV_RESAMPLE_MAX_TAPS);
+		return NOTOK;
+	}
+	rs = (struct wav_resampler * )calloc(1, sizeof(struct wav_resampler));
+	if (!rs) {
+		printf("ERROR: could not allocate resampler\n");
+		return NOTOK;
+	}
+	g = gcd(in_rate, out_rate);
+	rs->up = out_rate / g;
+	rs->down = in_rate / g;
+	rs->phases = rs->up < WAV_RESAMPLE_MAX_PHASES ? rs->up : WAV_RESAMPLE_MAX_PHASES;
+	rs->channels = channels;
+
+	/* downsampling narrows the passband, so the filter spans more input
+	 * frames to keep the same sharpness */
+	if (rs->down > rs->up) {
+		int64_t wide = (taps * rs->down / rs->up + WAV_RESAMPLE_LANES - 1) / WAV_RESAMPLE_LANES * WAV_RESAMPLE_LANES;
+		taps = wide < WAV_RESAMPLE_MAX_WIDE_TAPS ? wide : WAV_RESAMPLE_MAX_WIDE_TAPS;
+	}
+	rs->taps = taps;
+	rs->max_in = max_in_frames;
+	rs->hist_cap = taps + (max_in_frames > taps ? max_in_frames : taps);
+	rs->coeffs = (float * )aligned_alloc(WAV_RESAMPLE_LANES * sizeof(float), sizeof(float) * (rs->phases + 1) * taps);
+	rs->hist = (float ** )calloc(channels, sizeof(float * ));
+	if (!rs->coeffs || !rs->hist) {
+		printf("ERROR: could not allocate resampler\n");
+		wav_resampler_close(rs);
+		return NOTOK;
+	}
+	for (int c = 0; c < channels; c++) {
+		rs->hist[c] = (float * )malloc(sizeof(float) * rs->hist_cap);
+		if (!rs->hist[c]) {
+			printf("ERROR: could not allocate resampler\n");
+			wav_resampler_close(rs);
+			return NOTOK;
+		}
+	}
+	fill_coeffs(rs);
+	wav_resampler_reset(rs);
+	*rs_out = rs;
+	return OK;
+}
+
+int wav_resampler_max_out(struct wav_resampler *rs, int in_frames)
+{
+	return (int )(((int64_t )in_frames * rs->up + rs->down - 1) / rs->down) + 1;
+}
+
+void wav_resampler_reset(struct wav_resampler *rs)
+{
+	/* taps/2 - 1 frames of silence put the first output on the first input frame */
+	rs->hist_len = rs->taps / 2 - 1;
+	for (int c = 0; c < rs->channels; c++)
+		memset(rs->hist[c], 0, sizeof(float) * rs->hist_len);
+	rs->pos = 0;
+	rs->frac = 0;
+	rs->frames_in = 0;
+	rs->frames_out = 0;
+	rs->padded = 0;
+}
+
+static inline __attribute__((always_inline))
+float dot(const float * restrict x, const float * restrict h, int taps)
+{
+	float acc[WAV_RESAMPLE_LANES] = { 0 };
+	float sum = 0.0f;
+
+	for (int k = 0; k < taps; k += WAV_RESAMPLE_LANES)
+		for (int j = 0; j < WAV_RESAMPLE_LANES; j++)
+			acc[j] += x[k + j] * h[k + j];
+	for (int j = 0; j < WAV_RESAMPLE_LANES; j++)
+		sum += acc[j];
+	return sum;
+}
+
+/* make outputs while the history covers them, up to max_out frames and
+ * frames_out reaching limit. returns frames made.  compiled once per SIMD
+ * level below, with the inner products inlined, and picked at startup */
+
+static inline __attribute__((always_inline))
+int produce_body(struct wav_resampler *rs, float *out, int max_out, int64_t limit)
+{
+	int made = 0;
+
+	while (made < max_out && rs->frames_out < limit && rs->pos + rs->taps <= rs->hist_len) {
+		if (rs->phases == rs->up) {
+			const float * row = rs->coeffs + (size_t )rs->frac * rs->taps;
+			for (int c = 0; c < rs->channels; c++)
+				out[c] = dot(rs->hist[c] + rs->pos, row, rs->taps);
+		} else {
+			/* between two rows of the table */
+			double where = (double )rs->frac * rs->phases / rs->up;
+			int p = (int )where;
+			float mu = where - p;
+			const float * row = rs->coeffs + (size_t )p * rs->taps;
+			for (int c = 0; c < rs->channels; c++) {
+				float a = dot(rs->hist[c] + rs->pos, row, rs->taps);
+				float b = dot(rs->hist[c] + rs->pos, row + rs->taps, rs->taps);
+				out[c] = a + mu * (b - a);
+			}
+		}
+		out += rs->channels;
+		made++;
+		rs->frames_out++;
+		rs->frac += rs->down;
+		rs->pos += rs->frac / rs->up;
+		rs->frac %= rs->up;
+	}
+	return made;
+}
+
+static int produce_c(struct wav_resampler *rs, float *out, int max_out, int64_t limit)
+{
+	return produce_body(rs, out, max_out, limit);
+}
+
+#ifdef WAV_SIMD_X86
+/* WAV_RESAMPLE_LANES is one AVX2 register, AVX-512 adds nothing here */
+WAV_TARGET_AVX2
+static int produce_avx2(struct wav_resampler *rs, float *out, int max_out, int64_t limit)
+{
+	return produce_body(rs, out, max_out, limit);
+}
+#endif
+
+static int (*produce)(struct wav_resampler *rs, float *out, int max_out, int64_t limit) = produce_c;
+
+__attribute__((constructor))
+static void pick_produce(void)
+{
+#ifdef WAV_SIMD_X86
+	if (wav_simd_level() >= WAV_SIMD_AVX2)
+		produce = produce_avx2;
+#endif
+}
+
+/* drop history that no output needs any more */
+
+static void compact(struct wav_resampler *rs)
+{
+	int drop = rs->pos < rs->hist_len ? rs->pos : rs->hist_len;
+
+	if (drop == 0)
+		return;
+	for (int c = 0; c < rs->channels; c++)
+		memmove(rs->hist[c], rs->hist[c] + drop, sizeof(float) * (rs->hist_len - drop));
+	rs->hist_len -= drop;
+	rs->pos -= drop;
+}
+
+int wav_resampler_process(struct wav_resampler *rs, const float *in, int in_frames, float *out, int *out_frames_out)
+{
+	float * ends[WAV_MAX_CHANNELS];
+
+	*out_frames_out = 0;
+	if (in_frames > rs->max_in) {
+		printf("ERROR: resampler given %d frames, at most %d allowed\n", in_frames, rs->max_in);
+		return NOTOK;
+	}
+	compact(rs);
+	for (int c = 0; c < rs->channels; c++)
+		ends[c] = rs->hist[c] + rs->hist_len;
+	wav_deinterleave(in, rs->channels, ends, in_frames);
+	rs->hist_len += in_frames;
+	rs->frames_in += in_frames;
+	*out_frames_out = produce(rs, out, wav_resampler_max_out(rs, in_frames), INT64_MAX);
+	return OK;
+}
+
+int wav_resampler_flush(struct wav_resampler *rs, float *out, int max_frames, int *out_frames_out)
+{
+	int64_t total = (rs->frames_in * rs->up + rs->down - 1) / rs->down;
+
+	/* taps/2 frames of silence let the last output see past the end */
+	if (!rs->padded) {
+		compact(rs);
+		for (int c = 0; c < rs->channels; c++)
+			memset(rs->hist[c] + rs->hist_len, 0, sizeof(float) * (rs->taps / 2));
+		rs->hist_len += rs->taps / 2;
+		rs->padded = 1;
+	}
+	*out_frames_out = produce(rs, out, max_frames, total);
+	return OK;
+}
+
+void wav_resampler_close(struct wav_resampler *rs)
+{
+	if (rs->hist) {
+		for (int c = 0; c < rs->channels; c++)
+			free(rs->hist[c]);
+		free(rs->hist);
+	}
+	free(rs->coeffs);
+	free(rs);
+}
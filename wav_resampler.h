@@ -0,0 +1,70 @@
+#ifndef _wav_resampler_h_
+# define _wav_resampler_h_ 1
+
+/* sample-rate conversion between any two integer rates, a block at a time
+ *
+ * A windowed-sinc polyphase filter: the rate ratio is reduced to L/M
+ * (44100 -> 48000 is 160/147), and every output frame is an inner
+ * product of taps input frames with one of L precomputed phases of a
+ * Kaiser-windowed sinc.  When L is over WAV_RESAMPLE_MAX_PHASES, as for
+ * odd ratios like 44100 -> 44101, the table holds that many phases and
+ * each output is interpolated between the two nearest.
+ * The cutoff sits just below the lower of the two Nyquist frequencies,
+ * so downsampling does not alias.
+ *
+ * Inner products run WAV_RESAMPLE_LANES taps side by side, which the
+ * compiler turns into SIMD multiply-adds.
+ */
+
+#define WAV_RESAMPLE_MAX_PHASES 1024
+#define WAV_RESAMPLE_LANES 8
+
+/* default filter length, more taps give a sharper cutoff */
+#define WAV_RESAMPLE_TAPS 64
+#define WAV_RESAMPLE_MIN_TAPS 8
+#define WAV_RESAMPLE_MAX_TAPS 512
+
+/* opaque handle, see wav_resampler.c */
+struct wav_resampler;
+
+/*
+ * input:
+ *   in_rate, out_rate - frames per second in and out
+ *   channels - interleaved channels in every block
+ *   taps - filter length, a multiple of WAV_RESAMPLE_LANES from
+ *          WAV_RESAMPLE_MIN_TAPS to WAV_RESAMPLE_MAX_TAPS.  When
+ *          downsampling it is widened by in_rate/out_rate
+ *   max_in_frames - most frames passed to one wav_resampler_process()
+ * output:
+ *   rs_out - returns handle
+ * returns 0 if OK, non-0 otherwise
+ */
+int wav_resampler_open(int in_rate, int out_rate, int channels, int taps, int max_in_frames,
+		       struct wav_resampler **rs_out);
+
+/* most frames one wav_resampler_process() of in_frames can return */
+int wav_resampler_max_out(struct wav_resampler *rs, int in_frames);
+
+/*
+ * input:
+ *   in - in_frames interleaved float frames
+ * output:
+ *   out - room for wav_resampler_max_out(in_frames) frames
+ *   out_frames_out - how many frames were put in out
+ * output lags input by half the filter, wav_resampler_flush() gets the rest
+ * returns 0 if OK, non-0 otherwise
+ */
+int wav_resampler_process(struct wav_resampler *rs, const float *in, int in_frames, float *out, int *out_frames_out);
+
+/* at end of input, call until out_frames_out is 0 to get the last
+ * frames, up to max_frames at a time.  Total output is then exactly
+ * ceil(input frames * out_rate / in_rate).  returns 0 if OK */
+int wav_resampler_flush(struct wav_resampler *rs, float *out, int max_frames, int *out_frames_out);
+
+/* forget all input, as if just opened */
+void wav_resampler_reset(struct wav_resampler *rs);
+
+/* free handle */
+void wav_resampler_close(struct wav_resampler *rs);
+
+#endif
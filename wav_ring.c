@@ -0,0 +1,123 @@
+/* lock-free single-producer single-consumer ring, see wav_ring.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "wav_file_access.h"
+#include "wav_ring.h"
+
+#define WAV_RING_CACHE_LINE 64
+
+struct wav_ring {
+	/* written by the writer only */
+	_Alignas(WAV_RING_CACHE_LINE) atomic_size_t write_pos;
+	atomic_int	finished;
+	/* written by the reader only */
+	_Alignas(WAV_RING_CACHE_LINE) atomic_size_t read_pos;
+	/* never change after open */
+	_Alignas(WAV_RING_CACHE_LINE) size_t size;
+	size_t		mask;
+	unsigned char *	data;
+};
+
+int wav_ring_open(size_t min_bytes, struct wav_ring **ring_out)
+{
+	struct wav_ring * ring;
+	size_t size = WAV_RING_CACHE_LINE;
+
+	while (size < min_bytes)
+		size *= 2;
+	ring = (struct wav_ring * )aligned_alloc(WAV_RING_CACHE_LINE, sizeof(struct wav_ring));
+	if (!ring) {
+		printf("ERROR: could not allocate ring\n");
+		return NOTOK;
+	}
+	ring->data = (unsigned char * )malloc(size);
+	if (!ring->data) {
+		printf("ERROR: could not allocate %zu byte ring\n", size);
+		free(ring);
+		return NOTOK;
+	}
+	atomic_init(&ring->write_pos, 0);
+	atomic_init(&ring->finished, 0);
+	atomic_init(&ring->read_pos, 0);
+	ring->size = size;
+	ring->mask = size - 1;
+	*ring_out = ring;
+	return OK;
+}
+
+size_t wav_ring_size(struct wav_ring *ring)
+{
+	return ring->size;
+}
+
+size_t wav_ring_writable(struct wav_ring *ring)
+{
+	size_t w = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+	size_t r = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+
+	return ring->size - (w - r);
+}
+
+size_t wav_ring_write(struct wav_ring *ring, const void *src, size_t len)
+{
+	size_t w = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+	size_t r = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+	size_t space = ring->size - (w - r);
+	size_t start = w & ring->mask;
+	size_t first;
+
+	if (len > space)
+		len = space;
+	/* may wrap around the end of the buffer */
+	first = ring->size - start < len ? ring->size - start : len;
+	memcpy(ring->data + start, src, first);
+	memcpy(ring->data, (const unsigned char * )src + first, len - first);
+	atomic_store_explicit(&ring->write_pos, w + len, memory_order_release);
+	return len;
+}
+
+void wav_ring_finish(struct wav_ring *ring)
+{
+	atomic_store_explicit(&ring->finished, 1, memory_order_release);
+}
+
+size_t wav_ring_readable(struct wav_ring *ring)
+{
+	size_t r = atomic_load_explicit(&ring->read_pos, memory_order_relaxed);
+	size_t w = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+
+	return w - r;
+}
+
+size_t wav_ring_read(struct wav_ring *ring, void *dst, size_t len)
+{
+	size_t r = atomic_load_explicit(&ring->read_pos, memory_order_relaxed);
+	size_t w = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+	size_t start = r & ring->mask;
+	size_t first;
+
+	if (len > w - r)
+		len = w - r;
+	first = ring->size - start < len ? ring->size - start : len;
+	memcpy(dst, ring->data + start, first);
+	memcpy((unsigned char * )dst + first, ring->data, len - first);
+	atomic_store_explicit(&ring->read_pos, r + len, memory_order_release);
+	return len;
+}
+
+int wav_ring_drained(struct wav_ring *ring)
+{
+	/* finished is stored after the last write, so load it first */
+	if (!atomic_load_explicit(&ring->finished, memory_order_acquire))
+		return 0;
+	return wav_ring_readable(ring) == 0;
+}
+
+void wav_ring_close(struct wav_ring *ring)
+{
+	free(ring->data);
+	free(ring);
+}
@@ -0,0 +1,54 @@
+#ifndef _wav_ring_h_
+# define _wav_ring_h_ 1
+
+/* single-producer single-consumer ring buffer of bytes, without locks
+ *
+ * One thread writes and one other thread reads, neither ever waits on
+ * the other, so the reader can be an audio callback running on the
+ * sound server's clock while the writer runs effects ahead of it.  The
+ * read and write positions only ever grow; each is stored by its own
+ * side with release order and loaded by the other with acquire order,
+ * and they sit on separate cache lines so the two sides do not bounce
+ * a line between cores on every call.
+ */
+
+#include <stddef.h>
+
+/* opaque handle, see wav_ring.c */
+struct wav_ring;
+
+/*
+ * input:
+ *   min_bytes - smallest capacity wanted, rounded up to a power of 2
+ * output:
+ *   ring_out - returns empty ring
+ * returns 0 if OK, non-0 otherwise
+ */
+int wav_ring_open(size_t min_bytes, struct wav_ring **ring_out);
+
+/* capacity in bytes */
+size_t wav_ring_size(struct wav_ring *ring);
+
+/* writer side: bytes that can be written now */
+size_t wav_ring_writable(struct wav_ring *ring);
+
+/* writer side: copy up to len bytes in, returns how many fit */
+size_t wav_ring_write(struct wav_ring *ring, const void *src, size_t len);
+
+/* writer side: no more writes are coming */
+void wav_ring_finish(struct wav_ring *ring);
+
+/* reader side: bytes that can be read now */
+size_t wav_ring_readable(struct wav_ring *ring);
+
+/* reader side: copy up to len bytes out, returns how many there were */
+size_t wav_ring_read(struct wav_ring *ring, void *dst, size_t len);
+
+/* reader side: returns non-0 once wav_ring_finish() was called and
+ * everything before it has been read */
+int wav_ring_drained(struct wav_ring *ring);
+
+/* free ring, once neither side uses it */
+void wav_ring_close(struct wav_ring *ring);
+
+#endif
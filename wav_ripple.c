@@ -0,0 +1,256 @@
+/* sine ripple effect stage: insert sinusoid ripple of given frequency
+ * with modulating frequency, panned between left and right channels
+ *
+ * parameters:
+ *   freq - ripple frequency in Hz, 40 to 15000
+ *   mod - modulating frequency in Hz, 0.1 to 10000
+ *   lr - left-right direction from -1 to 1 (default 0 means both channels)
+ *   amp - fractional amplitude of ripple from 0 to 1.0,
+ *         the original signal is attenuated to make room for it
+ *
+ * with more than 2 channels the ripple goes into every channel alike.
+ *
+ * both sinusoids come from wav_osc, so there are no per-sample cos() calls,
+ * and the inner loop is one inline kernel compiled separately for mono,
+ * stereo and any other count, so mono and stereo have no per-sample
+ * channel loop at all, and for AVX2 and AVX-512 as well.
+ *
+ * a hot mix is not an error: samples past full scale are saturated when
+ * they are written, with one warning, and a limit stage after this one
+ * brings them back under full scale smoothly.  For s16 in and out the
+ * stage also runs on the samples directly, with saturating fixed-point
+ * arithmetic (wav_s16_scale_add_sat()), which can differ from the float
+ * path by one in the last bit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <inttypes.h>
+#include "wav_effect.h"
+#include "wav_convert.h"
+#include "wav_osc.h"
+#include "wav_simd.h"
+
+/* output is scaled by this so a full-scale ripple stays just inside full scale */
+#define RIPPLE_HEADROOM 0.9999f
+
+struct ripple_state {
+	float		fractional_amplitude;
+	float		channel_amplitudes[WAV_MAX_CHANNELS];
+	struct wav_osc	carrier;
+	struct wav_osc	modulator;
+	float *		carrier_buf;	/* one block of each oscillator */
+	float *		modulator_buf;
+	float *		mix_buf;	/* interleaved ripple for the s16 path */
+	int16_t *	mix_s16;
+	int		clip_warned;
+};
+
+static int check_range(struct wav_effect *fx, const char * range_name, float val, float lowbound, float upbound)
+{
+	if (val < lowbound || val > upbound) {
+		printf("ERROR: %s: var %s val %f not in [ %f, %f ]\n",
+				fx->ops->name, range_name, val, lowbound, upbound);
+		return NOTOK;
+	}
+	return OK;
+}
+
+void wav_ripple_pan(float left_right, float *left, float *right)
+{
+	const double PIover2 = M_PI / 2.0;
+	double left_right_radians = ((left_right + 1.0) / 2.0) * PIover2;
+
+	*left = cos(left_right_radians);
+	*right = sin(left_right_radians);
+}
+
+static int ripple_init(struct wav_effect *fx, struct wav_stream_fmt *fmt)
+{
+	struct ripple_state * rs;
+	float freq = wav_effect_param(fx, "freq", 440.);
+	float modulating_freq = wav_effect_param(fx, "mod", 1.);
+	float left_right = wav_effect_param(fx, "lr", 0.);
+	float fractional_amplitude = wav_effect_param(fx, "amp", 0.2);
+
+	if (check_range(fx, "left_right", left_right, -1., 1.) ||
+	    check_range(fx, "fractional_amplitude", fractional_amplitude, 0., 1.) ||
+	    check_range(fx, "freq", freq, 40., 15000.) ||
+	    check_range(fx, "modulating_freq", modulating_freq, 0.1, 10000.))
+		return NOTOK;
+	if (fmt->channels != 2 && left_right != 0.0)
+		return wav_effect_error(fx, "left-right direction needs exactly 2 channels");
+
+	rs = (struct ripple_state * )calloc(1, sizeof(struct ripple_state));
+	if (!rs)
+		return wav_effect_error(fx, "could not allocate state");
+	fx->state = rs;
+	rs->fractional_amplitude = fractional_amplitude;
+	wav_osc_init(&rs->carrier, freq, fmt->samples_per_sec, 0.0);
+	wav_osc_init(&rs->modulator, modulating_freq, fmt->samples_per_sec, 0.0);
+	rs->carrier_buf = (float * )malloc(sizeof(float) * fmt->max_frames);
+	rs->modulator_buf = (float * )malloc(sizeof(float) * fmt->max_frames);
+	rs->mix_buf = (float * )malloc(sizeof(float) * fmt->max_frames * fmt->channels);
+	rs->mix_s16 = (int16_t * )malloc(sizeof(int16_t) * fmt->max_frames * fmt->channels);
+	if (!rs->carrier_buf || !rs->modulator_buf || !rs->mix_buf || !rs->mix_s16)
+		return wav_effect_error(fx, "could not allocate oscillator buffers");
+
+	/* pre-compute effect of left-right parameter */
+
+	if (fmt->channels != 2) {
+		for (int c = 0; c < fmt->channels; c++)
+			rs->channel_amplitudes[c] = 1.0;
+	} else {
+		wav_ripple_pan(left_right, &rs->channel_amplitudes[0], &rs->channel_amplitudes[1]);
+	}
+	return OK;
+}
+
+/* ripple[k] = amplitude * carrier * modulator, same for every channel,
+ * into carrier_buf */
+
+static float * make_ripple(struct ripple_state *rs, int64_t first_frame, int frames)
+{
+	float * ripple = rs->carrier_buf;
+	float * modulation = rs->modulator_buf;
+
+	wav_osc_generate(&rs->carrier, first_frame, ripple, frames);
+	wav_osc_generate(&rs->modulator, first_frame, modulation, frames);
+	for (int k = 0; k < frames; k++)
+		ripple[k] *= modulation[k] * rs->fractional_amplitude * RIPPLE_HEADROOM;
+	return ripple;
+}
+
+/* make room for additional signal and insert weird sinusoidal thingy.
+ * always inlined with channels a constant for mono and stereo, where the
+ * channel loop unrolls away.  returns the block peak */
+
+static inline __attribute__((always_inline))
+float ripple_mix(float *data, const float *ripple, const float *amps, float keep, int frames, const int channels)
+{
+	float peak = 0.0f;
+
+	for (int k = 0; k < frames; k++, data += channels) {
+		for (int c = 0; c < channels; c++) {
+			data[c] = data[c] * keep + ripple[k] * amps[c];
+			peak = fmaxf(peak, fabsf(data[c]));
+		}
+	}
+	return peak;
+}
+
+static inline __attribute__((always_inline))
+float mix_block_body(float *data, const float *ripple, const float *amps, float keep, int frames, int channels)
+{
+	if (channels == 1)
+		return ripple_mix(data, ripple, amps, keep, frames, 1);
+	if (channels == 2)
+		return ripple_mix(data, ripple, amps, keep, frames, 2);
+	return ripple_mix(data, ripple, amps, keep, frames, channels);
+}
+
+/* and each of those again for every SIMD level, see wav_simd.h */
+
+static float mix_block_c(float *data, const float *ripple, const float *amps, float keep, int frames, int channels)
+{
+	return mix_block_body(data, ripple, amps, keep, frames, channels);
+}
+
+#ifdef WAV_SIMD_X86
+WAV_TARGET_AVX2
+static float mix_block_avx2(float *data, const float *ripple, const float *amps, float keep, int frames, int channels)
+{
+	return mix_block_body(data, ripple, amps, keep, frames, channels);
+}
+
+WAV_TARGET_AVX512
+static float mix_block_avx512(float *data, const float *ripple, const float *amps, float keep, int frames, int channels)
+{
+	return mix_block_body(data, ripple, amps, keep, frames, channels);
+}
+#endif
+
+static float (*mix_block)(float *data, const float *ripple, const float *amps, float keep, int frames, int channels) =
+	mix_block_c;
+
+__attribute__((constructor))
+static void pick_mix_block(void)
+{
+#ifdef WAV_SIMD_X86
+	int level = wav_simd_level();
+
+	if (level >= WAV_SIMD_AVX512)
+		mix_block = mix_block_avx512;
+	else if (level >= WAV_SIMD_AVX2)
+		mix_block = mix_block_avx2;
+#endif
+}
+
+static int ripple_process(struct wav_effect *fx, struct wav_block *blk)
+{
+	struct ripple_state * rs = (struct ripple_state * )fx->state;
+	float * ripple = make_ripple(rs, blk->first_frame, blk->frames);
+	float * data = blk->data;
+	int frames = blk->frames;
+	float keep = (1.0f - rs->fractional_amplitude) * RIPPLE_HEADROOM;
+	float peak = mix_block(data, ripple, rs->channel_amplitudes, keep, frames, blk->channels);
+
+	/* checking the block peak keeps the branch out of the loops above */
+
+	if (peak > 1.0f && !rs->clip_warned) {
+		for (int k = 0; k < frames * blk->channels; k++) {
+			if (fabsf(data[k]) > 1.0f) {
+				printf("WARNING: %s: volume maximum exceeded at frame %" PRId64 " with new vol %f, "
+				       "saturating (a limit stage after it avoids this)\n",
+				       fx->ops->name, blk->first_frame + k / blk->channels, data[k]);
+				break;
+			}
+		}
+		rs->clip_warned = 1;
+	}
+	return OK;
+}
+
+/* data = data * keep + ripple * channel amplitude, all in saturating Q15 */
+
+static int ripple_process_s16(struct wav_effect *fx, int16_t *data, int frames, int64_t first_frame)
+{
+	struct ripple_state * rs = (struct ripple_state * )fx->state;
+	float * ripple = make_ripple(rs, first_frame, frames);
+	int channels = fx->in_fmt.channels;
+	int16_t keep = (int16_t )lrintf((1.0f - rs->fractional_amplitude) * RIPPLE_HEADROOM * 32768.0f);
+
+	if (channels == 1) {
+		wav_float_to_s16(ripple, rs->mix_s16, frames);
+	} else {
+		for (int c = 0; c < channels; c++)
+			for (int k = 0; k < frames; k++)
+				rs->mix_buf[(size_t )k * channels + c] = ripple[k] * rs->channel_amplitudes[c];
+		wav_float_to_s16(rs->mix_buf, rs->mix_s16, (size_t )frames * channels);
+	}
+	wav_s16_scale_add_sat(data, keep, rs->mix_s16, (size_t )frames * channels);
+	return OK;
+}
+
+static void ripple_destroy(struct wav_effect *fx)
+{
+	struct ripple_state * rs = (struct ripple_state * )fx->state;
+
+	if (!rs)
+		return;
+	free(rs->carrier_buf);
+	free(rs->modulator_buf);
+	free(rs->mix_buf);
+	free(rs->mix_s16);
+	free(rs);
+}
+
+const struct wav_effect_ops wav_ripple_ops = {
+	.name = "ripple",
+	.help = "freq=440 mod=1 lr=0 amp=0.2  sinusoid ripple with modulating frequency",
+	.init = ripple_init,
+	.process = ripple_process,
+	.process_s16 = ripple_process_s16,
+	.destroy = ripple_destroy,
+};
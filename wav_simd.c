@@ -0,0 +1,63 @@
+/* SIMD level detection, see wav_simd.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wav_simd.h"
+
+static const char * level_names[WAV_SIMD_LEVELS] = {
+	"c", "sse2", "ssse3", "sse4.1", "avx2", "avx512"
+};
+
+/* set on the first call, which is from a kernel table being filled in
+ * before main() runs, so later calls from threads only read it */
+static int chosen_level = -1;
+
+static int best_level(void)
+{
+#ifdef WAV_SIMD_X86
+	/* libgcc's cpuid checks also ask the OS whether it saves the wide registers */
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+	    __builtin_cpu_supports("avx512vl"))
+		return WAV_SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return WAV_SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return WAV_SIMD_SSE41;
+	if (__builtin_cpu_supports("ssse3"))
+		return WAV_SIMD_SSSE3;
+	return WAV_SIMD_SSE2;
+#else
+	return WAV_SIMD_C;
+#endif
+}
+
+int wav_simd_level(void)
+{
+	const char * want;
+	int level;
+
+	if (chosen_level >= 0)
+		return chosen_level;
+	chosen_level = best_level();
+	want = getenv("WAV_SIMD");
+	if (!want || !*want)
+		return chosen_level;
+	for (level = 0; level < WAV_SIMD_LEVELS; level++)
+		if (!strcmp(want, level_names[level]))
+			break;
+	if (level == WAV_SIMD_LEVELS)
+		printf("WARNING: WAV_SIMD=%s is not one of c, sse2, ssse3, sse4.1, avx2, avx512, using %s\n",
+		       want, level_names[chosen_level]);
+	else if (level > chosen_level)
+		printf("WARNING: WAV_SIMD=%s is more than this CPU has, using %s\n", want, level_names[chosen_level]);
+	else
+		chosen_level = level;
+	return chosen_level;
+}
+
+const char * wav_simd_name(int level)
+{
+	return level >= 0 && level < WAV_SIMD_LEVELS ? level_names[level] : "unknown";
+}
@@ -0,0 +1,43 @@
+#ifndef _wav_simd_h_
+# define _wav_simd_h_ 1
+
+/* which SIMD instructions the kernels may use, decided once at startup
+ *
+ * Hot kernels are compiled several times, each copy for one of the
+ * levels below with a target attribute, and the best copy the CPU runs
+ * is picked through cpuid when the program starts.  So one binary built
+ * with plain -O3 uses AVX2 or AVX-512 where it has them and SSE2 where it
+ * does not.  Setting WAV_SIMD to a level name (c, sse2, ssse3, sse4.1,
+ * avx2, avx512) caps the choice, for comparing levels or working around
+ * a bad one; a level the CPU lacks falls back to the best it has.
+ *
+ * No copy uses FMA or reorders a sum, so every level gives the same
+ * output bit for bit.
+ */
+
+/* each level includes the ones before it */
+enum wav_simd_level {
+	WAV_SIMD_C,		/* plain C, whatever the compiler does at baseline */
+	WAV_SIMD_SSE2,
+	WAV_SIMD_SSSE3,
+	WAV_SIMD_SSE41,
+	WAV_SIMD_AVX2,
+	WAV_SIMD_AVX512,	/* F, BW and VL */
+	WAV_SIMD_LEVELS
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# define WAV_SIMD_X86 1
+# define WAV_TARGET_SSSE3 __attribute__((target("ssse3")))
+# define WAV_TARGET_SSE41 __attribute__((target("sse4.1")))
+# define WAV_TARGET_AVX2 __attribute__((target("avx2")))
+# define WAV_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl")))
+#endif
+
+/* returns the level to run at: the best the CPU has, capped by WAV_SIMD */
+int wav_simd_level(void);
+
+/* returns the name of a level as WAV_SIMD takes it */
+const char * wav_simd_name(int level);
+
+#endif
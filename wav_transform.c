@@ -1,4 +1,4 @@
-/* library of functions to apply effects to music */
+/* apply a chain of effects to a .wav file, see wav_effect.h */
 
 #include <stdio.h>
 #include <assert.h>
@@ -7,86 +7,116 @@
 #include <stdlib.h>
 #include <math.h>
 #include <ctype.h>
+#include <inttypes.h>
 #include "wav_file_access.h"
+#include "wav_effect.h"
+#include "wav_batch.h"
+
+#define MAX_RIPPLE_SPEC_LEN 256
+
+/* what the command line asked for, so every worker can build the same chain */
+struct chain_args {
+	char *	ripple_spec;	/* NULL if no ripple */
+	char **	effect_args;	/* -x and -c arguments in command line order */
+	char *	effect_opts;	/* which option each one came from */
+	int	effect_arg_count;
+	int	out_format;	/* output encoding, 0 for same as input */
+	int	out_bits_per_sample;
+};
 
 static void usage(const char * msg)
 {
 	printf("ERROR: %s\n", msg);
-	printf("usage: wav_transform.c -f freq -m modulating-freq -l left-right -a fractional-amplitude\n");
+	printf("usage: wav_transform.c [ -f freq -m modulating-freq -l left-right -a fractional-amplitude ]\n");
+	printf("                       [ -x effect-spec ]... [ -c chain-file ] [ -e encoding ] [ -j threads ] [ -L ]\n");
+	printf("                       input.wav output.wav | -b manifest | -b input-dir output-dir\n");
+	printf("-f, -m, -l and -a add a ripple effect, which is also what you get if no other effect is given\n");
+	printf("freq and modulating-freq are in Hz, older versions took other units so their output differs\n");
 	printf("left-right must be from -1 to 1 (default 0 means both channels)\n");
-	printf("fractional amplitude is from 0 to 1.0\n\n");
+	printf("fractional amplitude is from 0 to 1.0\n");
+	printf("effect-spec is name:key=value,key=value..., chain-file has one effect-spec per line\n");
+	printf("-L lists the effects and their parameters\n");
+	printf("-j splits the input across that many threads, output is the same as with one\n");
+	printf("-b transforms every input.wav output.wav pair in manifest, or every .wav file in input-dir,\n");
+	printf("   on a pool of -j threads\n");
+	printf("encoding of output is one of u8, s16, s24, s32, f32, f64 (default same as input)\n\n");
 	exit(NOTOK);
 }
 
-void check_range(const char * range_name, float val, float lowbound, float upbound)
+/* append the stages described by the command line to pl. returns OK if done, NOTOK otherwise */
+
+static int build_chain(struct wav_pipeline *pl, void *arg)
 {
-	if (val < lowbound || val > upbound) {
-		printf("ERROR: var %s val %f not in [ %f, %f ]\n",
-				range_name, val, lowbound, upbound);
-		exit(NOTOK);
+	struct chain_args * ca = (struct chain_args * )arg;
+
+	if (ca->ripple_spec && wav_pipeline_add(pl, ca->ripple_spec)) {
+		printf("ERROR: bad ripple parameters\n");
+		return NOTOK;
 	}
+	for (int k = 0; k < ca->effect_arg_count; k++) {
+		if (ca->effect_opts[k] == 'x' && wav_pipeline_add(pl, ca->effect_args[k])) {
+			printf("ERROR: bad effect spec\n");
+			return NOTOK;
+		}
+		if (ca->effect_opts[k] == 'c' && wav_pipeline_load(pl, ca->effect_args[k])) {
+			printf("ERROR: bad chain file\n");
+			return NOTOK;
+		}
+	}
+	return OK;
 }
 
-/* insert sinusoid ripple of given frequency with modulating frequency */
+/* transform one file of a batch, quietly. returns OK if done, NOTOK otherwise */
 
-void wav_xform_sine_ripple( 
-		wav_sample_t * sample_data_in, 
-		int sample_count, 
-		int channels, 
-		float left_right, 
-		float fractional_amplitude, 
-		float freq, 
-		float modulating_freq )
+static int transform_file(struct wav_batch_worker *worker, struct wav_batch_item *item, void *arg)
 {
-	const double PIover2 = PI / 2.0;
-	const double twoPI = PI * 2.0;
-	double single_chan_amplitude = 1.0;
-	double two_channel_amplitudes[2] = { 1.0, 0.0 }; /* default is all left channel */
-
-	double freq_radians = freq / twoPI;
-	double modulating_freq_radians = modulating_freq / twoPI;
-
-	check_range("left_right", left_right, -1., 1.);
-	check_range("fractional_amplitude", fractional_amplitude, 0., 1.);
-	check_range("freq", freq, 40., 15000.);
-	check_range("modulating_freq", modulating_freq, 0.1, 10000.);
-
-	/* pre-compute effect of left-right parameter */
-
-	double * channel_amplitudes;
-	if (channels == 1)
-		channel_amplitudes = &single_chan_amplitude;
-	else if (channels == 2) {
-		channel_amplitudes = &two_channel_amplitudes[0];
-		double left_right_radians = ((left_right + 1.0) / 2.0) * PIover2;
-		channel_amplitudes[0] = cos(left_right_radians);
-		channel_amplitudes[1] = sin(left_right_radians);
-		printf("left amplitude = %f, right amplitude = %f\n",
-				channel_amplitudes[0], channel_amplitudes[1]);
-	} else
-		usage("only 1 or 2 channels allowed");
-
-	for (int k = 0; k < sample_count ; k++) {
-	  int sample_chan = k % channels;
-	  /* convert array index into time */
-	  double sample_time = k / FLOAT_SAMPLES_PER_SEC;
-	  double old_sample = sample_data_in[k];
-	  /* insert weird sinusoidal thingy */
-	  double new_signal = MAX_VOLUME * fractional_amplitude * 
-			     cos(sample_time * freq_radians) * 
-			     cos(sample_time * modulating_freq_radians) *
-			     channel_amplitudes[sample_chan];
-	  /* make room for additional signal */
-	  double attenuated_old_sample = old_sample * (1.0 - fractional_amplitude);
-	  double generated_sample = attenuated_old_sample + new_signal;
-	  int generated_int_sample = (generated_sample * 0.9999);
-	  if (abs(generated_int_sample) > MAX_VOLUME) {
-		  printf("ERROR: volume maximum exceeded at sample %d with old vol %lf new vol %lf\n",
-				  k, old_sample, generated_sample);
-		  exit(NOTOK);
-	  }
-	  sample_data_in[k] = generated_int_sample;
+	struct chain_args * ca = (struct chain_args * )arg;
+	struct wav_pipeline chain = { 0 };
+	struct wav_reader * rdr;
+	struct wav_writer * wtr;
+	struct wav_info info;
+	struct wav_info in_info;
+	struct wav_stream_fmt fmt;
+	float * block_buf;
+	int rc;
+
+	if (wav_reader_open(item->input, &rdr, &info) != OK)
+		return NOTOK;
+	in_info = info;
+	if (ca->out_format) {
+		info.format = ca->out_format;
+		info.bits_per_sample = ca->out_bits_per_sample;
+	}
+	fmt.channels = info.channels;
+	fmt.samples_per_sec = info.samples_per_sec;
+	fmt.max_frames = WAV_EFFECT_BLOCK_FRAMES;
+	block_buf = (float * )wav_batch_buf(worker, 0, sizeof(float) * WAV_EFFECT_BLOCK_FRAMES * info.channels);
+	if (!block_buf || build_chain(&chain, ca) || wav_pipeline_init(&chain, &fmt)) {
+		wav_reader_close(rdr);
+		wav_pipeline_free(&chain);
+		return NOTOK;
 	}
+	info.channels = chain.out_fmt.channels;
+	info.samples_per_sec = chain.out_fmt.samples_per_sec;
+	rc = wav_writer_open_format(item->output, &info, &wtr);
+	if (rc == OK) {
+		/* the conversion buffers stay with the worker too, slots 1 and 2 */
+		wav_reader_swap_buf(rdr, &worker->bufs[1], &worker->buf_sizes[1]);
+		wav_writer_swap_buf(wtr, &worker->bufs[2], &worker->buf_sizes[2]);
+		if (wav_pipeline_can_s16(&chain, &in_info, &info))
+			rc = wav_pipeline_run_s16(&chain, rdr, wtr, (int16_t * )block_buf);
+		else
+			rc = wav_pipeline_run_buf(&chain, rdr, wtr, block_buf);
+		wav_reader_swap_buf(rdr, &worker->bufs[1], &worker->buf_sizes[1]);
+		wav_writer_swap_buf(wtr, &worker->bufs[2], &worker->buf_sizes[2]);
+		if (rc == OK)
+			rc = wav_writer_close(wtr);
+		else
+			wav_writer_abort(wtr);
+	}
+	wav_reader_close(rdr);
+	wav_pipeline_free(&chain);
+	return rc;
 }
 
 int main(int argc, char **argv)
@@ -94,32 +124,68 @@ int main(int argc, char **argv)
 	int rc;
 	char * input_wav_filename = NULL;
 	char * output_wav_filename = NULL;
-	wav_sample_t * sample_buf = NULL;
-	int sample_count = 0;
-        int chans = 0;
+	struct wav_reader * rdr;
+	struct wav_writer * wtr;
+	struct wav_info info, in_info;
+	struct wav_stream_fmt fmt;
+	struct wav_pipeline chain = { 0 };
+	char ripple_spec[MAX_RIPPLE_SPEC_LEN];
+	struct chain_args ca = { 0 };
+	char * encoding = NULL;
+	char * batch_source = NULL;
+	int threads = 1;
 	float freq = 440.;
 	float modulating_freq = 1. ;
 	float fractional_amplitude = 0.2;
 	float left_right = 0.0;
+	int ripple_opts = 0;
 	int opt;
 
+	ca.effect_args = (char ** )calloc(argc, sizeof(char * ));
+	ca.effect_opts = (char * )calloc(argc, sizeof(char));
+	if (!ca.effect_args || !ca.effect_opts)
+		usage("could not allocate option list");
 	opterr = 0;
-	while ((opt = getopt (argc, argv, "f:m:l:a:")) != -1)
+	while ((opt = getopt (argc, argv, "f:m:l:a:e:x:c:j:b:L")) != -1)
 	{
 	  switch (opt)
 	  {
 	    case 'f':
 		freq = atof(optarg);
+		ripple_opts++;
 		break;
 	    case 'm':
 		modulating_freq = atof(optarg);
+		ripple_opts++;
 		break;
 	    case 'l':
 		left_right = atof(optarg);
+		ripple_opts++;
 		break;
 	    case 'a':
 		fractional_amplitude = atof(optarg);
+		ripple_opts++;
+		break;
+	    case 'e':
+		encoding = optarg;
+		break;
+	    case 'b':
+		batch_source = optarg;
 		break;
+	    case 'j':
+		threads = atoi(optarg);
+		if (threads < 1)
+			usage("thread count must be at least 1");
+		break;
+	    case 'x':
+	    case 'c':
+		/* chain is built after the ripple options are known */
+		ca.effect_opts[ca.effect_arg_count] = opt;
+		ca.effect_args[ca.effect_arg_count++] = optarg;
+		break;
+	    case 'L':
+		wav_effect_list();
+		exit(OK);
 	    case '?':
         	if (optopt == 'c')
           		printf("Option -%c requires an argument.\n", optopt);
@@ -130,33 +196,101 @@ int main(int argc, char **argv)
 		usage("option parse error");
 	  };
 	}
-	if (optind != argc - 2) 
+	if (batch_source && optind < argc - 1)
+		usage("-b takes at most an output directory after it");
+	if (!batch_source && optind != argc - 2) 
 		usage("input and output .wav filename must be supplied");
+	if (encoding && wav_parse_encoding(encoding, &ca.out_format, &ca.out_bits_per_sample))
+		usage("unknown output encoding");
+
+	/* the original command line options describe a ripple, which goes first */
+
+	if (ripple_opts || ca.effect_arg_count == 0) {
+		snprintf(ripple_spec, sizeof(ripple_spec), "ripple:freq=%f,mod=%f,amp=%f,lr=%f",
+			freq, modulating_freq, fractional_amplitude, left_right);
+		ca.ripple_spec = ripple_spec;
+	}
+
+	/* many files, one per thread at a time */
+
+	if (batch_source) {
+		struct wav_batch batch = { 0 };
+
+		if (wav_batch_open(&batch, batch_source, optind < argc ? argv[optind] : NULL))
+			exit(NOTOK);
+		rc = wav_batch_run(&batch, threads, transform_file, &ca);
+		wav_batch_free(&batch);
+		free(ca.effect_args);
+		free(ca.effect_opts);
+		return rc;
+	}
 
 	input_wav_filename = argv[optind];
 	printf("%s is .wav file to transform\n", input_wav_filename);
 	output_wav_filename = argv[optind+1];
 	printf("%s is output .wav file \n", output_wav_filename);
 
-	printf("%9.2f = frequency\n%9.2f = modulating frequency\n%9.2f = fractional amplitude\n%9.2f = left-right direction\n",
-		freq, modulating_freq, fractional_amplitude, left_right);
-	if (chans == 1 && left_right != 0.0)
-		usage("cannot specify left-right direction with only 1 channel");
+	if (ca.ripple_spec)
+		printf("%9.2f = frequency\n%9.2f = modulating frequency\n%9.2f = fractional amplitude\n%9.2f = left-right direction\n",
+			freq, modulating_freq, fractional_amplitude, left_right);
+	if (build_chain(&chain, &ca))
+		exit(NOTOK);
+
+	/* open the wav file */
+
+	rc = wav_reader_open(input_wav_filename, &rdr, &info);
+	if (rc) return rc;
+	printf("sample count %" PRId64 ", channels %d\n", info.frame_count * info.channels, info.channels);
+	printf("%s encoding at %d samples/sec\n", 
+		wav_encoding_name(info.format, info.bits_per_sample), info.samples_per_sec);
+	if (ca.ripple_spec && info.channels == 2) {
+		float left, right;
+
+		/* here rather than in the stage, which every -j worker builds again */
+		wav_ripple_pan(left_right, &left, &right);
+		printf("left amplitude = %f, right amplitude = %f\n", left, right);
+	}
+	in_info = info;
+	if (ca.out_format) {
+		info.format = ca.out_format;
+		info.bits_per_sample = ca.out_bits_per_sample;
+	}
 
-	/* read the wav file */
+	/* set up the chain, output has whatever channels and rate come out of it */
 
-	rc = wav_read(input_wav_filename, &sample_buf, &sample_count, &chans);
+	fmt.channels = info.channels;
+	fmt.samples_per_sec = info.samples_per_sec;
+	fmt.max_frames = WAV_EFFECT_BLOCK_FRAMES;
+	if (wav_pipeline_init(&chain, &fmt))
+		exit(NOTOK);
+	info.channels = chain.out_fmt.channels;
+	info.samples_per_sec = chain.out_fmt.samples_per_sec;
+	rc = wav_writer_open_format(output_wav_filename, &info, &wtr);
 	if (rc) return rc;
-	printf("sample count %d, channels %d\n", sample_count, chans);
-	/* print_samples(sample_buf, sample_count); */
 
-	/* transform the wav file */
+	/* transform the wav file a block at a time, writing out each result
+	 * while the next blocks are read.  threads each build their own copy
+	 * of the chain */
+
+	if (threads > 1 && !wav_pipeline_can_split(&chain)) {
+		printf("effect chain does not split, running on one thread\n");
+		threads = 1;
+	}
+	if (threads > 1)
+		rc = wav_pipeline_run_parallel(build_chain, &ca, input_wav_filename, &fmt, wtr, &info, threads);
+	else
+		rc = wav_pipeline_run_async(&chain, rdr, &in_info, wtr, &info, WAV_AIO_DEPTH);
+	wav_reader_close(rdr);
+	wav_pipeline_free(&chain);
+	free(ca.effect_args);
+	free(ca.effect_opts);
+	if (rc) {
+		wav_writer_abort(wtr);
+		return rc;
+	}
 
-	wav_xform_sine_ripple( sample_buf, sample_count, chans, 
-		left_right, fractional_amplitude, freq, modulating_freq );
-	
-	/* write out the resultig wav file */
+	/* patch lengths and rename the resulting wav file into place */
 
-	rc = wav_write(output_wav_filename, sample_buf, sample_count, chans);
+	rc = wav_writer_close(wtr);
 	return rc;
 }